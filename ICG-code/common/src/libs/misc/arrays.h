@@ -14,6 +14,7 @@
 using std::vector;
 #include <algorithm>
 #include <stdint.h>
+#include <xmmintrin.h>
 using std::copy;
 
 // Simple wrapper for C arrays
@@ -90,6 +91,51 @@ private:
 	T* d;
 };
 
+// Simple wrapper for aligned C arrays, for data loaded with SSE instructions
+// T must be a plain data type: no constructors or destructors are run
+// not copyable, hold it by pointer if it needs to be shared
+template<class T, uint32_t A = 16>
+class acarray {
+public:
+    acarray() { d = 0; l = 0; }
+    acarray(size_t ll) { d = 0; l = 0; resize(ll); }
+
+    ~acarray() { clear(); }
+
+	void resize(size_t ll) { 
+		if(l == ll) return;
+		clear();
+		l = ll;
+		if(l) d = static_cast<T*>(_mm_malloc(l * sizeof(T), A));
+	}
+
+    void clear() {
+        l = 0;
+        if(d) _mm_free(d);
+        d = 0;
+    }
+
+	size_t size() const { return l; }
+	bool empty() const { return l == 0; }
+
+	T& operator[](size_t i) { return d[i]; }
+	const T& operator[](size_t i) const { return d[i]; }
+
+	T* data() { return d; }
+	const T* data() const { return d; }
+
+	void set(const T& v) { for(size_t i = 0; i < l; i ++) d[i] = v; }
+
+	size_t getMemoryAllocated() { return sizeof(size_t) + sizeof(T*) + l * sizeof(T); }
+
+private:
+    acarray(const acarray<T, A>& v);
+    acarray<T, A>& operator = (const acarray<T, A>& v);
+
+	size_t l;
+	T* d;
+};
+
 // Simple wrapper for C arrays accessed as 2D matrices / images
 // NOTE: addressing is done as an image (i.e. this is a transposed matrix if looking at i,j)
 // allows easy creation, deletion, reallocation and keeps the size stored in
@@ -0,0 +1,74 @@
+#include "checkpoint.h"
+
+struct CheckpointHeader
+{
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            keyLength;
+};
+
+bool CheckpointWriter::Open(const string &filename, const string &key)
+{
+    _os.open(filename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!_os)
+        return false;
+    CheckpointHeader header = { CHECKPOINT_MAGIC, CHECKPOINT_VERSION, static_cast<uint32_t>(key.size()) };
+    _os.write((const char*)&header, sizeof(CheckpointHeader));
+    _os.write(key.data(), key.size());
+    return _os.good();
+}
+
+bool CheckpointWriter::Close()
+{
+    bool good = _os.good();
+    _os.close();
+    return good;
+}
+
+void CheckpointWriter::Write(const void *data, uint64_t count, uint32_t size)
+{
+    _os.write((const char*)&count, sizeof(uint64_t));
+    _os.write((const char*)&size, sizeof(uint32_t));
+    if (count)
+        _os.write((const char*)data, count * size);
+}
+
+bool CheckpointReader::Open(const string &filename, const string &key)
+{
+    _is.open(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!_is)
+        return false;
+    _is.seekg(0, std::ios_base::end);
+    _size = static_cast<uint64_t>(_is.tellg());
+    _is.seekg(0, std::ios_base::beg);
+    CheckpointHeader header;
+    if (!_ReadData(&header, sizeof(CheckpointHeader)) || header.magic != CHECKPOINT_MAGIC ||
+        header.version != CHECKPOINT_VERSION || header.keyLength != key.size())
+    {
+        Close();
+        return false;
+    }
+    vector<char> fileKey(key.size() + 1, 0);
+    if (!_ReadData(&fileKey[0], key.size()) || key != &fileKey[0])
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool CheckpointReader::_ReadCount(uint64_t &count, uint32_t size)
+{
+    uint32_t fileSize;
+    if (!_ReadData(&count, sizeof(uint64_t)) || !_ReadData(&fileSize, sizeof(uint32_t)) || fileSize != size)
+        return false;
+    // a damaged count must not allocate more than the file holds
+    return count <= (_size - static_cast<uint64_t>(_is.tellg())) / size;
+}
+
+bool CheckpointReader::_ReadData(void *data, uint64_t bytes)
+{
+    if (bytes)
+        _is.read((char*)data, bytes);
+    return _is.good();
+}
@@ -0,0 +1,76 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+using std::string;
+using std::vector;
+
+#define CHECKPOINT_MAGIC        0x4b435043  // "CPCK"
+#define CHECKPOINT_VERSION      1
+
+// Binary file of arrays written one after the other, each as its element
+// count and size followed by the raw elements, behind a header holding the
+// key the file was written for. A reader only opens a file of the same key,
+// so the key has to name everything the stored data depends on.
+class CheckpointWriter
+{
+public:
+    bool                Open(const string &filename, const string &key);
+    // true when every write succeeded
+    bool                Close();
+
+    void                Write(const void *data, uint64_t count, uint32_t size);
+    template<typename T>
+    void                Write(const vector<T> &v) { Write(v.empty() ? 0 : &v[0], v.size(), sizeof(T)); }
+    template<typename T>
+    void                WriteValue(const T &v) { Write(&v, 1, sizeof(T)); }
+
+private:
+    std::ofstream       _os;
+};
+
+class CheckpointReader
+{
+public:
+    CheckpointReader() : _size(0) {}
+
+    // false when the file is missing, of another version or another key
+    bool                Open(const string &filename, const string &key);
+    void                Close() { _is.close(); }
+
+    // reads an array of exactly count elements of size bytes into data,
+    // false when the stored array differs or the file is cut short
+    bool                Read(void *data, uint64_t count, uint32_t size)
+    {
+        uint64_t stored;
+        return _ReadCount(stored, size) && stored == count && _ReadData(data, count * size);
+    }
+    // false when the next array is not of T or the file is cut short
+    template<typename T>
+    bool                Read(vector<T> &v)
+    {
+        uint64_t count;
+        if (!_ReadCount(count, sizeof(T)))
+            return false;
+        v.resize(static_cast<size_t>(count));
+        return _ReadData(v.empty() ? 0 : &v[0], count * sizeof(T));
+    }
+    template<typename T>
+    bool                ReadValue(T &v)
+    {
+        uint64_t count;
+        return _ReadCount(count, sizeof(T)) && count == 1 && _ReadData(&v, sizeof(T));
+    }
+
+private:
+    bool                _ReadCount(uint64_t &count, uint32_t size);
+    bool                _ReadData(void *data, uint64_t bytes);
+
+    std::ifstream       _is;
+    uint64_t            _size;
+};
+
+#endif // _CHECKPOINT_H_
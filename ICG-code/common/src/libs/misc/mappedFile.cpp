@@ -0,0 +1,91 @@
+#include "mappedFile.h"
+
+#ifdef WIN32
+#include <windows.h>
+
+MappedFile::MappedFile() : _data(0), _size(0), _file(INVALID_HANDLE_VALUE), _mapping(0)
+{
+}
+
+bool MappedFile::Open(const string &filename)
+{
+    Close();
+    _file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (_file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+    {
+        Close();
+        return false;
+    }
+    _mapping = CreateFileMappingA(_file, 0, PAGE_READONLY, 0, 0, 0);
+    if (!_mapping)
+    {
+        Close();
+        return false;
+    }
+    _data = static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!_data)
+    {
+        Close();
+        return false;
+    }
+    _size = size.QuadPart;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data) UnmapViewOfFile(_data);
+    if (_mapping) CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+    _data = 0;
+    _size = 0;
+    _mapping = 0;
+    _file = INVALID_HANDLE_VALUE;
+}
+
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedFile::MappedFile() : _data(0), _size(0), _fd(-1)
+{
+}
+
+bool MappedFile::Open(const string &filename)
+{
+    Close();
+    _fd = open(filename.c_str(), O_RDONLY);
+    if (_fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(_fd, &st) != 0 || st.st_size == 0)
+    {
+        Close();
+        return false;
+    }
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+    if (data == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    _data = static_cast<const char*>(data);
+    _size = st.st_size;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data) munmap(const_cast<char*>(_data), _size);
+    if (_fd >= 0) close(_fd);
+    _data = 0;
+    _size = 0;
+    _fd = -1;
+}
+
+#endif
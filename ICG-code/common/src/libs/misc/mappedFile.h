@@ -0,0 +1,36 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <string>
+#include <stdint.h>
+using std::string;
+
+// Read only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile() { Close(); }
+
+    bool            Open(const string &filename);
+    void            Close();
+
+    bool            IsOpen() const { return _data != 0; }
+    const char*     Data() const { return _data; }
+    uint64_t        Size() const { return _size; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char      *_data;
+    uint64_t        _size;
+#ifdef WIN32
+    void            *_file;
+    void            *_mapping;
+#else
+    int             _fd;
+#endif
+};
+
+#endif // _MAPPED_FILE_H_
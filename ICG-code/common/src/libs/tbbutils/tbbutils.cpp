@@ -0,0 +1,30 @@
+#include "tbbutils.h"
+
+TbbProgress::TbbProgress(uint64_t total, ReportHandler *report, uint32_t step)
+    : _total(total), _report(report), _step(step ? step : 1)
+{
+    _done = 0;
+    _next = _step;
+}
+
+void TbbProgress::Advance(uint64_t n)
+{
+    uint64_t done = (_done += n);
+    if (!_report)
+        return;
+
+    uint32_t percent = (uint32_t)(done * 100 / _total);
+    if (percent < _next)
+        return;
+
+    // whoever holds the lock reports, everyone else skips this update
+    spin_mutex::scoped_lock lock;
+    if (!lock.try_acquire(_mutex))
+        return;
+    if (percent >= _next)
+    {
+        percent -= percent % _step;
+        _report->progress(percent / 100.0f, _step);
+        _next = percent + _step;
+    }
+}
@@ -8,8 +8,7 @@
 #include <tbb/blocked_range2d.h>
 #include <tbb/spin_mutex.h>
 #include <tbb/concurrent_vector.h>
-#include <tbb/parallel_while.h>
-#include <tbb/parallel_for.h>
+#include <tbb/atomic.h>
 #include <tbb/task_scheduler_init.h>
 #include <tbb/parallel_reduce.h>
 #include <tbb/queuing_mutex.h>
@@ -22,105 +21,81 @@
 
 using namespace tbb;
 
-class TbbCounter 
+#define TBB_TILE_SIZE      16
+
+// Progress shared by the workers of one parallel loop. Workers add the amount
+// of finished work, the one crossing the next step forwards it to the report
+// handler while the others carry on without waiting.
+class TbbProgress
 {
 public:
-    bool pop_if_present( uint32_t& i ) 
-    {
-        if( _current < _count ) 
-        {
-            i = _current;
-            _current++;
-            return true;
-        } 
-        else 
-            return false;
-    }
-    TbbCounter(uint32_t count) : _count(count), _current(0) {}
+    TbbProgress(uint64_t total, ReportHandler *report, uint32_t step = 1);
+    void Advance(uint64_t n);
 private:
-    uint32_t        _current;
-    uint32_t        _count;
+    tbb::atomic<uint64_t> _done;
+    tbb::atomic<uint32_t> _next;
+    spin_mutex          _mutex;
+    uint64_t            _total;
+    ReportHandler       *_report;
+    uint32_t            _step;
 };
 
-class TbbCounter2D 
+// calls body(i) for every index of the range
+template<typename Body>
+class TbbIndexBody
 {
 public:
-    bool pop_if_present( Vec2i& px ) 
+    TbbIndexBody(const Body &body, TbbProgress *progress) : _body(body), _progress(progress) {}
+    void operator()(const blocked_range<uint32_t> &r) const
     {
-        if( _current.y < _height && _current.x < _width) 
-        {
-            px = _current;
-            _current.x++;
-            if (_current.x >= _width)
-            {
-                _current.x = 0;
-                _current.y++;
-            }
-            return true;
-        } 
-        else 
-            return false;
+        for (uint32_t i = r.begin(); i != r.end(); i++)
+            _body(i);
+        if (_progress) _progress->Advance(r.size());
     }
-    TbbCounter2D(uint32_t width, uint32_t height) : _height(height), _width(width), _current() {}
 private:
-    Vec2i           _current;
-    int32_t        _height;
-    int32_t        _width;
+    const Body          &_body;
+    TbbProgress         *_progress;
 };
 
-
-class TbbReportCounter
+// calls body(i, j) for every pixel of a tile, j being the row
+template<typename Body>
+class TbbPixelBody
 {
 public:
-    bool pop_if_present( uint32_t& i ) 
+    TbbPixelBody(const Body &body, TbbProgress *progress) : _body(body), _progress(progress) {}
+    void operator()(const blocked_range2d<uint32_t> &r) const
     {
-        if( _current < _count ) 
-        {
-            i = _current;
-			if(_report) _report->progress((float)_current / _count, _step);
-            _current++;
-            return true;
-        } 
-        else 
-            return false;
+        for (uint32_t j = r.rows().begin(); j != r.rows().end(); j++)
+            for (uint32_t i = r.cols().begin(); i != r.cols().end(); i++)
+                _body(i, j);
+        if (_progress) _progress->Advance((uint64_t)r.rows().size() * r.cols().size());
     }
-    TbbReportCounter(uint32_t count, ReportHandler* report, uint32_t step = 1 ) 
-        : _count(count), _current(0), _report(report), _step(step) {}
 private:
-    uint32_t        _current;
-    uint32_t        _count;
-    ReportHandler   *_report;
-    uint32_t        _step;
+    const Body          &_body;
+    TbbProgress         *_progress;
 };
 
+// Runs body(i) for i in [begin, end). Indices are handed out in chunks of at
+// least grain, so cheap bodies should use a larger grain.
+template<typename Body>
+void TbbParallelFor(uint32_t begin, uint32_t end, const Body &body, ReportHandler *report = 0, uint32_t grain = 1, uint32_t step = 1)
+{
+    if (begin >= end)
+        return;
+    TbbProgress progress(end - begin, report, step);
+    parallel_for(blocked_range<uint32_t>(begin, end, grain), TbbIndexBody<Body>(body, report ? &progress : 0));
+}
 
-class TbbReportCounter2D
+// Runs body(i, j) for every pixel of a width x height image, scheduling
+// square tiles of tileSize pixels so neighboring pixels share a thread.
+template<typename Body>
+void TbbParallelForTiles(uint32_t width, uint32_t height, const Body &body, ReportHandler *report = 0, uint32_t tileSize = TBB_TILE_SIZE, uint32_t step = 1)
 {
-public:
-    bool pop_if_present( Vec2i& px ) 
-    {
-        if( _current.y < _height && _current.x < _width) 
-        {
-            px = _current;
-			if(_report) _report->progress((float)(_current.y * _width + _current.x) / (_width * _height), _step);
-            _current.x++;
-            if (_current.x >= _width)
-            {
-                _current.x = 0;
-                _current.y++;
-            }
-            return true;
-        } 
-        else 
-            return false;
-    }
-    TbbReportCounter2D(uint32_t width, uint32_t height, ReportHandler* report, uint32_t step = 1 ) 
-        : _height(height), _width(width), _current(), _report(report), _step(step) {}
-private:
-    Vec2i           _current;
-    int32_t         _height;
-    int32_t         _width;
-    ReportHandler   *_report;
-    uint32_t        _step;
-};
+    if (!width || !height)
+        return;
+    TbbProgress progress((uint64_t)width * height, report, step);
+    parallel_for(blocked_range2d<uint32_t>(0, height, tileSize, 0, width, tileSize), 
+        TbbPixelBody<Body>(body, report ? &progress : 0), simple_partitioner());
+}
+
 #endif // _TBB_UTILS_H_
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include "BinaryLightCache.h"
+#include "SerializableLightCache.h"
+#include <string.h>
+
+static uint64_t _AlignOffset(uint64_t offset)
+{
+	return (offset + VPL_FILE_ALIGN - 1) & ~(uint64_t)(VPL_FILE_ALIGN - 1);
+}
+
+bool BinaryLightCache::Save(const string &filename, const SerializableLightCache &cache)
+{
+	LightList lights;
+	for (uint32_t i = 0; i < cache._ptLights.size(); i++)
+		lights.AddOmniDirLight(cache._ptLights[i].position, cache._ptLights[i].intensity);
+	for (uint32_t i = 0; i < cache._dirLights.size(); i++)
+		lights.AddDirLight(cache._dirLights[i].normal, cache._dirLights[i].le);
+	for (uint32_t i = 0; i < cache._otrLights.size(); i++)
+		lights.AddOrientedLight(cache._otrLights[i].position, cache._otrLights[i].normal, cache._otrLights[i].le);
+	for (uint32_t i = 0; i < cache._idtLights.size(); i++)
+		lights.AddOrientedLight(cache._idtLights[i].position, cache._idtLights[i].normal, cache._idtLights[i].le);
+	return Save(filename, lights, (uint32_t)cache._idtLights.size());
+}
+
+bool BinaryLightCache::Save(const string &filename, const LightList &lights, uint32_t indirectNum)
+{
+	const float *channels[VPL_FILE_CHANNELS];
+	uint32_t counts[VPL_FILE_CHANNELS];
+	uint32_t n = 0;
+	for (uint32_t c = 0; c < OMNI_CHANNELS; c++, n++)
+	{
+		channels[n] = lights.OmniDirLights().Channel(c);
+		counts[n] = lights.OmniDirLights().Size();
+	}
+	for (uint32_t c = 0; c < DIR_CHANNELS; c++, n++)
+	{
+		channels[n] = lights.DirLights().Channel(c);
+		counts[n] = lights.DirLights().Size();
+	}
+	for (uint32_t c = 0; c < ORIENTED_CHANNELS; c++, n++)
+	{
+		channels[n] = lights.OrientedLights().Channel(c);
+		counts[n] = lights.OrientedLights().Size();
+	}
+
+	VplFileHeader header;
+	memset(&header, 0, sizeof(VplFileHeader));
+	header.magic = VPL_FILE_MAGIC;
+	header.version = VPL_FILE_VERSION;
+	header.omniNum = lights.OmniDirLights().Size();
+	header.dirNum = lights.DirLights().Size();
+	header.orientedNum = lights.OrientedLights().Size();
+	header.indirectNum = indirectNum;
+	uint64_t offset = _AlignOffset(sizeof(VplFileHeader));
+	for (uint32_t c = 0; c < VPL_FILE_CHANNELS; c++)
+	{
+		header.channels[c] = offset;
+		offset = _AlignOffset(offset + counts[c] * sizeof(float));
+	}
+
+	ofstream os(filename.c_str(), ios_base::out | ios_base::binary);
+	if (!os)
+		return false;
+	os.write((const char*)&header, sizeof(VplFileHeader));
+	uint64_t pos = sizeof(VplFileHeader);
+	const char zeros[VPL_FILE_ALIGN] = { 0 };
+	for (uint32_t c = 0; c < VPL_FILE_CHANNELS; c++)
+	{
+		os.write(zeros, header.channels[c] - pos);
+		if (counts[c])
+			os.write((const char*)channels[c], counts[c] * sizeof(float));
+		pos = header.channels[c] + counts[c] * sizeof(float);
+	}
+	return os.good();
+}
+
+bool BinaryLightCache::Open(const string &filename)
+{
+	Close();
+	if (!_file.Open(filename))
+		return false;
+	if (_file.Size() < sizeof(VplFileHeader))
+	{
+		_file.Close();
+		return false;
+	}
+
+	const VplFileHeader *header = reinterpret_cast<const VplFileHeader*>(_file.Data());
+	if (header->magic != VPL_FILE_MAGIC || header->version != VPL_FILE_VERSION || header->indirectNum > header->orientedNum)
+	{
+		_file.Close();
+		return false;
+	}
+
+	for (uint32_t c = 0; c < VPL_FILE_CHANNELS; c++)
+	{
+		uint32_t count = c < OMNI_CHANNELS ? header->omniNum : 
+			(c < OMNI_CHANNELS + DIR_CHANNELS ? header->dirNum : header->orientedNum);
+		if (header->channels[c] % VPL_FILE_ALIGN || header->channels[c] + (uint64_t)count * sizeof(float) > _file.Size())
+		{
+			_file.Close();
+			return false;
+		}
+	}
+	_header = header;
+	return true;
+}
+
+void BinaryLightCache::View(LightList &lights) const
+{
+	const float *omni[OMNI_CHANNELS], *dir[DIR_CHANNELS], *oriented[ORIENTED_CHANNELS];
+	for (uint32_t c = 0; c < OMNI_CHANNELS; c++)
+		omni[c] = OmniChannel(c);
+	for (uint32_t c = 0; c < DIR_CHANNELS; c++)
+		dir[c] = DirChannel(c);
+	for (uint32_t c = 0; c < ORIENTED_CHANNELS; c++)
+		oriented[c] = OrientedChannel(c);
+	lights.View(omni, OmniNum(), dir, DirNum(), oriented, OrientedNum());
+}
+
+void BinaryLightCache::AddToCache(VirtualLightCache *cache) const
+{
+	LightList lights;
+	View(lights);
+	const OrientedLightArray &oriented = lights.OrientedLights();
+	const DirLightArray &dir = lights.DirLights();
+	const OmniDirLightArray &omni = lights.OmniDirLights();
+	uint32_t direct = OrientedNum() - IndirectNum();
+	for (uint32_t i = 0; i < direct; i++)
+		cache->AddOrientedLight(oriented.Get(ORIENTED_POSITION, i), oriented.Get(ORIENTED_NORMAL, i), oriented.Get(ORIENTED_LE, i));
+	for (uint32_t i = 0; i < DirNum(); i++)
+		cache->AddDirLight(dir.Get(DIR_NORMAL, i), dir.Get(DIR_LE, i));
+	for (uint32_t i = 0; i < OmniNum(); i++)
+		cache->AddOmniDirLight(omni.Get(OMNI_POSITION, i), omni.Get(OMNI_INTENSITY, i));
+	for (uint32_t i = direct; i < OrientedNum(); i++)
+		cache->AddIndirectLight(oriented.Get(ORIENTED_POSITION, i), oriented.Get(ORIENTED_NORMAL, i), oriented.Get(ORIENTED_LE, i));
+}
@@ -0,0 +1,64 @@
+#ifndef _BINARY_LIGHT_CACHE_H_
+#define _BINARY_LIGHT_CACHE_H_
+
+#include <scene/vlight.h>
+#include <misc/mappedFile.h>
+#include "LightData.h"
+
+class SerializableLightCache;
+
+#define VPL_FILE_MAGIC			0x434c5056	// "VPLC"
+#define VPL_FILE_VERSION		2
+#define VPL_FILE_ALIGN			64
+#define VPL_FILE_CHANNELS		(OMNI_CHANNELS + DIR_CHANNELS + ORIENTED_CHANNELS)
+
+// Header of a binary light file. The file holds the LightList channels, omni
+// first, then directional, then oriented, each a contiguous float array
+// starting at a VPL_FILE_ALIGN aligned byte offset, so a LightList views them
+// in place. The indirect lights are the last indirectNum oriented lights.
+struct VplFileHeader
+{
+	uint32_t				magic;
+	uint32_t				version;
+	uint32_t				omniNum;
+	uint32_t				dirNum;
+	uint32_t				orientedNum;
+	uint32_t				indirectNum;
+	uint64_t				channels[VPL_FILE_CHANNELS];
+};
+
+// Read only view of a memory mapped binary light file.
+class BinaryLightCache
+{
+public:
+	BinaryLightCache() : _header(0) {}
+
+	bool					Open(const string &filename);
+	void					Close() { _file.Close(); _header = 0; }
+	bool					IsOpen() const { return _header != 0; }
+
+	uint32_t				OmniNum() const { return _header->omniNum; }
+	uint32_t				DirNum() const { return _header->dirNum; }
+	uint32_t				OrientedNum() const { return _header->orientedNum; }
+	uint32_t				IndirectNum() const { return _header->indirectNum; }
+
+	const float*			OmniChannel(uint32_t c) const { return _Channel(c); }
+	const float*			DirChannel(uint32_t c) const { return _Channel(OMNI_CHANNELS + c); }
+	const float*			OrientedChannel(uint32_t c) const { return _Channel(OMNI_CHANNELS + DIR_CHANNELS + c); }
+
+	// points lights at the mapped channels, valid while the file is open
+	void					View(LightList &lights) const;
+	// adds the lights in the order LightSerializeGenerator uses for the old format
+	void					AddToCache(VirtualLightCache *cache) const;
+
+	static bool				Save(const string &filename, const SerializableLightCache &cache);
+	static bool				Save(const string &filename, const LightList &lights, uint32_t indirectNum);
+
+private:
+	const float*			_Channel(uint32_t c) const { return reinterpret_cast<const float*>(_file.Data() + _header->channels[c]); }
+
+	MappedFile				_file;
+	const VplFileHeader		*_header;
+};
+
+#endif // _BINARY_LIGHT_CACHE_H_
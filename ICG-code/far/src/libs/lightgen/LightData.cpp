@@ -2,59 +2,49 @@
 
 VL_TYPE LightList::GetLightType(uint32_t idx) const
 {
-    if (idx < _ptLights.size())
+    if (idx < _ptLights.Size())
         return OMNIDIR_LIGHT;
 
-    if (idx < _ptLights.size() + _dirLights.size())
+    if (idx < _ptLights.Size() + _dirLights.Size())
         return DIRECTIONAL_LIGHT;
 
-    if (idx < _ptLights.size() + _dirLights.size() + _otrLights.size())
+    if (idx < GetSize())
         return ORIENTED_LIGHT;
 
     assert(false);
     return UNKNOWN_LIGHT;
 }
 
-const VLight* LightList::GetLight(uint32_t idx) const
+OmniDirLight LightList::GetOmniDirLight(uint32_t idx) const
 {
-    if (idx < _ptLights.size())
-        return &_ptLights[idx];
-
-    if (idx < _ptLights.size() + _dirLights.size())
-        return &_dirLights[idx - _ptLights.size()];
-
-    if (idx < _ptLights.size() + _dirLights.size() + _otrLights.size())
-        return &_otrLights[idx - _ptLights.size() - _dirLights.size()];;
-
-    assert(false);
-    return NULL;
+    assert(idx < _ptLights.Size());
+    return OmniDirLight(_ptLights.Get(OMNI_POSITION, idx), _ptLights.Get(OMNI_INTENSITY, idx));
 }
 
-VLight* LightList::GetLight(uint32_t idx)
+DirLight LightList::GetDirLight(uint32_t idx) const
 {
-    if (idx < _ptLights.size())
-        return &_ptLights[idx];
-
-    if (idx < _ptLights.size() + _dirLights.size())
-        return &_dirLights[idx - _ptLights.size()];
-
-    if (idx < _ptLights.size() + _dirLights.size() + _otrLights.size())
-        return &_otrLights[idx - _ptLights.size() - _dirLights.size()];;
+    idx -= _ptLights.Size();
+    assert(idx < _dirLights.Size());
+    return DirLight(_dirLights.Get(DIR_NORMAL, idx), _dirLights.Get(DIR_LE, idx));
+}
 
-    assert(false);
-    return NULL;
+OrientedLight LightList::GetOrientedLight(uint32_t idx) const
+{
+    idx -= _ptLights.Size() + _dirLights.Size();
+    assert(idx < _otrLights.Size());
+    return OrientedLight(_otrLights.Get(ORIENTED_POSITION, idx), _otrLights.Get(ORIENTED_NORMAL, idx), _otrLights.Get(ORIENTED_LE, idx));
 }
 
 Vec3f LightList::GetPower( uint32_t idx ) const
 {
-    if (idx < _ptLights.size())
-        return _ptLights[idx].intensity;
+    if (idx < _ptLights.Size())
+        return _ptLights.Get(OMNI_INTENSITY, idx);
 
-    if (idx < _ptLights.size() + _dirLights.size())
-        return _dirLights[idx - _ptLights.size()].le;
+    if (idx < _ptLights.Size() + _dirLights.Size())
+        return _dirLights.Get(DIR_LE, idx - _ptLights.Size());
 
-    if (idx < _ptLights.size() + _dirLights.size() + _otrLights.size())
-        return _otrLights[idx - _ptLights.size() - _dirLights.size()].le;
+    if (idx < GetSize())
+        return _otrLights.Get(ORIENTED_LE, idx - _ptLights.Size() - _dirLights.Size());
 
     assert(false);
     return Vec3f::Zero();
@@ -65,11 +55,71 @@ Range1u LightList::GetRange( VL_TYPE type ) const
     switch(type)
     {
     case OMNIDIR_LIGHT:
-        return Range1u(0, (uint32_t)_ptLights.size());
+        return Range1u(0, _ptLights.Size());
     case DIRECTIONAL_LIGHT:
-        return Range1u((uint32_t)_ptLights.size(), (uint32_t)(_ptLights.size() + _dirLights.size()));
+        return Range1u(_ptLights.Size(), _ptLights.Size() + _dirLights.Size());
     case ORIENTED_LIGHT:
-        return Range1u((uint32_t)(_ptLights.size() + _dirLights.size()), (uint32_t)(_ptLights.size() + _dirLights.size() + _otrLights.size()));
+        return Range1u(_ptLights.Size() + _dirLights.Size(), GetSize());
     }
     return Range1u::Empty();
 }
+
+void LightList::AddOmniDirLight(const Vec3f &position, const Vec3f &intensity)
+{
+    _ptLights.Push(OMNI_POSITION, position);
+    _ptLights.Push(OMNI_INTENSITY, intensity);
+}
+
+void LightList::AddDirLight(const Vec3f &normal, const Vec3f &le)
+{
+    _dirLights.Push(DIR_NORMAL, normal);
+    _dirLights.Push(DIR_LE, le);
+}
+
+void LightList::AddOrientedLight(const Vec3f &position, const Vec3f &normal, const Vec3f &le)
+{
+    _otrLights.Push(ORIENTED_POSITION, position);
+    _otrLights.Push(ORIENTED_NORMAL, normal);
+    _otrLights.Push(ORIENTED_LE, le);
+}
+
+void LightList::View(const float *const *omni, uint32_t omniNum, const float *const *dir, uint32_t dirNum,
+    const float *const *oriented, uint32_t orientedNum)
+{
+    _ptLights.View(omni, omniNum);
+    _dirLights.View(dir, dirNum);
+    _otrLights.View(oriented, orientedNum);
+}
+
+template<uint32_t C>
+static void _SaveChannels(CheckpointWriter &writer, const LightChannels<C> &lights)
+{
+    for (uint32_t c = 0; c < C; c++)
+        writer.Write(lights.Channel(c), lights.Size(), sizeof(float));
+}
+
+template<uint32_t C>
+static bool _LoadChannels(CheckpointReader &reader, LightChannels<C> &lights)
+{
+    bool good = true;
+    for (uint32_t c = 0; c < C && good; c++)
+        good = reader.Read(lights.Owned(c)) && lights.Owned(c).size() == lights.Owned(0).size();
+    lights.Rebind();
+    return good;
+}
+
+void LightList::Save(CheckpointWriter &writer) const
+{
+    _SaveChannels(writer, _ptLights);
+    _SaveChannels(writer, _dirLights);
+    _SaveChannels(writer, _otrLights);
+}
+
+bool LightList::Load(CheckpointReader &reader)
+{
+    Clear();
+    bool good = _LoadChannels(reader, _ptLights) && _LoadChannels(reader, _dirLights) && _LoadChannels(reader, _otrLights);
+    if (!good)
+        Clear();
+    return good;
+}
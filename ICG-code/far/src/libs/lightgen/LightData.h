@@ -12,6 +12,7 @@
 
 #include <vmath/vec3.h>
 #include <misc/stdcommon.h>
+#include <misc/checkpoint.h>
 #include "vmath/range1.h"
 
 struct VLight {};
@@ -53,18 +54,104 @@ enum VL_TYPE
 };
 
 
+// One float array per channel, so a run of lights of one type loads
+// straight into SSE registers. The channels are either owned or a view of
+// external arrays, such as a mapped light file, that the owner keeps alive;
+// adding to a view copies it first.
+template<uint32_t C>
+struct LightChannels
+{
+    LightChannels() : _size(0), _external(false) { _Bind(); }
+    LightChannels(const LightChannels &v) { *this = v; }
+    LightChannels& operator=(const LightChannels &v)
+    {
+        for (uint32_t c = 0; c < C; c++) _ch[c] = v._ch[c];
+        _external = v._external;
+        if (_external) { _size = v._size; for (uint32_t c = 0; c < C; c++) _data[c] = v._data[c]; }
+        else _Bind();
+        return *this;
+    }
+
+    inline uint32_t     Size() const { return _size; }
+    inline void         Clear() { for (uint32_t c = 0; c < C; c++) _ch[c].clear(); _external = false; _Bind(); }
+    inline void         Push(uint32_t c, const Vec3f &v)
+    {
+        if (_external) _Detach();
+        _ch[c].push_back(v.x); _ch[c+1].push_back(v.y); _ch[c+2].push_back(v.z);
+        _Bind();
+    }
+    inline Vec3f        Get(uint32_t c, uint32_t i) const { return Vec3f(_data[c][i], _data[c+1][i], _data[c+2][i]); }
+    inline const float* Channel(uint32_t c) const { return _data[c]; }
+    void                View(const float *const *channels, uint32_t size)
+    {
+        for (uint32_t c = 0; c < C; c++) { vector<float>().swap(_ch[c]); _data[c] = channels[c]; }
+        _size = size;
+        _external = true;
+    }
+    // the owned arrays, rebound after a direct resize
+    inline vector<float>& Owned(uint32_t c) { if (_external) _Detach(); return _ch[c]; }
+    inline void         Rebind() { _Bind(); }
+
+private:
+    void                _Bind()
+    {
+        for (uint32_t c = 0; c < C; c++) _data[c] = _ch[c].empty() ? 0 : &_ch[c][0];
+        _size = static_cast<uint32_t>(_ch[0].size());
+    }
+    void                _Detach()
+    {
+        for (uint32_t c = 0; c < C; c++) _ch[c].assign(_data[c], _data[c] + _size);
+        _external = false;
+        _Bind();
+    }
+
+    vector<float>       _ch[C];
+    const float         *_data[C];
+    uint32_t            _size;
+    bool                _external;
+};
+
+// channel offsets of the Vec3f members
+enum { OMNI_POSITION = 0, OMNI_INTENSITY = 3, OMNI_CHANNELS = 6 };
+enum { DIR_NORMAL = 0, DIR_LE = 3, DIR_CHANNELS = 6 };
+enum { ORIENTED_POSITION = 0, ORIENTED_NORMAL = 3, ORIENTED_LE = 6, ORIENTED_CHANNELS = 9 };
+
+typedef LightChannels<OMNI_CHANNELS>        OmniDirLightArray;
+typedef LightChannels<DIR_CHANNELS>         DirLightArray;
+typedef LightChannels<ORIENTED_CHANNELS>    OrientedLightArray;
+
+// Lights are indexed omni first, then directional, then oriented, so each
+// type is the contiguous range returned by GetRange.
 struct LightList 
 {
     VL_TYPE         GetLightType(uint32_t idx) const;
-    const VLight*   GetLight(uint32_t idx) const;
-    VLight*         GetLight(uint32_t idx);
+    OmniDirLight    GetOmniDirLight(uint32_t idx) const;
+    DirLight        GetDirLight(uint32_t idx) const;
+    OrientedLight   GetOrientedLight(uint32_t idx) const;
     Vec3f           GetPower( uint32_t idx ) const;
-    inline uint32_t GetSize() const { return static_cast<uint32_t>(_ptLights.size() + _dirLights.size() + _otrLights.size()); }
-    inline void     Clear() { _ptLights.clear(); _dirLights.clear(); _otrLights.clear(); }
+    inline uint32_t GetSize() const { return _ptLights.Size() + _dirLights.Size() + _otrLights.Size(); }
+    inline void     Clear() { _ptLights.Clear(); _dirLights.Clear(); _otrLights.Clear(); }
     Range1u         GetRange(VL_TYPE type) const;
 
-	vector<OrientedLight>	_otrLights;
-	vector<DirLight>		_dirLights;
-	vector<OmniDirLight>	_ptLights;
+    void            AddOmniDirLight(const Vec3f &position, const Vec3f &intensity);
+    void            AddDirLight(const Vec3f &normal, const Vec3f &le);
+    void            AddOrientedLight(const Vec3f &position, const Vec3f &normal, const Vec3f &le);
+    // views the channel arrays in place instead of copying them, the caller
+    // keeps them alive as long as the list
+    void            View(const float *const *omni, uint32_t omniNum, const float *const *dir, uint32_t dirNum,
+                        const float *const *oriented, uint32_t orientedNum);
+
+    const OmniDirLightArray&    OmniDirLights() const { return _ptLights; }
+    const DirLightArray&        DirLights() const { return _dirLights; }
+    const OrientedLightArray&   OrientedLights() const { return _otrLights; }
+
+    // every channel as one checkpoint array, so the light indices survive
+    void            Save(CheckpointWriter &writer) const;
+    bool            Load(CheckpointReader &reader);
+
+private:
+	OrientedLightArray	_otrLights;
+	DirLightArray		_dirLights;
+	OmniDirLightArray	_ptLights;
 };
 #endif // _VIRTUAL_LIGHT_DATA_H_
\ No newline at end of file
@@ -5,6 +5,11 @@
 #include <scene/sampling.h>
 #include <sampler/pathSampler.h>
 #include <sampler/LightSampleUtils.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+using tbb::parallel_for;
+using tbb::blocked_range;
 
 
 VirtualPointLightDiffuseGenerator::VirtualPointLightDiffuseGenerator(Scene *scene, RayEngine *engine)
@@ -19,67 +24,150 @@ VirtualPointLightDiffuseGenerator::~VirtualPointLightDiffuseGenerator(void)
 
 void VirtualPointLightDiffuseGenerator::_GenerateIndirect(uint32_t indirect, VirtualLightCache *cache, float time, ReportHandler *report)
 {
-    vector<shared_ptr<Light> > &lights = _scene->Lights();
     if(report) report->beginActivity("generate indirect virtual light");
+    vector<PhotonVLight> path;
     while(cache->IndirectLightNum() < indirect)
     {
-        //PhotonSample photon = LightSampleUtils::SamplePhotonPowerDist(_scene->Lights(), _dist, _sceneCenter, _sceneRadius, _sampler->Next1D(), _sampler->Next2D(), _sampler->Next2D(), time);
-        PhotonSample photon = LightSampleUtils::SamplePhotonUniform(_scene->Lights(), _sceneCenter, _sceneRadius, _sampler.Next1D(), _sampler.Next2D(), _sampler.Next2D(), time);
+        path.clear();
+        _TracePhoton(_sampler, time, indirect - cache->IndirectLightNum(), path);
+        for (uint32_t i = 0; i < path.size(); i++)
+            cache->AddIndirectLight(path[i].P, path[i].N, path[i].le / static_cast<float>(indirect));
+        if(report && !path.empty()) report->progress((float)cache->IndirectLightNum() / indirect);
+    }
+    if(report) report->endActivity();
+}
 
-        if (!photon.Valid())
-            continue;
-        Ray walkRay(photon.P, photon.wo, time);
-        Vec3f alpha = photon.le / (photon.pdf);
-        Intersection isect;
+void VirtualPointLightDiffuseGenerator::_TracePhoton(PathSampler &sampler, float time, uint32_t maxLights, vector<PhotonVLight> &lights) const
+{
+    //PhotonSample photon = LightSampleUtils::SamplePhotonPowerDist(_scene->Lights(), _dist, _sceneCenter, _sceneRadius, sampler.Next1D(), sampler.Next2D(), sampler.Next2D(), time);
+    PhotonSample photon = LightSampleUtils::SamplePhotonUniform(_scene->Lights(), _sceneCenter, _sceneRadius, sampler.Next1D(), sampler.Next2D(), sampler.Next2D(), time);
+
+    if (!photon.Valid())
+        return;
+    Ray walkRay(photon.P, photon.wo, time);
+    Vec3f alpha = photon.le / (photon.pdf);
+    Intersection isect;
+
+    uint32_t maxSpecularDepth = 5;
+    uint32_t added = 0;
+
+    while (_engine->Intersect(walkRay, &isect) && !alpha.IsZero())
+    {
+        Vec3f wo = -walkRay.D;
+        float pdf;
 
-		uint32_t maxSpecularDepth = 5;
+        BxdfUnion msu;
+        isect.m->SampleReflectance(isect.dp, msu);
+        Bxdf *ms = &msu;
+        BxdfSample brdfSample = ms->SampleCos(ALL_BXDF, wo, isect.dp, sampler.Next2D(), sampler.Next1D());
+        if(!brdfSample.Valid()) break;
 
-        while (_engine->Intersect(walkRay, &isect) && !alpha.IsZero())
+        if (brdfSample.delta)
         {
-            Vec3f wo = -walkRay.D;
-            float pdf;
-
-			BxdfUnion msu;
-            isect.m->SampleReflectance(isect.dp, msu);
-			Bxdf *ms = &msu;
-			BxdfSample brdfSample = ms->SampleCos(ALL_BXDF, wo, isect.dp, _sampler.Next2D(), _sampler.Next1D());
-			if(!brdfSample.Valid()) break;
-
-			if (brdfSample.delta)
-			{
-				if (maxSpecularDepth == 0)
-					break;
-				maxSpecularDepth--;
-				alpha *= brdfSample.brdfCos;
-				walkRay = Ray(isect.dp.P, brdfSample.wi, isect.rayEpsilon, RAY_INFINITY, time);
-				continue;
-			}
-
-            GLPhongApproximation glApprox = isect.m->ApprtoximateAsGLPhong(isect.dp);
-
-            Vec3f localWi = Sampling::HemisphericalDirectionCos(_sampler.Next2D(), &pdf);
-            Vec3f wi = isect.dp.VectorToWorld(localWi);
-            Vec3f brdfCos = glApprox.Kd * (wi % isect.dp.N);
-
-            if(brdfCos.IsZero()) break;
-
-            Vec3f contrib = alpha * glApprox.Kd;
-            if(contrib.IsZero() || cache->IndirectLightNum() >= indirect)
+            if (maxSpecularDepth == 0)
                 break;
+            maxSpecularDepth--;
+            alpha *= brdfSample.brdfCos;
+            walkRay = Ray(isect.dp.P, brdfSample.wi, isect.rayEpsilon, RAY_INFINITY, time);
+            continue;
+        }
 
-            cache->AddIndirectLight(isect.dp.P, isect.dp.N, contrib / static_cast<float>(indirect));
-            
-            if(report) report->progress((float)cache->IndirectLightNum() / indirect);
+        GLPhongApproximation glApprox = isect.m->ApprtoximateAsGLPhong(isect.dp);
 
-            Vec3f contribScale = glApprox.Kd * (wi % isect.dp.N) / pdf;
+        Vec3f localWi = Sampling::HemisphericalDirectionCos(sampler.Next2D(), &pdf);
+        Vec3f wi = isect.dp.VectorToWorld(localWi);
+        Vec3f brdfCos = glApprox.Kd * (wi % isect.dp.N);
 
-            float rrProb = min(1.0f, contribScale.Average());
-            if (_sampler.Next1D() > rrProb)
-                break;
-            alpha *= contribScale / rrProb;
-            walkRay = Ray(isect.dp.P, wi, isect.rayEpsilon, RAY_INFINITY, time);
+        if(brdfCos.IsZero()) break;
+
+        Vec3f contrib = alpha * glApprox.Kd;
+        if(contrib.IsZero() || added >= maxLights)
+            break;
+
+        PhotonVLight light;
+        light.P = isect.dp.P;
+        light.N = isect.dp.N;
+        light.le = contrib;
+        lights.push_back(light);
+        added++;
+
+        Vec3f contribScale = glApprox.Kd * (wi % isect.dp.N) / pdf;
+
+        float rrProb = min(1.0f, contribScale.Average());
+        if (sampler.Next1D() > rrProb)
+            break;
+        alpha *= contribScale / rrProb;
+        walkRay = Ray(isect.dp.P, wi, isect.rayEpsilon, RAY_INFINITY, time);
+    }
+}
+
+struct DiffuseBatch
+{
+    uint64_t                                                        seed;
+    vector<VirtualPointLightParallelDiffuseGenerator::PhotonVLight> lights;
+};
+
+class DiffuseBatchThread
+{
+public:
+    DiffuseBatchThread(const VirtualPointLightParallelDiffuseGenerator *generator, DiffuseBatch *batches, float time)
+        : _generator(generator), _batches(batches), _time(time) {}
+    void operator()(const blocked_range<uint32_t> &r) const
+    {
+        for (uint32_t b = r.begin(); b != r.end(); b++)
+        {
+            DiffuseBatch &batch = _batches[b];
+            StratifiedPathSamplerStd::Engine e((unsigned long)batch.seed);
+            StratifiedPathSamplerStd sampler(e);
+            for (uint32_t p = 0; p < VPL_PHOTON_BATCH; p++)
+                _generator->_TracePhoton(sampler, _time, UINT_MAX, batch.lights);
         }
     }
-    if(report) report->endActivity();
+private:
+    const VirtualPointLightParallelDiffuseGenerator *_generator;
+    DiffuseBatch                                    *_batches;
+    float                                           _time;
+};
+
+VirtualPointLightParallelDiffuseGenerator::VirtualPointLightParallelDiffuseGenerator(Scene *scene, RayEngine *engine, uint32_t seed)
+    : VirtualPointLightDiffuseGenerator(scene, engine), _seeder(seed)
+{
 }
 
+void VirtualPointLightParallelDiffuseGenerator::_GenerateIndirect(uint32_t indirect, VirtualLightCache *cache, float time, ReportHandler *report)
+{
+    if(report) report->beginActivity("generate indirect virtual light");
+    // the round sizes only depend on the lights found so far, never on the thread count
+    uint32_t nBatches = VPL_FIRST_ROUND;
+    uint64_t traced = 0, found = 0;
+    vector<DiffuseBatch> batches;
+    while(cache->IndirectLightNum() < indirect)
+    {
+        batches.resize(nBatches);
+        for (uint32_t b = 0; b < nBatches; b++)
+        {
+            batches[b].seed = _seeder();
+            batches[b].lights.clear();
+        }
+        parallel_for(blocked_range<uint32_t>(0, nBatches), DiffuseBatchThread(this, &batches[0], time));
+
+        uint64_t roundFound = 0;
+        for (uint32_t b = 0; b < nBatches; b++)
+        {
+            vector<PhotonVLight> &lights = batches[b].lights;
+            roundFound += lights.size();
+            for (uint32_t i = 0; i < lights.size() && cache->IndirectLightNum() < indirect; i++)
+                cache->AddIndirectLight(lights[i].P, lights[i].N, lights[i].le / static_cast<float>(indirect));
+        }
+        if(report) report->progress((float)cache->IndirectLightNum() / indirect);
+
+        // nothing reaches a surface
+        if (!roundFound)
+            break;
+        traced += nBatches;
+        found += roundFound;
+        uint64_t remaining = indirect - cache->IndirectLightNum();
+        nBatches = (uint32_t)min<uint64_t>(VPL_MAX_ROUND, max<uint64_t>(1, (remaining * traced + found - 1) / found));
+    }
+    if(report) report->endActivity();
+}
@@ -1,4 +1,3 @@
-
 #ifndef VirtualLightDiffuseGenerator_h__
 #define VirtualLightDiffuseGenerator_h__
 
@@ -9,8 +8,38 @@ class VirtualPointLightDiffuseGenerator :
 public:
     VirtualPointLightDiffuseGenerator(Scene *scene, RayEngine *engine);
     virtual ~VirtualPointLightDiffuseGenerator(void);
+
+    struct PhotonVLight
+    {
+        Vec3f   P;
+        Vec3f   N;
+        Vec3f   le;
+    };
+protected:
+    virtual void _GenerateIndirect(uint32_t indirect, VirtualLightCache *cache, float time, ReportHandler *report);
+    // follows one photon path, appending at most maxLights lights
+    void _TracePhoton(PathSampler &sampler, float time, uint32_t maxLights, vector<PhotonVLight> &lights) const;
+};
+
+// photon paths traced by one task, each batch has its own seeded sampler
+#define VPL_PHOTON_BATCH        256
+#define VPL_FIRST_ROUND         64
+#define VPL_MAX_ROUND           4096
+
+// Traces photon batches in parallel. Batch seeds are drawn in order from
+// the generator seed and batches are merged in order, so the light list
+// only depends on the seed, not on the number of threads.
+class VirtualPointLightParallelDiffuseGenerator :
+    public VirtualPointLightDiffuseGenerator
+{
+    friend class DiffuseBatchThread;
+public:
+    VirtualPointLightParallelDiffuseGenerator(Scene *scene, RayEngine *engine, uint32_t seed = 1);
+    void SetSeed(uint32_t seed) { _seeder.seed(seed); }
 protected:
     virtual void _GenerateIndirect(uint32_t indirect, VirtualLightCache *cache, float time, ReportHandler *report);
+
+    minstd_rand     _seeder;
 };
 
 #endif // VirtualLightDiffuseGenerator_h__
@@ -21,6 +21,7 @@ class Scene;
 class RayEngine;
 class ReportHandler;
 class Light;
+struct LightList;
 
 //////////////////////////////////////////////////////////////////////////
 // Virtual Light Declaration
@@ -28,6 +29,9 @@ class VirtualLightGenerator
 {
 public:
 	virtual bool Generate(uint32_t indirect, VirtualLightCache* cache, float time = 0.0f, ReportHandler *report = 0) = 0;
+	// points lights at storage the generator keeps alive instead of adding
+	// copies, false when there is none and Generate has to be used
+	virtual bool ViewLights(LightList &lights) { return false; }
 };
 
 //////////////////////////////////////////////////////////////////////////
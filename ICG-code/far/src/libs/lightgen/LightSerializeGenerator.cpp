@@ -3,15 +3,30 @@
 
 LightSerializeGenerator::LightSerializeGenerator(const string& lightFilename)
 {
-	_cache.Load(lightFilename);
+	if (!_binary.Open(lightFilename))
+		_cache.Load(lightFilename);
 }
 
 LightSerializeGenerator::~LightSerializeGenerator(void)
 {
 }
 
+bool LightSerializeGenerator::ViewLights(LightList &lights)
+{
+	if (!_binary.IsOpen())
+		return false;
+	_binary.View(lights);
+	return true;
+}
+
 bool LightSerializeGenerator::Generate(uint32_t indirect, VirtualLightCache *cache, float time, ReportHandler *report)
 {
+	if (_binary.IsOpen())
+	{
+		_binary.AddToCache(cache);
+		return true;
+	}
+
 	for (uint32_t i = 0; i < _cache._otrLights.size(); i++)
 	{
 		OrientedLight& ortLight = _cache._otrLights[i];
@@ -4,14 +4,21 @@
 
 #include "LightGenerator.h"
 #include "SerializableLightCache.h"
+#include "BinaryLightCache.h"
+
+// Reads binary light files through a memory mapping, any other file with
+// SerializableLightCache::Load.
 class LightSerializeGenerator :	public VirtualLightGenerator
 {
 public:
 	LightSerializeGenerator(const string& lightFilename);
 	virtual ~LightSerializeGenerator(void);
 	virtual bool Generate(uint32_t indirect, VirtualLightCache *cache, float time = 0.0f, ReportHandler *report = 0);
+	// binary light files are viewed in place through the mapping
+	virtual bool ViewLights(LightList &lights);
 protected:
 	SerializableLightCache _cache;
+	BinaryLightCache		_binary;
 };
 #endif // _LIGHT_SERIALIZE_GENERATOR_H_
 
@@ -14,6 +14,7 @@ using std::ifstream;
 class SerializableLightCache : public VirtualLightCache
 {
 	friend class LightSerializeGenerator;
+	friend class BinaryLightCache;
 public:
 	virtual void			Clear() { _otrLights.clear(); _ptLights.clear(); _dirLights.clear(); _idtLights.clear(); }
 	virtual void			AddOmniDirLight(const Vec3f &position, const Vec3f &intensity) 
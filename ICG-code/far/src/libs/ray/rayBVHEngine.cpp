@@ -102,6 +102,60 @@ bool BvhEngineGroupNode::IntersectAny(const Ray& r)
     return false;
 }
 
+struct GroupBvhPacketLeaf
+{
+    GroupBvhPacketLeaf(GroupBvh *data, const BvhRayPacket &packet) : _data(data), _packet(packet) {}
+    void operator()(const LinearBVHNode *node, uint32_t mask, uint32_t &active)
+    {
+        Ray rays[BVH_PACKET_SIZE];
+        uint32_t slots[BVH_PACKET_SIZE];
+        for (uint32_t i = 0; i < node->nPrimitives; ++i) 
+        {
+            // hand the still unoccluded rays to the sub engine as one batch
+            uint32_t n = 0;
+            for (uint32_t r = 0; r < _packet.nRays; r++)
+            {
+                if (mask & active & (1u << r))
+                {
+                    rays[n] = _packet.rays[r];
+                    slots[n++] = r;
+                }
+            }
+            if (n == 0)
+                break;
+
+            uint32_t occluded;
+            _data->groups[node->primitivesOffset+i]->IntersectAnyBatch(rays, n, &occluded);
+            for (uint32_t k = 0; k < n; k++)
+            {
+                if (occluded & (1u << k))
+                    active &= ~(1u << slots[k]);
+            }
+        }
+    }
+    GroupBvh                *_data;
+    const BvhRayPacket      &_packet;
+};
+
+void BvhEngineGroupNode::IntersectAnyBatch(const Ray* rays, uint32_t nRays, uint32_t* occluded)
+{
+    for (uint32_t w = 0; w < RAY_BATCH_MASK_WORDS(nRays); w++)
+        occluded[w] = 0;
+    if (!_data->bvhNodes.size()) 
+        return;
+
+    BvhRayPacket packet;
+    for (uint32_t start = 0; start < nRays; start += BVH_PACKET_SIZE)
+    {
+        uint32_t n = min<uint32_t>(BVH_PACKET_SIZE, nRays - start);
+        packet.Init(rays + start, n);
+        uint32_t active = BvhPacketMask(n);
+        GroupBvhPacketLeaf leaf(_data, packet);
+        TraverseBVHPacket(_data->bvhNodes, packet, active, leaf);
+        occluded[start >> 5] = BvhPacketMask(n) & ~active;
+    }
+}
+
 void BvhEngineGroupNode::CollectStats(StatsManager& stats)
 {
     for(size_t p = 0; p < _data->groups.size(); p++) 
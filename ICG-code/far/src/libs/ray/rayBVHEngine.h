@@ -35,6 +35,101 @@ inline bool IntersectBVHBoundingBox(const Range3f &bounds, const Ray &ray,
         return (tmin < ray.tMax) && (tmax > ray.tMin);
 }
 
+#define BVH_PACKET_SIZE 32
+
+inline uint32_t BvhPacketMask(uint32_t nRays)
+{
+    return nRays >= BVH_PACKET_SIZE ? 0xffffffffu : (1u << nRays) - 1;
+}
+
+// Up to BVH_PACKET_SIZE rays traversed together, one mask bit per ray.
+// Traversal order follows the first ray, so the packet should be coherent
+// (e.g. shadow rays leaving one gather point).
+struct BvhRayPacket
+{
+    void Init(const Ray *r, uint32_t n)
+    {
+        assert(n <= BVH_PACKET_SIZE);
+        rays = r;
+        nRays = n;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            const Vec3f &D = rays[i].D;
+            invDir[i] = Vec3f(1.f / D.x, 1.f / D.y, 1.f / D.z);
+            dirIsNeg[i][0] = invDir[i].x < 0;
+            dirIsNeg[i][1] = invDir[i].y < 0;
+            dirIsNeg[i][2] = invDir[i].z < 0;
+        }
+    }
+    const Ray       *rays;
+    uint32_t        nRays;
+    Vec3f           invDir[BVH_PACKET_SIZE];
+    uint32_t        dirIsNeg[BVH_PACKET_SIZE][3];
+};
+
+inline uint32_t IntersectBVHBoundingBoxPacket(const Range3f &bounds, const BvhRayPacket &packet, uint32_t mask)
+{
+    uint32_t hit = 0;
+    for (uint32_t i = 0; i < packet.nRays; i++)
+    {
+        uint32_t bit = 1u << i;
+        if ((mask & bit) && IntersectBVHBoundingBox(bounds, packet.rays[i], packet.invDir[i], packet.dirIsNeg[i]))
+            hit |= bit;
+    }
+    return hit;
+}
+
+// Walks the packet through a flattened BVH. leafOp(node, mask, active) is called
+// for every leaf reached by the rays in mask and clears the bits of occluded rays
+// in active; traversal stops as soon as no ray is left active.
+template<typename LeafOp>
+void TraverseBVHPacket(const vector<LinearBVHNode> &bvhNodes, const BvhRayPacket &packet, uint32_t &active, LeafOp &leafOp)
+{
+    if (!bvhNodes.size() || !active)
+        return;
+
+    uint32_t first = 0;
+    while (!(active & (1u << first))) first++;
+    const uint32_t *dirIsNeg = packet.dirIsNeg[first];
+
+    uint32_t todo[64];
+    uint32_t todoMask[64];
+    uint32_t todoOffset = 0, nodeNum = 0;
+    uint32_t mask = active;
+    while (true) {
+        const LinearBVHNode *node = &bvhNodes[nodeNum];
+        mask = IntersectBVHBoundingBoxPacket(node->bounds, packet, mask & active);
+        if (mask) 
+        {
+            if (node->nPrimitives > 0) {
+                leafOp(node, mask, active);
+                if (!active) break;
+                if (todoOffset == 0) break;
+                --todoOffset;
+                nodeNum = todo[todoOffset];
+                mask = todoMask[todoOffset];
+            }
+            else {
+                todoMask[todoOffset] = mask;
+                if (dirIsNeg[node->axis]) {
+                    todo[todoOffset++] = nodeNum + 1;
+                    nodeNum = node->secondChildOffset;
+                }
+                else {
+                    todo[todoOffset++] = node->secondChildOffset;
+                    nodeNum = nodeNum + 1;
+                }
+            }
+        }
+        else {
+            if (todoOffset == 0) break;
+            --todoOffset;
+            nodeNum = todo[todoOffset];
+            mask = todoMask[todoOffset];
+        }
+    }
+}
+
 
 class BvhEngineGroupNode
 {
@@ -44,6 +139,7 @@ public:
     Intervalf               ValidInterval();
     bool                    Intersect(const Ray& ray, Intersection* intersection);
     bool                    IntersectAny(const Ray& ray);
+    void                    IntersectAnyBatch(const Ray* rays, uint32_t nRays, uint32_t* occluded);
     void                    CollectStats(StatsManager& stats);
     Range3f                 ComputeBoundingBox();
     float                   ComputeAverageArea();
@@ -200,6 +296,33 @@ public:
         return false;
     }
 
+    void IntersectAnyBatch(const Ray* rays, uint32_t nRays, uint32_t* occluded)
+    {
+        for (uint32_t w = 0; w < RAY_BATCH_MASK_WORDS(nRays); w++)
+            occluded[w] = 0;
+        if (!_data->bvhNodes.size() || (_material->IntersectOption() & IOPT_IGNORE_SHADOW)) 
+            return;
+
+        Ray local[BVH_PACKET_SIZE];
+        BvhRayPacket packet;
+        for (uint32_t start = 0; start < nRays; start += BVH_PACKET_SIZE)
+        {
+            uint32_t n = min<uint32_t>(BVH_PACKET_SIZE, nRays - start);
+            for (uint32_t i = 0; i < n; i++)
+            {
+                local[i] = rays[start + i];
+                local[i].Transform(_xform->GetInverseTransform(local[i].time));
+            }
+            packet.Init(local, n);
+            uint32_t active = BvhPacketMask(n);
+            TriangleLeaf leaf(this, packet);
+            TraverseBVHPacket(_data->bvhNodes, packet, active, leaf);
+
+            // packets start on a word boundary since BVH_PACKET_SIZE is 32
+            occluded[start >> 5] = BvhPacketMask(n) & ~active;
+        }
+    }
+
     void CollectStats(StatsManager& stats)
     {
         StatsCounterVariable* primitives = stats.GetVariable<StatsCounterVariable>("Ray", "Primitives");
@@ -213,6 +336,36 @@ public:
 
     float ComputeAverageArea() {  throw std::exception(); }
 private:
+    struct TriangleLeaf
+    {
+        TriangleLeaf(BvhEngineMeshNode *node, const BvhRayPacket &packet) : _node(node), _packet(packet) {}
+        void operator()(const LinearBVHNode *node, uint32_t mask, uint32_t &active)
+        {
+            carray<Vec3i> &faces = _node->_data->faces;
+            carray<Vec3f> &pos = _node->_data->positions;
+            const vector<uint32_t> &ordered = _node->_data->ordered;
+            float t, b1, b2, rayEpsilon;
+            for (uint32_t i = 0; i < node->nPrimitives && (mask & active); ++i) 
+            {
+                uint32_t f = ordered[node->primitivesOffset+i];
+                const Vec3f &v0 = pos[faces[f][0]];
+                const Vec3f &v1 = pos[faces[f][1]];
+                const Vec3f &v2 = pos[faces[f][2]];
+                for (uint32_t r = 0; r < _packet.nRays; r++)
+                {
+                    uint32_t bit = 1u << r;
+                    if (!(mask & active & bit))
+                        continue;
+                    if(IntersectTriangle(v0, v1, v2, _packet.rays[r], &t, &b1, &b2, &rayEpsilon) && 
+                        _node->_material->CheckAlpha(Vec2f(b1, b2), 0.5f))
+                        active &= ~bit;
+                }
+            }
+        }
+        BvhEngineMeshNode           *_node;
+        const BvhRayPacket          &_packet;
+    };
+
     Xform                       *_xform;
     Material                    *_material;
     TriangleBvh                 *_data;  //This cache the pointer to avoid evaluate share_ptr every time.
@@ -31,35 +31,60 @@ RayEngine* RayBVHEngineBuilder::Build(const vector<shared_ptr<Surface> >& surfac
     }
 
     bvh->BuildBVH();
-    RayEngineX<BvhEngineGroupNode>* engine = new RayEngineX<BvhEngineGroupNode>(BvhEngineGroupNode(bvh));
+    RayEngineX<BvhEngineGroupNode>* engine = new RayEngineBatchX<BvhEngineGroupNode>(BvhEngineGroupNode(bvh));
     return engine;
 }
 
+RayEngine* RayBVHEngineBuilder::_MakeQbvhMeshNode(shared_ptr<MeshShape> shape, shared_ptr<TriangleQbvh> data, Material *material, Xform *xform)
+{
+    if (!shape->NormalArray().size() && !shape->UvArray().size())
+        return new RayEngineBatchX<QbvhEngineMeshNode<WithoutNormal, WithoutUv> >(
+            QbvhEngineMeshNode<WithoutNormal, WithoutUv>(xform, material, data));
+    else if(shape->NormalArray().size() && !shape->UvArray().size())
+        return new RayEngineBatchX<QbvhEngineMeshNode<WithNormal, WithoutUv> >(
+            QbvhEngineMeshNode<WithNormal, WithoutUv>(xform, material, data));
+    else if (!shape->NormalArray().size() && shape->UvArray().size())
+        return new RayEngineBatchX<QbvhEngineMeshNode<WithoutNormal, WithUv> >(
+            QbvhEngineMeshNode<WithoutNormal, WithUv>(xform, material, data));
+    else
+        return new RayEngineBatchX<QbvhEngineMeshNode<WithNormal, WithUv> >(
+            QbvhEngineMeshNode<WithNormal, WithUv>(xform, material, data));
+}
+
 template<>
 RayEngine* RayBVHEngineBuilder::MakeNode(shared_ptr<MeshShape> shape, shared_ptr<Material> material, shared_ptr<Xform> xform)
 {
     RayEngine* rayEngine = NULL;
+    if (_wide)
+    {
+        if (xform->IsStatic())
+        {
+            shared_ptr<TriangleQbvh> data = shared_ptr<TriangleQbvh>(new TriangleQbvh(shape->PosArray(), shape->NormalArray(), shape->UvArray(), shape->FaceArray()));
+            rayEngine = _MakeQbvhMeshNode(shape, data, material.get(), xform.get());
+        }
+        return rayEngine;
+    }
     if (xform->IsStatic())
     {
         shared_ptr<TriangleBvh> data = shared_ptr<TriangleBvh>(new TriangleBvh(shape->PosArray(), shape->NormalArray(), shape->UvArray(), shape->FaceArray()));
         if (!shape->NormalArray().size() && !shape->UvArray().size())
         {
-            rayEngine = new RayEngineX<BvhEngineMeshNode<WithoutNormal, WithoutUv> >(
+            rayEngine = new RayEngineBatchX<BvhEngineMeshNode<WithoutNormal, WithoutUv> >(
                 BvhEngineMeshNode<WithoutNormal, WithoutUv>(xform.get(), material.get(), data));
         }
         else if(shape->NormalArray().size() && !shape->UvArray().size())
         {
-            rayEngine = new RayEngineX<BvhEngineMeshNode<WithNormal, WithoutUv> >(
+            rayEngine = new RayEngineBatchX<BvhEngineMeshNode<WithNormal, WithoutUv> >(
                 BvhEngineMeshNode<WithNormal, WithoutUv>(xform.get(), material.get(), data));
         }
         else if (!shape->NormalArray().size() && shape->UvArray().size())
         {
-            rayEngine = new RayEngineX<BvhEngineMeshNode<WithoutNormal, WithUv> >(
+            rayEngine = new RayEngineBatchX<BvhEngineMeshNode<WithoutNormal, WithUv> >(
                 BvhEngineMeshNode<WithoutNormal, WithUv>(xform.get(), material.get(), data));
         }
         else if (shape->NormalArray().size() && shape->UvArray().size())
         {
-            rayEngine = new RayEngineX<BvhEngineMeshNode<WithNormal, WithUv> >(
+            rayEngine = new RayEngineBatchX<BvhEngineMeshNode<WithNormal, WithUv> >(
                 BvhEngineMeshNode<WithNormal, WithUv>(xform.get(), material.get(), data));
         }
     }
@@ -138,6 +163,20 @@ RayEngine* RayBVHEngineBuilder::MakeNode(shared_ptr<CurveShape> shape, shared_pt
 template<>
 void RayBVHEngineBuilder::MakeNodes(shared_ptr<MeshShape> shape, vector<shared_ptr<Material> > &materials, vector<shared_ptr<Xform> > &xforms, vector<RayEngine*> &es)
 {
+    if (_wide)
+    {
+        shared_ptr<TriangleQbvh> data = shared_ptr<TriangleQbvh>(new TriangleQbvh(shape->PosArray(), shape->NormalArray(), shape->UvArray(), shape->FaceArray()));
+        assert(materials.size() == xforms.size());
+        for (uint32_t i = 0; i < materials.size(); i++)
+        {
+            if (xforms[i]->IsStatic())
+                es.push_back(_MakeQbvhMeshNode(shape, data, materials[i].get(), xforms[i].get()));
+            else
+                cerr << "animation xform not supported" << endl;
+        }
+        return;
+    }
+
     shared_ptr<TriangleBvh> data = shared_ptr<TriangleBvh>(new TriangleBvh(shape->PosArray(), shape->NormalArray(), shape->UvArray(), shape->FaceArray()));
     assert(materials.size() == xforms.size());
     RayEngine* rayEngine = NULL;
@@ -149,22 +188,22 @@ void RayBVHEngineBuilder::MakeNodes(shared_ptr<MeshShape> shape, vector<shared_p
         {
             if (!shape->NormalArray().size() && !shape->UvArray().size())
             {
-                rayEngine = new RayEngineX<BvhEngineMeshNode<WithoutNormal, WithoutUv> >(
+                rayEngine = new RayEngineBatchX<BvhEngineMeshNode<WithoutNormal, WithoutUv> >(
                     BvhEngineMeshNode<WithoutNormal, WithoutUv>(xform.get(), material.get(), data));
             }
             else if(shape->NormalArray().size() && !shape->UvArray().size())
             {
-                rayEngine = new RayEngineX<BvhEngineMeshNode<WithNormal, WithoutUv> >(
+                rayEngine = new RayEngineBatchX<BvhEngineMeshNode<WithNormal, WithoutUv> >(
                     BvhEngineMeshNode<WithNormal, WithoutUv>(xform.get(), material.get(), data));
             }
             else if (!shape->NormalArray().size() && shape->UvArray().size())
             {
-                rayEngine = new RayEngineX<BvhEngineMeshNode<WithoutNormal, WithUv> >(
+                rayEngine = new RayEngineBatchX<BvhEngineMeshNode<WithoutNormal, WithUv> >(
                     BvhEngineMeshNode<WithoutNormal, WithUv>(xform.get(), material.get(), data));
             }
             else if (shape->NormalArray().size() && shape->UvArray().size())
             {
-                rayEngine = new RayEngineX<BvhEngineMeshNode<WithNormal, WithUv> >(
+                rayEngine = new RayEngineBatchX<BvhEngineMeshNode<WithNormal, WithUv> >(
                     BvhEngineMeshNode<WithNormal, WithUv>(xform.get(), material.get(), data));
             }
         }
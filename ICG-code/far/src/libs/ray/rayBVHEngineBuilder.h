@@ -1,10 +1,13 @@
 #ifndef _RAY_BVH_ENGINE_BUILDER_H_
 #define _RAY_BVH_ENGINE_BUILDER_H_
 #include "rayBVHEngine.h"
+#include "rayQBVHEngine.h"
 
 class RayBVHEngineBuilder
 {
 public:
+    // wide: meshes use the 4-wide SSE BVH instead of the binary one
+    RayBVHEngineBuilder(bool wide = false) : _wide(wide) {}
     RayEngine*  Build(const vector<shared_ptr<Surface> >& surfaces, const vector<shared_ptr<InstanceGroup> >& instances, 
         const Intervalf& time, int timeSamples);
     RayEngine*  Build(shared_ptr<Surface> surface, const Intervalf& time, int timeSamples);
@@ -14,6 +17,9 @@ private:
     RayEngine*  MakeNode(shared_ptr<T> shape, shared_ptr<Material> material, shared_ptr<Xform> xform);
     template<typename T>
     void        MakeNodes(shared_ptr<T> shape, vector<shared_ptr<Material> > &materials, vector<shared_ptr<Xform> > &xforms, vector<RayEngine*> &es);
+    RayEngine*  _MakeQbvhMeshNode(shared_ptr<MeshShape> shape, shared_ptr<TriangleQbvh> data, Material *material, Xform *xform);
+
+    bool        _wide;
 };
 
 
@@ -1,4 +1,5 @@
 #include "rayBVHEngineData.h"
+#include "rayBVHParallelBuilder.h"
 
 
 uint32_t FlattenBVHTree(BVHBuildNode *node, vector<LinearBVHNode> &nodes, uint32_t *offset) 
@@ -36,17 +37,13 @@ void GroupBvh::BuildBVH()
         buildData.push_back(BVHItem(i, bbox));
     }
 
-    vector<RayEngine* > ordered;
-    ordered.reserve(groups.size());
-
-    uint64_t totalNodes = 0;
-    BVHBuildNode *root = RecursiveBuildBVH<RayEngine*>(SPLIT_SAH, buildData.begin(), buildData.end(), &totalNodes, groups, ordered);
+    vector<uint32_t> order;
+    ParallelBuildBVH(buildData, bvhNodes, order);
 
+    vector<RayEngine* > ordered(groups.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        ordered[i] = groups[order[i]];
     groups = ordered;
-
-    bvhNodes.resize(totalNodes);
-    uint32_t offset = 0;
-    FlattenBVHTree(root, bvhNodes, &offset);
 }
 
 void SphereBvh::BuildBVH()
@@ -56,21 +53,13 @@ void SphereBvh::BuildBVH()
 
     vector<BVHItem> buildData;
     buildData.reserve(centers.size());
-    vector<uint32_t> prims(centers.size());
     for (uint32_t i = 0; i < centers.size(); ++i) 
     {
         Range3f bbox = ElementOperations::SphereBoundingBox(centers[i], radius[i]);
         buildData.push_back(BVHItem(i, bbox));
-        prims[i] = i;
     }
 
-    ordered.reserve(centers.size());
-    uint64_t totalNodes = 0;
-    BVHBuildNode *root = RecursiveBuildBVH<uint32_t>(SPLIT_SAH, buildData.begin(), buildData.end(), &totalNodes, prims, ordered);
-
-    bvhNodes.resize(totalNodes);
-    uint32_t offset = 0;
-    FlattenBVHTree(root, bvhNodes, &offset);
+    ParallelBuildBVH(buildData, bvhNodes, ordered);
 }
 
 void TriangleBvh::BuildBVH()
@@ -80,7 +69,6 @@ void TriangleBvh::BuildBVH()
 
     vector<BVHItem> buildData;
     buildData.reserve(faces.size());
-    vector<uint32_t> prims(faces.size());
     for (uint32_t i = 0; i < faces.size(); ++i) 
     {
         Vec3f &v0 = positions[faces[i][0]];
@@ -88,16 +76,9 @@ void TriangleBvh::BuildBVH()
         Vec3f &v2 = positions[faces[i][2]];
         Range3f bbox = ElementOperations::TriangleBoundingBox(v0, v1, v2);
         buildData.push_back(BVHItem(i, bbox));
-        prims[i] = i;
     }
 
-    ordered.reserve(faces.size());
-    uint64_t totalNodes = 0;
-    BVHBuildNode *root = RecursiveBuildBVH<uint32_t>(SPLIT_SAH, buildData.begin(), buildData.end(), &totalNodes, prims, ordered);
-
-    bvhNodes.resize(totalNodes);
-    uint32_t offset = 0;
-    FlattenBVHTree(root, bvhNodes, &offset);
+    ParallelBuildBVH(buildData, bvhNodes, ordered);
 }
 
 void SegmentBvh::BuildBVH()
@@ -107,7 +88,6 @@ void SegmentBvh::BuildBVH()
 
     vector<BVHItem> buildData;
     buildData.reserve(segments.size());
-    vector<uint32_t> prims(segments.size());
     for (uint32_t i = 0; i < segments.size(); ++i) 
     {
         Vec3f &v0 = positions[segments[i][0]];
@@ -115,16 +95,9 @@ void SegmentBvh::BuildBVH()
         float r = radius;
         Range3f bbox = ElementOperations::CylinderBoundingBox(v0, v1, r);
         buildData.push_back(BVHItem(i, bbox));
-        prims[i] = i;
     }
 
-    ordered.reserve(segments.size());
-    uint64_t totalNodes = 0;
-    BVHBuildNode *root = RecursiveBuildBVH<uint32_t>(SPLIT_SAH, buildData.begin(), buildData.end(), &totalNodes, prims, ordered);
-
-    bvhNodes.resize(totalNodes);
-    uint32_t offset = 0;
-    FlattenBVHTree(root, bvhNodes, &offset);
+    ParallelBuildBVH(buildData, bvhNodes, ordered);
 }
 
 
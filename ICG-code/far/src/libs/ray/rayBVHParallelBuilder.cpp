@@ -0,0 +1,235 @@
+#include "rayBVHParallelBuilder.h"
+#include <float.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+
+using tbb::blocked_range;
+using tbb::split;
+
+#define BVH_TRAVERSAL_COST      0.125f
+#define BVH_BIN_GRAIN           1024
+
+struct BVHBin
+{
+    BVHBin() : count(0), bounds(Range3f::Empty()), centroidBounds(Range3f::Empty()) {}
+    void Grow(const BVHBin &b)
+    {
+        count += b.count;
+        bounds.Grow(b.bounds);
+        centroidBounds.Grow(b.centroidBounds);
+    }
+    uint32_t        count;
+    Range3f         bounds;
+    Range3f         centroidBounds;
+};
+
+inline int BVHBinIndex(const BVHItem &item, int dim, float minCentroid, float scale)
+{
+    int b = (int)((item.centroid[dim] - minCentroid) * scale);
+    return b >= BVH_BINS ? BVH_BINS - 1 : (b < 0 ? 0 : b);
+}
+
+struct BVHBinning
+{
+    BVHBinning(const vector<BVHItem> &items, int dim, float minCentroid, float scale) 
+        : _items(items), _dim(dim), _minCentroid(minCentroid), _scale(scale) {}
+    BVHBinning(BVHBinning &b, split) 
+        : _items(b._items), _dim(b._dim), _minCentroid(b._minCentroid), _scale(b._scale) {}
+    void operator()(const blocked_range<uint32_t> &r)
+    {
+        for (uint32_t i = r.begin(); i != r.end(); i++)
+        {
+            const BVHItem &item = _items[i];
+            BVHBin &bin = bins[BVHBinIndex(item, _dim, _minCentroid, _scale)];
+            bin.count++;
+            bin.bounds.Grow(item.bbox);
+            bin.centroidBounds.Grow(item.centroid);
+        }
+    }
+    void join(const BVHBinning &b)
+    {
+        for (int i = 0; i < BVH_BINS; i++)
+            bins[i].Grow(b.bins[i]);
+    }
+    BVHBin                      bins[BVH_BINS];
+private:
+    const vector<BVHItem>       &_items;
+    int                         _dim;
+    float                       _minCentroid;
+    float                       _scale;
+};
+
+// Subtrees are laid out depth first in the node array: a node with n items owns
+// the 2n-1 slots starting at its own index, so both children can be written
+// concurrently. Slots left over by leaves with several items are removed by _Compact.
+class BVHParallelBuild
+{
+public:
+    BVHParallelBuild(vector<BVHItem> &items, vector<LinearBVHNode> &nodes) : _items(items), _nodes(nodes) {}
+
+    void Build(uint32_t start, uint32_t end, uint32_t nodeNum, const Range3f &bounds, const Range3f &centroidBounds) const
+    {
+        uint32_t nPrimitives = end - start;
+        LinearBVHNode &node = _nodes[nodeNum];
+        node.bounds = bounds;
+        if (nPrimitives == 1)
+        {
+            _InitLeaf(node, start, nPrimitives);
+            return;
+        }
+
+        int dim = centroidBounds.GetSize().MaxComponentIndex();
+        float minCentroid = centroidBounds.GetMin()[dim];
+        float extent = centroidBounds.GetMax()[dim] - minCentroid;
+        if (extent <= 0.0f)
+        {
+            // all centroids coincide, split by count to keep the leaves small
+            if (nPrimitives <= MAX_PRIMS_IN_NODE)
+            {
+                _InitLeaf(node, start, nPrimitives);
+                return;
+            }
+            uint32_t mid = start + nPrimitives / 2;
+            BVHBin left, right;
+            for (uint32_t i = start; i < end; i++)
+            {
+                BVHBin &b = i < mid ? left : right;
+                b.bounds.Grow(_items[i].bbox);
+                b.centroidBounds.Grow(_items[i].centroid);
+            }
+            _BuildChildren(node, nodeNum, dim, start, mid, end, left, right);
+            return;
+        }
+
+        float scale = BVH_BINS / extent;
+        BVHBinning binning(_items, dim, minCentroid, scale);
+        if (nPrimitives > BVH_PARALLEL_CUTOFF)
+            tbb::parallel_reduce(blocked_range<uint32_t>(start, end, BVH_BIN_GRAIN), binning);
+        else
+            binning(blocked_range<uint32_t>(start, end));
+
+        // sweep from both sides to cost every split plane
+        BVHBin leftAcc[BVH_BINS - 1];
+        BVHBin acc;
+        for (int i = 0; i < BVH_BINS - 1; i++)
+        {
+            acc.Grow(binning.bins[i]);
+            leftAcc[i] = acc;
+        }
+        float area = bounds.SurfaceArea();
+        float minCost = FLT_MAX;
+        int minCostSplit = 0;
+        BVHBin rightAcc, bestRight;
+        for (int i = BVH_BINS - 2; i >= 0; i--)
+        {
+            rightAcc.Grow(binning.bins[i + 1]);
+            if (!leftAcc[i].count || !rightAcc.count)
+                continue;
+            float cost = BVH_TRAVERSAL_COST + (leftAcc[i].count * leftAcc[i].bounds.SurfaceArea() + 
+                rightAcc.count * rightAcc.bounds.SurfaceArea()) / area;
+            if (cost < minCost)
+            {
+                minCost = cost;
+                minCostSplit = i;
+                bestRight = rightAcc;
+            }
+        }
+
+        if (nPrimitives <= MAX_PRIMS_IN_NODE && minCost >= nPrimitives)
+        {
+            _InitLeaf(node, start, nPrimitives);
+            return;
+        }
+
+        vector<BVHItem>::iterator mid = std::partition(_items.begin() + start, _items.begin() + end, 
+            [dim, minCentroid, scale, minCostSplit](const BVHItem &a) -> bool { 
+                return BVHBinIndex(a, dim, minCentroid, scale) <= minCostSplit; });
+        _BuildChildren(node, nodeNum, dim, start, (uint32_t)(mid - _items.begin()), end, leftAcc[minCostSplit], bestRight);
+    }
+
+private:
+    static void _InitLeaf(LinearBVHNode &node, uint32_t start, uint32_t nPrimitives)
+    {
+        node.primitivesOffset = start;
+        node.nPrimitives = nPrimitives;
+        node.axis = 0;
+    }
+
+    void _BuildChildren(LinearBVHNode &node, uint32_t nodeNum, int dim, uint32_t start, uint32_t mid, uint32_t end, 
+        const BVHBin &left, const BVHBin &right) const
+    {
+        assert(start < mid && mid < end);
+        uint32_t second = nodeNum + 2 * (mid - start);
+        node.axis = (uint8_t)dim;
+        node.nPrimitives = 0;
+        node.secondChildOffset = second;
+        if (end - start > BVH_PARALLEL_CUTOFF)
+        {
+            tbb::parallel_invoke(
+                [&]() { Build(start, mid, nodeNum + 1, left.bounds, left.centroidBounds); },
+                [&]() { Build(mid, end, second, right.bounds, right.centroidBounds); });
+        }
+        else
+        {
+            Build(start, mid, nodeNum + 1, left.bounds, left.centroidBounds);
+            Build(mid, end, second, right.bounds, right.centroidBounds);
+        }
+    }
+
+    vector<BVHItem>             &_items;
+    vector<LinearBVHNode>       &_nodes;
+};
+
+static uint32_t _Compact(const vector<LinearBVHNode> &src, uint32_t nodeNum, vector<LinearBVHNode> &dst)
+{
+    uint32_t offset = (uint32_t)dst.size();
+    dst.push_back(src[nodeNum]);
+    if (src[nodeNum].nPrimitives == 0)
+    {
+        _Compact(src, nodeNum + 1, dst);
+        dst[offset].secondChildOffset = _Compact(src, src[nodeNum].secondChildOffset, dst);
+    }
+    return offset;
+}
+
+void ParallelBuildBVH(vector<BVHItem> &items, vector<LinearBVHNode> &nodes, vector<uint32_t> &ordered)
+{
+    nodes.clear();
+    ordered.clear();
+    if (items.size() == 0)
+        return;
+
+    Range3f bounds = Range3f::Empty();
+    Range3f centroidBounds = Range3f::Empty();
+    for (uint32_t i = 0; i < items.size(); i++)
+    {
+        bounds.Grow(items[i].bbox);
+        centroidBounds.Grow(items[i].centroid);
+    }
+
+    vector<LinearBVHNode> slots(2 * items.size() - 1);
+    BVHParallelBuild(items, slots).Build(0, (uint32_t)items.size(), 0, bounds, centroidBounds);
+
+    nodes.reserve(slots.size());
+    _Compact(slots, 0, nodes);
+
+    ordered.resize(items.size());
+    for (uint32_t i = 0; i < items.size(); i++)
+        ordered[i] = items[i].idx;
+}
+
+float ComputeBVHSAHCost(const vector<LinearBVHNode> &nodes)
+{
+    if (nodes.size() == 0)
+        return 0.0f;
+
+    double cost = 0.0;
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        const LinearBVHNode &node = nodes[i];
+        float area = node.bounds.SurfaceArea();
+        cost += node.nPrimitives ? node.nPrimitives * area : BVH_TRAVERSAL_COST * area;
+    }
+    return (float)(cost / nodes[0].bounds.SurfaceArea());
+}
@@ -0,0 +1,17 @@
+#ifndef _RAY_BVH_PARALLEL_BUILDER_H_
+#define _RAY_BVH_PARALLEL_BUILDER_H_
+#include "rayBVHEngineData.h"
+
+#define BVH_BINS                16
+#define BVH_PARALLEL_CUTOFF     4096
+
+// Task-parallel binned SAH build. Reorders items so that every leaf covers a
+// contiguous range, writes the flattened tree into nodes (depth first, first
+// child right after its parent) and the item indices in leaf order into ordered.
+void        ParallelBuildBVH(vector<BVHItem> &items, vector<LinearBVHNode> &nodes, vector<uint32_t> &ordered);
+
+// SAH cost of a flattened tree relative to the root area, using the builders'
+// 0.125 traversal cost for interior nodes and one per primitive in leaves
+float       ComputeBVHSAHCost(const vector<LinearBVHNode> &nodes);
+
+#endif // _RAY_BVH_PARALLEL_BUILDER_H_
@@ -14,6 +14,7 @@ public:
     // contract: intersection is modified iff the ray hits
     virtual bool Intersect(const Ray& ray, Intersection* intersection);
     virtual bool IntersectAny(const Ray& ray) { return _engine->IntersectAny(ray); }
+    virtual void IntersectAnyBatch(const Ray* rays, uint32_t nRays, uint32_t* occluded) { _engine->IntersectAnyBatch(rays, nRays, occluded); }
 
     virtual void CollectStats(StatsManager& stats) { _engine->CollectStats(stats); }
 
@@ -5,6 +5,9 @@
 #include "rayListEngineBuilder.h"
 #include "rayBVHEngineBuilder.h"
 
+// meshes in the default engine use the 4-wide BVH
+#define RAY_WIDE_BVH true
+
 shared_ptr<RayEngine> RayEngine::BuildDefault(
     const vector<shared_ptr<Surface> >& surfaces, 
     const vector<shared_ptr<InstanceGroup> >& instances,
@@ -22,9 +25,20 @@ shared_ptr<RayEngine> RayEngine::BuildDefault(
 
         return shared_ptr<rayDoubleSidedEngine>(
             new rayDoubleSidedEngine(
-            shared_ptr<RayEngine>(RayBVHEngineBuilder().Build(surfaces, instances, time, timeSamples))));
+            shared_ptr<RayEngine>(RayBVHEngineBuilder(RAY_WIDE_BVH).Build(surfaces, instances, time, timeSamples))));
 
         //return RayTesselatedKdTreeFastEngineBuilder().Build(surfaces, instances, time, timeSamples);
         // return RayPrimitiveBVHEngineBuilder().Build(surfaces, instances, time, timeSamples);
         // return RayTesselatedBVHEngineBuilder().Build(surfaces, instances, time, timeSamples);
 }
+
+void RayEngine::IntersectAnyBatch(const Ray* rays, uint32_t nRays, uint32_t* occluded)
+{
+    for (uint32_t w = 0; w < RAY_BATCH_MASK_WORDS(nRays); w++)
+        occluded[w] = 0;
+    for (uint32_t i = 0; i < nRays; i++)
+    {
+        if (IntersectAny(rays[i]))
+            occluded[i >> 5] |= 1u << (i & 31);
+    }
+}
@@ -6,6 +6,8 @@
 #include <ray/intersection.h>
 #include <misc/stats.h>
 
+#define RAY_BATCH_MASK_WORDS(n) (((n) + 31) >> 5)
+
 class RayEngine {
 public:
     // valid interval for time vaiations
@@ -15,6 +17,10 @@ public:
     virtual bool Intersect(const Ray& ray, Intersection* intersection) = 0;
     virtual bool IntersectAny(const Ray& ray) = 0;
 
+    // batched visibility: bit i of occluded is set iff rays[i] hits anything.
+    // occluded holds RAY_BATCH_MASK_WORDS(nRays) words and is fully overwritten.
+    virtual void IntersectAnyBatch(const Ray* rays, uint32_t nRays, uint32_t* occluded);
+
     virtual void CollectStats(StatsManager& stats) = 0;
 
     // these are very slow and should be cached by the caller
@@ -48,4 +54,13 @@ private:
     explicit RayEngineX(const RayEngineX &e) {}
 };
 
+// RayEngineX for nodes that trace ray batches themselves instead of one ray at a time
+template<typename T>
+class RayEngineBatchX : public RayEngineX<T>
+{
+public:
+    RayEngineBatchX(const T &tt) : RayEngineX<T>(tt) {}
+    virtual void        IntersectAnyBatch(const Ray* rays, uint32_t nRays, uint32_t* occluded) { this->t.IntersectAnyBatch(rays, nRays, occluded); }
+};
+
 #endif
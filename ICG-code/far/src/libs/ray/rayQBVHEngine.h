@@ -0,0 +1,352 @@
+#ifndef _RAY_QBVH_ENGINE_H_
+#define _RAY_QBVH_ENGINE_H_
+
+#include "rayEngine.h"
+#include <scene/xform.h>
+#include <scene/shape_mesh.h>
+#include <scene/intersectionMethods.h>
+#include "rayQBVHEngineData.h"
+
+class RayBVHEngineBuilder;
+
+// rays traced together by IntersectAnyBatch, one mask bit per ray
+#define QBVH_PACKET_SIZE 32
+
+// ray data splatted across the four SSE lanes
+struct QbvhRay
+{
+    QbvhRay() {}
+    QbvhRay(const Ray &ray) { Init(ray); }
+    void Init(const Ray &ray)
+    {
+        for (uint32_t a = 0; a < 3; a++)
+        {
+            org[a] = _mm_set1_ps(ray.E[a]);
+            dir[a] = _mm_set1_ps(ray.D[a]);
+            invDir[a] = _mm_set1_ps(1.f / ray.D[a]);
+            dirIsNeg[a] = ray.D[a] < 0;
+        }
+        tMin = _mm_set1_ps(ray.tMin);
+        tMax = _mm_set1_ps(ray.tMax);
+    }
+    __m128      org[3];
+    __m128      dir[3];
+    __m128      invDir[3];
+    __m128      tMin;
+    __m128      tMax;
+    uint32_t    dirIsNeg[3];
+};
+
+// slab test of one ray against the four children, returns a lane mask
+inline int IntersectQBVHBoundingBoxes(const QBVHNode &node, const QbvhRay &ray)
+{
+    __m128 t0 = ray.tMin;
+    __m128 t1 = ray.tMax;
+    for (uint32_t a = 0; a < 3; a++)
+    {
+        __m128 tNear = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bboxes[  ray.dirIsNeg[a]][a]), ray.org[a]), ray.invDir[a]);
+        __m128 tFar  = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bboxes[1-ray.dirIsNeg[a]][a]), ray.org[a]), ray.invDir[a]);
+        // keep the accumulated value when the product is NaN
+        t0 = _mm_max_ps(tNear, t0);
+        t1 = _mm_min_ps(tFar, t1);
+    }
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+// same test as IntersectTriangle, for four triangles at once
+inline int IntersectQTriangle4(const QTriangle4 &tri, const QbvhRay &ray, float t[4], float b1[4], float b2[4])
+{
+    __m128 e1x = _mm_load_ps(tri.e1[0]), e1y = _mm_load_ps(tri.e1[1]), e1z = _mm_load_ps(tri.e1[2]);
+    __m128 e2x = _mm_load_ps(tri.e2[0]), e2y = _mm_load_ps(tri.e2[1]), e2z = _mm_load_ps(tri.e2[2]);
+
+    // s1 = D ^ e2
+    __m128 s1x = _mm_sub_ps(_mm_mul_ps(ray.dir[1], e2z), _mm_mul_ps(ray.dir[2], e2y));
+    __m128 s1y = _mm_sub_ps(_mm_mul_ps(ray.dir[2], e2x), _mm_mul_ps(ray.dir[0], e2z));
+    __m128 s1z = _mm_sub_ps(_mm_mul_ps(ray.dir[0], e2y), _mm_mul_ps(ray.dir[1], e2x));
+    __m128 divisor = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s1x, e1x), _mm_mul_ps(s1y, e1y)), _mm_mul_ps(s1z, e1z));
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 valid = _mm_cmpneq_ps(divisor, zero);
+    __m128 invDivisor = _mm_div_ps(one, divisor);
+
+    // d = E - v0
+    __m128 dx = _mm_sub_ps(ray.org[0], _mm_load_ps(tri.v0[0]));
+    __m128 dy = _mm_sub_ps(ray.org[1], _mm_load_ps(tri.v0[1]));
+    __m128 dz = _mm_sub_ps(ray.org[2], _mm_load_ps(tri.v0[2]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, s1x), _mm_mul_ps(dy, s1y)), _mm_mul_ps(dz, s1z)), invDivisor);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+    // s2 = d ^ e1
+    __m128 s2x = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+    __m128 s2y = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+    __m128 s2z = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ray.dir[0], s2x), _mm_mul_ps(ray.dir[1], s2y)), _mm_mul_ps(ray.dir[2], s2z)), invDivisor);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, s2x), _mm_mul_ps(e2y, s2y)), _mm_mul_ps(e2z, s2z)), invDivisor);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tt, ray.tMin), _mm_cmple_ps(tt, ray.tMax)));
+
+    int mask = _mm_movemask_ps(valid);
+    if (mask)
+    {
+        _mm_storeu_ps(t, tt);
+        _mm_storeu_ps(b1, u);
+        _mm_storeu_ps(b2, v);
+    }
+    return mask;
+}
+
+template<typename NormOp, typename UvOp>
+struct QbvhEngineMeshNode
+{
+    friend class RayBVHEngineBuilder;
+public:
+    QbvhEngineMeshNode() : _xform(NULL), _material(NULL) {}
+    QbvhEngineMeshNode(Xform* xform, Material* material, shared_ptr<TriangleQbvh> data) : _xform(xform), _material(material), _ref(data), _data(data.get()) {}
+    Intervalf ValidInterval() { return Intervalf::Invalid(); }
+    bool Intersect(const Ray& r, Intersection* isect)
+    {
+        if (!_data->nodes.size())
+            return false;
+
+        Ray ray = r;
+        ray.Transform(_xform->GetInverseTransform(r.time));
+        QbvhRay qray(ray);
+
+        const QBVHNode *nodes = _data->nodes.data();
+        const QTriangle4 *tris = _data->triangles.data();
+        uint32_t hitFace = QBVH_EMPTY;
+        float hitT = ray.tMax, hitB1 = 0.0f, hitB2 = 0.0f;
+        float t[4], b1[4], b2[4];
+
+        uint32_t todo[128];
+        uint32_t todoOffset = 0;
+        todo[todoOffset++] = 0;
+        while (todoOffset)
+        {
+            const QBVHNode &node = nodes[todo[--todoOffset]];
+            int hitMask = IntersectQBVHBoundingBoxes(node, qray);
+            if (!hitMask)
+                continue;
+
+            // interior children go on the stack far first, leaves are intersected near first
+            uint32_t slots[4];
+            uint32_t nSlots = 0;
+            _OrderedSlots(node, hitMask, qray.dirIsNeg, slots, nSlots);
+            for (int k = (int)nSlots - 1; k >= 0; k--)
+            {
+                uint32_t child = node.children[slots[k]];
+                if (!(child & QBVH_LEAF))
+                    todo[todoOffset++] = child;
+            }
+            for (uint32_t k = 0; k < nSlots; k++)
+            {
+                uint32_t slot = slots[k];
+                uint32_t child = node.children[slot];
+                if (!(child & QBVH_LEAF))
+                    continue;
+                const QTriangle4 *block = &tris[child & ~QBVH_LEAF];
+                for (uint32_t b = 0; b < node.nBlocks[slot]; b++)
+                {
+                    int triMask = IntersectQTriangle4(block[b], qray, t, b1, b2);
+                    for (uint32_t l = 0; l < 4; l++)
+                    {
+                        if ((triMask & (1 << l)) && t[l] < hitT && _material->CheckAlpha(Vec2f(b1[l], b2[l]), 0.5f))
+                        {
+                            hitT = t[l];
+                            hitB1 = b1[l];
+                            hitB2 = b2[l];
+                            hitFace = block[b].faces[l];
+                            qray.tMax = _mm_set1_ps(hitT);
+                        }
+                    }
+                }
+            }
+        }
+
+        if (hitFace == QBVH_EMPTY)
+            return false;
+
+        const Vec3i &face = _data->faces[hitFace];
+        carray<Vec3f> &pos = _data->positions;
+        DifferentialGeometry &dp = isect->dp;
+        dp.P = ray.Eval(hitT);
+        dp.uv = Vec2f(hitB1, hitB2);
+        dp.Ng = ElementOperations::TriangleNormal(pos[face[0]], pos[face[1]], pos[face[2]]);
+        dp.N = NormOp::ComputeNormal(_data, dp, hitB1, hitB2, face);
+        dp.GenerateTuTv();
+        dp.st = UvOp::ComputeTexcoord(_data, dp, hitB1, hitB2, face);
+        isect->rayEpsilon = 1e-3f * hitT;
+        isect->t = hitT;
+        isect->m = _material;
+        isect->Transform(_xform->GetTransform(ray.time));
+        return true;
+    }
+
+    bool IntersectAny(const Ray& r)
+    {
+        if (!_data->nodes.size() || (_material->IntersectOption() & IOPT_IGNORE_SHADOW))
+            return false;
+
+        Ray ray = r;
+        ray.Transform(_xform->GetInverseTransform(r.time));
+        QbvhRay qray(ray);
+
+        const QBVHNode *nodes = _data->nodes.data();
+        const QTriangle4 *tris = _data->triangles.data();
+        float t[4], b1[4], b2[4];
+
+        uint32_t todo[128];
+        uint32_t todoOffset = 0;
+        todo[todoOffset++] = 0;
+        while (todoOffset)
+        {
+            const QBVHNode &node = nodes[todo[--todoOffset]];
+            int hitMask = IntersectQBVHBoundingBoxes(node, qray);
+            for (uint32_t slot = 0; slot < 4; slot++)
+            {
+                if (!(hitMask & (1 << slot)))
+                    continue;
+                uint32_t child = node.children[slot];
+                if (!(child & QBVH_LEAF))
+                {
+                    todo[todoOffset++] = child;
+                    continue;
+                }
+                const QTriangle4 *block = &tris[child & ~QBVH_LEAF];
+                for (uint32_t b = 0; b < node.nBlocks[slot]; b++)
+                {
+                    int triMask = IntersectQTriangle4(block[b], qray, t, b1, b2);
+                    for (uint32_t l = 0; l < 4; l++)
+                    {
+                        if ((triMask & (1 << l)) && _material->CheckAlpha(Vec2f(b1[l], b2[l]), 0.5f))
+                            return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    // packets of rays share the node fetches, each node entry carries the
+    // mask of the rays that hit its box and rays leave the packet once occluded
+    void IntersectAnyBatch(const Ray* rays, uint32_t nRays, uint32_t* occluded)
+    {
+        for (uint32_t w = 0; w < RAY_BATCH_MASK_WORDS(nRays); w++)
+            occluded[w] = 0;
+        if (!_data->nodes.size() || (_material->IntersectOption() & IOPT_IGNORE_SHADOW))
+            return;
+
+        const QBVHNode *nodes = _data->nodes.data();
+        const QTriangle4 *tris = _data->triangles.data();
+        float t[4], b1[4], b2[4];
+        QbvhRay packet[QBVH_PACKET_SIZE];
+        for (uint32_t start = 0; start < nRays; start += QBVH_PACKET_SIZE)
+        {
+            uint32_t n = min<uint32_t>(QBVH_PACKET_SIZE, nRays - start);
+            for (uint32_t i = 0; i < n; i++)
+            {
+                Ray ray = rays[start + i];
+                ray.Transform(_xform->GetInverseTransform(ray.time));
+                packet[i].Init(ray);
+            }
+            uint32_t all = n >= QBVH_PACKET_SIZE ? 0xffffffffu : (1u << n) - 1;
+            uint32_t active = all;
+
+            uint32_t todo[128], todoMask[128];
+            uint32_t todoOffset = 0;
+            todo[todoOffset] = 0;
+            todoMask[todoOffset++] = active;
+            while (todoOffset && active)
+            {
+                --todoOffset;
+                const QBVHNode &node = nodes[todo[todoOffset]];
+                uint32_t mask = todoMask[todoOffset] & active;
+                uint32_t slotMask[4] = { 0, 0, 0, 0 };
+                for (uint32_t r = 0; r < n; r++)
+                {
+                    if (!(mask & (1u << r)))
+                        continue;
+                    int hitMask = IntersectQBVHBoundingBoxes(node, packet[r]);
+                    for (uint32_t slot = 0; slot < 4; slot++)
+                    {
+                        if (hitMask & (1 << slot))
+                            slotMask[slot] |= 1u << r;
+                    }
+                }
+
+                for (uint32_t slot = 0; slot < 4; slot++)
+                {
+                    if (!slotMask[slot])
+                        continue;
+                    uint32_t child = node.children[slot];
+                    if (!(child & QBVH_LEAF))
+                    {
+                        todo[todoOffset] = child;
+                        todoMask[todoOffset++] = slotMask[slot];
+                        continue;
+                    }
+                    const QTriangle4 *block = &tris[child & ~QBVH_LEAF];
+                    for (uint32_t b = 0; b < node.nBlocks[slot] && (slotMask[slot] & active); b++)
+                    {
+                        for (uint32_t r = 0; r < n; r++)
+                        {
+                            uint32_t bit = 1u << r;
+                            if (!(slotMask[slot] & active & bit))
+                                continue;
+                            int triMask = IntersectQTriangle4(block[b], packet[r], t, b1, b2);
+                            for (uint32_t l = 0; l < 4; l++)
+                            {
+                                if ((triMask & (1 << l)) && _material->CheckAlpha(Vec2f(b1[l], b2[l]), 0.5f))
+                                {
+                                    active &= ~bit;
+                                    break;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            // packets start on a word boundary since QBVH_PACKET_SIZE is 32
+            occluded[start >> 5] = all & ~active;
+        }
+    }
+
+    void CollectStats(StatsManager& stats)
+    {
+        StatsCounterVariable* primitives = stats.GetVariable<StatsCounterVariable>("Ray", "Primitives");
+        primitives->Increment(_data->faces.size());
+    }
+
+    Range3f ComputeBoundingBox()
+    {
+        return _data->nodes.size() ? _xform->GetTransform(0.0f).TransformBBox(_data->bounds) : Range3f();
+    }
+
+    float ComputeAverageArea() {  throw std::exception(); }
+private:
+    // hit children in front to back order along the collapsed split axes
+    static void _OrderedSlots(const QBVHNode &node, int hitMask, const uint32_t dirIsNeg[3], uint32_t slots[4], uint32_t &nSlots)
+    {
+        uint32_t pair0 = dirIsNeg[node.axes[0]];
+        for (uint32_t p = 0; p < 2; p++)
+        {
+            uint32_t pair = p ^ pair0;
+            uint32_t first = dirIsNeg[node.axes[1 + pair]];
+            for (uint32_t c = 0; c < 2; c++)
+            {
+                uint32_t slot = pair * 2 + (c ^ first);
+                if (hitMask & (1 << slot))
+                    slots[nSlots++] = slot;
+            }
+        }
+    }
+
+    Xform                       *_xform;
+    Material                    *_material;
+    TriangleQbvh                *_data;  //This cache the pointer to avoid evaluate share_ptr every time.
+    shared_ptr<TriangleQbvh>     _ref;   //Hold the obj ref to avoid deletion
+};
+
+#endif // _RAY_QBVH_ENGINE_H_
@@ -0,0 +1,159 @@
+#include "rayQBVHEngineData.h"
+#include <float.h>
+
+static void _SetEmptySlot(QBVHNode &node, uint32_t slot)
+{
+    for (uint32_t a = 0; a < 3; a++)
+    {
+        node.bboxes[0][a][slot] = FLT_MAX;
+        node.bboxes[1][a][slot] = -FLT_MAX;
+    }
+    node.children[slot] = QBVH_EMPTY;
+    node.nBlocks[slot] = 0;
+}
+
+static void _SetSlotBounds(QBVHNode &node, uint32_t slot, const Range3f &bounds)
+{
+    for (uint32_t a = 0; a < 3; a++)
+    {
+        node.bboxes[0][a][slot] = bounds.GetMin()[a];
+        node.bboxes[1][a][slot] = bounds.GetMax()[a];
+    }
+}
+
+// collects the faces below binNode, fails once there are more than limit
+static bool _CollectSubtree(const TriangleBvh &bvh, uint32_t binNode, uint32_t limit, vector<uint32_t> &prims)
+{
+    const LinearBVHNode &node = bvh.bvhNodes[binNode];
+    if (node.nPrimitives == 0)
+        return _CollectSubtree(bvh, binNode + 1, limit, prims) && 
+            _CollectSubtree(bvh, node.secondChildOffset, limit, prims);
+    for (uint32_t i = 0; i < node.nPrimitives; i++)
+        prims.push_back(bvh.ordered[node.primitivesOffset + i]);
+    return prims.size() <= limit;
+}
+
+uint32_t TriangleQbvh::_CollapseChild(const TriangleBvh &bvh, uint32_t binNode, uint16_t *nBlocks, 
+    vector<QBVHNode> &qnodes, vector<QTriangle4> &tris)
+{
+    // binary leaves and subtrees that fit in one block become a single leaf
+    vector<uint32_t> prims;
+    if (!_CollectSubtree(bvh, binNode, 4, prims) && bvh.bvhNodes[binNode].nPrimitives == 0)
+    {
+        *nBlocks = 0;
+        return _CollapseNode(bvh, binNode, qnodes, tris);
+    }
+    uint32_t nPrimitives = (uint32_t)prims.size();
+
+    // pack the leaf triangles four at a time
+    uint32_t first = (uint32_t)tris.size();
+    uint32_t blocks = (nPrimitives + 3) / 4;
+    assert(blocks < 0x10000);
+    tris.resize(first + blocks);
+    for (uint32_t b = 0; b < blocks; b++)
+    {
+        QTriangle4 &q = tris[first + b];
+        for (uint32_t k = 0; k < 4; k++)
+        {
+            uint32_t i = b * 4 + k;
+            if (i < nPrimitives)
+            {
+                uint32_t f = prims[i];
+                const Vec3f &v0 = positions[faces[f][0]];
+                Vec3f e1 = positions[faces[f][1]] - v0;
+                Vec3f e2 = positions[faces[f][2]] - v0;
+                for (uint32_t a = 0; a < 3; a++)
+                {
+                    q.v0[a][k] = v0[a];
+                    q.e1[a][k] = e1[a];
+                    q.e2[a][k] = e2[a];
+                }
+                q.faces[k] = f;
+            }
+            else
+            {
+                for (uint32_t a = 0; a < 3; a++)
+                    q.v0[a][k] = q.e1[a][k] = q.e2[a][k] = 0.0f;
+                q.faces[k] = QBVH_EMPTY;
+            }
+        }
+    }
+    *nBlocks = (uint16_t)blocks;
+    return QBVH_LEAF | first;
+}
+
+uint32_t TriangleQbvh::_CollapseNode(const TriangleBvh &bvh, uint32_t binNode, vector<QBVHNode> &qnodes, vector<QTriangle4> &tris)
+{
+    uint32_t idx = (uint32_t)qnodes.size();
+    qnodes.push_back(QBVHNode());
+    const LinearBVHNode &node = bvh.bvhNodes[binNode];
+
+    // binary nodes that end up in the four slots
+    uint32_t slots[4] = { QBVH_EMPTY, QBVH_EMPTY, QBVH_EMPTY, QBVH_EMPTY };
+    uint8_t axes[3] = { 0, 0, 0 };
+    if (node.nPrimitives > 0)
+        slots[0] = binNode;
+    else
+    {
+        axes[0] = node.axis;
+        uint32_t sides[2] = { binNode + 1, node.secondChildOffset };
+        for (uint32_t s = 0; s < 2; s++)
+        {
+            const LinearBVHNode &side = bvh.bvhNodes[sides[s]];
+            if (side.nPrimitives > 0)
+                slots[s * 2] = sides[s];
+            else
+            {
+                axes[s + 1] = side.axis;
+                slots[s * 2] = sides[s] + 1;
+                slots[s * 2 + 1] = side.secondChildOffset;
+            }
+        }
+    }
+
+    uint32_t children[4];
+    uint16_t nBlocks[4];
+    for (uint32_t s = 0; s < 4; s++)
+    {
+        if (slots[s] != QBVH_EMPTY)
+            children[s] = _CollapseChild(bvh, slots[s], &nBlocks[s], qnodes, tris);
+    }
+
+    // qnodes may have been reallocated by the recursion
+    QBVHNode &qnode = qnodes[idx];
+    for (uint32_t s = 0; s < 4; s++)
+    {
+        if (slots[s] == QBVH_EMPTY)
+            _SetEmptySlot(qnode, s);
+        else
+        {
+            _SetSlotBounds(qnode, s, bvh.bvhNodes[slots[s]].bounds);
+            qnode.children[s] = children[s];
+            qnode.nBlocks[s] = nBlocks[s];
+        }
+    }
+    for (uint32_t a = 0; a < 3; a++)
+        qnode.axes[a] = axes[a];
+    return idx;
+}
+
+void TriangleQbvh::BuildQBVH()
+{
+    if (faces.size() == 0)
+        return;
+
+    // collapse the binary SAH tree, it is only kept during the build
+    TriangleBvh bvh(positions, normals, uvs, faces);
+    bounds = bvh.bvhNodes[0].bounds;
+
+    vector<QBVHNode> qnodes;
+    vector<QTriangle4> tris;
+    qnodes.reserve(bvh.bvhNodes.size() / 2 + 1);
+    tris.reserve(faces.size() / 4 + 1);
+    _CollapseNode(bvh, 0, qnodes, tris);
+
+    nodes.resize((uint32_t)qnodes.size());
+    std::copy(qnodes.begin(), qnodes.end(), nodes.data());
+    triangles.resize((uint32_t)tris.size());
+    std::copy(tris.begin(), tris.end(), triangles.data());
+}
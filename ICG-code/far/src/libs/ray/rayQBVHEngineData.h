@@ -0,0 +1,52 @@
+#ifndef _RAY_QBVH_ENGINE_DATA_H_
+#define _RAY_QBVH_ENGINE_DATA_H_
+#include <stdint.h>
+#include <xmmintrin.h>
+#include <misc/stdcommon.h>
+#include <misc/arrays.h>
+#include "rayBVHEngineData.h"
+
+#define QBVH_EMPTY      0xffffffffu
+#define QBVH_LEAF       0x80000000u
+
+// 4-wide BVH node collapsed from two levels of the binary tree.
+// Child bounds are stored SoA so one ray is tested against all four at once.
+struct QBVHNode
+{
+    float       bboxes[2][3][4];    // [min/max][xyz][child]
+    uint32_t    children[4];        // interior: node index, leaf: QBVH_LEAF | first block, QBVH_EMPTY: unused
+    uint16_t    nBlocks[4];         // leaf: number of QTriangle4 blocks
+    uint8_t     axes[3];            // split axes: top level, children 0-1, children 2-3
+    uint8_t     pad[5];
+};
+
+// four triangles in SoA layout, unused lanes have degenerate edges
+struct QTriangle4
+{
+    float       v0[3][4];
+    float       e1[3][4];
+    float       e2[3][4];
+    uint32_t    faces[4];
+};
+
+struct TriangleQbvh
+{
+    TriangleQbvh(carray<Vec3f> &pos, carray<Vec3f> &norm, carray<Vec2f> &texcoord, carray<Vec3i> &fs)
+        : positions(pos), faces(fs), normals(norm), uvs(texcoord)
+    {
+        BuildQBVH();
+    }
+    carray<Vec3f>           &positions;
+    carray<Vec3i>           &faces;
+    carray<Vec2f>           &uvs;
+    carray<Vec3f>           &normals;
+    Range3f                 bounds;
+    acarray<QBVHNode>       nodes;
+    acarray<QTriangle4>     triangles;
+    void                    BuildQBVH();
+private:
+    uint32_t                _CollapseChild(const TriangleBvh &bvh, uint32_t binNode, uint16_t *nBlocks, vector<QBVHNode> &qnodes, vector<QTriangle4> &tris);
+    uint32_t                _CollapseNode(const TriangleBvh &bvh, uint32_t binNode, vector<QBVHNode> &qnodes, vector<QTriangle4> &tris);
+};
+
+#endif // _RAY_QBVH_ENGINE_DATA_H_
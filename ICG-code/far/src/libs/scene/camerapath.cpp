@@ -0,0 +1,41 @@
+#include "camerapath.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+bool CameraPath::Load(const string& filename) {
+    keyframes.clear();
+    std::ifstream fin(filename.c_str());
+    string line;
+    while(std::getline(fin, line)) {
+        std::istringstream sin(line);
+        Keyframe k;
+        if(sin >> k.eye.x >> k.eye.y >> k.eye.z >> k.target.x >> k.target.y >> k.target.z >> k.up.x >> k.up.y >> k.up.z)
+            keyframes.push_back(k);
+    }
+    return !keyframes.empty();
+}
+
+uint32_t CameraPath::FrameCount() const {
+    if(keyframes.empty()) return 0;
+    return static_cast<uint32_t>(keyframes.size() - 1) * (inbetween + 1) + 1;
+}
+
+void CameraPath::SetFrame(Camera* camera, uint32_t frame) const {
+    uint32_t k = frame / (inbetween + 1);
+    float t = (frame % (inbetween + 1)) / (float)(inbetween + 1);
+    const Keyframe& k0 = keyframes[k];
+    const Keyframe& k1 = keyframes[min(k + 1, static_cast<uint32_t>(keyframes.size() - 1))];
+
+    XformStaticLookAt* lookAt = dynamic_cast<XformStaticLookAt*>(camera->XformRef().get());
+    bool flipz = lookAt ? lookAt->Flipz() : true;
+    camera->XformRef() = shared_ptr<Xform>(new XformStaticLookAt(
+        k0.eye * (1 - t) + k1.eye * t, k0.target * (1 - t) + k1.target * t,
+        (k0.up * (1 - t) + k1.up * t).GetNormalized(), flipz));
+}
+
+string CameraPath::FrameFilename(const string& filename, uint32_t frame) {
+    std::ostringstream sout;
+    sout << filename << "." << std::setw(4) << std::setfill('0') << frame;
+    return sout.str();
+}
@@ -0,0 +1,36 @@
+#ifndef _CAMERAPATH_H_
+#define _CAMERAPATH_H_
+
+#include "camera.h"
+#include "xform_static.h"
+
+// Camera keyframes of a fly-through over a static scene, read from a text
+// file with one keyframe per line as
+//     eye.x eye.y eye.z target.x target.y target.z up.x up.y up.z
+// Inbetween frames are linearly interpolated between consecutive keyframes.
+class CameraPath {
+public:
+    CameraPath(uint32_t inbetween = 0) : inbetween(inbetween) { }
+
+    // false when the file is missing or holds no keyframe
+    bool Load(const string& filename);
+
+    uint32_t FrameCount() const;
+    // points camera at frame, keeping the flipz of a lookat xform
+    void SetFrame(Camera* camera, uint32_t frame) const;
+
+    // filename with the zero padded frame number appended, as "image.0003"
+    static string FrameFilename(const string& filename, uint32_t frame);
+
+protected:
+    struct Keyframe {
+        Vec3f eye;
+        Vec3f target;
+        Vec3f up;
+    };
+
+    vector<Keyframe> keyframes;
+    uint32_t inbetween;
+};
+
+#endif
@@ -0,0 +1,138 @@
+//////////////////////////////////////////////////////////////////////////
+//!
+//!	\file    main.cpp
+//!
+//!	\brief   BVH build benchmark, compares the recursive and the parallel
+//!          binned SAH builders on the triangles of a set of scenes
+//!
+//////////////////////////////////////////////////////////////////////////
+#include <tclap/CmdLine.h>
+using namespace TCLAP;
+
+#include <float.h>
+
+#include <misc/timer.h>
+#include <scene/scene.h>
+#include <scene/scenearchive.h>
+#include <scene/shape_mesh.h>
+#include <scene/xform.h>
+#include <ray/rayBVHEngineData.h>
+#include <ray/rayBVHParallelBuilder.h>
+
+static void _CollectMesh(shared_ptr<Shape> shape, Xform *xform, vector<BVHItem> &items)
+{
+    shared_ptr<MeshShape> mesh = dynamic_pointer_cast<MeshShape>(shape);
+    if (!mesh)
+        return;
+    Matrix4d m = xform->GetTransform(0.0f);
+    carray<Vec3f> &pos = mesh->PosArray();
+    carray<Vec3i> &faces = mesh->FaceArray();
+    for (uint32_t i = 0; i < faces.size(); i++)
+    {
+        Vec3f v0 = m.TransformPoint(pos[faces[i][0]]);
+        Vec3f v1 = m.TransformPoint(pos[faces[i][1]]);
+        Vec3f v2 = m.TransformPoint(pos[faces[i][2]]);
+        items.push_back(BVHItem((uint32_t)items.size(), ElementOperations::TriangleBoundingBox(v0, v1, v2)));
+    }
+}
+
+static void _DeleteBuildTree(BVHBuildNode *node)
+{
+    if (!node)
+        return;
+    _DeleteBuildTree(node->children[0]);
+    _DeleteBuildTree(node->children[1]);
+    delete node;
+}
+
+static void _Report(const string &name, uint64_t nodes, double time, float cost)
+{
+    cout << "    " << name << ": " << nodes << " nodes, "
+        << time << " sec, SAH cost " << cost << endl;
+}
+
+int main(int argc, char** argv) {
+    vector<string> filenameScenes;
+    int runs = 3;
+
+    CmdLine cmd("bvh build benchmark: ", ' ', "none", false);
+    try {
+        SwitchArg helpArg("?", "help", "help message", cmd, false);
+        ValueArg<int> runsArg("r", "runs", "builds per scene, best time is reported", false, runs, "int", cmd);
+        UnlabeledMultiArg<string> filenameScenesArg("scenes", "scene filenames", true, "string", cmd);
+
+        cmd.parse(argc, argv);
+
+        if(helpArg.getValue()) StdOutput().usage(cmd);
+
+        filenameScenes = filenameScenesArg.getValue();
+        runs = max(1, runsArg.getValue());
+    } catch(ArgException &e) {
+        StdOutput().usage(cmd);
+        cerr << "error: " << e.error() << endl << " for arg " << e.argId() << endl;
+        return 1;
+    }
+
+    for (uint32_t s = 0; s < filenameScenes.size(); s++)
+    {
+        shared_ptr<Scene> scene;
+        SceneArchive::load(filenameScenes[s], scene);
+
+        vector<BVHItem> items;
+        vector<shared_ptr<Surface> > &surfaces = scene->Surfaces();
+        for (uint32_t i = 0; i < surfaces.size(); i++)
+            _CollectMesh(surfaces[i]->ShapeRef(), surfaces[i]->XformRef().get(), items);
+        vector<shared_ptr<InstanceGroup> > &instances = scene->Instances();
+        for (uint32_t i = 0; i < instances.size(); i++)
+        {
+            vector<shared_ptr<Xform> > &xforms = instances[i]->XformArray();
+            for (uint32_t j = 0; j < xforms.size(); j++)
+                _CollectMesh(instances[i]->ShapeRef(), xforms[j].get(), items);
+        }
+
+        cout << filenameScenes[s] << ": " << items.size() << " triangles" << endl;
+        if (items.empty())
+            continue;
+
+        vector<uint32_t> prims(items.size());
+        for (uint32_t i = 0; i < prims.size(); i++)
+            prims[i] = i;
+
+        // both builders reorder their input, every run starts from a fresh copy
+        double recursiveTime = DBL_MAX, parallelTime = DBL_MAX;
+        vector<LinearBVHNode> recursiveNodes, parallelNodes;
+        for (int r = 0; r < runs; r++)
+        {
+            vector<BVHItem> buildData = items;
+            vector<uint32_t> ordered;
+            ordered.reserve(prims.size());
+            uint64_t totalNodes = 0;
+
+            Timer timer;
+            timer.Start();
+            BVHBuildNode *root = RecursiveBuildBVH<uint32_t>(SPLIT_SAH, buildData.begin(), buildData.end(), &totalNodes, prims, ordered);
+            recursiveNodes.resize(totalNodes);
+            uint32_t offset = 0;
+            FlattenBVHTree(root, recursiveNodes, &offset);
+            timer.Stop();
+            recursiveTime = min(recursiveTime, timer.GetElapsedTime());
+            _DeleteBuildTree(root);
+        }
+        for (int r = 0; r < runs; r++)
+        {
+            vector<BVHItem> buildData = items;
+            vector<uint32_t> ordered;
+
+            Timer timer;
+            timer.Start();
+            ParallelBuildBVH(buildData, parallelNodes, ordered);
+            timer.Stop();
+            parallelTime = min(parallelTime, timer.GetElapsedTime());
+        }
+
+        _Report("recursive", recursiveNodes.size(), recursiveTime, ComputeBVHSAHCost(recursiveNodes));
+        _Report("parallel ", parallelNodes.size(), parallelTime, ComputeBVHSAHCost(parallelNodes));
+    }
+
+    return 0;
+}
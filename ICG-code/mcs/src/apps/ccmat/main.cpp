@@ -6,6 +6,7 @@ using namespace TCLAP;
 #include <image/image.h>
 #include <imageio/imageio.h>
 #include <scene/scenearchive.h>
+#include <scene/camerapath.h>
 #include <ray/rayEngine.h>
 #include <lightgen/LightGenerator.h>
 #include <lightgen/LightDiffuseGenerator.h>
@@ -39,6 +40,9 @@ int main(int argc, char** argv) {
     string filenameScene = "./boxArea.xml";
     string filenameImage = "./image.exr";
 	string filenameLight;
+	string filenameCheckpoint;
+	string filenameCameraPath;
+    uint32_t inbetween = 0;
     uint32_t width = 512; 
     uint32_t height = 512;
     uint32_t indirect = 8192;
@@ -60,6 +64,9 @@ int main(int argc, char** argv) {
 
 		SwitchArg sampleImgArg("c", "sampleimage", "sample image", cmd, false);
 		ValueArg<string> filenameLightArg("f", "lights", "virtual light filename", false, filenameLight, "string", cmd);
+		ValueArg<string> filenameCheckpointArg("x", "checkpoint", "checkpoint filename of the lights, gather points and matrix", false, filenameCheckpoint, "string", cmd);
+		ValueArg<string> cameraPathArg("a", "camerapath", "camera keyframe filename, one image per frame", false, filenameCameraPath, "string", cmd);
+        ValueArg<int> inbetweenArg("n", "inbetween", "frames interpolated between camera keyframes", false, inbetween, "int", cmd);
         ValueArg<int> indirectArg("i", "indirect", "indirect virtual light number", false, indirect, "int", cmd);
         ValueArg<int> samplesArg("s", "samples", "pixel row samples", false, samples, "int", cmd);
         ValueArg<int> seedArg("r", "seeds", "seedings", false, seedNum, "int", cmd);
@@ -75,6 +82,11 @@ int main(int argc, char** argv) {
         filenameScene = filenameSceneArg.getValue();
         filenameImage = filenameImageArg.getValue();
 		filenameLight = filenameLightArg.getValue();
+		filenameCheckpoint = filenameCheckpointArg.getValue();
+		filenameCameraPath = cameraPathArg.getValue();
+        if (inbetweenArg.getValue() < 0)
+            throw ArgException("must not be negative", inbetweenArg.longID());
+        inbetween = inbetweenArg.getValue();
         seedNum = seedArg.getValue();
         budget = clusterArg.getValue();
         width = widthArg.getValue();
@@ -107,42 +119,69 @@ int main(int argc, char** argv) {
     shared_ptr<RayEngine> engine = RayEngine::BuildDefault(scene->Surfaces(), scene->Instances(), 0.0f, 0);
     if(reportHandler) reportHandler->endActivity();
 
+	CameraPath cameraPath(inbetween);
+	if (!filenameCameraPath.empty() && !cameraPath.Load(filenameCameraPath))
+	{
+		cerr << "error: could not read camera path " << filenameCameraPath << endl;
+		return 1;
+	}
+
 	shared_ptr<VirtualLightGenerator> generator;
 	if (filenameLight.empty())
-		generator = shared_ptr<VirtualLightGenerator>(new VirtualPointLightDiffuseGenerator(scene.get(), engine.get()));
+		generator = shared_ptr<VirtualLightGenerator>(new VirtualPointLightParallelDiffuseGenerator(scene.get(), engine.get()));
 	else
 		generator = shared_ptr<VirtualLightGenerator>(new LightSerializeGenerator(filenameLight));
 
 	shared_ptr<PathSampler> sampler = shared_ptr<PathSampler>(new StratifiedPathSamplerStd());
 
-	Image<Vec3f> image(width, height);
-	shared_ptr<Image<uint32_t> > sampleImage;
-	if (outputSample)
-		sampleImage = shared_ptr<Image<uint32_t> >(new Image<uint32_t>(width, height));
-
     KnnMatrix knnMat(scene.get(), engine.get(), generator.get(), reportHandler.get());
-
+	// the key does not hold the camera, so a camera path never uses the checkpoint
+	if (!filenameCheckpoint.empty() && !cameraPath.FrameCount())
+	{
+		// everything the stored matrix depends on
+		stringstream key;
+		key << filenameScene << " " << filenameLight << " " << width << " " << height << " " << samples << " " << indirect << " " << seedNum;
+		knnMat.SetCheckpoint(filenameCheckpoint, key.str());
+	}
+
+	// the ray engine and lights are shared by all the frames of a camera path
 	timer.Reset();
-	timer.Start();
-    knnMat.Render(&image, sampleImage.get(), samples, indirect, seedNum, budget);
-	timer.Stop();
-
-	Image<Vec3f> gpImage(width, height);
-	knnMat.RenderGatherGroup(&gpImage);
-	ImageIO::Save(filenameImage + ".gpg.exr", gpImage);
-	cout << "************************************************************" << endl;
-    if (outputSample)
-    {
-        ImageIO::Save(filenameImage + "sample.exr", sampleImage);
-        uint32_t avgSampleNum = (uint32_t)AverageSampleNum(sampleImage.get());
-        stringstream sout;
-        sout << "." << avgSampleNum;
-        ImageIO::Save(filenameImage + sout.str() + ".exr", image);
-    }
-    else
-    {
-        ImageIO::Save(filenameImage + ".exr", image);
-    }
+	uint32_t frames = max(cameraPath.FrameCount(), 1u);
+	for (uint32_t f = 0; f < frames; f++)
+	{
+		string filenameFrame = filenameImage;
+		if (cameraPath.FrameCount())
+		{
+			cameraPath.SetFrame(scene->MainCamera().get(), f);
+			filenameFrame = CameraPath::FrameFilename(filenameImage, f);
+		}
+
+		Image<Vec3f> image(width, height);
+		shared_ptr<Image<uint32_t> > sampleImage;
+		if (outputSample)
+			sampleImage = shared_ptr<Image<uint32_t> >(new Image<uint32_t>(width, height));
+
+		timer.Start();
+		knnMat.Render(&image, sampleImage.get(), samples, indirect, seedNum, budget);
+		timer.Stop();
+
+		Image<Vec3f> gpImage(width, height);
+		knnMat.RenderGatherGroup(&gpImage);
+		ImageIO::Save(filenameFrame + ".gpg.exr", gpImage);
+		cout << "************************************************************" << endl;
+		if (outputSample)
+		{
+			ImageIO::Save(filenameFrame + "sample.exr", sampleImage);
+			uint32_t avgSampleNum = (uint32_t)AverageSampleNum(sampleImage.get());
+			stringstream sout;
+			sout << "." << avgSampleNum;
+			ImageIO::Save(filenameFrame + sout.str() + ".exr", image);
+		}
+		else
+		{
+			ImageIO::Save(filenameFrame + ".exr", image);
+		}
+	}
 
     stringstream sout;
     sout << "total Rendering time: " << timer.GetElapsedTime() << endl;
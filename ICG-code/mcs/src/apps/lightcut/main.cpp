@@ -17,6 +17,7 @@ using namespace TCLAP;
 #include <imageio/imageio.h>
 #include <scene/scenearchive.h>
 #include <scene/camera.h>
+#include <scene/camerapath.h>
 #include <scene/background.h>
 #include <ray/rayEngine.h>
 #include <lightgen/LightGenerator.h>
@@ -53,6 +54,8 @@ int main(int argc, char** argv) {
     string filenameScene = "scene.xml";
     string filenameImage = "image.exr";
 	string filenameLight;
+    string filenameCameraPath;
+    int inbetween = 0;
     int width = 512; 
     int height = 512;
 
@@ -81,6 +84,8 @@ int main(int argc, char** argv) {
         UnlabeledValueArg<string> filenameImageArg("image", "image filename", true, filenameImage, "string", cmd);
 
 		ValueArg<string> filenameLightArg("f", "lights", "virtual light filename", false, filenameLight, "string", cmd);
+        ValueArg<string> cameraPathArg("a", "camerapath", "camera keyframe filename, one image per frame", false, filenameCameraPath, "string", cmd);
+        ValueArg<int> inbetweenArg("n", "inbetween", "frames interpolated between camera keyframes", false, inbetween, "int", cmd);
 
         ValueArg<int> indirectArg("i", "indirect", "indirect virtual light number", false, indirect, "int", cmd);
         ValueArg<int> samplesArg("s", "samples", "sample per pixels", false, samples, "int", cmd);
@@ -111,6 +116,10 @@ int main(int argc, char** argv) {
         filenameScene = filenameSceneArg.getValue();
         filenameImage = filenameImageArg.getValue();
 		filenameLight = filenameLightArg.getValue();
+        filenameCameraPath = cameraPathArg.getValue();
+        if (inbetweenArg.getValue() < 0)
+            throw ArgException("must not be negative", inbetweenArg.longID());
+        inbetween = inbetweenArg.getValue();
         width = widthArg.getValue();
         height = heightArg.getValue();
         indirect = indirectArg.getValue();
@@ -146,37 +155,55 @@ int main(int argc, char** argv) {
         RayEngine::BuildDefault(scene->Surfaces(), scene->Instances(), 0.0f, 0);
     if(reportHandler) reportHandler->endActivity();
 
+    CameraPath cameraPath(inbetween);
+    if(!filenameCameraPath.empty() && !cameraPath.Load(filenameCameraPath)) {
+        cerr << "error: could not read camera path " << filenameCameraPath << endl;
+        return 1;
+    }
+
 	shared_ptr<VirtualLightGenerator> generator;
 	if (filenameLight.empty())
-		generator = shared_ptr<VirtualLightGenerator>(new VirtualPointLightDiffuseGenerator(scene.get(), rayEngine.get()));
+		generator = shared_ptr<VirtualLightGenerator>(new VirtualPointLightParallelDiffuseGenerator(scene.get(), rayEngine.get()));
 	else
 		generator = shared_ptr<VirtualLightGenerator>(new LightSerializeGenerator(filenameLight));
 
     timer.Reset();
     timer.Start();
-    LightTree* lightTree = DivisiveLightTreeBuilder(generator.get()).Build(scene.get(), rayEngine.get(), indirect, reportHandler.get());
-
-    Image<Vec3f> image(width, height);
-    shared_ptr<Image<uint32_t> > cutImage;
-    if (outputCutImg)
-        cutImage = shared_ptr<Image<uint32_t> >(new Image<uint32_t>(width, height));
+    FlatLightTree* lightTree = DivisiveLightTreeBuilder(generator.get()).BuildFlat(scene.get(), rayEngine.get(), indirect, reportHandler.get());
 
-    if (cutter == "std")
-        Lightcutter(lightTree, scene.get(), rayEngine.get(), error, depth).Lightcut(&image, samples, cutImage.get(), reportHandler.get());
-    else if (cutter == "mt")
-        MTLightcutter(lightTree, scene.get(), rayEngine.get(), error, depth).Lightcut(&image, samples, cutImage.get(), reportHandler.get());
-    timer.Stop();
-
-    if (cutImage)
+    // the ray engine and light tree are shared by all the frames of a camera path
+    uint32_t frames = max(cameraPath.FrameCount(), 1u);
+    for (uint32_t f = 0; f < frames; f++)
     {
-        ImageIO::Save(filenameImage + "cs.exr", cutImage);
-        uint32_t avgCutSize = _AverageCutSize(cutImage);
-        stringstream sout;
-        sout << "." << avgCutSize;
-        ImageIO::Save(filenameImage + sout.str() + ".exr", image);
+        string filenameFrame = filenameImage;
+        if (cameraPath.FrameCount())
+        {
+            cameraPath.SetFrame(scene->MainCamera().get(), f);
+            filenameFrame = CameraPath::FrameFilename(filenameImage, f);
+        }
+
+        Image<Vec3f> image(width, height);
+        shared_ptr<Image<uint32_t> > cutImage;
+        if (outputCutImg)
+            cutImage = shared_ptr<Image<uint32_t> >(new Image<uint32_t>(width, height));
+
+        if (cutter == "std")
+            Lightcutter(lightTree, scene.get(), rayEngine.get(), error, depth).Lightcut(&image, samples, cutImage.get(), reportHandler.get());
+        else if (cutter == "mt")
+            MTLightcutter(lightTree, scene.get(), rayEngine.get(), error, depth).Lightcut(&image, samples, cutImage.get(), reportHandler.get());
+
+        if (cutImage)
+        {
+            ImageIO::Save(filenameFrame + "cs.exr", cutImage);
+            uint32_t avgCutSize = _AverageCutSize(cutImage);
+            stringstream sout;
+            sout << "." << avgCutSize;
+            ImageIO::Save(filenameFrame + sout.str() + ".exr", image);
+        }
+        else
+            ImageIO::Save(filenameFrame + ".exr", image);
     }
-    else
-        ImageIO::Save(filenameImage + ".exr", image);
+    timer.Stop();
 
     stringstream sout;
     sout << "total Rendering time: " << timer.GetElapsedTime() << endl;
@@ -0,0 +1,124 @@
+//////////////////////////////////////////////////////////////////////////
+//!
+//!	\file    main.cpp
+//!
+//!	\brief   light tree build benchmark, builds the divisive light tree over
+//!          synthetic VPL sets of growing size on one and on all threads
+//!
+//////////////////////////////////////////////////////////////////////////
+#include <tclap/CmdLine.h>
+using namespace TCLAP;
+
+#include <float.h>
+
+#include <misc/timer.h>
+#include <tbbutils/tbbutils.h>
+#include <lighttree/DivisiveLightTreeBuilder.h>
+
+// VPLs scattered over the inside of a box shaped room, facing inwards
+static void _GenerateLights(uint32_t n, uint32_t seed, const Range3f &room, vector<OrientedLight> &lights)
+{
+    minstd_rand rng(seed);
+    lights.clear();
+    lights.reserve(n);
+    Vec3f size = room.GetSize();
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t face = uniform1D<uint32_t>(rng, 6);
+        uint32_t axis = face / 2;
+        Vec3f p = room.GetMin() + Vec3f(uniform1D01<float>(rng) * size.x, uniform1D01<float>(rng) * size.y, uniform1D01<float>(rng) * size.z);
+        Vec3f normal = Vec3f::Zero();
+        if (face % 2)
+        {
+            p[axis] = room.GetMax()[axis];
+            normal[axis] = -1.0f;
+        }
+        else
+        {
+            p[axis] = room.GetMin()[axis];
+            normal[axis] = 1.0f;
+        }
+        Vec3f le(uniform1D01<float>(rng), uniform1D01<float>(rng), uniform1D01<float>(rng));
+        lights.push_back(OrientedLight(p, normal, le * (1.0f / n)));
+    }
+}
+
+static double _TimeBuild(const vector<OrientedLight> &lights, float c, uint32_t runs)
+{
+    double best = DBL_MAX;
+    for (uint32_t r = 0; r < runs; r++)
+    {
+        LightTree lightTree;
+        lightTree.OrientedLights() = lights;
+
+        Timer timer;
+        timer.Start();
+        DivisiveLightTreeBuilder(0).Construct(&lightTree, c);
+        timer.Stop();
+        best = min(best, timer.GetElapsedTime());
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    uint32_t minLights = 10000;
+    uint32_t maxLights = 1000000;
+    int runs = 3;
+    int threads = 0;
+    uint32_t seed = 1;
+
+    CmdLine cmd("light tree build benchmark: ", ' ', "none", false);
+    try {
+        SwitchArg helpArg("?", "help", "help message", cmd, false);
+        ValueArg<int> runsArg("r", "runs", "builds per light count, best time is reported", false, runs, "int", cmd);
+        ValueArg<uint32_t> minArg("n", "min", "smallest light count", false, minLights, "uint", cmd);
+        ValueArg<uint32_t> maxArg("m", "max", "largest light count, the count grows by ~3x per step", false, maxLights, "uint", cmd);
+        ValueArg<int> threadsArg("t", "threads", "threads of the parallel build (0 for all)", false, threads, "int", cmd);
+        ValueArg<uint32_t> seedArg("s", "seed", "seed of the synthetic lights", false, seed, "uint", cmd);
+
+        cmd.parse(argc, argv);
+
+        if(helpArg.getValue()) StdOutput().usage(cmd);
+
+        runs = max(1, runsArg.getValue());
+        minLights = max(1u, minArg.getValue());
+        maxLights = max(minLights, maxArg.getValue());
+        threads = threadsArg.getValue();
+        seed = seedArg.getValue();
+    } catch(ArgException &e) {
+        StdOutput().usage(cmd);
+        cerr << "error: " << e.error() << endl << " for arg " << e.argId() << endl;
+        return 1;
+    }
+
+    if (threads <= 0)
+        threads = task_scheduler_init::default_num_threads();
+    Range3f room(Vec3f(-5.0f, 0.0f, -5.0f), Vec3f(5.0f, 3.0f, 5.0f));
+    // same normal weight the builder derives from the scene bounds
+    float c = room.Diagonal() / 16.0f;
+
+    cout << "lights, serial sec, parallel sec (" << threads << " threads), speedup" << endl;
+    vector<OrientedLight> lights;
+    // 10k, 30k, 100k, 300k, ... for the default range
+    bool tenth = false;
+    for (uint32_t n = minLights; ; )
+    {
+        _GenerateLights(n, seed, room, lights);
+
+        task_scheduler_init init(task_scheduler_init::deferred);
+        init.initialize(1);
+        double serialTime = _TimeBuild(lights, c, runs);
+        init.terminate();
+        init.initialize(threads);
+        double parallelTime = _TimeBuild(lights, c, runs);
+        init.terminate();
+
+        cout << n << ", " << serialTime << ", " << parallelTime << ", " << serialTime / parallelTime << endl;
+        if (n == maxLights)
+            break;
+        n = min(maxLights, tenth ? n / 3 * 10 : n * 3);
+        tenth = !tenth;
+    }
+
+    return 0;
+}
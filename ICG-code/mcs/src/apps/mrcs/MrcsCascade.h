@@ -2,6 +2,7 @@
 #define _MRCS_CASCADE_H_
 
 #include "common.h"
+#include "ReducedMatrix.h"
 
 //#define MULTI_REP
 
@@ -11,52 +12,73 @@ class MrcsCascade
 	friend class CascadeReducedMatrixThread;
 	friend struct CascadeMrcsReducedColumnThread;
 	friend struct FinalMrcsCascadeThread;
+	friend struct FinalMrcsCascadeGatherThread;
 public:
     MrcsCascade(VirtualLightGenerator *gen, Scene *scene, RayEngine *engine);
     ~MrcsCascade(void) {};
 	const vector<ScaledLight>&	ScaledLights() const { return _scaledLights; }
+    // rendering again after moving the camera reuses the lights of the first frame
     void						Render(uint32_t indirect, Image<Vec3f> *image, uint32_t samples, uint32_t rSamples, uint32_t nClusters, ReportHandler *report = 0);
+	// Progressive mode when > 0: the rSamples rows are rendered in batches until
+	// the estimated clustering error converges, and cluster splitting stops once
+	// it gains less than the target, see MrcsProgressiveRows and Cluster.
+	void						SetErrorTarget(float errorTarget) { _errorTarget = errorTarget; }
+	// Resumes from the lights, gather points and projected reduced matrix in
+	// filename when it was written for key, else writes them there once the
+	// matrix is rendered. The key names the scene and every parameter the
+	// matrix depends on.
+	void						SetCheckpoint(const string &filename, const string &key) { _checkpointFile = filename; _checkpointKey = key; }
 protected:
     void                        _RenderRows(uint32_t rSamples);
     void                        _MrcsCluster(uint32_t budget, uint32_t samples);
-    double                      _ComputeCost( const vector<uint32_t> &cluster, gsl_vector* norms, gsl_matrix* input );
+	// shades the gather points of the reduced matrix, or re-traces the primary
+	// rays when there are none
 	void						_RenderFinalImage(Image<Vec3f> *image, uint32_t samples);
+	void						_RetraceFinalImage(Image<Vec3f> *image, uint32_t samples);
     void                        _GenerateLights(uint32_t indirect);
     Vec3f                       _RenderCell(uint32_t col, DifferentialGeometry &dp, Vec3f &wo, Material *m, float rayEpsilon);
-    void                        _RenderRow(Ray &ray, uint32_t r);
+    void                        _RenderRow(Ray &ray, Vec3f *row);
     Vec3f                       _RenderRay(Ray ray, uint32_t s);
+	Vec3f						_RenderGatherPoint(GatherPoint &gp);
 //eunah
-	void						_MRCSClustering(gsl_matrix* input, RandomPathSamplerStd &sampler, uint32_t budget, vector<vector<uint32_t> > &clusters);
 	void						_MRCSReprLight(vector<vector<uint32_t>> &clusters, RandomPathSamplerStd &sampler, vector<Vec3f> &colorNorms, vector<uint32_t> &r_light);
 //han
 	void                        _ShootGatherPoints(uint32_t width, uint32_t height, uint32_t sample);
 	void                        _GroupGatherPoints(uint32_t rows);
-	void                        _KdGatherGroup(vector<GatherKdItem>::iterator start, vector<GatherKdItem>::iterator end);
 	void                        _FindGatherGroupNeighbors();
-	void                        _RenderReducedMatrix(Image<Vec3f> &matrix);
+	void                        _RenderReducedMatrix(ReducedRows &matrix, uint32_t budget);
 	template<typename T> Vec3f  RenderCell(const T &t, uint32_t col, uint32_t row);
 	template<typename T> Vec3f  RenderCell(const T &t, uint32_t col, const GatherPoint &gp);
 	void                        _SetBackground(Image<Vec3f> *image);
+	bool						_LoadCheckpoint();
+	void						_SaveCheckpoint();
+	void						_ProjectMatrix();
 
 private:
     float                                   _clamp;
+    float                                   _errorTarget;
     LightList                               _lightList;
     VirtualLightGenerator					*_generator;
     Scene									*_scene;
     RayEngine								*_engine;
     ReportHandler							*_report;
-    Image<Vec3f>                            _matrix;
+    ReducedRows                             _matrix;
+	vector<float>							_projected;
+	vector<Vec3f>							_colorNorms;
+	string									_checkpointFile;
+	string									_checkpointKey;
     vector<ScaledLight>                     _scaledLights;
 
 //han
 	StratifiedPathSamplerStd				_sampler;
+	RandomPathSamplerStd					_clusterSampler;
 
 	float                                   _normScale;
 	float									_diagonal;
 	uint32_t                                _maxGatherGroupSize;
 
-	vector<GatherPoint>                     _gatherPoints;
-	vector<GatherGroup>                     _gpGroups;
+	GatherPointStore                        _gatherPoints;
+	GatherGroupList                         _gpGroups;
 	vector<BackgroundPixel>                 _bkPixels;
 
 };
@@ -64,7 +86,8 @@ private:
 template<typename T>
 Vec3f MrcsCascade::RenderCell(const T &t, uint32_t col, uint32_t row)
 {
-	GatherPoint &gp = _gatherPoints[row];
+	GatherPoint gp;
+	_gatherPoints.Get(row, gp);
 	return RenderCell(t, col, gp);
 }
 
@@ -79,11 +102,11 @@ Vec3f MrcsCascade::RenderCell(const T &t, uint32_t col, const GatherPoint &gp)
 		L = Vec3f::Zero();
 		break;
 	case DIRECTIONAL_LIGHT:
-		L = t(*reinterpret_cast<DirLight*>(_lightList.GetLight(col)),
+		L = t(_lightList.GetDirLight(col),
 			gp.isect.dp, gp.wo, gp.isect.m, _engine, gp.isect.rayEpsilon);
 		break;
 	case ORIENTED_LIGHT:
-		L = t(*reinterpret_cast<OrientedLight*>(_lightList.GetLight(col)),
+		L = t(_lightList.GetOrientedLight(col),
 			gp.isect.dp, gp.wo, gp.isect.m, _engine, gp.isect.rayEpsilon);
 		break;
 	}
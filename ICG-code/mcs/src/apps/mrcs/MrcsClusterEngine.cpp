@@ -0,0 +1,385 @@
+#include "MrcsClusterEngine.h"
+#include <sampler/Distribution1D.h>
+#include <tbbutils/tbbutils.h>
+#include <vmath/range1.h>
+#include <xmmintrin.h>
+
+#define COLUMN_QUADS	(REDUCED_SKETCH_STRIDE / 4)
+
+static inline float _Dot(const float *a, const float *b)
+{
+	__m128 d = _mm_setzero_ps();
+	for (uint32_t k = 0; k < COLUMN_QUADS; k++)
+		d = _mm_add_ps(d, _mm_mul_ps(_mm_load_ps(a + k * 4), _mm_load_ps(b + k * 4)));
+	__m128 s = _mm_add_ps(d, _mm_movehl_ps(d, d));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+void MrcsClusterEngine::Init(const float *projected, uint32_t width)
+{
+	_width = width;
+	_columns.resize((size_t)width * REDUCED_SKETCH_STRIDE);
+	_columns.set(0.0f);
+	_norms.resize(width);
+	for (uint32_t k = 0; k < REDUCED_PROJECTIONS; k++)
+		for (uint32_t c = 0; c < width; c++)
+			_columns[c * REDUCED_SKETCH_STRIDE + k] = projected[(uint64_t)k * width + c];
+	for (uint32_t c = 0; c < width; c++)
+		_norms[c] = sqrt(_Dot(Column(c), Column(c)));
+}
+
+void MrcsClusterEngine::Init(const MrcsClusterEngine &src, const vector<uint32_t> &cols)
+{
+	_width = (uint32_t)cols.size();
+	_columns.resize((size_t)_width * REDUCED_SKETCH_STRIDE);
+	_norms.resize(_width);
+	for (uint32_t c = 0; c < _width; c++)
+	{
+		memcpy(&_columns[c * REDUCED_SKETCH_STRIDE], src.Column(cols[c]), REDUCED_SKETCH_STRIDE * sizeof(float));
+		_norms[c] = src.Norm(cols[c]);
+	}
+}
+
+double MrcsClusterEngine::Cost(const uint32_t *cols, uint32_t n) const
+{
+	if (n <= 1)
+		return 0.0;
+
+	__m128 sum[COLUMN_QUADS];
+	for (uint32_t k = 0; k < COLUMN_QUADS; k++)
+		sum[k] = _mm_setzero_ps();
+	double nsum = 0.0;
+	for (uint32_t i = 0; i < n; i++)
+	{
+		const float *c = Column(cols[i]);
+		for (uint32_t k = 0; k < COLUMN_QUADS; k++)
+			sum[k] = _mm_add_ps(sum[k], _mm_load_ps(c + k * 4));
+		nsum += _norms[cols[i]];
+	}
+
+	// the difference cancels for tight clusters, finish it in double
+	float v[REDUCED_SKETCH_STRIDE];
+	for (uint32_t k = 0; k < COLUMN_QUADS; k++)
+		_mm_storeu_ps(v + k * 4, sum[k]);
+	double vsum = 0.0;
+	for (uint32_t k = 0; k < REDUCED_PROJECTIONS; k++)
+		vsum += (double)v[k] * v[k];
+	return max(0.0, nsum * nsum - vsum);
+}
+
+class ClusterAssignThread
+{
+public:
+	ClusterAssignThread(const MrcsClusterEngine &engine, const float *centers, const float *centerNorms, const double *weights, uint32_t nCenters, uint32_t *assign)
+		: _engine(engine), _centers(centers), _centerNorms(centerNorms), _weights(weights), _nCenters(nCenters), _assign(assign) {}
+	void operator()(uint32_t i) const
+	{
+		const float *x = _engine.Column(i);
+		double n = _engine.Norm(i);
+		uint32_t mini = 0;
+		double mind = FLT_MAX;
+		for (uint32_t j = 0; j < _nCenters; j++)
+		{
+			double dot = _Dot(_centers + j * REDUCED_SKETCH_STRIDE, x);
+			double dist = max(0.0, _weights[j] * (_centerNorms[j] * n - dot));
+			if (mind >= dist)
+			{
+				mind = dist;
+				mini = j;
+			}
+		}
+		_assign[i] = mini;
+	}
+private:
+	const MrcsClusterEngine		&_engine;
+	const float					*_centers;
+	const float					*_centerNorms;
+	const double				*_weights;
+	uint32_t					_nCenters;
+	uint32_t					*_assign;
+};
+
+class ClusterCostThread
+{
+public:
+	ClusterCostThread(const MrcsClusterEngine &engine, const vector<vector<uint32_t> > &clusters, vector<double> &costs)
+		: _engine(engine), _clusters(clusters), _costs(costs) {}
+	void operator()(uint32_t i) const
+	{
+		const vector<uint32_t> &c = _clusters[i];
+		_costs[i] = c.empty() ? 0.0 : _engine.Cost(&c[0], (uint32_t)c.size());
+	}
+private:
+	const MrcsClusterEngine				&_engine;
+	const vector<vector<uint32_t> >		&_clusters;
+	vector<double>						&_costs;
+};
+
+struct ClusterSplit
+{
+	uint32_t			index;
+	double				cost;
+	vector<float>		proj;
+	vector<uint32_t>	left;
+	vector<uint32_t>	right;
+	double				leftCost;
+	double				rightCost;
+};
+
+// Splits a cluster at the center of its projection on a random line. The
+// buffers of a split slot are kept across batches.
+class ClusterSplitThread
+{
+public:
+	ClusterSplitThread(const MrcsClusterEngine &engine, const vector<vector<uint32_t> > &clusters, vector<ClusterSplit> &splits, const float *lines)
+		: _engine(engine), _clusters(clusters), _splits(splits), _lines(lines) {}
+	void operator()(uint32_t b) const
+	{
+		ClusterSplit &s = _splits[b];
+		const vector<uint32_t> &cluster = _clusters[s.index];
+		const float *line = _lines + b * REDUCED_SKETCH_STRIDE;
+
+		Range1f r = Range1f::Empty();
+		s.proj.resize(cluster.size());
+		for (uint32_t i = 0; i < cluster.size(); i++)
+		{
+			s.proj[i] = _Dot(_engine.Column(cluster[i]), line);
+			r.Grow(s.proj[i]);
+		}
+
+		float pmid = r.GetCenter();
+		s.left.clear();
+		s.right.clear();
+		for (uint32_t i = 0; i < cluster.size(); i++)
+		{
+			if (s.proj[i] < pmid)
+				s.left.push_back(cluster[i]);
+			else
+				s.right.push_back(cluster[i]);
+		}
+		// all projections equal, cut the cluster in half
+		if (s.left.empty() || s.right.empty())
+		{
+			uint32_t half = (uint32_t)cluster.size() / 2;
+			s.left.assign(cluster.begin(), cluster.begin() + half);
+			s.right.assign(cluster.begin() + half, cluster.end());
+		}
+
+		// a part never costs more than the whole, up to rounding
+		s.leftCost = min(s.cost, _engine.Cost(&s.left[0], (uint32_t)s.left.size()));
+		s.rightCost = min(s.cost, _engine.Cost(&s.right[0], (uint32_t)s.right.size()));
+	}
+private:
+	const MrcsClusterEngine				&_engine;
+	const vector<vector<uint32_t> >		&_clusters;
+	vector<ClusterSplit>				&_splits;
+	const float							*_lines;
+};
+
+double MrcsClusterEngine::TotalCost() const
+{
+	vector<uint32_t> all(_width);
+	for (uint32_t c = 0; c < _width; c++)
+		all[c] = c;
+	return _width ? Cost(&all[0], _width) : 0.0;
+}
+
+double MrcsClusterEngine::Error(const vector<vector<uint32_t> > &clusters) const
+{
+	double total = TotalCost();
+	if (total == 0.0)
+		return 0.0;
+
+	vector<double> costs(clusters.size());
+	TbbParallelFor(0, (uint32_t)clusters.size(), ClusterCostThread(*this, clusters, costs));
+	double cost = 0.0;
+	for (uint32_t i = 0; i < costs.size(); i++)
+		cost += costs[i];
+	return min(1.0, cost / total);
+}
+
+void MrcsClusterEngine::Cluster(RandomPathSamplerStd &sampler, uint32_t budget, vector<vector<uint32_t> > &clusters, double target) const
+{
+	clusters.clear();
+	if (!_width)
+		return;
+
+	vector<float> sinput(REDUCED_SKETCH_STRIDE, 0.0f);
+	double snorm = 0.0;
+	for (uint32_t c = 0; c < _width; c++)
+	{
+		const float *x = Column(c);
+		for (uint32_t k = 0; k < REDUCED_PROJECTIONS; k++)
+			sinput[k] += fabs(x[k]);
+		snorm += _norms[c];
+	}
+
+	vector<double> alphas(_width);
+	for (uint32_t c = 0; c < _width; c++)
+	{
+		double y = 0.0;
+		const float *x = Column(c);
+		for (uint32_t k = 0; k < REDUCED_PROJECTIONS; k++)
+			y += (double)x[k] * sinput[k];
+		alphas[c] = _norms[c] * snorm - y;
+	}
+
+	map<uint32_t, double> centers;
+	Distribution1Dd alphaDist(&alphas[0], _width);
+	if (!alphaDist.IsValid())
+	{
+		while (centers.size() < budget * 0.66f && centers.size() < _width) // initial clustering only 2/3
+		{
+			uint32_t idx = min(static_cast<uint32_t>(sampler.Next1D() * _width), _width - 1);
+			centers[idx] += _width;
+		}
+	}
+	else
+	{
+		uint32_t s = (uint32_t)(budget * 0.66f);
+		while (s--)
+		{
+			double pdf;
+			uint32_t idx = static_cast<uint32_t>(alphaDist.SampleDiscrete(sampler.Next1D(), &pdf));
+			centers[idx] += pdf == 0.0 ? 0.0 : 1.0 / pdf;
+		}
+	}
+	if (centers.empty())
+		centers[0] = 1.0;
+
+	// assign every column to its closest center
+	uint32_t nCenters = (uint32_t)centers.size();
+	acarray<float> kcolumns(nCenters * REDUCED_SKETCH_STRIDE);
+	vector<float> knorms(nCenters);
+	vector<double> kweights(nCenters);
+	map<uint32_t, double>::iterator it = centers.begin();
+	for (uint32_t j = 0; it != centers.end(); j++, it++)
+	{
+		memcpy(&kcolumns[j * REDUCED_SKETCH_STRIDE], Column(it->first), REDUCED_SKETCH_STRIDE * sizeof(float));
+		knorms[j] = _norms[it->first];
+		kweights[j] = it->second;
+	}
+
+	vector<uint32_t> assign(_width);
+	TbbParallelFor(0, _width, ClusterAssignThread(*this, kcolumns.data(), &knorms[0], &kweights[0], nCenters, &assign[0]), 0, 64);
+	kcolumns.clear();
+
+	clusters.resize(nCenters);
+	for (uint32_t i = 0; i < _width; i++)
+		clusters[assign[i]].push_back(i);
+
+	vector<double> costs(clusters.size());
+	TbbParallelFor(0, (uint32_t)clusters.size(), ClusterCostThread(*this, clusters, costs));
+
+	vector<pair<double, uint32_t> > heap;
+	double cost = 0.0;
+	for (uint32_t i = 0; i < clusters.size(); i++)
+	{
+		if (clusters[i].size() != 0)
+		{
+			heap.push_back(make_pair(costs[i], i));
+			push_heap(heap.begin(), heap.end());
+		}
+		cost += costs[i];
+	}
+
+	// top-down splitting, the most expensive clusters of the heap are split together
+	vector<ClusterSplit> splits(MRCS_SPLIT_BATCH);
+	acarray<float> lines(MRCS_SPLIT_BATCH * REDUCED_SKETCH_STRIDE);
+	lines.set(0.0f);
+	while (clusters.size() < budget)
+	{
+		uint32_t batch = 0;
+		uint32_t maxBatch = min(budget - (uint32_t)clusters.size(), (uint32_t)MRCS_SPLIT_BATCH);
+		while (batch < maxBatch && !heap.empty() && heap.front().first > 0.0)
+		{
+			pop_heap(heap.begin(), heap.end());
+			splits[batch].index = heap.back().second;
+			splits[batch].cost = heap.back().first;
+			heap.pop_back();
+
+			float *line = &lines[batch * REDUCED_SKETCH_STRIDE];
+			for (uint32_t k = 0; k < REDUCED_PROJECTIONS; k++)
+				line[k] = sampler.Next1D();
+			batch++;
+		}
+		if (!batch)
+			break;
+
+		TbbParallelFor(0, batch, ClusterSplitThread(*this, clusters, splits, lines.data()));
+		double batchCost = cost;
+
+		for (uint32_t b = 0; b < batch; b++)
+		{
+			ClusterSplit &s = splits[b];
+			clusters[s.index].swap(s.right);
+			clusters.push_back(vector<uint32_t>());
+			clusters.back().swap(s.left);
+
+			heap.push_back(make_pair(s.rightCost, s.index));
+			push_heap(heap.begin(), heap.end());
+			heap.push_back(make_pair(s.leftCost, (uint32_t)clusters.size() - 1));
+			push_heap(heap.begin(), heap.end());
+			cost += s.leftCost + s.rightCost - s.cost;
+		}
+		if (target > 0.0 && batchCost - cost <= target * batchCost)
+			break;
+	}
+}
+
+MrcsProgressiveRows::MrcsProgressiveRows(uint32_t rows, uint32_t budget, float errorTarget)
+	: _rendered(0), _budget(budget), _errorTarget(errorTarget), _error(1.0), _converged(false)
+{
+	_batch = max((uint32_t)MRCS_ROW_BATCH, (uint32_t)task_scheduler_init::default_num_threads() * REDUCED_SKETCH_BLOCK);
+
+	// shuffled so every batch spreads over the whole image
+	RandomPathSamplerStd sampler;
+	_order.resize(rows);
+	for (uint32_t i = 0; i < rows; i++)
+		_order[i] = i;
+	for (uint32_t i = rows; i > 1; i--)
+		std::swap(_order[i - 1], _order[min((uint32_t)(sampler.Next1D() * i), i - 1)]);
+}
+
+void MrcsProgressiveRows::Update(const ReducedRows &matrix, const RandomPathSamplerStd &sampler)
+{
+	_rendered += BatchSize();
+	_batch = max(_batch, _rendered);
+	if (Done())
+		return;
+
+	vector<Vec3f> colorNorms(matrix.Width());
+	acarray<float> projected((size_t)REDUCED_PROJECTIONS * matrix.Width());
+	matrix.Project(projected.data(), &colorNorms[0]);
+	MrcsClusterEngine input;
+	input.Init(projected.data(), matrix.Width());
+	projected.clear();
+
+	RandomPathSamplerStd clusterSampler = sampler;
+	if (_clusters.empty())
+	{
+		input.Cluster(clusterSampler, _budget, _clusters);
+		_error = input.Error(_clusters);
+		return;
+	}
+
+	// the kept clusters on the updated sketch, reclustered once their cost settles
+	double error = input.Error(_clusters);
+	bool settled = fabs(error - _error) <= _error * _errorTarget;
+	_error = error;
+	if (!settled)
+		return;
+
+	// the kept clusters against new ones on the same sketch, both errors
+	// carry the same bias of the row count
+	vector<vector<uint32_t> > clusters;
+	input.Cluster(clusterSampler, _budget, clusters);
+	double fresh = input.Error(clusters);
+	_converged = error <= fresh * (1.0 + _errorTarget);
+	if (!_converged)
+	{
+		_clusters.swap(clusters);
+		_error = fresh;
+	}
+}
@@ -0,0 +1,83 @@
+#ifndef _MRCS_CLUSTER_ENGINE_H_
+#define _MRCS_CLUSTER_ENGINE_H_
+
+#include "ReducedMatrix.h"
+
+// clusters taken off the split heap at once and split in parallel
+#define MRCS_SPLIT_BATCH		32
+// rows of the first batch of the progressive mode, raised to a sketch run
+// per worker; every later batch renders as many rows as are already in
+#define MRCS_ROW_BATCH			32
+
+// Clustering of the randomly projected reduced matrix. Columns are stored one
+// after the other, REDUCED_SKETCH_STRIDE floats each, zero padded, so distances,
+// projections and costs are plain SSE loops over a column.
+class MrcsClusterEngine
+{
+public:
+	MrcsClusterEngine() : _width(0) {}
+
+	// projected is REDUCED_PROJECTIONS x width, row by row, as written by Project
+	void					Init(const float *projected, uint32_t width);
+	// the columns cols of src, in that order
+	void					Init(const MrcsClusterEngine &src, const vector<uint32_t> &cols);
+
+	uint32_t				Width() const { return _width; }
+	float					Norm(uint32_t col) const { return _norms[col]; }
+
+	// Samples about 2/3 of the budget as centers, assigns every column to the
+	// closest one, then splits the most expensive clusters along random lines
+	// until there are budget clusters. With a target, splitting also stops once
+	// a batch of splits lowers the summed cost by less than that fraction. The
+	// sampler is only used serially, so the result does not depend on the
+	// thread schedule.
+	void					Cluster(RandomPathSamplerStd &sampler, uint32_t budget, vector<vector<uint32_t> > &clusters, double target = 0.0) const;
+
+	// (sum of norms)^2 - |sum of columns|^2
+	double					Cost(const uint32_t *cols, uint32_t n) const;
+	// cost of all columns in one cluster
+	double					TotalCost() const;
+	// summed cost of the clusters over TotalCost, in [0, 1]
+	double					Error(const vector<vector<uint32_t> > &clusters) const;
+
+	const float*			Column(uint32_t col) const { return &_columns[col * REDUCED_SKETCH_STRIDE]; }
+
+private:
+	uint32_t				_width;
+	acarray<float>			_columns;
+	vector<float>			_norms;
+};
+
+// Row schedule of the progressive mode. Rows are rendered in a random order,
+// in batches doubling the rows rendered. The first batch is clustered at the
+// full budget; after each later one only the Error of those clusters is
+// evaluated on the updated sketch. Once it moves by less than the target
+// (relative), the sketch is clustered again, and rendering stops when the
+// kept clusters are within the target of the Error of the new ones; else the
+// new clusters are kept and rendering goes on.
+class MrcsProgressiveRows
+{
+public:
+	MrcsProgressiveRows(uint32_t rows, uint32_t budget, float errorTarget);
+
+	bool					Done() const { return _converged || _rendered == _order.size(); }
+	const uint32_t*			Batch() const { return &_order[_rendered]; }
+	uint32_t				BatchSize() const { return min(_batch, (uint32_t)_order.size() - _rendered); }
+	// call once the rows of Batch are in the matrix, sampler is copied
+	void					Update(const ReducedRows &matrix, const RandomPathSamplerStd &sampler);
+
+	uint32_t				Rendered() const { return _rendered; }
+	double					Error() const { return _error; }
+
+private:
+	vector<uint32_t>		_order;
+	uint32_t				_rendered;
+	uint32_t				_batch;
+	uint32_t				_budget;
+	float					_errorTarget;
+	double					_error;
+	bool					_converged;
+	vector<vector<uint32_t> >	_clusters;
+};
+
+#endif // _MRCS_CLUSTER_ENGINE_H_
@@ -1,4 +1,5 @@
 #include "MrcsLightgroup.h"
+#include "MrcsClusterEngine.h"
 #include <ray/rayEngine.h>
 #include <scene/scene.h>
 #include <scene/background.h>
@@ -7,7 +8,6 @@
 #include <sampler/pathSampler.h>
 #include <tbbutils/tbbutils.h>
 #include <vlutil/LightEval.h>
-#include <gsl/gsl_blas.h>
 #include <vmath/range1.h>
 #include <vmath/streamMethods.h>
 
@@ -16,7 +16,7 @@ int kd_tree_node = 0;
 
 
 MrcsLightgroup::MrcsLightgroup(VirtualLightGenerator *gen, Scene *scene, RayEngine *engine)
-: _generator(gen), _scene(scene), _engine(engine)
+: _generator(gen), _scene(scene), _engine(engine), _errorTarget(0.0f)
 {
 	float radius = (_engine->ComputeBoundingBox().Diagonal() / 2.0f) * 0.05f;
 	_clamp = radius * radius;
@@ -35,47 +35,167 @@ void MrcsLightgroup::_SetBackground(Image<Vec3f> *image)
 void MrcsLightgroup::Render(uint32_t indirect, Image<Vec3f> *image, uint32_t samples, uint32_t rows, uint32_t columns, ReportHandler *report)
 {
 	_report = report;
-	_GenerateLights(indirect);
-	//_RenderRows(rows);
+	_scaledLights.clear();
+	idx_mapper.clear();
+	bool resumed = _LoadCheckpoint();
+	if (!resumed)
+	{
+		// the lights and light groups of an earlier frame are kept, only the view changes
+		if (_lightList.GetSize() == 0)
+			_GenerateLights(indirect);
+		//_RenderRows(rows);
 
-	// Matrix Sclicing
-	//////////////////////////////////////////////////////
-	_ShootGatherPoints(image->Width(), image->Height(), samples);
-	_GroupGatherPoints(rows);
-	_FindGatherGroupNeighbors();
-	///////////////////////////////////////////////////////
+		// Matrix Sclicing
+		//////////////////////////////////////////////////////
+		_ShootGatherPoints(image->Width(), image->Height(), samples);
+		_GroupGatherPoints(rows);
+		_FindGatherGroupNeighbors();
+		///////////////////////////////////////////////////////
 
-	// Lightgroup Clustering
+		// Lightgroup Clustering
 
-	_LGroupGatherPoints(0.01 * columns);
-	//_matrix.Alloc(_lightList.GetSize(), (uint32_t)(_gpGroups.size()));
+		if (_LgpGroups.Empty())
+			_LGroupGatherPoints(0.01 * columns);
+		//_matrix.Alloc(_lightList.GetSize(), (uint32_t)(_gpGroups.Size()));
+	}
 
-	for (uint32_t i = 0; i<_LgpGroups.size(); i++) {
-		vector<uint32_t> indices;
-		for (uint32_t j = 0; j < _LgpGroups[i].indices.size(); j++) {
-			indices.push_back(_LgpGroups[i].indices[j]);
-		}
-		idx_mapper.push_back(indices);
+	for (uint32_t i = 0; i<_LgpGroups.Size(); i++) {
+		const uint32_t *indices = _LgpGroups.Members(i);
+		idx_mapper.push_back(vector<uint32_t>(indices, indices + _LgpGroups.MemberNum(i)));
 	}
 
-	for (uint32_t i = 0; i < _LgpGroups.size(); i++){
+	_ClusterLightgroups(columns, samples, resumed);
+	if (!resumed)
+		_SaveCheckpoint();
+	if (_gatherPoints.Memory() > MRCS_GATHER_MEMORY)
+		_gatherPoints.Release();
+	//cout << "*** light size : " << _scaledLights.size() << endl;
 
-		_matrix.Clear();
+	_RenderFinalImage(image, samples);
+}
 
-		_matrix.Alloc((uint32_t)(_LgpGroups[i].indices.size()), (uint32_t)(_gpGroups.size()));
+void MrcsLightgroup::_ClusterLightgroups(uint32_t columns, uint32_t samples, bool resumed)
+{
+	if (_report) _report->beginActivity("Lightgroup Cluster");
+	if (!resumed)
+	{
+		_projected.assign(_LgpGroups.Size(), vector<float>());
+		_colorNorms.assign(_LgpGroups.Size(), vector<Vec3f>());
+	}
 
-		_RenderReducedMatrix(_matrix, i);
+	// the groups of a wave run concurrently, a wave holds as many groups as
+	// their reduced matrices fit in LIGHTGROUP_MATRIX_MEMORY, at least one
+	vector<vector<ScaledLight> > groupLights(_LgpGroups.Size());
+	vector<uint32_t> groupRows(_LgpGroups.Size());
+	MrcsLightgroup *renderer = this;
+	uint32_t begin = 0;
+	while (begin < _LgpGroups.Size())
+	{
+		uint64_t memory = ReducedRows::Footprint(_LgpGroups.MemberNum(begin), _gpGroups.Size());
+		uint32_t end = resumed ? _LgpGroups.Size() : begin + 1;
+		for (; end < _LgpGroups.Size(); end++)
+		{
+			uint64_t m = ReducedRows::Footprint(_LgpGroups.MemberNum(end), _gpGroups.Size());
+			if (memory + m > LIGHTGROUP_MATRIX_MEMORY)
+				break;
+			memory += m;
+		}
+		TbbParallelFor(begin, end, [renderer, columns, samples, resumed, &groupLights, &groupRows](uint32_t i) {
+			groupRows[i] = renderer->_ClusterLightgroup(i, columns, samples, resumed, groupLights[i]);
+		});
+		begin = end;
+		if (_report) _report->progress(begin / (float)_LgpGroups.Size(), 1);
+	}
 
-		_SetBackground(image);
+	// merged in group order, the lights do not depend on the schedule
+	uint64_t rows = 0;
+	for (uint32_t i = 0; i < groupLights.size(); i++)
+	{
+		_scaledLights.insert(_scaledLights.end(), groupLights[i].begin(), groupLights[i].end());
+		rows += groupRows[i];
+	}
+	if (_errorTarget > 0.0f && !resumed)
+	{
+		stringstream sout;
+		sout << "Reduced rows: " << rows << " of " << (uint64_t)_gpGroups.Size() * _LgpGroups.Size();
+		if (_report) _report->message(sout.str());
+	}
+	if (_report) _report->endActivity();
+}
 
-		float ratio = (float)_LgpGroups[i].indices.size() / (float)_lightList.GetSize();
+uint32_t MrcsLightgroup::_ClusterLightgroup(uint32_t idx, uint32_t columns, uint32_t samples, bool resumed, vector<ScaledLight> &lights)
+{
+	RandomPathSamplerStd sampler;
+	float ratio = (float)_LgpGroups.MemberNum(idx) / (float)_lightList.GetSize();
+	uint32_t rows = 0;
+	if (resumed)
+	{
+		// replays the draws of the projection, see MrcsCascade::_LoadCheckpoint
+		acarray<float> randMat;
+		ReducedMatrix::GenerateProjection(sampler, REDUCED_PROJECTIONS, _gpGroups.Size(), randMat);
+	}
+	else
+	{
+		ReducedRows matrix;
+		matrix.Alloc(_LgpGroups.MemberNum(idx), _gpGroups.Size(), sampler);
+		rows = _RenderReducedMatrix(matrix, sampler, idx, (uint32_t)(columns * ratio));
 
-		//cout << "check : " << _LgpGroups[i].indices.size() << " " << columns * ratio << endl;
-		_MrcsCluster(columns * ratio, samples, i);
+		// random projection of the element magnitudes, drawn from sampler when the matrix was allocated
+		_colorNorms[idx].resize(matrix.Width());
+		_projected[idx].resize(REDUCED_PROJECTIONS * matrix.Width());
+		matrix.Project(&_projected[idx][0], &_colorNorms[idx][0]);
 	}
-	//cout << "*** light size : " << _scaledLights.size() << endl;
+	//cout << "check : " << _LgpGroups.MemberNum(idx) << " " << columns * ratio << endl;
+	_MrcsCluster(_projected[idx], _colorNorms[idx], sampler, columns * ratio, samples, idx, lights);
+	return rows;
+}
 
-	_RenderFinalImage(image, samples);
+bool MrcsLightgroup::_LoadCheckpoint()
+{
+	CheckpointReader reader;
+	if (_checkpointFile.empty() || !reader.Open(_checkpointFile, _checkpointKey))
+		return false;
+	if (_report) _report->beginActivity("loading checkpoint");
+	bool good = LoadGatherState(reader, _scene, _lightList, _gatherPoints, _bkPixels, _gpGroups) && _LgpGroups.Load(reader);
+	_projected.assign(_LgpGroups.Size(), vector<float>());
+	_colorNorms.assign(_LgpGroups.Size(), vector<Vec3f>());
+	for (uint32_t i = 0; good && i < _LgpGroups.Size(); i++)
+	{
+		good = reader.Read(_projected[i]) && reader.Read(_colorNorms[i]) &&
+			_colorNorms[i].size() == _LgpGroups.MemberNum(i) && _projected[i].size() == REDUCED_PROJECTIONS * _colorNorms[i].size();
+	}
+	if (!good)
+	{
+		_lightList.Clear();
+		_gatherPoints.Clear();
+		_bkPixels.clear();
+		_gpGroups.Clear();
+		_LgpGroups.Clear();
+		_projected.clear();
+		_colorNorms.clear();
+	}
+	if (_report) _report->endActivity();
+	return good;
+}
+
+void MrcsLightgroup::_SaveCheckpoint()
+{
+	if (_checkpointFile.empty())
+		return;
+	CheckpointWriter writer;
+	bool good = writer.Open(_checkpointFile, _checkpointKey);
+	if (good)
+	{
+		SaveGatherState(writer, _scene, _lightList, _gatherPoints, _bkPixels, _gpGroups);
+		_LgpGroups.Save(writer);
+		for (uint32_t i = 0; i < _LgpGroups.Size(); i++)
+		{
+			writer.Write(_projected[i]);
+			writer.Write(_colorNorms[i]);
+		}
+		good = writer.Close();
+	}
+	if (!good && _report) _report->message("could not write checkpoint " + _checkpointFile);
 }
 
 void MrcsLightgroup::RenderGatherGroup(Image<Vec3f> *gpImage)
@@ -94,18 +214,17 @@ void MrcsLightgroup::RenderGatherGroup(Image<Vec3f> *gpImage)
 	//}
 	for (int i = 0; i < 2; i++)
 	{
-		const GatherGroup &lg = _LgpGroups[i];
+		const uint32_t *lg = _LgpGroups.Members(i);
 		Vec3f color(sampler.Next1D(), sampler.Next1D(), sampler.Next1D());
 
-		for (uint32_t j = 0; j < lg.indices.size(); j++)
+		for (uint32_t j = 0; j < _LgpGroups.MemberNum(i); j++)
 		{
-			Vec3f light_pos = _lightList._otrLights[lg.indices[j]].position;
+			Vec3f light_pos = _lightList.GetOrientedLight(lg[j]).position;
 			double min_value = 100000;
 			int min_group_idx, min_point_idx;
-			for (int k = 0; k < _gpGroups.size(); k++)
+			for (int k = 0; k < _gpGroups.Size(); k++)
 			{
-				GatherPoint& gp0 = _gatherPoints[_gpGroups[k].indices[0]];
-				Vec3f gp_pos = gp0.isect.dp.P;
+				const Vec3f &gp_pos = _gatherPoints.Position(_gpGroups.Members(k)[0]);
 				double tmp = abs(light_pos[0] - gp_pos[0]) + abs(light_pos[1] - gp_pos[1]) + abs(light_pos[2] - gp_pos[2]);
 				if (tmp < min_value)
 				{
@@ -114,10 +233,10 @@ void MrcsLightgroup::RenderGatherGroup(Image<Vec3f> *gpImage)
 				}
 			}
 			min_value = 1000000;
-			for (int kk = 0; kk < _gpGroups[min_group_idx].indices.size(); kk++)
+			const uint32_t *members = _gpGroups.Members(min_group_idx);
+			for (int kk = 0; kk < _gpGroups.MemberNum(min_group_idx); kk++)
 			{
-				GatherPoint& gp0 = _gatherPoints[_gpGroups[min_group_idx].indices[kk]];
-				Vec3f gp_pos = gp0.isect.dp.P;
+				const Vec3f &gp_pos = _gatherPoints.Position(members[kk]);
 				double tmp = abs(light_pos[0] - gp_pos[0]) + abs(light_pos[1] - gp_pos[1]) + abs(light_pos[2] - gp_pos[2]);
 				if (tmp < min_value)
 				{
@@ -125,9 +244,9 @@ void MrcsLightgroup::RenderGatherGroup(Image<Vec3f> *gpImage)
 					min_value = tmp;
 				}
 			}
-			GatherPoint& final_gp = _gatherPoints[_gpGroups[min_group_idx].indices[min_point_idx]];
+			Vec2i pixel = _gatherPoints.Pixel(members[min_point_idx]);
 
-			gpImage->ElementAt(final_gp.pixel.x, gpImage->Height() - final_gp.pixel.y - 1) = color;
+			gpImage->ElementAt(pixel.x, gpImage->Height() - pixel.y - 1) = color;
 		}
 	}
 	//for (uint32_t i = 0; i < 5; i++)
@@ -142,12 +261,14 @@ void MrcsLightgroup::RenderGatherGroup(Image<Vec3f> *gpImage)
 	//		cout << gp.isect.dp.P[0] << " " << gp.isect.dp.P[1] << " " << gp.isect.dp.P[2] << endl;
 	//		gpImage->ElementAt(gp.pixel.x, gpImage->Height() - gp.pixel.y - 1) = color;
 	//	}
-	//	if (_report) _report->progress(i / (float)_gpGroups.size(), 1);
+	//	if (_report) _report->progress(i / (float)_gpGroups.Size(), 1);
 	//}
 }
 
 void MrcsLightgroup::_GenerateLights(uint32_t indirect)
 {
+	if (_generator->ViewLights(_lightList))
+		return;
 	ListVirtualLightCache cache(_lightList);
 	_generator->Generate(indirect, &cache, 0.0f, _report);
 }
@@ -157,19 +278,16 @@ struct LightgroupMrcsReducedColumnThread
 public:
 	LightgroupMrcsReducedColumnThread(MrcsLightgroup *renderer, const vector<Ray> &rays)
 		: _renderer(renderer), _rays(rays) {};
-	void operator()(const blocked_range<uint32_t> &r) const;
+	void operator()(uint32_t j, Vec3f *row) const;
 private:
 	MrcsLightgroup                *_renderer;
 	const vector<Ray>		    &_rays;
 };
 
-void LightgroupMrcsReducedColumnThread::operator()(const blocked_range<uint32_t> &r) const
+void LightgroupMrcsReducedColumnThread::operator()(uint32_t j, Vec3f *row) const
 {
-	for (uint32_t j = r.begin(); j != r.end(); j++)
-	{
-		Ray ray = _rays[j];
-		_renderer->_RenderRow(ray, j);
-	}
+	Ray ray = _rays[j];
+	_renderer->_RenderRow(ray, row);
 }
 
 void MrcsLightgroup::_ShootGatherPoints(uint32_t width, uint32_t height, uint32_t samples)
@@ -179,142 +297,48 @@ void MrcsLightgroup::_ShootGatherPoints(uint32_t width, uint32_t height, uint32_
 	if (_report) _report->endActivity();
 }
 
-void MrcsLightgroup::_KdGatherGroup(vector<GatherKdItem>::iterator start, vector<GatherKdItem>::iterator end)
-{
-	Range6f bbox = Range6f::Empty();
-	for (vector<GatherKdItem>::iterator it = start; it != end; it++)
-		bbox.Grow(it->p);
-	if (end - start < _maxGatherGroupSize)
-	{
-		_gpGroups.push_back(GatherGroup());
-		GatherGroup &group = _gpGroups.back();
-		for (vector<GatherKdItem>::iterator it = start; it != end; it++)
-		{
-			group.indices.push_back(it->idx);
-			GatherPoint &gp = _gatherPoints[it->idx];
-			group.bbox.Grow(gp.isect.dp.P);
-			group.normal += gp.isect.dp.N;
-		}
-		group.normal.Normalize();
-		assert(!group.normal.IsZero());
-		uint32_t sidx = min((uint32_t)(_sampler.Next1D() * group.indices.size()), (uint32_t)(group.indices.size() - 1));
-		group.seed = group.indices[sidx];
-	}
-	else
-	{
-		uint32_t dim = bbox.GetSize().MaxComponentIndex();
-		//vector<GatherKdItem>::iterator mid = start + (end - start) / 2;
-		//std::nth_element(start, mid, end, [dim](const GatherKdItem &d1, const GatherKdItem &d2) { return d1.p[dim] < d2.p[dim]; });
-
-		float pmid = bbox.GetCenter()[dim];
-		vector<GatherKdItem>::iterator mid =
-			std::partition(start, end, [dim, pmid](const GatherKdItem &a) { return a.p[dim] < pmid; });
-
-		_KdGatherGroup(start, mid);
-		_KdGatherGroup(mid, end);
-	}
-}
-
 void MrcsLightgroup::_GroupGatherPoints(uint32_t seedNum)
 {
-	_maxGatherGroupSize = max<uint32_t>(1, (uint32_t)(_gatherPoints.size() / seedNum));
+	_maxGatherGroupSize = max<uint32_t>(1, (uint32_t)(_gatherPoints.Size() / seedNum));
 	// Compute Gather Point Bounding Box
 	Range3f	gpBBox = Range3f::Empty();
-	for (uint32_t i = 0; i < _gatherPoints.size(); i++)
+	for (uint32_t i = 0; i < _gatherPoints.Size(); i++)
 	{
-		GatherPoint &gp = _gatherPoints[i];
-		Vec3f &P = gp.isect.dp.P;
-		gpBBox.Grow(P);
+		gpBBox.Grow(_gatherPoints.Position(i));
 	}
 	_normScale = gpBBox.GetSize().Average() / 8.0f;
 	_diagonal = gpBBox.Diagonal() / 32.0f;
 
-	vector<GatherKdItem> items(_gatherPoints.size());
-	for (uint32_t i = 0; i < _gatherPoints.size(); i++)
+	vector<GatherKdItem> items(_gatherPoints.Size());
+	for (uint32_t i = 0; i < _gatherPoints.Size(); i++)
 	{
-		GatherPoint &gp = _gatherPoints[i];
 		GatherKdItem &item = items[i];
 		item.idx = i;
-		item.p = Vec6f(gp.isect.dp.P, gp.isect.dp.N * _normScale);
+		item.p = Vec6f(_gatherPoints.Position(i), _gatherPoints.Normal(i) * _normScale);
 	}
 
 	//_KmeanGatherGroup(items, seedNum);
-	_KdGatherGroup(items.begin(), items.end());
+	_gpGroups.Build(items, _maxGatherGroupSize, _gatherPoints, _sampler);
 
 	stringstream sout;
-	sout << "Gather group numbers: " << _gpGroups.size();
+	sout << "Gather group numbers: " << _gpGroups.Size();
 	if (_report) _report->message(sout.str());
 }
 
 void MrcsLightgroup::_FindGatherGroupNeighbors()
 {
-	vector<GatherKdItem> data;
-	for (uint32_t i = 0; i < _gpGroups.size(); i++)
-	{
-		GatherGroup &gpGroup = _gpGroups[i];
-		Vec3f P = gpGroup.bbox.GetCenter();
-		Vec3f &N = gpGroup.normal;
-		data.push_back(GatherKdItem(i, Vec6f(P, N * _normScale)));
-	}
-
-	KdTree<GatherKdItem> *kdTree = new KdTree<GatherKdItem>(data);
-	for (uint32_t g = 0; g < _gpGroups.size(); g++)
-	{
-		GatherGroup &gpGroup = _gpGroups[g];
-		Vec6f P(gpGroup.bbox.GetCenter(), gpGroup.normal * _normScale);
-
-		// find mini matrix
-		SeedProcess proc(8);
-		float r2 = FLT_MAX;
-		kdTree->Lookup(P, proc, r2);
-
-		for (uint32_t i = 0; i < proc.foundSeeds; i++)
-		{
-			CloseSeed &cSeed = proc.closeSeeds[i];
-			uint32_t index = cSeed.seedKdItem->idx;
-			gpGroup.neighbors.push_back(index);
-		}
-	}
-	delete kdTree;
+	// find mini matrix
+	_gpGroups.FindNeighbors(_normScale, 8);
 }
 
-void MrcsLightgroup::_LKdGatherGroup(vector<GatherKdItem>::iterator start, vector<GatherKdItem>::iterator end)
+// positions and normals of the oriented lights, grouped like gather points
+struct LightGroupPoints
 {
-	Range6f bbox = Range6f::Empty();
-	for (vector<GatherKdItem>::iterator it = start; it != end; it++)
-		bbox.Grow(it->p);
-	if (end - start < _LmaxGatherGroupSize)
-	{
-		//cout << "---------------------- Light Node : " << kd_tree_node++ << endl;
-		_LgpGroups.push_back(GatherGroup());
-		GatherGroup &group = _LgpGroups.back();
-		for (vector<GatherKdItem>::iterator it = start; it != end; it++)
-		{
-			group.indices.push_back(it->idx);
-			OrientedLight &lp = _lightList._otrLights[it->idx];
-			group.bbox.Grow(lp.position);
-			group.normal += lp.normal;
-			//cout << "Light : " << it->idx << " " << lp.position[0] << " " << lp.position[1] << " " << lp.position[2] << endl;
-		}
-		group.normal.Normalize();
-		assert(!group.normal.IsZero());
-		uint32_t sidx = min((uint32_t)(_sampler.Next1D() * group.indices.size()), (uint32_t)(group.indices.size() - 1));
-		group.seed = group.indices[sidx];
-	}
-	else
-	{
-		uint32_t dim = bbox.GetSize().MaxComponentIndex();
-		//vector<GatherKdItem>::iterator mid = start + (end - start) / 2;
-		//std::nth_element(start, mid, end, [dim](const GatherKdItem &d1, const GatherKdItem &d2) { return d1.p[dim] < d2.p[dim]; });
-
-		float pmid = bbox.GetCenter()[dim];
-		vector<GatherKdItem>::iterator mid =
-			std::partition(start, end, [dim, pmid](const GatherKdItem &a) { return a.p[dim] < pmid; });
-
-		_LKdGatherGroup(start, mid);
-		_LKdGatherGroup(mid, end);
-	}
-}
+	LightGroupPoints(const LightList &lights) : _lights(lights) {}
+	Vec3f Position(uint32_t i) const { return _lights.GetOrientedLight(i).position; }
+	Vec3f Normal(uint32_t i) const { return _lights.GetOrientedLight(i).normal; }
+	const LightList		&_lights;
+};
 
 void MrcsLightgroup::_LGroupGatherPoints(uint32_t seedNum)
 {
@@ -323,7 +347,7 @@ void MrcsLightgroup::_LGroupGatherPoints(uint32_t seedNum)
 	Range3f	gpBBox = Range3f::Empty();
 	for (uint32_t i = 0; i < _lightList.GetSize(); i++)
 	{
-		OrientedLight &lp = _lightList._otrLights[i];
+		OrientedLight lp = _lightList.GetOrientedLight(i);
 		Vec3f &P = lp.position;
 		gpBBox.Grow(P);
 	}
@@ -333,33 +357,32 @@ void MrcsLightgroup::_LGroupGatherPoints(uint32_t seedNum)
 	vector<GatherKdItem> items(_lightList.GetSize());
 	for (uint32_t i = 0; i < _lightList.GetSize(); i++)
 	{
-		OrientedLight &lp = _lightList._otrLights[i];
+		OrientedLight lp = _lightList.GetOrientedLight(i);
 		GatherKdItem &item = items[i];
 		item.idx = i;
 		item.p = Vec6f(lp.position, lp.normal * _LnormScale);
 	}
 
 	//_KmeanGatherGroup(items, seedNum);
-	_LKdGatherGroup(items.begin(), items.end());
+	_LgpGroups.Build(items, _LmaxGatherGroupSize, LightGroupPoints(_lightList), _sampler);
 
 	stringstream sout;
-	sout << "Light Gather group numbers: " << _LgpGroups.size();
+	sout << "Light Gather group numbers: " << _LgpGroups.Size();
 	if (_report) _report->message(sout.str());
 }
 
 class LightgroupReducedMatrixThread
 {
 public:
-	typedef uint32_t argument_type;
-	LightgroupReducedMatrixThread(Image<Vec3f> &matrix, MrcsLightgroup *knnMat, uint32_t idx) : _matrix(matrix), _knnMat(knnMat), _idx(idx) { };
-	void operator()(const uint32_t &g) const;
+	LightgroupReducedMatrixThread(ReducedRows &matrix, MrcsLightgroup *knnMat, uint32_t idx) : _matrix(matrix), _knnMat(knnMat), _idx(idx) { };
+	void operator()(uint32_t g, Vec3f *row) const;
 private:
-	Image<Vec3f>				&_matrix;
+	ReducedRows					&_matrix;
 	MrcsLightgroup                *_knnMat;
 	uint32_t					_idx;
 };
 
-void LightgroupReducedMatrixThread::operator()(const uint32_t &g) const
+void LightgroupReducedMatrixThread::operator()(uint32_t g, Vec3f *row) const
 {
 	//const GatherGroup &gpGroup = _knnMat->_gpGroups[g];
 	//uint32_t gpIdx = gpGroup.seed;
@@ -367,27 +390,35 @@ void LightgroupReducedMatrixThread::operator()(const uint32_t &g) const
 	//for (uint32_t i = 0; i < _matrix.Width(); i++)
 	//	_matrix.ElementAt(i, g) = _knnMat->RenderCell(LightEvalUtil::EvalL(_knnMat->_clamp), i, gp);
 
-	const GatherGroup &gpGroup = _knnMat->_gpGroups[g];
-	uint32_t gpIdx = gpGroup.seed;
-	const GatherPoint &gp = _knnMat->_gatherPoints[gpIdx];
-	for (uint32_t i = 0; i < _matrix.Width(); i++){
-		_matrix.ElementAt(i, g) = _knnMat->RenderCell(LightEvalUtil::EvalL(_knnMat->_clamp), _knnMat->_LgpGroups[_idx].indices[i], gp);
-	}
+	uint32_t gpIdx = _knnMat->_gpGroups[g].seed;
+	GatherPoint gp;
+	_knnMat->_gatherPoints.Get(gpIdx, gp);
+	LightEvalUtil::EvalL eval(_knnMat->_clamp);
+	eval(_knnMat->_lightList, _knnMat->_LgpGroups.Members(_idx), _matrix.Width(), gp.isect.dp, gp.wo, gp.isect.m, 
+		_knnMat->_engine, gp.isect.rayEpsilon, row);
 }
 
-void MrcsLightgroup::_RenderReducedMatrix(Image<Vec3f> &matrix, uint32_t idx)
+uint32_t MrcsLightgroup::_RenderReducedMatrix(ReducedRows &matrix, RandomPathSamplerStd &sampler, uint32_t idx, uint32_t budget)
 {
-	if (_report) _report->beginActivity("render reduced column");
-	TbbReportCounter counter((uint32_t)_gpGroups.size(), _report);
 	LightgroupReducedMatrixThread thread(matrix, this, idx);
-	parallel_while<LightgroupReducedMatrixThread> w;
-	w.run(counter, thread);
-	if (_report) _report->endActivity();
+	if (_errorTarget <= 0.0f)
+	{
+		matrix.SetRows(0, (uint32_t)_gpGroups.Size(), thread);
+		return _gpGroups.Size();
+	}
+
+	MrcsProgressiveRows progressive(_gpGroups.Size(), budget, _errorTarget);
+	while (!progressive.Done())
+	{
+		matrix.SetRows(progressive.Batch(), progressive.BatchSize(), thread);
+		progressive.Update(matrix, sampler);
+	}
+	return progressive.Rendered();
 }
 
 
 
-void MrcsLightgroup::_RenderRow(Ray &ray, uint32_t r)
+void MrcsLightgroup::_RenderRow(Ray &ray, Vec3f *row)
 {
 	uint32_t maxSpecDepth = 5;
 	Intersection isect;
@@ -409,7 +440,7 @@ void MrcsLightgroup::_RenderRow(Ray &ray, uint32_t r)
 		{
 			Vec3f wo = -ray.D;
 			for (uint32_t i = 0; i < _lightList.GetSize(); i++)
-				_matrix.ElementAt(i, r) = _RenderCell(i, isect.dp, wo, isect.m, isect.rayEpsilon);
+				row[i] = _RenderCell(i, isect.dp, wo, isect.m, isect.rayEpsilon);
 		}
 		break;
 	}
@@ -418,7 +449,8 @@ void MrcsLightgroup::_RenderRow(Ray &ray, uint32_t r)
 void MrcsLightgroup::_RenderRows(uint32_t rows)
 {
 	if (_report) _report->beginActivity("Render Reduced Column");
-	_matrix.Alloc(_lightList.GetSize(), rows);
+	_clusterSampler = RandomPathSamplerStd();
+	_matrix.Alloc(_lightList.GetSize(), rows, _clusterSampler);
 	vector<Ray> rays;
 	StratifiedPathSamplerStd sampler;
 	uint32_t samples = sampler.RoundSamples(rows);
@@ -435,7 +467,7 @@ void MrcsLightgroup::_RenderRows(uint32_t rows)
 	//TbbReportCounter counter((uint32_t)rays.size(), _report.get());
 	//parallel_while<LightgroupMrcsReducedColumnThread> w;
 	//w.run(counter, thread);
-	parallel_for(blocked_range<uint32_t>(0, samples), thread);
+	_matrix.SetRows(0, samples, thread);
 
 	//ImageIO::Save("reduced_column.exr", _matrix);
 	if (_report) _report->endActivity();
@@ -453,238 +485,24 @@ Vec3f MrcsLightgroup::_RenderCell(uint32_t col, DifferentialGeometry &dp, Vec3f
 		L = Vec3f::Zero();
 		break;
 	case DIRECTIONAL_LIGHT:
-		L = eval(*reinterpret_cast<DirLight*>(_lightList.GetLight(col)),
+		L = eval(_lightList.GetDirLight(col),
 			dp, wo, m, _engine, rayEpsilon);
 		break;
 	case ORIENTED_LIGHT:
-		L = eval(*reinterpret_cast<OrientedLight*>(_lightList.GetLight(col)),
+		L = eval(_lightList.GetOrientedLight(col),
 			dp, wo, m, _engine, rayEpsilon);
 		break;
 	}
 	return L;
 }
 
-void MrcsLightgroup::_MrcsCluster(uint32_t budget, uint32_t samples, uint32_t lkd_idx)
+void MrcsLightgroup::_MrcsCluster(const vector<float> &projected, vector<Vec3f> &colorNorms, RandomPathSamplerStd &sampler, uint32_t budget, uint32_t samples, uint32_t lkd_idx, vector<ScaledLight> &lights)
 {
-	RandomPathSamplerStd sampler;
-	if (_report) _report->beginActivity("Mrcs Cluster");
 	vector<vector<uint32_t> >   clusters;
 
-	vector<Vec3f>               colorNorms;
-	gsl_matrix* origin = gsl_matrix_alloc(_matrix.Height(), _matrix.Width());
-	for (uint32_t i = 0; i < origin->size2; i++)
-	{
-		Vec3f norm;
-		for (uint32_t j = 0; j < origin->size1; j++)
-		{
-			Vec3f &v = _matrix.ElementAt(i, j);
-			gsl_matrix_set(origin, j, i, v.GetLength());
-			norm += v * v;
-		}
-		colorNorms.push_back(norm.Sqrt());
-	}
-
-	//random projection
-	gsl_matrix* rand_mat = gsl_matrix_alloc(50, _matrix.Height());
-	for (uint32_t j = 0; j < 50; j++)
-	for (uint32_t i = 0; i < _matrix.Height(); i++)
-		gsl_matrix_set(rand_mat, j, i, sampler.Next1D());
-	gsl_matrix* input = gsl_matrix_alloc(50, _matrix.Width());
-	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, rand_mat, origin, 0.0, input);
-	gsl_matrix_free(origin);
-
-	gsl_vector* norms = gsl_vector_alloc(input->size2);
-	for (uint32_t i = 0; i < input->size2; i++)
-	{
-		gsl_vector_view column = gsl_matrix_column(input, i);
-		double d = gsl_blas_dnrm2(&column.vector);
-		gsl_vector_set(norms, i, d);
-	}
-
-	gsl_vector* sinput = gsl_vector_alloc(input->size1);
-	for (uint32_t j = 0; j < input->size1; j++)
-	{
-		gsl_vector_view row = gsl_matrix_row(input, j);
-		double s = gsl_blas_dasum(&row.vector);
-		gsl_vector_set(sinput, j, s);
-	}
-
-	double snorm = gsl_blas_dasum(norms);
-	gsl_vector* alphas = gsl_vector_alloc(input->size2);
-	{
-		gsl_vector *y = gsl_vector_alloc(input->size2);
-		gsl_blas_dgemv(CblasTrans, 1.0, input, sinput, 0.0, y);
-
-		gsl_vector_memcpy(alphas, norms);
-		gsl_vector_scale(alphas, snorm);
-
-		gsl_vector_sub(alphas, y);
-		gsl_vector_free(y);
-	}
-
-	map<uint32_t, double> centers;
-	Distribution1Dd alphaDist(alphas->data, (uint32_t)alphas->size);
-	if (!alphaDist.IsValid())
-	{
-		while (centers.size() < budget * 0.66f)
-		{
-			uint32_t idx = min(static_cast<uint32_t>(sampler.Next1D() * alphas->size), static_cast<uint32_t>(alphas->size - 1));
-			centers[idx] += alphas->size;
-		}
-	}
-	else
-	{
-		uint32_t s = (uint32_t)(budget * 0.66f);
-		while (s--)
-		{
-			double pdf;
-			uint32_t idx = static_cast<uint32_t>(alphaDist.SampleDiscrete(sampler.Next1D(), &pdf));
-			centers[idx] += pdf == 0.0 ? 0.0 : 1.0 / pdf;
-		}
-	}
-	assert(centers.size() > 0);
-
-	gsl_vector* knorms = gsl_vector_alloc((uint32_t)centers.size());
-	gsl_matrix* kcolumns = gsl_matrix_alloc(input->size1, (uint32_t)centers.size());
-	map<uint32_t, double>::iterator it = centers.begin();
-	for (uint32_t idx = 0; it != centers.end(); idx++, it++)
-	{
-		uint32_t i = (uint32_t)it->first;
-		assert(i >= 0 && i < norms->size);
-		double n = gsl_vector_get(norms, i);
-		gsl_vector_set(knorms, idx, n * it->second);
-
-		gsl_vector_view column = gsl_matrix_column(input, i);
-		gsl_matrix_set_col(kcolumns, idx, &column.vector);
-		gsl_vector_view kcolumn = gsl_matrix_column(kcolumns, idx);
-		gsl_vector_scale(&kcolumn.vector, it->second);
-	}
-
-	gsl_matrix *mdist = gsl_matrix_alloc(knorms->size, norms->size);
-	{
-		gsl_matrix_view x = gsl_matrix_view_vector(knorms, knorms->size, 1);
-		gsl_matrix_view y = gsl_matrix_view_vector(norms, norms->size, 1);
-		gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, &x.matrix, &y.matrix, 0.0, mdist);
-
-		gsl_matrix *col2 = gsl_matrix_alloc(kcolumns->size2, input->size2);
-		gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, kcolumns, input, 0.0, col2);
-
-		gsl_matrix_sub(mdist, col2);
-		gsl_matrix_free(col2);
-	}
-
-	clusters.resize(kcolumns->size2);
-	for (uint32_t i = 0; i < input->size2; i++)
-	{
-		int mini = -1;
-		double mind = FLT_MAX;
-		for (uint32_t j = 0; j < kcolumns->size2; j++)
-		{
-			double dist = max(0.0, gsl_matrix_get(mdist, j, i));
-			if (mind >= dist)
-			{
-				mind = dist;
-				mini = j;
-			}
-		}
-		clusters[mini].push_back(i);
-	}
-	gsl_matrix_free(mdist);
-
-
-	vector<pair<double, uint32_t> > heap;
-	uint32_t nCluster = 0;
-	for (uint32_t i = 0; i < clusters.size(); i++)
-	{
-		if (clusters[i].size() != 0)
-		{
-			double cost = _ComputeCost(clusters[i], norms, input);
-			heap.push_back(make_pair(cost, i));
-			push_heap(heap.begin(), heap.end());
-		}
-	}
-
-	while (clusters.size() < budget)
-	{
-		pop_heap(heap.begin(), heap.end());
-		if (heap.back().first <= 0.0)
-			break;
-		uint32_t index = heap.back().second;
-		double cost = heap.back().first;
-		heap.pop_back();
-
-		// Project down to random line;
-		vector<uint32_t> &cluster = clusters[index];
-		gsl_vector *randLine = gsl_vector_alloc(input->size1);
-		//{
-		//    vector<double> cnorms;
-		//    for (uint32_t i = 0; i < cluster.size(); i++)
-		//        cnorms.push_back(gsl_vector_get(norms, cluster[i]));
-		//    Distribution1Dd dist(&cnorms[0], cnorms.size());
-		//    double pdf;
-		//    uint64_t l1 = dist.SampleDiscrete(sampler.Next1D(), &pdf);
-		//    uint64_t l2 = dist.SampleDiscrete(sampler.Next1D(), &pdf);
-		//    while(l1 == l2)
-		//        l2 = dist.SampleDiscrete(sampler.Next1D(), &pdf);
-		//    gsl_matrix_get_col(randLine, input, cluster[l1]);
-		//    gsl_vector_sub(randLine, &gsl_matrix_column(input, cluster[l2]).vector);
-		//}
-
-		for (uint32_t i = 0; i < input->size1; i++)
-			gsl_vector_set(randLine, i, sampler.Next1D());
-
-		Range1f r = Range1f::Empty();
-		vector<pair<double, uint32_t> > line(cluster.size());
-		for (uint32_t i = 0; i < line.size(); i++)
-		{
-			uint32_t l = cluster[i];
-			double proj = 0.0;
-			gsl_blas_ddot(&gsl_matrix_column(input, l).vector, randLine, &proj);
-			line[i] = make_pair(proj, l);
-			r.Grow((float)proj);
-		}
-		gsl_vector_free(randLine);
-
-		//// divide line
-		//sort(line.begin(), line.end());
-		//vector<pair<double, uint32_t> >::iterator middle = line.begin() + 1;
-		//double maxInterval = -DBL_MAX;
-		//for (vector<pair<double, uint32_t> >::iterator it = line.begin() + 1; it != line.end(); it++)
-		//{
-		//    double interval = (it)->first - (it - 1)->first;
-		//    if (interval > maxInterval)
-		//    {
-		//        maxInterval = interval;
-		//        middle = it;
-		//    }
-		//}
-
-		float pmid = r.GetCenter();
-		vector<pair<double, uint32_t> >::iterator middle;
-		middle = std::partition(line.begin(), line.end(), [pmid](const pair<double, uint32_t> &a) { return a.first < pmid; });
-		assert(middle - line.begin() >= 1);
-		assert(line.end() - middle >= 1);
-
-		clusters.resize(clusters.size() + 1);
-
-		for (vector<pair<double, uint32_t> >::iterator it = line.begin(); it != middle; it++)
-			clusters.back().push_back(it->second);
-		double cost2 = _ComputeCost(clusters[clusters.size() - 1], norms, input);
-		assert(cost2 <= cost);
-		clusters[index].clear();
-		for (vector<pair<double, uint32_t> >::iterator it = middle; it != line.end(); it++)
-			clusters[index].push_back(it->second);
-		double cost1 = _ComputeCost(clusters[index], norms, input);
-		assert(cost1 <= cost);
-		heap.push_back(make_pair(cost1, index));
-		push_heap(heap.begin(), heap.end());
-		heap.push_back(make_pair(cost2, (uint32_t)clusters.size() - 1));
-		push_heap(heap.begin(), heap.end());
-	}
-
-	gsl_vector_free(alphas);
-	gsl_vector_free(norms);
-	gsl_matrix_free(input);
+	MrcsClusterEngine input;
+	input.Init(&projected[0], (uint32_t)colorNorms.size());
+	input.Cluster(sampler, budget, clusters, _errorTarget);
 
 
 	for (uint32_t k = 0; k < clusters.size(); k++)
@@ -706,8 +524,8 @@ void MrcsLightgroup::_MrcsCluster(uint32_t budget, uint32_t samples, uint32_t lk
 		{
 			Distribution1D<float, Vec3f> dist(&cnorms[0], (uint32_t)cnorms.size());
 			float pdf;
-			_scaledLights.push_back(ScaledLight());
-			ScaledLight &light = _scaledLights.back();
+			lights.push_back(ScaledLight());
+			ScaledLight &light = lights.back();
 #ifdef MULTI_REP
 			for (uint32_t s = 0; s < samples; s++)
 			{
@@ -723,44 +541,13 @@ void MrcsLightgroup::_MrcsCluster(uint32_t budget, uint32_t samples, uint32_t lk
 #endif
 		}
 	}
-
-	if (_report) _report->endActivity();
-}
-
-double MrcsLightgroup::_ComputeCost(const vector<uint32_t> &cluster, gsl_vector* norms, gsl_matrix* input)
-{
-	if (cluster.size() <= 1)
-		return 0.0;
-
-	double nsum = 0.0f;
-	double vsum = 0.0f;
-	for (uint32_t i = 0; i < cluster.size(); i++)
-	{
-		uint32_t col = cluster[i];
-		double n = gsl_vector_get(norms, col);
-		nsum += n;
-	}
-	for (uint32_t j = 0; j < input->size1; j++)
-	{
-		double sum = 0.0f;
-		for (uint32_t i = 0; i < cluster.size(); i++)
-		{
-			double v = gsl_matrix_get(input, j, cluster[i]);
-			sum += v;
-		}
-		vsum += sum * sum;
-	}
-	return max(0.0, (nsum * nsum) - vsum);
 }
 
 struct FinalMrcsLightgroupThread
 {
 public:
-	typedef uint32_t argument_type;
-
 	FinalMrcsLightgroupThread(MrcsLightgroup *renderer, Image<Vec3f> *image, Image<uint64_t> *seeds, uint32_t samples);
-	void operator()(uint32_t j) const;
-	void operator()(const blocked_range2d<uint32_t> &r) const;
+	void operator()(uint32_t i, uint32_t j) const;
 private:
 	uint32_t                            _samples;
 	Vec2f                               _pixelSize;
@@ -778,59 +565,112 @@ FinalMrcsLightgroupThread::FinalMrcsLightgroupThread(MrcsLightgroup *renderer, I
 	_pixelSize = Vec2f(1.0f / _image->Width(), 1.0f / _image->Height());
 }
 
-void FinalMrcsLightgroupThread::operator()(uint32_t j) const
+void FinalMrcsLightgroupThread::operator()(uint32_t i, uint32_t j) const
 {
-	uint64_t seed = _randSeeds->ElementAt(j);
-	StratifiedPathSamplerStd::Engine e(seed);
-	StratifiedPathSamplerStd sampler(e);
-
-	for (uint32_t i = 0; i < _image->Width(); i++)
+	Vec2i pixel(i, j);
+	if (_samples == 1)
 	{
-		Vec2i pixel(i, j);
-		if (_samples == 1)
-		{
-			Vec2f puv = (Vec2f(pixel) + Vec2f((float)0.5f, (float)0.5f)) * _pixelSize;
-			Ray ray = _scene->MainCamera()->GenerateRay(puv, Vec2f((float)0.5f, (float)0.5f), 0.0f);
-			_image->ElementAt(i, _image->Height() - j - 1) = _renderer->_RenderRay(ray, 0);
-		}
-		else
+		Vec2f puv = (Vec2f(pixel) + Vec2f((float)0.5f, (float)0.5f)) * _pixelSize;
+		Ray ray = _scene->MainCamera()->GenerateRay(puv, Vec2f((float)0.5f, (float)0.5f), 0.0f);
+		_image->ElementAt(i, _image->Height() - j - 1) = _renderer->_RenderRay(ray, 0);
+	}
+	else
+	{
+		uint64_t seed = _randSeeds->ElementAt(i, j);
+		StratifiedPathSamplerStd::Engine e(seed);
+		StratifiedPathSamplerStd sampler(e);
+
+		Vec3f L;
+		sampler.BeginPixel(_samples);
+		for (uint32_t s = 0; s < _samples; s++)
 		{
-			Vec3f L;
-			sampler.BeginPixel(_samples);
-			for (uint32_t s = 0; s < _samples; s++)
-			{
-				Vec2f puv = (Vec2f(pixel) + sampler.Pixel()) * _pixelSize;
-				Ray ray = _scene->MainCamera()->GenerateRay(puv, sampler.Lens(), sampler.Time());
-				L += _renderer->_RenderRay(ray, s) / (float)_samples;
-				sampler.NextPixelSample();
-			}
-			sampler.EndPixel();
-			_image->ElementAt(i, _image->Height() - j - 1) = L;
+			Vec2f puv = (Vec2f(pixel) + sampler.Pixel()) * _pixelSize;
+			Ray ray = _scene->MainCamera()->GenerateRay(puv, sampler.Lens(), sampler.Time());
+			L += _renderer->_RenderRay(ray, s) / (float)_samples;
+			sampler.NextPixelSample();
 		}
+		sampler.EndPixel();
+		_image->ElementAt(i, _image->Height() - j - 1) = L;
 	}
 }
 
 
+// Shades the stored gather points group by group, so only the shadow rays to
+// the representative lights are traced.
+struct FinalMrcsLightgroupGatherThread
+{
+public:
+	FinalMrcsLightgroupGatherThread(MrcsLightgroup *renderer, vector<Vec3f> &radiance)
+		: _renderer(renderer), _radiance(radiance) {}
+	void operator()(uint32_t g) const
+	{
+		const GatherGroupList &groups = _renderer->_gpGroups;
+		const uint32_t *members = groups.Members(g);
+		GatherPoint gp;
+		for (uint32_t i = 0; i < groups.MemberNum(g); i++)
+		{
+			_renderer->_gatherPoints.Get(members[i], gp);
+			_radiance[members[i]] = _renderer->_RenderGatherPoint(gp);
+		}
+	}
+private:
+	MrcsLightgroup						*_renderer;
+	vector<Vec3f>						&_radiance;
+};
+
 void MrcsLightgroup::_RenderFinalImage(Image<Vec3f> *image, uint32_t samples)
 {
+	if (_gatherPoints.Empty())
+	{
+		_RetraceFinalImage(image, samples);
+		return;
+	}
+
 	if (_report) _report->beginActivity("Render Final Image");
 
-	Image<uint64_t> randSeeds(image->Width(), image->Height());
-	for (uint32_t i = 0; i < randSeeds.Size(); i++)
+	vector<Vec3f> radiance(_gatherPoints.Size());
+	FinalMrcsLightgroupGatherThread thread(this, radiance);
+	TbbParallelFor(0, _gpGroups.Size(), thread, _report);
+
+	// splatted in store order so the sums do not depend on the schedule
+	image->Set(Vec3f::Zero());
+	_SetBackground(image);
+	for (uint32_t i = 0; i < radiance.size(); i++)
 	{
-		static minstd_rand0 seeder;
-		uint64_t seed = seeder();
-		randSeeds.ElementAt(i) = seed;
+		Vec2i pixel = _gatherPoints.Pixel(i);
+		image->ElementAt(pixel.x, image->Height() - pixel.y - 1) += radiance[i];
 	}
+	if (_report) _report->endActivity();
+}
+
+void MrcsLightgroup::_RetraceFinalImage(Image<Vec3f> *image, uint32_t samples)
+{
+	if (_report) _report->beginActivity("Render Final Image");
+
+	Image<uint64_t> randSeeds(image->Width(), image->Height());
+	GatherPointShooter::InitRandomSeeds(&randSeeds);
 
 	FinalMrcsLightgroupThread thread(this, image, &randSeeds, samples);
 
-	TbbReportCounter counter(image->Height(), _report);
-	parallel_while<FinalMrcsLightgroupThread> w;
-	w.run(counter, thread);
+	TbbParallelForTiles(image->Width(), image->Height(), thread, _report);
 	if (_report) _report->endActivity();
 }
 
+Vec3f MrcsLightgroup::_RenderGatherPoint(GatherPoint &gp)
+{
+	Vec3f L;
+	for (uint32_t i = 0; i < _scaledLights.size(); i++)
+	{
+		ScaledLight &light = _scaledLights[i];
+#ifdef MULTI_REP
+		L += _RenderCell(light.idx[gp.index], gp.isect.dp, gp.wo, gp.isect.m, gp.isect.rayEpsilon) * light.weight[gp.index];
+#else
+		L += _RenderCell(light.idx, gp.isect.dp, gp.wo, gp.isect.m, gp.isect.rayEpsilon) * light.weight;
+#endif
+	}
+	return (gp.emission + gp.weight * L) * gp.strength;
+}
+
 Vec3f MrcsLightgroup::_RenderRay(Ray ray, uint32_t s)
 {
 	Vec3f throughput = Vec3f::One();
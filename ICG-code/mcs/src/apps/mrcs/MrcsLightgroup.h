@@ -2,66 +2,91 @@
 #define _MRCS_LIGHTGROUP_H_
 
 #include "common.h"
+#include "ReducedMatrix.h"
+
+// bytes of reduced matrices of light groups clustered at the same time
+#define LIGHTGROUP_MATRIX_MEMORY	((uint64_t)512 << 20)
 
 class MrcsLightgroup
 {
 	friend class LightgroupReducedMatrixThread;
 	friend struct LightgroupMrcsReducedColumnThread;
 	friend struct FinalMrcsLightgroupThread;
+	friend struct FinalMrcsLightgroupGatherThread;
 public:
 	MrcsLightgroup(VirtualLightGenerator *gen, Scene *scene, RayEngine *engine);
 	~MrcsLightgroup(void) {};
 	const vector<ScaledLight>&	ScaledLights() const { return _scaledLights; }
+	// rendering again after moving the camera reuses the lights of the first frame
 	void						Render(uint32_t indirect, Image<Vec3f> *image, uint32_t samples, uint32_t rSamples, uint32_t nClusters, ReportHandler *report = 0);
+	// Progressive mode when > 0, as in MrcsCascade, per light group
+	void						SetErrorTarget(float errorTarget) { _errorTarget = errorTarget; }
+	// Resumes from a checkpoint of the lights, gather points, light groups and
+	// their projected reduced matrices, as in MrcsCascade
+	void						SetCheckpoint(const string &filename, const string &key) { _checkpointFile = filename; _checkpointKey = key; }
 	void						RenderGatherGroup(Image<Vec3f> *gpImage);
 
 protected:
 	void                        _RenderRows(uint32_t rSamples);
-	void                        _MrcsCluster(uint32_t budget, uint32_t samples, uint32_t lkd_idx);
-	double                      _ComputeCost(const vector<uint32_t> &cluster, gsl_vector* norms, gsl_matrix* input);
+	// runs the light groups concurrently and merges their lights in order
+	// resumed clusters the projections of the checkpoint
+	void						_ClusterLightgroups(uint32_t columns, uint32_t samples, bool resumed);
+	// reduced matrix and clusters of one light group, returns the rows rendered
+	uint32_t					_ClusterLightgroup(uint32_t idx, uint32_t columns, uint32_t samples, bool resumed, vector<ScaledLight> &lights);
+	void                        _MrcsCluster(const vector<float> &projected, vector<Vec3f> &colorNorms, RandomPathSamplerStd &sampler, uint32_t budget, uint32_t samples, uint32_t lkd_idx, vector<ScaledLight> &lights);
+	// shades the gather points of the reduced matrices, or re-traces the
+	// primary rays when there are none
 	void						_RenderFinalImage(Image<Vec3f> *image, uint32_t samples);
+	void						_RetraceFinalImage(Image<Vec3f> *image, uint32_t samples);
 	void                        _GenerateLights(uint32_t indirect);
 	Vec3f                       _RenderCell(uint32_t col, DifferentialGeometry &dp, Vec3f &wo, Material *m, float rayEpsilon);
-	void                        _RenderRow(Ray &ray, uint32_t r);
+	void                        _RenderRow(Ray &ray, Vec3f *row);
 	Vec3f                       _RenderRay(Ray ray, uint32_t s);
+	Vec3f						_RenderGatherPoint(GatherPoint &gp);
 
 	void                                    _ShootGatherPoints(uint32_t width, uint32_t height, uint32_t sample);
 	void                                    _GroupGatherPoints(uint32_t rows);
-	void                                    _KdGatherGroup(vector<GatherKdItem>::iterator start, vector<GatherKdItem>::iterator end);
 	void                                    _FindGatherGroupNeighbors();
 	void									_LGroupGatherPoints(uint32_t seedNum);
-	void									_LKdGatherGroup(vector<GatherKdItem>::iterator start, vector<GatherKdItem>::iterator end);
-	void                                    _RenderReducedMatrix(Image<Vec3f> &matrix, uint32_t idx);
+	uint32_t                                _RenderReducedMatrix(ReducedRows &matrix, RandomPathSamplerStd &sampler, uint32_t idx, uint32_t budget);
 	template<typename T> Vec3f              RenderCell(const T &t, uint32_t col, uint32_t row);
 	template<typename T> Vec3f              RenderCell(const T &t, uint32_t col, const GatherPoint &gp);
 	void                                    _SetBackground(Image<Vec3f> *image);
+	bool                                    _LoadCheckpoint();
+	void                                    _SaveCheckpoint();
 
 
 private:
 	float                                   _clamp;
+	float                                   _errorTarget;
 	LightList                               _lightList;
 	VirtualLightGenerator					*_generator;
 	Scene									*_scene;
 	RayEngine								*_engine;
 	ReportHandler							*_report;
-	Image<Vec3f>                            _matrix;
+	ReducedRows                             _matrix;
 	vector<ScaledLight>                     _scaledLights;
 
 	StratifiedPathSamplerStd				_sampler;
+	RandomPathSamplerStd					_clusterSampler;
 
 	float                                   _normScale;
 	float									_diagonal;
 	uint32_t                                _maxGatherGroupSize;
 
-	vector<GatherPoint>                     _gatherPoints;
-	vector<GatherGroup>                     _gpGroups;
+	GatherPointStore                        _gatherPoints;
+	GatherGroupList                         _gpGroups;
 	vector<BackgroundPixel>                 _bkPixels;
 
 	float                                   _LnormScale;
 	float									_Ldiagonal;
 	uint32_t                                _LmaxGatherGroupSize;
 
-	vector<GatherGroup>                     _LgpGroups;
+	GatherGroupList                         _LgpGroups;
+	vector<vector<float> >                  _projected;     // per light group
+	vector<vector<Vec3f> >                  _colorNorms;
+	string                                  _checkpointFile;
+	string                                  _checkpointKey;
 
 	vector<vector<uint32_t>>				idx_mapper;
 
@@ -71,7 +96,8 @@ private:
 template<typename T>
 Vec3f MrcsLightgroup::RenderCell(const T &t, uint32_t col, uint32_t row)
 {
-	GatherPoint &gp = _gatherPoints[row];
+	GatherPoint gp;
+	_gatherPoints.Get(row, gp);
 	return RenderCell(t, col, gp);
 }
 
@@ -86,11 +112,11 @@ Vec3f MrcsLightgroup::RenderCell(const T &t, uint32_t col, const GatherPoint &gp
 		L = Vec3f::Zero();
 		break;
 	case DIRECTIONAL_LIGHT:
-		L = t(*reinterpret_cast<DirLight*>(_lightList.GetLight(col)),
+		L = t(_lightList.GetDirLight(col),
 			gp.isect.dp, gp.wo, gp.isect.m, _engine, gp.isect.rayEpsilon);
 		break;
 	case ORIENTED_LIGHT:
-		L = t(*reinterpret_cast<OrientedLight*>(_lightList.GetLight(col)),
+		L = t(_lightList.GetOrientedLight(col),
 			gp.isect.dp, gp.wo, gp.isect.m, _engine, gp.isect.rayEpsilon);
 		break;
 	}
@@ -0,0 +1,258 @@
+#include "ReducedMatrix.h"
+#include <tbbutils/tbbutils.h>
+#include <xmmintrin.h>
+
+#define REDUCED_COLUMN_CHUNK	32
+
+void ReducedMatrix::Alloc(uint32_t width, uint32_t height, PathSampler &sampler)
+{
+	_width = width;
+	_height = height;
+	_blocks = (height + REDUCED_BLOCK_ROWS - 1) / REDUCED_BLOCK_ROWS;
+	_data.resize(static_cast<size_t>((uint64_t)_blocks * _width * 3 * REDUCED_BLOCK_ROWS));
+	_data.set(0.0f);
+	GenerateProjection(sampler, REDUCED_PROJECTIONS, height, _randMat);
+}
+
+void ReducedMatrix::Clear()
+{
+	_width = _height = _blocks = 0;
+	_data.clear();
+	_randMat.clear();
+}
+
+Vec3f ReducedMatrix::Get(uint32_t col, uint32_t row) const
+{
+	const float *c = _Column(row / REDUCED_BLOCK_ROWS, col) + row % REDUCED_BLOCK_ROWS;
+	return Vec3f(c[0], c[REDUCED_BLOCK_ROWS], c[2 * REDUCED_BLOCK_ROWS]);
+}
+
+void ReducedMatrix::Set(uint32_t col, uint32_t row, const Vec3f &v)
+{
+	float *c = _Column(row / REDUCED_BLOCK_ROWS, col) + row % REDUCED_BLOCK_ROWS;
+	c[0] = v.x;
+	c[REDUCED_BLOCK_ROWS] = v.y;
+	c[2 * REDUCED_BLOCK_ROWS] = v.z;
+}
+
+void ReducedMatrix::SetRow(uint32_t row, const Vec3f *values)
+{
+	uint32_t block = row / REDUCED_BLOCK_ROWS;
+	uint32_t r = row % REDUCED_BLOCK_ROWS;
+	for (uint32_t col = 0; col < _width; col++)
+	{
+		float *c = _Column(block, col) + r;
+		c[0] = values[col].x;
+		c[REDUCED_BLOCK_ROWS] = values[col].y;
+		c[2 * REDUCED_BLOCK_ROWS] = values[col].z;
+	}
+}
+
+static inline float _HorizontalSum(__m128 v)
+{
+	__m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+// Each task walks the row blocks once for a chunk of columns, so the slice of
+// the random matrix for a block stays in cache while it is applied to them.
+class ProjectThread
+{
+public:
+	ProjectThread(const float *data, uint32_t width, uint32_t blocks, const float *randMat, uint32_t nProj, float *projected, Vec3f *colorNorms)
+		: _data(data), _width(width), _blocks(blocks), _randMat(randMat), _nProj(nProj), _projected(projected), _colorNorms(colorNorms) {}
+	void operator()(const blocked_range<uint32_t> &range) const
+	{
+		uint32_t padded = _blocks * REDUCED_BLOCK_ROWS;
+		vector<float> acc(REDUCED_COLUMN_CHUNK * _nProj);
+		__m128 mag[REDUCED_BLOCK_ROWS / 4];
+		for (uint32_t c0 = range.begin(); c0 < range.end(); c0 += REDUCED_COLUMN_CHUNK)
+		{
+			uint32_t c1 = min(c0 + REDUCED_COLUMN_CHUNK, range.end());
+			__m128 n[REDUCED_COLUMN_CHUNK][3];
+			for (uint32_t c = c0; c < c1; c++)
+				n[c - c0][0] = n[c - c0][1] = n[c - c0][2] = _mm_setzero_ps();
+			std::fill(acc.begin(), acc.end(), 0.0f);
+
+			for (uint32_t b = 0; b < _blocks; b++)
+			{
+				for (uint32_t c = c0; c < c1; c++)
+				{
+					const float *col = _data + ((uint64_t)b * _width + c) * 3 * REDUCED_BLOCK_ROWS;
+					__m128 *cn = n[c - c0];
+					for (uint32_t r = 0; r < REDUCED_BLOCK_ROWS / 4; r++)
+					{
+						__m128 x = _mm_load_ps(col + r * 4);
+						__m128 y = _mm_load_ps(col + REDUCED_BLOCK_ROWS + r * 4);
+						__m128 z = _mm_load_ps(col + 2 * REDUCED_BLOCK_ROWS + r * 4);
+						x = _mm_mul_ps(x, x);
+						y = _mm_mul_ps(y, y);
+						z = _mm_mul_ps(z, z);
+						cn[0] = _mm_add_ps(cn[0], x);
+						cn[1] = _mm_add_ps(cn[1], y);
+						cn[2] = _mm_add_ps(cn[2], z);
+						mag[r] = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(x, y), z));
+					}
+
+					float *a = &acc[(c - c0) * _nProj];
+					for (uint32_t k = 0; k < _nProj; k++)
+					{
+						const float *rnd = _randMat + (uint64_t)k * padded + b * REDUCED_BLOCK_ROWS;
+						__m128 dot = _mm_setzero_ps();
+						for (uint32_t r = 0; r < REDUCED_BLOCK_ROWS / 4; r++)
+							dot = _mm_add_ps(dot, _mm_mul_ps(_mm_load_ps(rnd + r * 4), mag[r]));
+						a[k] += _HorizontalSum(dot);
+					}
+				}
+			}
+
+			for (uint32_t c = c0; c < c1; c++)
+			{
+				const float *a = &acc[(c - c0) * _nProj];
+				for (uint32_t k = 0; k < _nProj; k++)
+					_projected[(uint64_t)k * _width + c] = a[k];
+				__m128 *cn = n[c - c0];
+				_colorNorms[c] = Vec3f(_HorizontalSum(cn[0]), _HorizontalSum(cn[1]), _HorizontalSum(cn[2])).Sqrt();
+			}
+		}
+	}
+private:
+	const float					*_data;
+	uint32_t					_width;
+	uint32_t					_blocks;
+	const float					*_randMat;
+	uint32_t					_nProj;
+	float						*_projected;
+	Vec3f						*_colorNorms;
+};
+
+void ReducedMatrix::Project(float *projected, Vec3f *colorNorms) const
+{
+	if (!_width)
+		return;
+	ProjectThread thread(_data.data(), _width, _blocks, _randMat.data(), REDUCED_PROJECTIONS, projected, colorNorms);
+	parallel_for(blocked_range<uint32_t>(0, _width, REDUCED_COLUMN_CHUNK), thread);
+}
+
+uint64_t ReducedMatrix::Footprint(uint32_t width, uint32_t height)
+{
+	uint64_t padded = (height + REDUCED_BLOCK_ROWS - 1) / REDUCED_BLOCK_ROWS * REDUCED_BLOCK_ROWS;
+	return (padded * width * 3 + padded * REDUCED_PROJECTIONS) * sizeof(float);
+}
+
+void ReducedMatrix::GenerateProjection(PathSampler &sampler, uint32_t nProj, uint32_t height, acarray<float> &randMat)
+{
+	uint32_t padded = ((height + REDUCED_BLOCK_ROWS - 1) / REDUCED_BLOCK_ROWS) * REDUCED_BLOCK_ROWS;
+	randMat.resize((size_t)nProj * padded);
+	randMat.set(0.0f);
+	for (uint32_t k = 0; k < nProj; k++)
+		for (uint32_t i = 0; i < height; i++)
+			randMat[(size_t)k * padded + i] = sampler.Next1D();
+}
+
+void ReducedSketch::Alloc(uint32_t width, uint32_t height, PathSampler &sampler)
+{
+	Clear();
+	_width = width;
+	_height = height;
+	_streaming = _StreamFootprint(width, height) < ReducedMatrix::Footprint(width, height);
+	if (!_streaming)
+	{
+		_dense.Alloc(width, height, sampler);
+		return;
+	}
+	_total.sketch.assign((size_t)width * REDUCED_SKETCH_STRIDE, 0.0f);
+	_total.norms.assign(width, Vec3f::Zero());
+	_partials.resize(_Partials(width, height));
+
+	// same draws as ReducedMatrix, stored transposed so a row's weights are contiguous
+	acarray<float> randMat;
+	ReducedMatrix::GenerateProjection(sampler, REDUCED_PROJECTIONS, height, randMat);
+	uint32_t padded = static_cast<uint32_t>(randMat.size() / REDUCED_PROJECTIONS);
+	_coeffs.resize((size_t)height * REDUCED_SKETCH_STRIDE);
+	_coeffs.set(0.0f);
+	for (uint32_t k = 0; k < REDUCED_PROJECTIONS; k++)
+		for (uint32_t i = 0; i < height; i++)
+			_coeffs[(size_t)i * REDUCED_SKETCH_STRIDE + k] = randMat[(size_t)k * padded + i];
+}
+
+// partials worth having: no more than the workers and the runs of a full
+// render, and as many as fit in REDUCED_SKETCH_MEMORY, at least one
+uint32_t ReducedSketch::_Partials(uint32_t width, uint32_t height)
+{
+	uint64_t bytes = (uint64_t)width * (REDUCED_SKETCH_STRIDE * sizeof(float) + sizeof(Vec3f));
+	uint64_t fit = bytes ? REDUCED_SKETCH_MEMORY / bytes : 1;
+	uint32_t runs = (height + REDUCED_SKETCH_BLOCK - 1) / REDUCED_SKETCH_BLOCK;
+	uint32_t partials = min((uint32_t)task_scheduler_init::default_num_threads(), runs);
+	return max(1u, (uint32_t)min((uint64_t)partials, fit));
+}
+
+uint64_t ReducedSketch::_StreamFootprint(uint32_t width, uint32_t height)
+{
+	uint64_t partials = _Partials(width, height) + 1;
+	return (uint64_t)height * REDUCED_SKETCH_STRIDE * sizeof(float) +
+		partials * width * (REDUCED_SKETCH_STRIDE * sizeof(float) + sizeof(Vec3f));
+}
+
+uint64_t ReducedSketch::Footprint(uint32_t width, uint32_t height)
+{
+	return min(_StreamFootprint(width, height), ReducedMatrix::Footprint(width, height));
+}
+
+void ReducedSketch::Clear()
+{
+	_width = _height = 0;
+	_streaming = false;
+	_dense.Clear();
+	_coeffs.clear();
+	_total = Partial();
+	_partials.clear();
+}
+
+void ReducedSketch::_AddRow(Partial &partial, uint32_t row, const Vec3f *values) const
+{
+	const float *w = &_coeffs[(size_t)row * REDUCED_SKETCH_STRIDE];
+	for (uint32_t col = 0; col < _width; col++)
+	{
+		const Vec3f &v = values[col];
+		partial.norms[col] += v * v;
+		float m = v.GetLength();
+		if (m == 0.0f)
+			continue;
+		__m128 mm = _mm_set1_ps(m);
+		float *s = &partial.sketch[(uint64_t)col * REDUCED_SKETCH_STRIDE];
+		for (uint32_t k = 0; k < REDUCED_SKETCH_STRIDE; k += 4)
+			_mm_storeu_ps(s + k, _mm_add_ps(_mm_loadu_ps(s + k), _mm_mul_ps(_mm_load_ps(w + k), mm)));
+	}
+}
+
+// adds the first count partials to the total, in block order for every column
+void ReducedSketch::_Merge(uint32_t count)
+{
+	TbbParallelFor(0, _width, [&](uint32_t col) {
+		float *t = &_total.sketch[(uint64_t)col * REDUCED_SKETCH_STRIDE];
+		for (uint32_t p = 0; p < count; p++)
+		{
+			const float *s = &_partials[p].sketch[(uint64_t)col * REDUCED_SKETCH_STRIDE];
+			for (uint32_t k = 0; k < REDUCED_SKETCH_STRIDE; k += 4)
+				_mm_storeu_ps(t + k, _mm_add_ps(_mm_loadu_ps(t + k), _mm_loadu_ps(s + k)));
+			_total.norms[col] += _partials[p].norms[col];
+		}
+	}, 0, 64);
+}
+
+void ReducedSketch::Project(float *projected, Vec3f *colorNorms) const
+{
+	if (!_streaming)
+	{
+		_dense.Project(projected, colorNorms);
+		return;
+	}
+	TbbParallelFor(0, _width, [&](uint32_t col) {
+		const float *s = &_total.sketch[(uint64_t)col * REDUCED_SKETCH_STRIDE];
+		for (uint32_t k = 0; k < REDUCED_PROJECTIONS; k++)
+			projected[(uint64_t)k * _width + col] = s[k];
+		colorNorms[col] = _total.norms[col].Sqrt();
+	}, 0, 64);
+}
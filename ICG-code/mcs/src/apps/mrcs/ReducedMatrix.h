@@ -0,0 +1,163 @@
+#ifndef _REDUCED_MATRIX_H_
+#define _REDUCED_MATRIX_H_
+
+#include <misc/stdcommon.h>
+#include <misc/arrays.h>
+#include <vmath/vec3.h>
+#include <sampler/pathSampler.h>
+#include <tbbutils/tbbutils.h>
+
+#define REDUCED_BLOCK_ROWS		64
+#define REDUCED_PROJECTIONS		50
+#define REDUCED_SKETCH_STRIDE	((REDUCED_PROJECTIONS + 3) & ~3)
+#define REDUCED_SKETCH_BLOCK	16
+// bytes of the partial sketches of one ReducedSketch
+#define REDUCED_SKETCH_MEMORY	((uint64_t)256 << 20)
+
+// fold rendered rows into the projection right away instead of storing them
+#define REDUCED_STREAMING
+
+// Reduced light transport matrix, columns are lights and rows gather groups.
+// Rows are grouped in blocks of REDUCED_BLOCK_ROWS, inside a block every column
+// stores its three channels one after the other, so a column block is a
+// contiguous, aligned run of floats per channel.
+class ReducedMatrix
+{
+public:
+	ReducedMatrix() : _width(0), _height(0), _blocks(0) {}
+
+	// sampler draws the random projection, see GenerateProjection
+	void					Alloc(uint32_t width, uint32_t height, PathSampler &sampler);
+	void					Clear();
+
+	uint32_t				Width() const { return _width; }
+	uint32_t				Height() const { return _height; }
+	uint32_t				PaddedHeight() const { return _blocks * REDUCED_BLOCK_ROWS; }
+
+	Vec3f					Get(uint32_t col, uint32_t row) const;
+	void					Set(uint32_t col, uint32_t row, const Vec3f &v);
+	void					SetRow(uint32_t row, const Vec3f *values);
+	// Renders rows[0], ..., rows[count - 1] (0, ..., count - 1 when rows is 0)
+	// in parallel, body(row, values) fills the Width() values of a row.
+	template<typename Body>
+	void					SetRows(const uint32_t *rows, uint32_t count, const Body &body, ReportHandler *report = 0);
+
+	// Multiplies the random matrix by the matrix of element magnitudes, writing
+	// the REDUCED_PROJECTIONS x width result row by row into projected. The per
+	// channel column norms are gathered in the same pass.
+	void					Project(float *projected, Vec3f *colorNorms) const;
+
+	// uniform random nProj x PaddedHeight matrix, drawn row by row, zero padded
+	static void				GenerateProjection(PathSampler &sampler, uint32_t nProj, uint32_t height, acarray<float> &randMat);
+	// bytes held by a width x height matrix and its projection
+	static uint64_t			Footprint(uint32_t width, uint32_t height);
+
+private:
+	const float*			_Column(uint32_t block, uint32_t col) const { return &_data[((size_t)block * _width + col) * 3 * REDUCED_BLOCK_ROWS]; }
+	float*					_Column(uint32_t block, uint32_t col) { return &_data[((size_t)block * _width + col) * 3 * REDUCED_BLOCK_ROWS]; }
+
+	uint32_t				_width;
+	uint32_t				_height;
+	uint32_t				_blocks;
+	acarray<float>			_data;
+	acarray<float>			_randMat;
+};
+
+// Same interface as ReducedMatrix without keeping the rows. SetRows splits the
+// rows into one contiguous run per partial sketch (width x
+// REDUCED_SKETCH_STRIDE) and squared norms, of at least REDUCED_SKETCH_BLOCK
+// rows, a run is rendered by one task and the partials are added to the
+// sketch in run order, so the float sums do not depend on the schedule.
+// There are at most as many partials as workers and runs, and as fit in
+// REDUCED_SKETCH_MEMORY; when the dense matrix takes fewer bytes than the
+// sketch, Alloc keeps the rows in a ReducedMatrix instead.
+class ReducedSketch
+{
+public:
+	ReducedSketch() : _width(0), _height(0), _streaming(false) {}
+
+	void					Alloc(uint32_t width, uint32_t height, PathSampler &sampler);
+	void					Clear();
+
+	uint32_t				Width() const { return _width; }
+	uint32_t				Height() const { return _height; }
+
+	template<typename Body>
+	void					SetRows(const uint32_t *rows, uint32_t count, const Body &body, ReportHandler *report = 0);
+	void					Project(float *projected, Vec3f *colorNorms) const;
+
+	// bytes held by a width x height sketch, or by its dense matrix
+	static uint64_t			Footprint(uint32_t width, uint32_t height);
+
+private:
+	struct Partial
+	{
+		vector<float>		sketch;
+		vector<Vec3f>		norms;
+	};
+
+	void					_AddRow(Partial &partial, uint32_t row, const Vec3f *values) const;
+	void					_Merge(uint32_t count);
+
+	static uint32_t			_Partials(uint32_t width, uint32_t height);
+	static uint64_t			_StreamFootprint(uint32_t width, uint32_t height);
+
+	uint32_t				_width;
+	uint32_t				_height;
+	bool					_streaming;
+	ReducedMatrix			_dense;		// the rows when not streaming
+	acarray<float>			_coeffs;	// height x REDUCED_SKETCH_STRIDE, projection weights of each row
+	Partial					_total;
+	vector<Partial>			_partials;	// one per run of the rows being rendered
+};
+
+template<typename Body>
+void ReducedMatrix::SetRows(const uint32_t *rows, uint32_t count, const Body &body, ReportHandler *report)
+{
+	TbbParallelFor(0, count, [&](uint32_t k) {
+		uint32_t row = rows ? rows[k] : k;
+		vector<Vec3f> values(_width);
+		body(row, &values[0]);
+		SetRow(row, &values[0]);
+	}, report);
+}
+
+template<typename Body>
+void ReducedSketch::SetRows(const uint32_t *rows, uint32_t count, const Body &body, ReportHandler *report)
+{
+	if (!_streaming)
+	{
+		_dense.SetRows(rows, count, body, report);
+		return;
+	}
+	if (!_width || !count)
+		return;
+	uint32_t runs = min((uint32_t)_partials.size(), (count + REDUCED_SKETCH_BLOCK - 1) / REDUCED_SKETCH_BLOCK);
+	uint32_t run = (count + runs - 1) / runs;
+	runs = (count + run - 1) / run;
+	TbbProgress progress(count, report);
+	TbbParallelFor(0, runs, [&](uint32_t r) {
+		Partial &partial = _partials[r];
+		partial.sketch.assign((size_t)_width * REDUCED_SKETCH_STRIDE, 0.0f);
+		partial.norms.assign(_width, Vec3f::Zero());
+		vector<Vec3f> values(_width);
+		uint32_t end = min(count, (r + 1) * run);
+		for (uint32_t k = r * run; k < end; k++)
+		{
+			uint32_t row = rows ? rows[k] : k;
+			fill(values.begin(), values.end(), Vec3f::Zero());
+			body(row, &values[0]);
+			_AddRow(partial, row, &values[0]);
+			if (report) progress.Advance(1);
+		}
+	});
+	_Merge(runs);
+}
+
+#ifdef REDUCED_STREAMING
+typedef ReducedSketch			ReducedRows;
+#else
+typedef ReducedMatrix			ReducedRows;
+#endif
+
+#endif // _REDUCED_MATRIX_H_
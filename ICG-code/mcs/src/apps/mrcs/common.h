@@ -10,25 +10,9 @@
 #include <vmath/random.h>
 #include "vmath/fastcone.h"
 #include "gsl/gsl_blas.h"
-#include "nmatrix\kdtree.h"
-
-struct GatherKdItem
-{
-	GatherKdItem() : idx(0) {}
-	GatherKdItem(uint32_t i, const Vec6f& point) : idx(i), p(point) {}
-	uint32_t    idx;
-	Vec6f       p;
-};
-
-struct GatherGroup
-{
-	GatherGroup() : bbox(Range3f::Empty()) {}
-	vector<uint32_t>	indices;
-	uint32_t            seed;
-	vector<uint32_t>    neighbors;
-	Range3f				bbox;
-	Vec3f               normal;
-};
+#include "nmatrix\GatherGroups.h"
+#include "nmatrix\GatherCheckpoint.h"
+#include <tbbutils/tbbutils.h>
 
 struct LightGroup
 {
@@ -97,3 +81,8 @@ struct ScaledLight
 #endif
 };
 
+
+// bytes of gather points kept for the final pass, a larger store is released
+// once the reduced matrices are rendered and the final image re-traces the
+// primary rays
+#define MRCS_GATHER_MEMORY	((uint64_t)1024 << 20)
@@ -7,6 +7,7 @@ using namespace TCLAP;
 #include <image/image.h>
 #include <imageio/imageio.h>
 #include <scene/scenearchive.h>
+#include <scene/camerapath.h>
 #include <ray/rayEngine.h>
 #include <lightgen/LightGenerator.h>
 #include <lightgen/LightDiffuseGenerator.h>
@@ -24,6 +25,8 @@ string g_DebugFileName;
 
 //#define MRCS_CASCADE_CLUSTERING true
 #define MRCS_LIGHTGROUP_CLUSTERING true
+// render rows and split clusters only until the error estimate converges to errorRatio
+//#define MRCS_PROGRESSIVE true
 
 void WriteColumn(const vector<ScaledLight> &scaledLight, const string &filenameColumn );
 int main(int argc, char** argv) {
@@ -35,6 +38,10 @@ int main(int argc, char** argv) {
 	string filenameScene = "boxArea.xml";
 	string filenameLight;
 	string filenameColumn;
+	string filenameCheckpoint;
+	// one image per frame of the camera keyframes when set
+	string filenameCameraPath;
+	uint32_t inbetween = 0;
 
 	int width = 512;
 	int height = 512;
@@ -67,32 +74,69 @@ int main(int argc, char** argv) {
 	shared_ptr<RayEngine> engine = RayEngine::BuildDefault(scene->Surfaces(), scene->Instances(), 0.0f, 0);
 	if (reportHandler) reportHandler->endActivity();
 
+	CameraPath cameraPath(inbetween);
+	if (!filenameCameraPath.empty() && !cameraPath.Load(filenameCameraPath))
+	{
+		cerr << "error: could not read camera path " << filenameCameraPath << endl;
+		return 1;
+	}
+
 	shared_ptr<VirtualLightGenerator> generator;
 	if (filenameLight.empty())
-		generator = shared_ptr<VirtualLightGenerator>(new VirtualPointLightDiffuseGenerator(scene.get(), engine.get()));
+		generator = shared_ptr<VirtualLightGenerator>(new VirtualPointLightParallelDiffuseGenerator(scene.get(), engine.get()));
 	else
 		generator = shared_ptr<VirtualLightGenerator>(new LightSerializeGenerator(filenameLight));
 
-	Image<Vec3f> image(width, height);
-
 #ifdef MRCS_CASCADE_CLUSTERING
 	MrcsCascade renderer(generator.get(), scene.get(), engine.get());
 #endif
 #ifdef MRCS_LIGHTGROUP_CLUSTERING
 	MrcsLightgroup renderer(generator.get(), scene.get(), engine.get());
 #endif
-	timer.Start();
-	renderer.Render(indirect, &image, samples, nRow, nclusters, reportHandler.get());
-	timer.Stop();
+#ifdef MRCS_PROGRESSIVE
+	renderer.SetErrorTarget(errorRatio);
+#endif
+	// the key does not hold the camera, so a camera path never uses the checkpoint
+	if (!filenameCheckpoint.empty() && !cameraPath.FrameCount())
+	{
+		// everything the stored matrix depends on
+		stringstream key;
+		key << filenameScene << " " << filenameLight << " " << width << " " << height << " " << samples << " " << indirect << " " << nRow;
+#ifdef MRCS_LIGHTGROUP_CLUSTERING
+		key << " lightgroup " << nclusters;
+#endif
+#ifdef MRCS_PROGRESSIVE
+		key << " " << errorRatio << " " << nclusters;
+#endif
+		renderer.SetCheckpoint(filenameCheckpoint, key.str());
+	}
 
-	if (!filenameColumn.empty())
-		WriteColumn(renderer.ScaledLights(), filenameColumn);
+	// the ray engine and lights are shared by all the frames of a camera path,
+	// gather points and clusters depend on the view and are redone per frame
+	uint32_t frames = max(cameraPath.FrameCount(), 1u);
+	for (uint32_t f = 0; f < frames; f++)
+	{
+		string filenameFrame = filenameImage;
+		if (cameraPath.FrameCount())
+		{
+			cameraPath.SetFrame(scene->MainCamera().get(), f);
+			filenameFrame = CameraPath::FrameFilename(filenameImage, f);
+		}
+
+		Image<Vec3f> image(width, height);
+		timer.Start();
+		renderer.Render(indirect, &image, samples, nRow, nclusters, reportHandler.get());
+		timer.Stop();
+
+		if (!filenameColumn.empty())
+			WriteColumn(renderer.ScaledLights(), cameraPath.FrameCount() ? CameraPath::FrameFilename(filenameColumn, f) : filenameColumn);
+
+		stringstream sout;
+		sout << filenameFrame << "." << nclusters << ".exr";
+		ImageIO::Save(sout.str(), image);
+	}
 
 	stringstream sout;
-	sout << filenameImage << "." << nclusters << ".exr";
-	ImageIO::Save(sout.str(), image);
-
-	sout.clear();
 	sout << "total Rendering time: " << timer.GetElapsedTime() << endl;
 	if (reportHandler) reportHandler->message(sout.str());
 
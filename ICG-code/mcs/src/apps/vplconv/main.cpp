@@ -0,0 +1,67 @@
+//////////////////////////////////////////////////////////////////////////
+//!
+//!	\file    main.cpp
+//!
+//!	\brief   converts SerializableLightCache files to the memory mapped
+//!          binary light format read by LightSerializeGenerator
+//!
+//////////////////////////////////////////////////////////////////////////
+#include <tclap/CmdLine.h>
+using namespace TCLAP;
+
+#include <lightgen/SerializableLightCache.h>
+#include <lightgen/BinaryLightCache.h>
+#include <lightgen/LightSerializeGenerator.h>
+
+int main(int argc, char** argv) {
+    string filenameIn;
+    string filenameOut;
+    bool verify = false;
+
+    CmdLine cmd("vpl file converter: ", ' ', "none", false);
+    try {
+        SwitchArg helpArg("?", "help", "help message", cmd, false);
+        SwitchArg verifyArg("v", "verify", "reload the written file and compare it to the input", cmd, false);
+        UnlabeledValueArg<string> filenameInArg("input", "SerializableLightCache filename", true, "", "string", cmd);
+        UnlabeledValueArg<string> filenameOutArg("output", "binary light filename", true, "", "string", cmd);
+
+        cmd.parse(argc, argv);
+
+        if(helpArg.getValue()) StdOutput().usage(cmd);
+
+        filenameIn = filenameInArg.getValue();
+        filenameOut = filenameOutArg.getValue();
+        verify = verifyArg.getValue();
+    } catch(ArgException &e) {
+        StdOutput().usage(cmd);
+        cerr << "error: " << e.error() << endl << " for arg " << e.argId() << endl;
+        return 1;
+    }
+
+    SerializableLightCache cache;
+    cache.Load(filenameIn);
+    cout << filenameIn << ": " << cache.DirectLightNum() << " direct, " 
+        << cache.IndirectLightNum() << " indirect lights" << endl;
+
+    if (!BinaryLightCache::Save(filenameOut, cache))
+    {
+        cerr << "error: cannot write " << filenameOut << endl;
+        return 1;
+    }
+
+    if (verify)
+    {
+        // goes through the same path as the renderers
+        SerializableLightCache reloaded;
+        LightSerializeGenerator generator(filenameOut);
+        generator.Generate(0, &reloaded);
+        if (!(reloaded == cache))
+        {
+            cerr << "error: " << filenameOut << " does not match " << filenameIn << endl;
+            return 1;
+        }
+        cout << "verified " << filenameOut << endl;
+    }
+
+    return 0;
+}
@@ -10,17 +10,7 @@
 #include <vlutil/LightEval.h>
 #include <scene/background.h>
 #include <imageio/imageio.h>
-
-struct GatherPoint 
-{
-    Vec3f			emission;
-    Vec3f			weight;
-    Vec2i           pixel;
-    Intersection    isect;
-    Vec3f           wo;
-	float			strength;
-    uint32_t        index;
-};
+#include "GatherPointStore.h"
 
 struct BackgroundPixel 
 {
@@ -33,8 +23,8 @@ struct BackgroundPixel
 namespace GatherPointShooter
 {
 	void InitRandomSeeds(Image<uint64_t> *randSeeds);
-	void Shoot(Scene* scene, RayEngine *engine, uint32_t i, uint32_t j, uint32_t samples, Image<uint64_t> *randSeeds, vector<GatherPoint> &gatherPoint, vector<BackgroundPixel> &bgPixels, ReportHandler *report = 0);
-    void Shoot(Scene* scene, RayEngine *engine, uint32_t width, uint32_t height, uint32_t samples, vector<GatherPoint> &gatherPoint, vector<BackgroundPixel> &bgPixels, ReportHandler *report = 0);
+	void Shoot(Scene* scene, RayEngine *engine, uint32_t i, uint32_t j, uint32_t samples, Image<uint64_t> *randSeeds, GatherPointStore &gatherPoint, vector<BackgroundPixel> &bgPixels, ReportHandler *report = 0);
+    void Shoot(Scene* scene, RayEngine *engine, uint32_t width, uint32_t height, uint32_t samples, GatherPointStore &gatherPoint, vector<BackgroundPixel> &bgPixels, ReportHandler *report = 0);
 };
 
 #endif // GatherPointShooter_h__
\ No newline at end of file
@@ -0,0 +1,355 @@
+#include "GatherPointStore.h"
+#include <scene/scene.h>
+#include <scene/surface.h>
+#include <scene/instance.h>
+#include <tbbutils/tbbutils.h>
+#include <algorithm>
+
+#define GP_OCT_LEVELS       32767
+
+union _FloatBits
+{
+    float       f;
+    uint32_t    u;
+};
+
+static uint16_t _FloatToHalf(float v)
+{
+    _FloatBits b;
+    b.f = v;
+    uint32_t sign = (b.u >> 16) & 0x8000;
+    int32_t exp = static_cast<int32_t>((b.u >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = b.u & 0x7fffff;
+    if (((b.u >> 23) & 0xff) == 0xff)
+        return static_cast<uint16_t>(sign | 0x7c00 | (mant ? 0x200 : 0));
+    if (exp <= 0)
+    {
+        // denormal, rounded to nearest even
+        if (exp < -10)
+            return static_cast<uint16_t>(sign);
+        mant |= 0x800000;
+        uint32_t shift = static_cast<uint32_t>(14 - exp);
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1)))
+            h++;
+        return static_cast<uint16_t>(sign | h);
+    }
+    uint32_t h = (static_cast<uint32_t>(exp) << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;
+    // clamps to the largest finite half
+    if (exp >= 31 || h >= 0x7c00)
+        h = 0x7bff;
+    return static_cast<uint16_t>(sign | h);
+}
+
+static float _HalfToFloat(uint16_t h)
+{
+    uint32_t sign = (h & 0x8000u) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    _FloatBits b;
+    if (exp == 0)
+    {
+        float v = mant / 16777216.0f;
+        return sign ? -v : v;
+    }
+    if (exp == 31)
+        b.u = sign | 0x7f800000 | (mant << 13);
+    else
+        b.u = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    return b.f;
+}
+
+static uint32_t _EncodeRgbe(const Vec3f &c)
+{
+    float m = max(c.x, max(c.y, c.z));
+    if (m < 1e-32f)
+        return 0;
+    int e;
+    float scale = frexp(m, &e) * 256.0f / m;
+    uint32_t r = min(255u, static_cast<uint32_t>(max(0.0f, c.x) * scale + 0.5f));
+    uint32_t g = min(255u, static_cast<uint32_t>(max(0.0f, c.y) * scale + 0.5f));
+    uint32_t b = min(255u, static_cast<uint32_t>(max(0.0f, c.z) * scale + 0.5f));
+    return r | (g << 8) | (b << 16) | (static_cast<uint32_t>(e + 128) << 24);
+}
+
+static Vec3f _DecodeRgbe(uint32_t v)
+{
+    uint32_t e = v >> 24;
+    if (e == 0)
+        return Vec3f::Zero();
+    float f = static_cast<float>(ldexp(1.0, static_cast<int>(e) - (128 + 8)));
+    return Vec3f((v & 0xff) * f, ((v >> 8) & 0xff) * f, ((v >> 16) & 0xff) * f);
+}
+
+static uint32_t _EncodeOct(const Vec3f &v)
+{
+    float s = fabs(v.x) + fabs(v.y) + fabs(v.z);
+    float x = s > 0.0f ? v.x / s : 0.0f;
+    float y = s > 0.0f ? v.y / s : 0.0f;
+    if (v.z < 0.0f)
+    {
+        float ox = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float oy = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = ox;
+        y = oy;
+    }
+    int16_t qx = static_cast<int16_t>(floor(x * GP_OCT_LEVELS + 0.5f));
+    int16_t qy = static_cast<int16_t>(floor(y * GP_OCT_LEVELS + 0.5f));
+    return static_cast<uint16_t>(qx) | (static_cast<uint32_t>(static_cast<uint16_t>(qy)) << 16);
+}
+
+static Vec3f _DecodeOct(uint32_t v)
+{
+    float x = static_cast<int16_t>(v & 0xffff) / static_cast<float>(GP_OCT_LEVELS);
+    float y = static_cast<int16_t>(v >> 16) / static_cast<float>(GP_OCT_LEVELS);
+    float z = 1.0f - fabs(x) - fabs(y);
+    if (z < 0.0f)
+    {
+        float ox = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float oy = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = ox;
+        y = oy;
+    }
+    return Vec3f(x, y, z).GetNormalized();
+}
+
+void GatherPointStore::Init(uint32_t width, uint32_t samples)
+{
+    Clear();
+    _width = width;
+    _strength = 1.0f / samples;
+}
+
+void GatherPointStore::Clear()
+{
+    _materials.clear();
+    _Resize(0);
+}
+
+template<typename T>
+static void _Free(vector<T> &v)
+{
+    vector<T>().swap(v);
+}
+
+template<typename T>
+static uint64_t _Bytes(const vector<T> &v)
+{
+    return (uint64_t)v.capacity() * sizeof(T);
+}
+
+void GatherPointStore::Release()
+{
+    _Free(_materials);
+    _Free(_P);
+    _Free(_st);
+    _Free(_normal);
+    _Free(_wo);
+    _Free(_rayEpsilon);
+    _Free(_pixel);
+    _Free(_sample);
+    _Free(_material);
+    _Free(_weight);
+    _Free(_emission);
+}
+
+uint64_t GatherPointStore::Memory() const
+{
+    return _Bytes(_materials) + _Bytes(_P) + _Bytes(_st) + _Bytes(_normal) + _Bytes(_wo) + _Bytes(_rayEpsilon) +
+        _Bytes(_pixel) + _Bytes(_sample) + _Bytes(_material) + _Bytes(_weight) + _Bytes(_emission);
+}
+
+void GatherPointStore::Reserve(uint32_t n)
+{
+    _P.reserve(n);
+    _st.reserve(n);
+    _normal.reserve(n);
+    _wo.reserve(n);
+    _rayEpsilon.reserve(n);
+    _pixel.reserve(n);
+    _sample.reserve(n);
+    _material.reserve(n);
+    _weight.reserve(3 * n);
+    _emission.reserve(n);
+}
+
+void GatherPointStore::_Resize(uint32_t n)
+{
+    _P.resize(n);
+    _st.resize(n);
+    _normal.resize(n);
+    _wo.resize(n);
+    _rayEpsilon.resize(n);
+    _pixel.resize(n);
+    _sample.resize(n);
+    _material.resize(n);
+    _weight.resize(3 * n);
+    _emission.resize(n);
+}
+
+uint16_t GatherPointStore::_MaterialIndex(Material *m)
+{
+    // a tile sees a handful of materials, mostly the last one again
+    for (uint32_t k = static_cast<uint32_t>(_materials.size()); k > 0; k--)
+    {
+        if (_materials[k - 1] == m)
+            return static_cast<uint16_t>(k - 1);
+    }
+    assert(_materials.size() < 0xffff);
+    _materials.push_back(m);
+    return static_cast<uint16_t>(_materials.size() - 1);
+}
+
+void GatherPointStore::Append(const GatherPoint &gp)
+{
+    const DifferentialGeometry &dp = gp.isect.dp;
+    assert(gp.index <= 0xffff);
+    _P.push_back(dp.P);
+    _st.push_back(dp.st);
+    _normal.push_back(_EncodeOct(dp.N));
+    _wo.push_back(_EncodeOct(gp.wo));
+    _rayEpsilon.push_back(gp.isect.rayEpsilon);
+    _pixel.push_back(gp.pixel.y * _width + gp.pixel.x);
+    _sample.push_back(static_cast<uint16_t>(gp.index));
+    _material.push_back(_MaterialIndex(gp.isect.m));
+    for (uint32_t k = 0; k < 3; k++)
+        _weight.push_back(_FloatToHalf(gp.weight[k]));
+    _emission.push_back(_EncodeRgbe(gp.emission));
+}
+
+void GatherPointStore::Concatenate(vector<GatherPointStore> &parts)
+{
+    // offsets by an exclusive scan of the part sizes, material tables are
+    // merged in part order so the indices do not depend on the schedule
+    vector<uint32_t> offsets(parts.size() + 1);
+    vector<vector<uint16_t> > remap(parts.size());
+    offsets[0] = Size();
+    for (uint32_t t = 0; t < parts.size(); t++)
+    {
+        offsets[t + 1] = offsets[t] + parts[t].Size();
+        for (uint32_t k = 0; k < parts[t]._materials.size(); k++)
+            remap[t].push_back(_MaterialIndex(parts[t]._materials[k]));
+    }
+    _Resize(offsets.back());
+
+    GatherPointStore *store = this;
+    TbbParallelFor(0, static_cast<uint32_t>(parts.size()), [store, &parts, &offsets, &remap](uint32_t t) {
+        GatherPointStore &part = parts[t];
+        uint32_t o = offsets[t];
+        std::copy(part._P.begin(), part._P.end(), store->_P.begin() + o);
+        std::copy(part._st.begin(), part._st.end(), store->_st.begin() + o);
+        std::copy(part._normal.begin(), part._normal.end(), store->_normal.begin() + o);
+        std::copy(part._wo.begin(), part._wo.end(), store->_wo.begin() + o);
+        std::copy(part._rayEpsilon.begin(), part._rayEpsilon.end(), store->_rayEpsilon.begin() + o);
+        std::copy(part._pixel.begin(), part._pixel.end(), store->_pixel.begin() + o);
+        std::copy(part._sample.begin(), part._sample.end(), store->_sample.begin() + o);
+        std::copy(part._weight.begin(), part._weight.end(), store->_weight.begin() + 3 * o);
+        std::copy(part._emission.begin(), part._emission.end(), store->_emission.begin() + o);
+        for (uint32_t i = 0; i < part.Size(); i++)
+            store->_material[o + i] = remap[t][part._material[i]];
+        part = GatherPointStore();
+    });
+}
+
+Vec3f GatherPointStore::Normal(uint32_t i) const
+{
+    return _DecodeOct(_normal[i]);
+}
+
+Vec3f GatherPointStore::Wo(uint32_t i) const
+{
+    return _DecodeOct(_wo[i]);
+}
+
+Vec3f GatherPointStore::Weight(uint32_t i) const
+{
+    return Vec3f(_HalfToFloat(_weight[3 * i]), _HalfToFloat(_weight[3 * i + 1]), _HalfToFloat(_weight[3 * i + 2]));
+}
+
+Vec3f GatherPointStore::Emission(uint32_t i) const
+{
+    return _DecodeRgbe(_emission[i]);
+}
+
+void GatherPointStore::Get(uint32_t i, GatherPoint &gp) const
+{
+    DifferentialGeometry &dp = gp.isect.dp;
+    dp.P = _P[i];
+    dp.N = dp.Ng = Normal(i);
+    dp.uv = dp.st = _st[i];
+    dp.GenerateTuTv();
+    gp.isect.t = 0.0f;
+    gp.isect.m = GetMaterial(i);
+    gp.isect.rayEpsilon = _rayEpsilon[i];
+    gp.emission = Emission(i);
+    gp.weight = Weight(i);
+    gp.pixel = Pixel(i);
+    gp.wo = Wo(i);
+    gp.strength = _strength;
+    gp.index = _sample[i];
+}
+
+void GatherPointStore::SceneMaterials(Scene *scene, vector<Material*> &table)
+{
+    table.clear();
+    for (uint32_t i = 0; i < scene->Surfaces().size(); i++)
+        table.push_back(scene->Surfaces()[i]->MaterialRef().get());
+    for (uint32_t i = 0; i < scene->Instances().size(); i++)
+    {
+        vector<shared_ptr<Material> > &materials = scene->Instances()[i]->MaterialArray();
+        for (uint32_t k = 0; k < materials.size(); k++)
+            table.push_back(materials[k].get());
+    }
+}
+
+void GatherPointStore::Save(CheckpointWriter &writer, const vector<Material*> &table) const
+{
+    vector<uint32_t> materials(_materials.size());
+    for (uint32_t k = 0; k < _materials.size(); k++)
+    {
+        materials[k] = static_cast<uint32_t>(std::find(table.begin(), table.end(), _materials[k]) - table.begin());
+        assert(materials[k] < table.size());
+    }
+    writer.WriteValue(_width);
+    writer.WriteValue(_strength);
+    writer.Write(materials);
+    writer.Write(_P);
+    writer.Write(_st);
+    writer.Write(_normal);
+    writer.Write(_wo);
+    writer.Write(_rayEpsilon);
+    writer.Write(_pixel);
+    writer.Write(_sample);
+    writer.Write(_material);
+    writer.Write(_weight);
+    writer.Write(_emission);
+}
+
+bool GatherPointStore::Load(CheckpointReader &reader, const vector<Material*> &table)
+{
+    Clear();
+    vector<uint32_t> materials;
+    bool good = reader.ReadValue(_width) && reader.ReadValue(_strength) && reader.Read(materials) &&
+        reader.Read(_P) && reader.Read(_st) && reader.Read(_normal) && reader.Read(_wo) &&
+        reader.Read(_rayEpsilon) && reader.Read(_pixel) && reader.Read(_sample) && reader.Read(_material) &&
+        reader.Read(_weight) && reader.Read(_emission);
+    uint32_t n = Size();
+    good = good && _st.size() == n && _normal.size() == n && _wo.size() == n && _rayEpsilon.size() == n &&
+        _pixel.size() == n && _sample.size() == n && _material.size() == n && _weight.size() == 3 * n && _emission.size() == n;
+    for (uint32_t k = 0; good && k < materials.size(); k++)
+    {
+        good = materials[k] < table.size();
+        if (good)
+            _materials.push_back(table[materials[k]]);
+    }
+    for (uint32_t i = 0; good && i < n; i++)
+        good = _material[i] < _materials.size();
+    if (!good)
+        Clear();
+    return good;
+}
@@ -0,0 +1,83 @@
+#ifndef GatherPointStore_h__
+#define GatherPointStore_h__
+
+#include <ray/intersection.h>
+#include <misc/checkpoint.h>
+#include <vector>
+
+using std::vector;
+
+class Scene;
+
+struct GatherPoint
+{
+    Vec3f			emission;
+    Vec3f			weight;
+    Vec2i           pixel;
+    Intersection    isect;
+    Vec3f           wo;
+	float			strength;
+    uint32_t        index;
+};
+
+// Gather points of one shoot, stored field by field in compressed form:
+// normals and outgoing directions are octahedral, weights half floats,
+// emission shared exponent rgb and materials indices into a table of the
+// store. About 50 bytes per point. Get rebuilds the full point, with the
+// shading frame regenerated from the normal as the shapes do.
+class GatherPointStore
+{
+public:
+    GatherPointStore() : _width(0), _strength(0.0f) {}
+
+    void                Init(uint32_t width, uint32_t samples);
+    void                Clear();
+    // clears and frees the storage of the points
+    void                Release();
+    void                Reserve(uint32_t n);
+    void                Append(const GatherPoint &gp);
+    // appends the parts in order and empties them
+    void                Concatenate(vector<GatherPointStore> &parts);
+
+    inline uint32_t     Size() const { return static_cast<uint32_t>(_P.size()); }
+    inline bool         Empty() const { return _P.empty(); }
+    inline float        Strength() const { return _strength; }
+    uint64_t            Memory() const;
+    inline const Vec3f& Position(uint32_t i) const { return _P[i]; }
+    Vec3f               Normal(uint32_t i) const;
+    Vec3f               Wo(uint32_t i) const;
+    inline Vec2i        Pixel(uint32_t i) const { return Vec2i(_pixel[i] % _width, _pixel[i] / _width); }
+    inline uint32_t     SampleIndex(uint32_t i) const { return _sample[i]; }
+    inline Material*    GetMaterial(uint32_t i) const { return _materials[_material[i]]; }
+    Vec3f               Weight(uint32_t i) const;
+    Vec3f               Emission(uint32_t i) const;
+    void                Get(uint32_t i, GatherPoint &gp) const;
+
+    // materials are stored as indices into table, which lists the materials
+    // of the scene as SceneMaterials does, so another load of the scene reads
+    // the points back
+    void                Save(CheckpointWriter &writer, const vector<Material*> &table) const;
+    bool                Load(CheckpointReader &reader, const vector<Material*> &table);
+    static void         SceneMaterials(Scene *scene, vector<Material*> &table);
+
+protected:
+    void                _Resize(uint32_t n);
+    uint16_t            _MaterialIndex(Material *m);
+
+    uint32_t            _width;
+    float               _strength;
+    vector<Material*>   _materials;
+
+    vector<Vec3f>       _P;
+    vector<Vec2f>       _st;
+    vector<uint32_t>    _normal;
+    vector<uint32_t>    _wo;
+    vector<float>       _rayEpsilon;
+    vector<uint32_t>    _pixel;         // j * width + i
+    vector<uint16_t>    _sample;
+    vector<uint16_t>    _material;
+    vector<uint16_t>    _weight;        // 3 per point
+    vector<uint32_t>    _emission;
+};
+
+#endif // GatherPointStore_h__
@@ -1,27 +1,19 @@
 #include "Lightcutter.h"
 #include <scene/camera.h>
 #include <scene/background.h>
+#include <vmath/frame.h>
+#include <xmmintrin.h>
 
 #define MAX_RAYTRACE_DEPTH 10
 
-struct LightcutHeapItem
+void GenerateLightcutSeeds(Image<uint64_t> *seeds)
 {
-    LightcutHeapItem(LightTreeNode *node, Vec3f ub, Vec3f est = Vec3f::Zero()) : _node(node), _estimate(est), _upperBound(ub)
-    {
-        _e = _upperBound.Average();
-    }
-    bool operator< (const LightcutHeapItem &p2) const 
-    {
-        return _e == p2._e ? (_node < p2._node) : _e < p2._e;
-    }
-    LightTreeNode   *_node;
-    Vec3f           _upperBound;
-    float           _e;
-    Vec3f           _estimate;
-};
-
+    minstd_rand0 seeder;
+    for (uint32_t i = 0; i < seeds->Size(); i++)
+        seeds->ElementAt(i) = seeder();
+}
 
-Lightcutter::Lightcutter(LightTree *lightTree, Scene *scene, RayEngine *engine, float error, uint32_t maxCutSize) 
+Lightcutter::Lightcutter(FlatLightTree *lightTree, Scene *scene, RayEngine *engine, float error, uint32_t maxCutSize) 
     : _scene(scene), _engine(engine), _maxCutSize(maxCutSize), _lightTree(lightTree), _error(error)
 {
     float radius = (_engine->ComputeBoundingBox().Diagonal() / 2.0f) * 0.05f;
@@ -34,38 +26,55 @@ Lightcutter::~Lightcutter(void)
 
 void Lightcutter::Lightcut(Image<Vec3f> *image, uint32_t samples, Image<uint32_t> *cutImage, ReportHandler *report)
 {
-    const float time = 0.0f; // lightcut do not support motion blur;
     if (report) report->beginActivity("Lightcutting..");
-    Vec2f pixelSize(1.0f/image->Width(), 1.0f/image->Height());
+	Image<uint64_t> randSeeds(image->Width(), image->Height());
+    GenerateLightcutSeeds(&randSeeds);
 
-	StratifiedPathSamplerStd sampler;
+    Vec2f pixelSize(1.0f/image->Width(), 1.0f/image->Height());
+    LightcutScratch scratch;
     for(uint32_t j = 0; j < image->Height(); j ++) 
     {
         for(uint32_t i = 0; i < image->Width(); i ++) 
         {
-            Vec2f pixel(Vec2i(i,j));
-            sampler.BeginPixel(samples);
             uint32_t cutSize = 0;
-            Vec3f L;
-            for (uint32_t s = 0; s < samples; s++)
-            {
-                uint32_t cs = 0;
-                Vec2f puv = (pixel + ((samples == 1) ? Vec2f(0.5f, 0.5f) : sampler.Pixel())) * pixelSize;
-                Ray ray = _scene->MainCamera()->GenerateRay(puv, time);
-                L += EvaluateLightcut(ray, cs) / static_cast<float>(samples);
-                cutSize += cs;
-                sampler.NextPixelSample();
-            }
-            sampler.EndPixel();
+            Vec3f L = _RenderPixel(i, j, pixelSize, randSeeds.ElementAt(i, j), samples, scratch, cutSize);
             image->ElementAt(i, image->Height() - j - 1) = L;
             if(cutImage) cutImage->ElementAt(i, cutImage->Height() - j - 1) = cutSize;
-            if(report) report->progress((float)j / (float)(image->Height()), 1);
         }
+        if(report) report->progress((float)j / (float)(image->Height()), 1);
     }
     if (report) report->endActivity();
 }
 
+Vec3f Lightcutter::_RenderPixel(uint32_t i, uint32_t j, const Vec2f &pixelSize, uint64_t seed, uint32_t samples, LightcutScratch &scratch, uint32_t &cutSize)
+{
+    const float time = 0.0f; // lightcut do not support motion blur;
+	StratifiedPathSamplerStd::Engine e(seed);
+	StratifiedPathSamplerStd sampler(e);
+
+    sampler.BeginPixel(samples);
+    Vec3f L;
+    for (uint32_t s = 0; s < samples; s++)
+    {
+        uint32_t cs = 0;
+        Vec2f pixel(Vec2i(i,j));
+        Vec2f puv = (pixel + ((samples == 1) ? Vec2f(0.5f, 0.5f) : sampler.Pixel())) * pixelSize;
+        Ray ray = _scene->MainCamera()->GenerateRay(puv, time);
+        L += EvaluateLightcut(ray, cs, scratch) / static_cast<float>(samples);
+        cutSize += cs;
+        sampler.NextPixelSample();
+    }
+    sampler.EndPixel();
+    return L;
+}
+
 Vec3f Lightcutter::EvaluateLightcut( const Ray &r, uint32_t &cutSize )
+{
+    LightcutScratch scratch;
+    return EvaluateLightcut(r, cutSize, scratch);
+}
+
+Vec3f Lightcutter::EvaluateLightcut( const Ray &r, uint32_t &cutSize, LightcutScratch &scratch )
 {
 	Ray ray = r;
 	Vec3f throughput = Vec3f::One();
@@ -102,7 +111,7 @@ Vec3f Lightcutter::EvaluateLightcut( const Ray &r, uint32_t &cutSize )
 		{
 			uint32_t cs = 0;
 			Vec3f Ld = Vec3f::Zero();
-            Ld += _EvaluateCut(dp, wo, isect.rayEpsilon, isect.m, cs);
+            Ld += _EvaluateCut(dp, wo, isect.rayEpsilon, isect.m, cs, scratch);
 			cutSize += cs;
 
 			Vec3f Li = msu.Emission(wo,dp) + Ld;
@@ -111,9 +120,16 @@ Vec3f Lightcutter::EvaluateLightcut( const Ray &r, uint32_t &cutSize )
 	}
 }
 
-Vec3f Lightcutter::_EvalutateNode(const OrientedLightTreeNode *node, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms)
+Vec3f Lightcutter::_EvalutateNode(const FlatLightHierarchy &tree, const FlatLightNode &node, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms)
+{
+    if (tree.GetNodeType() == ORIENTED_NODE)
+        return _EvalutateLight(_lightTree->GetOrientedLight(node.light), dp, wo, rayEpsilon, ms);
+    else
+        return _EvalutateLight(_lightTree->GetDirLight(node.light), dp, wo, rayEpsilon, ms);
+}
+
+Vec3f Lightcutter::_EvalutateLight(const OrientedLight &light, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms)
 {
-    OrientedLight& light = *(node->light);
     Vec3f wi = (light.position - dp.P).GetNormalized();
     float maxDist = (light.position - dp.P).GetLength();
     float cosAngle = max(0.0f, light.normal % (-wi));
@@ -135,10 +151,9 @@ Vec3f Lightcutter::_EvalutateNode(const OrientedLightTreeNode *node, Differentia
     return Vec3f::Zero();
 }
 
-Vec3f Lightcutter::_EvalutateNode(const DirectionalLightTreeNode *node, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms)
+Vec3f Lightcutter::_EvalutateLight(const DirLight &light, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms)
 {
-    DirLight* light = node->light;
-    Vec3f wi = -light->normal;
+    Vec3f wi = -light.normal;
     BxdfUnion msu;
     ms->SampleReflectance(dp, msu);
     Vec3f brdf = msu.EvalSmoothCos(wo, wi, dp);
@@ -155,194 +170,166 @@ Vec3f Lightcutter::_EvalutateNode(const DirectionalLightTreeNode *node, Differen
     return Vec3f::Zero();
 }
 
-Vec3f Lightcutter::_ComputeUpperBound(const OrientedLightTreeNode *node, DifferentialGeometry & dp, const Vec3f &wo, Material *ms)
+static void _SetFrame(const Vec3f &z, Vec3f *frame)
 {
-    OrientedLight* light = node->light;
-    Vec3f wi = (light->position - dp.P).GetNormalized();
-
-    const Vec3f &m = node->bbox.GetMin();
-    const Vec3f &M = node->bbox.GetMax();
-    Vec3f bp = dp.P.Clamp(m, M);
-    float lenSqr = max(_clamp, (dp.P - bp).GetLengthSqr());
-
-    float cosBound = 1.0f;
-    float cosHalfAngle = node->cone.GetAngleCos();
-    if (cosHalfAngle <= 0.0f)
-        cosBound = 1.0f;
-    else
-    {
-        Vec3f vv = (Vec3f::Z() ^ node->cone.GetAxis()).GetNormalized();
-        Matrix4f mt = Matrix4f::Rotation(vv, -acosf(Vec3f::Z() % node->cone.GetAxis()));
-
-        Vec3f corners[8];
-        Range3f xbox = Range3f::Empty();
-        node->bbox.GetCorners(corners);
-        for (int i = 0; i < 8; i++)
-            xbox.Grow(mt.TransformPoint(dp.P - corners[i]));
-
-
-        Vec3f &xm = xbox.GetMinRef();
-        Vec3f &xM = xbox.GetMaxRef();
-
-        float cosTheta;
-        if (xM.z > 0)
-        {
-            float minx2, miny2;
-            if (xm.x * xM.x <= 0)
-                minx2 = 0.0f;
-            else
-                minx2 = min(xm.x * xm.x, xM.x * xM.x);
-
-            if (xm.y * xM.y <= 0)
-                miny2 = 0.0f;
-            else
-                miny2 = min(xm.y * xm.y, xM.y * xM.y);
-            float maxz2 = xM.z * xM.z;
-            cosTheta = xM.z / sqrt(minx2 + miny2 + maxz2);
-        }
-        else
-            cosTheta = 0;
-        
-        cosTheta = clamp(cosTheta, 0.0f, 1.0f);
-
-        if (cosTheta > cosHalfAngle)
-            cosBound = 1.0f;
-        else
-        {
-            float sinHalfAngle = sqrt(1 - cosHalfAngle * cosHalfAngle);
-            float sinTheta = sqrt(1 - cosTheta * cosTheta);
-            cosBound = clamp(cosTheta * cosHalfAngle + sinTheta * sinHalfAngle, 0.0f, 1.0f);
-            assert(cosBound >= 0.0f && cosBound <= 1.0f);
-        }
-    }
-    return (node->L * _BoundMaterial(node->bbox, wo, dp, ms, false) * (cosBound / lenSqr)).Abs();
+    Frame<float> f;
+    f.SetZ(z);
+    f.RenormalizeFromZ();
+    frame[0] = f.GetX();
+    frame[1] = f.GetY();
+    frame[2] = f.GetZ();
 }
 
-Vec3f Lightcutter::_ComputeUpperBound(const DirectionalLightTreeNode *node, DifferentialGeometry & dp, const Vec3f &wo, Material *ms)
+LightcutShadingPoint::LightcutShadingPoint(const DifferentialGeometry &dp, const Vec3f &wo, const Material *m)
+    : P(dp.P), mat(m->ApprtoximateAsGLPhong(dp))
 {
-    DirLight* light = node->light;
-    Vec3f wi = -light->normal;
-    return (node->L * _BoundMaterial(node->bbox, wo, dp, ms, true)).Abs();
+    _SetFrame(dp.N, normalFrame);
+    glossy = !mat.Ks.IsZero() && mat.n != 0;
+    if (glossy)
+    {
+        Vec3f R = ReflectanceUtils::MirrorDirection(dp.N, wo);
+        if (R == wo || dp.N == wo)
+            R = wo;
+        _SetFrame(R, glossyFrame);
+    }
 }
 
+// a box of directions, given by center and half size, seen from a frame
+struct LightcutBoundLane
+{
+    Vec3f           center;
+    Vec3f           extent;
+    const Vec3f     *frame;
+};
 
-Vec3f Lightcutter::_BoundMaterial( const Range3f &bbox, const Vec3f &wo, const DifferentialGeometry & dp, const Material *m, bool dirLight )
+// Bounds, per lane, the cosine between the frame z axis and the directions
+// of the box. The rotated box is taken from the center and the absolute
+// frame, which is the box of the 8 rotated corners without rotating them.
+static __m128 _BoundCosine(const LightcutBoundLane *l)
 {
-    GLPhongApproximation matApprox = m->ApprtoximateAsGLPhong(dp);
-    Vec3f vv = (Vec3f::Z() ^ dp.N).GetNormalized();
-    Matrix4f mt = Matrix4f::Rotation(vv, -acosf(Vec3f::Z() % dp.N));
-
-    Vec3f corners[8];
-    Range3f xbox = Range3f::Empty();
-    bbox.GetCorners(corners);
-    for (int i = 0; i < 8; i++)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 c[3], e[3], lo[3], hi[3];
+    for (int k = 0; k < 3; k++)
     {
-        if (!dirLight)
-            corners[i] -= dp.P;
-        else
-            corners[i] *= -1;
-        xbox.Grow(mt.TransformPoint(corners[i]));
+        c[k] = _mm_set_ps(l[3].center[k], l[2].center[k], l[1].center[k], l[0].center[k]);
+        e[k] = _mm_set_ps(l[3].extent[k], l[2].extent[k], l[1].extent[k], l[0].extent[k]);
     }
-
-    Vec3f &xm = xbox.GetMinRef();
-    Vec3f &xM = xbox.GetMaxRef();
-
-    float cosTheta;
-    if (xM.z > 0)
+    for (int k = 0; k < 3; k++)
     {
-        float minx2, miny2;
-        if (xm.x * xM.x <= 0)
-            minx2 = 0.0f;
-        else
-            minx2 = min(xm.x * xm.x, xM.x * xM.x);
-
-        if (xm.y * xM.y <= 0)
-            miny2 = 0.0f;
-        else
-            miny2 = min(xm.y * xm.y, xM.y * xM.y);
-        float maxz2 = xM.z * xM.z;
-        cosTheta = xM.z / sqrt(minx2 + miny2 + maxz2);
+        __m128 f0 = _mm_set_ps(l[3].frame[k].x, l[2].frame[k].x, l[1].frame[k].x, l[0].frame[k].x);
+        __m128 f1 = _mm_set_ps(l[3].frame[k].y, l[2].frame[k].y, l[1].frame[k].y, l[0].frame[k].y);
+        __m128 f2 = _mm_set_ps(l[3].frame[k].z, l[2].frame[k].z, l[1].frame[k].z, l[0].frame[k].z);
+        __m128 ck = _mm_add_ps(_mm_add_ps(_mm_mul_ps(f0, c[0]), _mm_mul_ps(f1, c[1])), _mm_mul_ps(f2, c[2]));
+        __m128 ek = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, f0), e[0]), 
+            _mm_mul_ps(_mm_andnot_ps(signMask, f1), e[1])), _mm_mul_ps(_mm_andnot_ps(signMask, f2), e[2]));
+        lo[k] = _mm_sub_ps(ck, ek);
+        hi[k] = _mm_add_ps(ck, ek);
     }
-    else
-        cosTheta = 0.0f;
 
-    assert(cosTheta >= 0.0f && cosTheta <= 1.0f);
-    cosTheta = clamp(cosTheta, 0.0f, 1.0f);
+    __m128 minxy2 = zero;
+    for (int k = 0; k < 2; k++)
+    {
+        __m128 straddle = _mm_cmple_ps(_mm_mul_ps(lo[k], hi[k]), zero);
+        __m128 min2 = _mm_min_ps(_mm_mul_ps(lo[k], lo[k]), _mm_mul_ps(hi[k], hi[k]));
+        minxy2 = _mm_add_ps(minxy2, _mm_andnot_ps(straddle, min2));
+    }
+    __m128 zM = hi[2];
+    __m128 front = _mm_cmpgt_ps(zM, zero);
+    __m128 cosTheta = _mm_div_ps(zM, _mm_sqrt_ps(_mm_add_ps(minxy2, _mm_mul_ps(zM, zM))));
+    return _mm_min_ps(_mm_and_ps(front, cosTheta), _mm_set1_ps(1.0f));
+}
 
-    if (!matApprox.Ks.IsZero() && matApprox.n != 0)
+void Lightcutter::_ComputeUpperBounds(const FlatLightHierarchy &tree, const uint32_t *nodes, uint32_t count, const LightcutShadingPoint &sp, Vec3f *bounds)
+{
+    assert(count <= 2);
+    bool oriented = tree.GetNodeType() == ORIENTED_NODE;
+
+    // lanes: material cosines, then the cone cosines of oriented nodes, then the glossy lobe
+    uint32_t coneBase = count;
+    uint32_t glossyBase = oriented ? 2 * count : count;
+    uint32_t laneNum = glossyBase + (sp.glossy ? count : 0);
+    LightcutBoundLane lanes[8];
+    for (uint32_t i = 0; i < count; i++)
     {
-        //Phong material
-        float glossyCosBound = 1.0f;
-        Vec3f R = ReflectanceUtils::MirrorDirection(dp.N, wo);
-        if (R == wo || dp.N == wo)
+        const FlatLightBound &b = tree.GetBound(nodes[i]);
+        // towards the lights, for directional lights the bbox holds their normals
+        Vec3f toLight = oriented ? b.center - sp.P : -b.center;
+        LightcutBoundLane material = { toLight, b.extent, sp.normalFrame };
+        lanes[i] = material;
+        if (oriented)
         {
-            R = wo;
+            LightcutBoundLane cone = { -toLight, b.extent, b.frame };
+            lanes[coneBase + i] = cone;
         }
+        if (sp.glossy)
+        {
+            LightcutBoundLane glossy = { toLight, b.extent, sp.glossyFrame };
+            lanes[glossyBase + i] = glossy;
+        }
+    }
+    for (uint32_t i = laneNum; i < 8; i++)
+        lanes[i] = lanes[0];
 
-        Vec3f gv = (Vec3f::Z() ^ R).GetNormalized();
-        Matrix4f gmt = Matrix4f::Rotation(gv, -acosf(Vec3f::Z() % R));
-
-        Range3f gbox = Range3f::Empty();
-        for (int i = 0; i < 8; i++)
-            gbox.Grow(gmt.TransformPoint(corners[i]));
-
-        Vec3f &gm = gbox.GetMinRef();
-        Vec3f &gM = gbox.GetMaxRef();
+    float cosines[8];
+    _mm_storeu_ps(cosines, _BoundCosine(lanes));
+    if (laneNum > 4)
+        _mm_storeu_ps(cosines + 4, _BoundCosine(lanes + 4));
 
-        if (gM.z > 0)
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const FlatLightNode &node = tree.GetNode(nodes[i]);
+        Vec3f matBound = sp.mat.Kd * cosines[i];
+        if (sp.glossy)
+            matBound += sp.mat.Ks * (pow(cosines[glossyBase + i], sp.mat.n) * cosines[i]);
+        if (!oriented)
         {
-            float minx2, miny2;
-            if (gm.x * gM.x <= 0)
-                minx2 = 0.0f;
-            else
-                minx2 = min(gm.x * gm.x, gM.x * gM.x);
-
-            if (gm.y * gM.y <= 0)
-                miny2 = 0.0f;
-            else
-                miny2 = min(gm.y * gm.y, gM.y * gM.y);
-            float maxz2 = gM.z * gM.z;
-            glossyCosBound = gM.z / sqrt(minx2 + miny2 + maxz2);
+            bounds[i] = (node.L * matBound).Abs();
+            continue;
         }
-        else
-            glossyCosBound = 0.0f;
 
-        glossyCosBound = clamp(glossyCosBound, 0.0f, 1.0f);
-        assert(glossyCosBound <= 1.0f);
+        float cosBound = 1.0f;
+        float cosHalfAngle = node.cosAngle;
+        float cosTheta = cosines[coneBase + i];
+        if (cosHalfAngle > 0.0f && cosTheta <= cosHalfAngle)
+        {
+            float sinHalfAngle = sqrt(1 - cosHalfAngle * cosHalfAngle);
+            float sinTheta = sqrt(1 - cosTheta * cosTheta);
+            cosBound = clamp(cosTheta * cosHalfAngle + sinTheta * sinHalfAngle, 0.0f, 1.0f);
+        }
 
-        return (matApprox.Kd + (matApprox.Ks * pow(glossyCosBound, matApprox.n))) * cosTheta;
+        const FlatLightBound &b = tree.GetBound(nodes[i]);
+        Vec3f d = Vec3f::Max((sp.P - b.center).Abs() - b.extent, Vec3f::Zero());
+        float lenSqr = max(_clamp, d.GetLengthSqr());
+        bounds[i] = (node.L * matBound * (cosBound / lenSqr)).Abs();
     }
-
-    return matApprox.Kd * cosTheta;
 }
 
-Vec3f Lightcutter::_EvaluateCut( DifferentialGeometry &dp, const Vec3f &wo, float rayEpsilon, Material *m, uint32_t &cs )
+Vec3f Lightcutter::_EvaluateCut( DifferentialGeometry &dp, const Vec3f &wo, float rayEpsilon, Material *m, uint32_t &cs, LightcutScratch &scratch )
 {
-    vector<LightcutHeapItem> lightcut;
+    vector<LightcutHeapItem> &lightcut = scratch.heap;
+    vector<Vec3f> &leafContrib = scratch.leafContrib;
+    lightcut.clear();
+    leafContrib.clear();
     lightcut.reserve(_maxCutSize);
+    LightcutShadingPoint sp(dp, wo, m);
 
     Vec3f totalEstL, estimate, bound;
-    if (_lightTree->GetOrientedRoot())
-    {
-        estimate = _EvalutateNode(_lightTree->GetOrientedRoot(), dp, wo, rayEpsilon, m);
-        bound = _ComputeUpperBound(_lightTree->GetOrientedRoot(), dp, wo, m);
-        totalEstL += _lightTree->GetOrientedRoot()->L * estimate;
-        cs++;
-        lightcut.push_back(LightcutHeapItem(_lightTree->GetOrientedRoot(), bound, estimate));
-        push_heap(lightcut.begin(), lightcut.end());
-    }
-
-    if (_lightTree->GetDirectionalRoot())
+    const FlatLightHierarchy *trees[2] = { &_lightTree->GetOriented(), &_lightTree->GetDirectional() };
+    for (uint32_t t = 0; t < 2; t++)
     {
-        estimate = _EvalutateNode(_lightTree->GetDirectionalRoot(), dp, wo, rayEpsilon, m);
-        bound = _ComputeUpperBound(_lightTree->GetDirectionalRoot(), dp, wo, m);
-        totalEstL += _lightTree->GetDirectionalRoot()->L * estimate;
+        if (trees[t]->Empty())
+            continue;
+        const FlatLightNode &root = trees[t]->GetNode(0);
+        uint32_t rootIdx = 0;
+        estimate = _EvalutateNode(*trees[t], root, dp, wo, rayEpsilon, m);
+        _ComputeUpperBounds(*trees[t], &rootIdx, 1, sp, &bound);
+        totalEstL += root.L * estimate;
         cs++;
-        lightcut.push_back(LightcutHeapItem(_lightTree->GetDirectionalRoot(), bound, estimate));
+        lightcut.push_back(LightcutHeapItem(trees[t], 0, bound, estimate));
         push_heap(lightcut.begin(), lightcut.end());
     }
 
-    vector<Vec3f> leafContrib;
     while(lightcut.size() > 0 && cs < _maxCutSize)
     {
         pop_heap(lightcut.begin(), lightcut.end());
@@ -353,74 +340,40 @@ Vec3f Lightcutter::_EvaluateCut( DifferentialGeometry &dp, const Vec3f &wo, floa
             break;
         lightcut.pop_back();
 
-        if (cutItem._node == NULL || cutItem._node->IsLeaf())
+        const FlatLightHierarchy &tree = *cutItem._tree;
+        const FlatLightNode &node = tree.GetNode(cutItem._node);
+        if (node.IsLeaf())
             continue;
 
-        if(cutItem._node->GetNodeType() == ORIENTED_NODE)
+        uint32_t children[2] = { tree.Left(cutItem._node), tree.Right(cutItem._node) };
+        totalEstL -= node.L * cutItem._estimate;
+        cs++;
+        uint32_t inner[2];
+        Vec3f innerEst[2];
+        uint32_t innerNum = 0;
+        for (uint32_t c = 0; c < 2; c++)
         {
-            OrientedLightTreeNode *node = static_cast<OrientedLightTreeNode*>(cutItem._node);
-            OrientedLightTreeNode *leftNode = node->left;
-            Vec3f leftEst = (node->light == leftNode->light) ? cutItem._estimate : _EvalutateNode(leftNode, dp, wo, rayEpsilon, m);
-            Vec3f lL = leftNode->L * leftEst;
-
-            OrientedLightTreeNode *rightNode = node->right;
-            Vec3f rightEst = (node->light == rightNode->light) ? cutItem._estimate : _EvalutateNode(rightNode, dp, wo, rayEpsilon, m);
-            Vec3f rL = rightNode->L * rightEst;
+            const FlatLightNode &child = tree.GetNode(children[c]);
+            Vec3f childEst = (node.light == child.light) ? cutItem._estimate : _EvalutateNode(tree, child, dp, wo, rayEpsilon, m);
+            Vec3f childL = child.L * childEst;
+            totalEstL += childL;
 
-            totalEstL -= node->L * cutItem._estimate;
-            totalEstL += lL + rL; 
-            cs++;
-
-            if (leftNode->IsLeaf())
-                leafContrib.push_back(lL);
+            if (child.IsLeaf())
+                leafContrib.push_back(childL);
             else
             {
-                Vec3f leftErr = _ComputeUpperBound(leftNode, dp, wo, m);
-                lightcut.push_back(LightcutHeapItem(leftNode, leftErr, leftEst));
-                push_heap(lightcut.begin(), lightcut.end());
-            }
-
-            if (rightNode->IsLeaf())
-                leafContrib.push_back(rL);
-            else
-            {
-                Vec3f rightErr = _ComputeUpperBound(rightNode, dp, wo, m);
-                lightcut.push_back(LightcutHeapItem(rightNode, rightErr, rightEst));
-                push_heap(lightcut.begin(), lightcut.end());
+                inner[innerNum] = children[c];
+                innerEst[innerNum++] = childEst;
             }
         }
-        else if(cutItem._node->GetNodeType() == DIRECT_NODE)
-        {
-            DirectionalLightTreeNode *node = static_cast<DirectionalLightTreeNode*>(cutItem._node);
-            DirectionalLightTreeNode *leftNode = node->left;
-            Vec3f leftEst = (node->light == leftNode->light) ? cutItem._estimate : _EvalutateNode(leftNode, dp, wo, rayEpsilon, m);
-            Vec3f lL = leftNode->L * leftEst;
-
-            DirectionalLightTreeNode *rightNode = node->right;
-            Vec3f rightEst = (node->light == rightNode->light) ? cutItem._estimate : _EvalutateNode(rightNode, dp, wo, rayEpsilon, m);
-            Vec3f rL = rightNode->L * rightEst;
 
-            totalEstL -= node->L * cutItem._estimate;
-            totalEstL += lL + rL; 
-            cs++;
-
-            if (leftNode->IsLeaf())
-                leafContrib.push_back(lL);
-            else
-            {
-                Vec3f leftErr = _ComputeUpperBound(leftNode, dp, wo, m);
-                lightcut.push_back(LightcutHeapItem(leftNode, leftErr, leftEst));
-                push_heap(lightcut.begin(), lightcut.end());
-            }
-
-            if (rightNode->IsLeaf())
-                leafContrib.push_back(rL);
-            else
-            {
-                Vec3f rightErr = _ComputeUpperBound(rightNode, dp, wo, m);
-                lightcut.push_back(LightcutHeapItem(rightNode, rightErr, rightEst));
-                push_heap(lightcut.begin(), lightcut.end());
-            }
+        Vec3f childErr[2];
+        if (innerNum)
+            _ComputeUpperBounds(tree, inner, innerNum, sp, childErr);
+        for (uint32_t c = 0; c < innerNum; c++)
+        {
+            lightcut.push_back(LightcutHeapItem(&tree, inner[c], childErr[c], innerEst[c]));
+            push_heap(lightcut.begin(), lightcut.end());
         }
     }
 
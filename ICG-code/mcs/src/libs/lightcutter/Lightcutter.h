@@ -1,32 +1,73 @@
 #ifndef _LIGHT_CUT_INTEGRATOR_H_
 #define _LIGHT_CUT_INTEGRATOR_H_
-#include <lighttree/LightTree.h>
+#include <lighttree/FlatLightTree.h>
 #include <image/image.h>
 #include <sampler/pathSampler.h>
 #include <misc/report.h>
 #include <scene/scene.h>
 #include <ray/rayEngine.h>
 
+// Shading point terms shared by every bound of one cut: the material
+// approximation and the frames of the normal and of the glossy lobe.
+struct LightcutShadingPoint
+{
+    LightcutShadingPoint(const DifferentialGeometry &dp, const Vec3f &wo, const Material *m);
+    Vec3f                   P;
+    Vec3f                   normalFrame[3];
+    Vec3f                   glossyFrame[3];
+    GLPhongApproximation    mat;
+    bool                    glossy;
+};
+
+struct LightcutHeapItem
+{
+    LightcutHeapItem(const FlatLightHierarchy *tree, uint32_t node, Vec3f ub, Vec3f est = Vec3f::Zero()) : _tree(tree), _node(node), _estimate(est), _upperBound(ub)
+    {
+        _e = _upperBound.Average();
+    }
+    bool operator< (const LightcutHeapItem &p2) const 
+    {
+        return _e == p2._e ? (_tree == p2._tree ? _node < p2._node : _tree < p2._tree) : _e < p2._e;
+    }
+    const FlatLightHierarchy    *_tree;
+    uint32_t                    _node;
+    Vec3f                       _upperBound;
+    float                       _e;
+    Vec3f                       _estimate;
+};
+
+// cut storage kept by a thread across the pixels it renders
+struct LightcutScratch
+{
+    vector<LightcutHeapItem>    heap;
+    vector<Vec3f>               leafContrib;
+};
+
+// one seed per pixel, the same sequence for every render
+void GenerateLightcutSeeds(Image<uint64_t> *seeds);
+
 class Lightcutter
 {
 public:
-    Lightcutter(LightTree *lightTree, Scene *scene, RayEngine *engine, float error = 0.02f, uint32_t maxCutSize = 1000);
+    Lightcutter(FlatLightTree *lightTree, Scene *scene, RayEngine *engine, float error = 0.02f, uint32_t maxCutSize = 1000);
     ~Lightcutter(void);
 
     virtual void	Lightcut(Image<Vec3f> *image, uint32_t samples, Image<uint32_t> *cutImage, ReportHandler *report = 0);
     virtual Vec3f   EvaluateLightcut( const Ray &ray, uint32_t &cutSize );
+    Vec3f           EvaluateLightcut( const Ray &ray, uint32_t &cutSize, LightcutScratch &scratch );
 protected:
-    Vec3f           _EvalutateNode(const OrientedLightTreeNode *node, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms);
-    Vec3f           _EvalutateNode(const DirectionalLightTreeNode *node, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms);
+    Vec3f           _RenderPixel(uint32_t i, uint32_t j, const Vec2f &pixelSize, uint64_t seed, uint32_t samples, LightcutScratch &scratch, uint32_t &cutSize);
+    Vec3f           _EvalutateNode(const FlatLightHierarchy &tree, const FlatLightNode &node, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms);
+    Vec3f           _EvalutateLight(const OrientedLight &light, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms);
+    Vec3f           _EvalutateLight(const DirLight &light, DifferentialGeometry& dp, const Vec3f &wo, float rayEpsilon, Material *ms);
 
-    Vec3f           _ComputeUpperBound(const OrientedLightTreeNode *node, DifferentialGeometry& dp, const Vec3f &wo, Material *ms);
-    Vec3f           _ComputeUpperBound(const DirectionalLightTreeNode *node, DifferentialGeometry& dp, const Vec3f &wo, Material *ms);
-    Vec3f           _BoundMaterial(const Range3f &bbox, const Vec3f &wo, const DifferentialGeometry & dp, const Material *m, bool dirLight );
-    Vec3f           _EvaluateCut(DifferentialGeometry &dp, const Vec3f &wo, float rayEpsilon, Material *m, uint32_t &cs );
+    // bounds up to two nodes of the same hierarchy at once
+    void            _ComputeUpperBounds(const FlatLightHierarchy &tree, const uint32_t *nodes, uint32_t count, const LightcutShadingPoint &sp, Vec3f *bounds);
+    Vec3f           _EvaluateCut(DifferentialGeometry &dp, const Vec3f &wo, float rayEpsilon, Material *m, uint32_t &cs, LightcutScratch &scratch );
     Scene								*_scene;
     RayEngine							*_engine;
     uint32_t                            _maxCutSize;
-    LightTree							*_lightTree;
+    FlatLightTree						*_lightTree;
     float                               _clamp;
     float                               _error;
 };
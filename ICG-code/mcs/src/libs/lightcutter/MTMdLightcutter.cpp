@@ -7,32 +7,35 @@
 #include <ray/rayEngine.h>
 #include <tbbutils/tbbutils.h>
 #include "lighttree/GatherTreeBuilder.h"
+#include "Lightcutter.h"
+#include <tbb/enumerable_thread_specific.h>
 
 #define MAX_RAYTRACE_DEPTH 5
 
-MTMdLightcutter::MTMdLightcutter(MdLightTree *lightTree, Scene *scene, RayEngine *engine, uint32_t maxCutSize) 
+MTMdLightcutter::MTMdLightcutter(FlatLightTree *lightTree, Scene *scene, RayEngine *engine, uint32_t maxCutSize) 
 	: MdLightcutter(lightTree, scene, engine, maxCutSize) {}
 
 MTMdLightcutter::~MTMdLightcutter(void)
 {
 }
 
+typedef tbb::enumerable_thread_specific<MdLightcutScratch> MdLightcutScratchList;
+
 class MTMdLightcutThread
 {
 public:
-	typedef uint32_t argument_type;
-
-	MTMdLightcutThread(MTMdLightcutter *lcutter, GatherTreeBuilder *gtBuilder, Image<uint64_t> *seeds, Image<Vec3f> *img, Image<uint32_t> *sampleImg, uint32_t s) 
-        : lightcutter(lcutter), randSeeds(seeds), image(img), sampleImage(sampleImg), samples(s), gatherTreeBuilder(gtBuilder) {
+	MTMdLightcutThread(MTMdLightcutter *lcutter, GatherTreeBuilder *gtBuilder, Image<uint64_t> *seeds, Image<Vec3f> *img, Image<uint32_t> *sampleImg, MdLightcutScratchList *scratch, uint32_t s) 
+        : lightcutter(lcutter), randSeeds(seeds), image(img), sampleImage(sampleImg), scratchList(scratch), samples(s), gatherTreeBuilder(gtBuilder) {
         scene = lightcutter->_scene;
         engine = lightcutter->_engine;
         pixelSize = Vec2f(1.0f/image->Width(), 1.0f/image->Height());
     }
-    void operator()(uint32_t j) const;
+    void operator()(uint32_t i, uint32_t j) const;
 private:
     Image<Vec3f>					*image;
     Image<uint32_t>					*sampleImage;
 	Image<uint64_t>					*randSeeds;
+    MdLightcutScratchList           *scratchList;
     Scene							*scene;
     RayEngine						*engine;
     GatherTreeBuilder				*gatherTreeBuilder;
@@ -41,23 +44,12 @@ private:
     Vec2f                           pixelSize;
 };
 
-void MTMdLightcutThread::operator()( uint32_t j ) const
+void MTMdLightcutThread::operator()( uint32_t i, uint32_t j ) const
 {
-    uint64_t seed = randSeeds->ElementAt(j);
-    const float time = 0.0f;
-    for(uint32_t i = 0; i < image->Width(); i ++) 
-    {
-        uint32_t cutSize = 0;
-        vector<GatherPoint> points;
-		Vec3f background;
-        GatherNode *gpRoot = gatherTreeBuilder->Build(i, j, seed, points, &background);
-        uint32_t cs = 0;
-        Vec3f L;
-        if (gpRoot) L = lightcutter->_EvaluateLightcut(gpRoot, cutSize);
-        image->ElementAt(i, image->Height() - j - 1) = background + L;
-        if(sampleImage) sampleImage->ElementAt(i, sampleImage->Height() - j - 1) = cutSize;
-		delete gpRoot;
-    }
+    uint32_t cutSize = 0;
+    Vec3f L = lightcutter->_RenderPixel(gatherTreeBuilder, i, j, randSeeds->ElementAt(i, j), scratchList->local(), cutSize);
+    image->ElementAt(i, image->Height() - j - 1) = L;
+    if(sampleImage) sampleImage->ElementAt(i, sampleImage->Height() - j - 1) = cutSize;
 }
 
 void MTMdLightcutter::Lightcut(Image<Vec3f> *image, Image<uint32_t> *cutImage, uint32_t samples, ReportHandler *report)
@@ -75,18 +67,11 @@ void MTMdLightcutter::Lightcut(Image<Vec3f> *image, Image<uint32_t> *cutImage, u
     if (report) report->beginActivity("Multi-thread Lightcutting..");
 	
 	Image<uint64_t> randSeeds(image->Width(), image->Height());
-	for (uint32_t i = 0; i < randSeeds.Size(); i++)
-	{
-		static minstd_rand0 seeder;
-		uint64_t seed = seeder();
-		randSeeds.ElementAt(i) = seed; 
-	}
-
-    TbbReportCounter counter(image->Height(), report);
-    MTMdLightcutThread thread(this, gatherTreeBuilder.get(), &randSeeds, image, cutImage, samples);
+    GenerateLightcutSeeds(&randSeeds);
 
-    parallel_while<MTMdLightcutThread> w;
-    w.run(counter, thread);
+    MdLightcutScratchList scratchList;
+    MTMdLightcutThread thread(this, gatherTreeBuilder.get(), &randSeeds, image, cutImage, &scratchList, samples);
+    TbbParallelForTiles(image->Width(), image->Height(), thread, report);
     if (report) report->endActivity();
 
 }
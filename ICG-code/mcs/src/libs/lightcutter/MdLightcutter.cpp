@@ -2,8 +2,9 @@
 #include <scene/camera.h>
 #include <scene/background.h>
 #include <lighttree/GatherTreeBuilder.h>
+#include "Lightcutter.h"
 
-MdLightcutter::MdLightcutter(MdLightTree *lightTree, Scene *scene, RayEngine *engine, uint32_t maxCutSize)
+MdLightcutter::MdLightcutter(FlatLightTree *lightTree, Scene *scene, RayEngine *engine, uint32_t maxCutSize)
     : _scene(scene), _engine(engine), _maxCutSize(maxCutSize), _lightTree(lightTree) 
 {
     float radius = (_engine->ComputeBoundingBox().Diagonal() / 2.0f) * 0.05f;
@@ -20,101 +21,59 @@ void MdLightcutter::Lightcut(Image<Vec3f> *image, Image<uint32_t> *cutImage, uin
         shared_ptr<GatherTreeBuilder>(new GatherTreeBuilder(_scene, _engine, image->Width(), image->Height(), samples, normScale));
 
 	Image<uint64_t> randSeeds(image->Width(), image->Height());
-	for (uint32_t i = 0; i < randSeeds.Size(); i++)
-	{
-		static minstd_rand0 seeder;
-		uint64_t seed = seeder();
-		randSeeds.ElementAt(i) = seed; 
-	}
+    GenerateLightcutSeeds(&randSeeds);
 
-    const float time = 0.0f; // lightcut do not support motion blur;
     if (report) report->beginActivity("Multi-dimensional Lightcutting..");
+    MdLightcutScratch scratch;
     for(uint32_t j = 0; j < image->Height(); j ++) 
     {
         for(uint32_t i = 0; i < image->Width(); i ++) 
         {
-            vector<GatherPoint> points;
-			Vec3f background;
-            GatherNode *gpRoot = gatherTreeBuilder->Build(i, j, randSeeds.ElementAt(i, j), points, &background);
             uint32_t cutSize = 0;
-            Vec3f L = _EvaluateLightcut(gpRoot, cutSize);
-            image->ElementAt(i, image->Height() - j - 1) = background + L;
-            cutImage->ElementAt(i, cutImage->Height() - j - 1) = cutSize;
-            delete gpRoot;
-            if(report) report->progress((float)j / (float)(image->Height()), 1);
+            Vec3f L = _RenderPixel(gatherTreeBuilder.get(), i, j, randSeeds.ElementAt(i, j), scratch, cutSize);
+            image->ElementAt(i, image->Height() - j - 1) = L;
+            if(cutImage) cutImage->ElementAt(i, cutImage->Height() - j - 1) = cutSize;
         }
+        if(report) report->progress((float)j / (float)(image->Height()), 1);
     }
     if (report) report->endActivity();
 }
 
-struct MdLightcutHeapItem
+Vec3f MdLightcutter::_RenderPixel(GatherTreeBuilder *builder, uint32_t i, uint32_t j, uint64_t seed, MdLightcutScratch &scratch, uint32_t &cutSize)
 {
-    MdLightcutHeapItem(LightTreeNode *node, GatherNode *gpNode, uint32_t ltIdx, const Vec3f &ub, const Vec3f &est, bool refineLight, uint32_t refineSeq) 
-        : _ltNode(node), _gpNode(gpNode), _ltIdx(ltIdx), _estimate(est), _upperBound(ub), _refineLight(refineLight), _refineSeq(refineSeq) {
-        _bound = _upperBound.Average();
-    }
+	Vec3f background;
+    GatherNode *gpRoot = builder->Build(i, j, seed, scratch.gatherTree, &background);
+    Vec3f L;
+    if (gpRoot) L = _EvaluateLightcut(gpRoot, cutSize, scratch);
+    return background + L;
+}
 
-    bool operator< (const MdLightcutHeapItem &p2) const {
-        return _bound == p2._bound ? (_ltNode < p2._ltNode) : _bound < p2._bound;
-    }
-    LightTreeNode   *_ltNode;
-    GatherNode      *_gpNode;
-	uint32_t		_ltIdx;
-    Vec3f           _upperBound;
-    float           _bound;
-    Vec3f           _estimate;
-    bool            _refineLight;
-    uint32_t        _refineSeq;
-};
-
-Vec3f MdLightcutter::_EvaluateLightcut(GatherNode *gpRoot, uint32_t &cutSize)
+Vec3f MdLightcutter::_EvaluateLightcut(GatherNode *gpRoot, uint32_t &cutSize, MdLightcutScratch &scratch)
 {
     if (gpRoot->gp == 0)
         return Vec3f::Zero();
 
-    vector<MdLightcutHeapItem> lightcut;
+    vector<MdLightcutHeapItem> &lightcut = scratch.heap;
+    lightcut.clear();
     lightcut.reserve(_maxCutSize);
     cutSize = 0;
 
     Vec3f totalEstL, estimate, bound;
-    if (_lightTree->GetOrientedRoot())
+    const FlatLightHierarchy *trees[2] = { &_lightTree->GetOriented(), &_lightTree->GetDirectional() };
+    for (uint32_t t = 0; t < 2; t++)
     {
-		bool heuristic;
-		MdOrientedLightTreeNode *root = _lightTree->GetOrientedRoot();
-#ifdef MULTI_REP
-		uint32_t index = _SelectRandomLight(root->lights);
-		estimate = _EvalutateNode(root->lights[index], gpRoot->gp);
-#else
-		uint32_t index = 0;
-		estimate = _EvalutateNode(root->light, gpRoot->gp);
-#endif // MULTI_REP
-
-        bound = _ComputeUpperBound(root, gpRoot, heuristic);
-        totalEstL += root->L * estimate * gpRoot->strength;
-        cutSize++;
-        lightcut.push_back(MdLightcutHeapItem(root, gpRoot, index, bound, estimate, heuristic, 0));
-        push_heap(lightcut.begin(), lightcut.end());
-    }
-
-    if (_lightTree->GetDirectionalRoot())
-    {
-		MdDirectionalLightTreeNode *root = _lightTree->GetDirectionalRoot();
+        if (trees[t]->Empty())
+            continue;
         bool heuristic;
-#ifdef MULTI_REP
-		uint32_t index = _SelectRandomLight(root->lights);
-        estimate = _EvalutateNode(root->lights[index], gpRoot->gp);
-#else
-		uint32_t index = 0;
-		estimate = _EvalutateNode(root->light, gpRoot->gp);
-#endif
-        bound = _ComputeUpperBound(root, gpRoot, heuristic);
-        totalEstL += root->L * estimate * gpRoot->strength;
+        const FlatLightNode &root = trees[t]->GetNode(0);
+        estimate = _EvalutateNode(*trees[t], root, gpRoot->gp);
+        bound = _ComputeUpperBound(*trees[t], 0, gpRoot, heuristic);
+        totalEstL += root.L * estimate * gpRoot->strength;
         cutSize++;
-        lightcut.push_back(MdLightcutHeapItem(root, gpRoot, index, bound, estimate, heuristic, 0));
+        lightcut.push_back(MdLightcutHeapItem(trees[t], 0, gpRoot, bound, estimate, heuristic, 0));
         push_heap(lightcut.begin(), lightcut.end());
     }
 
-
     while(lightcut.size() > 0 && cutSize < _maxCutSize)
     {
 		MdLightcutHeapItem cutItem = lightcut.front();
@@ -125,185 +84,51 @@ Vec3f MdLightcutter::_EvaluateLightcut(GatherNode *gpRoot, uint32_t &cutSize)
 		pop_heap(lightcut.begin(), lightcut.end());
         lightcut.pop_back();
 
-        LightTreeNode* node = cutItem._ltNode;
+        const FlatLightHierarchy &tree = *cutItem._tree;
+        uint32_t ltIdx = cutItem._ltNode;
+        const FlatLightNode &ltNode = tree.GetNode(ltIdx);
         GatherNode* gpNode = cutItem._gpNode;
-		uint32_t index = cutItem._ltIdx;
 
-        if (node == NULL || gpNode == NULL)
+        if (gpNode == NULL)
             cout << "null error" << endl;
 
-        const GatherPoint *gp = gpRoot->gp;
-
         // Refine heuristic
         bool refineLightNode = cutItem._refineLight;
         if (cutItem._refineSeq > 4 && !gpNode->IsLeaf())
             refineLightNode = false;
 
-        if (refineLightNode && !node->IsLeaf())
+        if (refineLightNode && !ltNode.IsLeaf())
         {
-            if (node->GetNodeType() == ORIENTED_NODE)
+            uint32_t seq = cutItem._refineSeq + 1;
+            uint32_t children[2] = { tree.Left(ltIdx), tree.Right(ltIdx) };
+            totalEstL -= (ltNode.L * cutItem._estimate) * gpNode->strength;
+            for (uint32_t c = 0; c < 2; c++)
             {
-				MdOrientedLightTreeNode *ltNode = static_cast<MdOrientedLightTreeNode*>(node);
-				Vec3f leftEst, rightEst;
-				uint32_t lIdx = 0;
-				uint32_t rIdx = 0;
-				bool lHeur, rHeur;
-
-				uint32_t seq = cutItem._refineSeq >= 0 ? cutItem._refineSeq + 1 : 0; 
-				MdOrientedLightTreeNode *leftNode = ltNode->left;
-				MdOrientedLightTreeNode *rightNode = ltNode->right;
-
-#ifdef MULTI_REP
-				if(ltNode->lights[index] == leftNode->lights[index]) {
-					lIdx = index;
-					leftEst = cutItem._estimate;
-				} else {
-					lIdx = _SelectRandomLight(leftNode->lights);
-					leftEst = _EvalutateNode(leftNode->lights[lIdx], gpNode->gp);
-				}
-#else
-				leftEst = (ltNode->light == leftNode->light) ? cutItem._estimate : _EvalutateNode(leftNode->light, gpNode->gp);
-#endif
-                Vec3f leftBound = _ComputeUpperBound(leftNode, gpNode, lHeur) * gpNode->strength;
-                lightcut.push_back(MdLightcutHeapItem(leftNode, gpNode, lIdx, leftBound, leftEst, lHeur, seq));
-                push_heap(lightcut.begin(), lightcut.end());
-                Vec3f lL = leftNode->L * leftEst;
-
-#ifdef MULTI_REP
-                
-				if(ltNode->lights[index] == rightNode->lights[index]) {
-					rIdx = index;
-					rightEst = cutItem._estimate;
-				} else {
-					rIdx = _SelectRandomLight(rightNode->lights);
-					rightEst = _EvalutateNode(rightNode->lights[rIdx], gpNode->gp);
-				}
-#else
-				rightEst = (ltNode->light == rightNode->light) ? cutItem._estimate : _EvalutateNode(rightNode->light, gpNode->gp);
-#endif
-
-				Vec3f rightBound = _ComputeUpperBound(rightNode, gpNode, rHeur) * gpNode->strength;
-                lightcut.push_back(MdLightcutHeapItem(rightNode, gpNode, rIdx, rightBound, rightEst, rHeur, seq));
+                const FlatLightNode &child = tree.GetNode(children[c]);
+                bool heur;
+                Vec3f est = (ltNode.light == child.light) ? cutItem._estimate : _EvalutateNode(tree, child, gpNode->gp);
+                Vec3f childBound = _ComputeUpperBound(tree, children[c], gpNode, heur) * gpNode->strength;
+                lightcut.push_back(MdLightcutHeapItem(&tree, children[c], gpNode, childBound, est, heur, seq));
                 push_heap(lightcut.begin(), lightcut.end());
-                Vec3f rL = rightNode->L * rightEst;
-
-				totalEstL -= (ltNode->L * cutItem._estimate) * gpNode->strength;
-				totalEstL += (lL + rL) * gpNode->strength;
-				cutSize++;
+                totalEstL += (child.L * est) * gpNode->strength;
             }
-            else if (node->GetNodeType() == DIRECT_NODE)
-            {
-				MdDirectionalLightTreeNode *ltNode = static_cast<MdDirectionalLightTreeNode*>(node);
-				Vec3f leftEst, rightEst;
-				uint32_t lIdx = 0, rIdx = 0;
-				bool lHeur, rHeur;
-				uint32_t seq = cutItem._refineSeq >= 0 ? cutItem._refineSeq + 1 : 0; 
-
-				MdDirectionalLightTreeNode *leftNode = ltNode->left;
-				MdDirectionalLightTreeNode *rightNode = ltNode->right;
-#ifdef MULTI_REP
-				if(ltNode->lights[index] == leftNode->lights[index]) {
-					lIdx = index;
-					leftEst = cutItem._estimate;
-				} else {
-					lIdx = _SelectRandomLight(leftNode->lights);
-					leftEst = _EvalutateNode(leftNode->lights[lIdx], gpNode->gp);
-				}
-#else
-				leftEst = (ltNode->light == leftNode->light) ? cutItem._estimate : _EvalutateNode(leftNode->light, gpNode->gp);
-#endif
-
-                Vec3f leftBound = _ComputeUpperBound(leftNode, gpNode, lHeur) * gpNode->strength;
-                lightcut.push_back(MdLightcutHeapItem(leftNode, gpNode, lIdx, leftBound, leftEst, lHeur, seq));
-                push_heap(lightcut.begin(), lightcut.end());
-                Vec3f lL = leftNode->L * leftEst;
-
-#ifdef MULTI_REP
-				if(ltNode->lights[index] == rightNode->lights[index]) {
-					rIdx = index;
-					rightEst = cutItem._estimate;
-				} else {
-					rIdx = _SelectRandomLight(rightNode->lights);
-					rightEst = _EvalutateNode(rightNode->lights[rIdx], gpNode->gp);
-				}
-#else
-				rightEst = (ltNode->light == rightNode->light) ? cutItem._estimate : _EvalutateNode(rightNode->light, gpNode->gp);
-#endif
-
-                Vec3f rightBound = _ComputeUpperBound(rightNode, gpNode, rHeur) * gpNode->strength;
-                lightcut.push_back(MdLightcutHeapItem(rightNode, gpNode, rIdx, rightBound, rightEst, rHeur, seq));
-                push_heap(lightcut.begin(), lightcut.end());
-                Vec3f rL = rightNode->L * rightEst;
-
-				totalEstL -= (ltNode->L * cutItem._estimate) * gpNode->strength;
-				totalEstL += (lL + rL) * gpNode->strength;
-				cutSize++;
-			}
+            cutSize++;
         }
         else if (!gpNode->IsLeaf())
         {
-            if (node->GetNodeType() == ORIENTED_NODE)
-            {
-                MdOrientedLightTreeNode *ltNode = static_cast<MdOrientedLightTreeNode*>(node);
-                Vec3f leftEst, rightEst;
-				bool lHeur, rHeur;
-                uint32_t seq = cutItem._refineSeq <= 0 ? cutItem._refineSeq - 1 : 0;
-#ifdef MULTI_REP
-				OrientedLight* light = ltNode->lights[index];
-#else
-				OrientedLight* light = ltNode->light;
-#endif
-
-                GatherNode *leftNode = gpNode->left;
-                leftEst = gpNode->gp == leftNode->gp ? cutItem._estimate : _EvalutateNode(light, leftNode->gp);
-                Vec3f leftBound = _ComputeUpperBound(ltNode, leftNode, lHeur) * leftNode->strength;
-                lightcut.push_back(MdLightcutHeapItem(ltNode, leftNode, index, leftBound, leftEst, lHeur, 0));
-                push_heap(lightcut.begin(), lightcut.end());
-                Vec3f lL = ltNode->L * leftEst;
-
-                GatherNode *rightNode = gpNode->right;
-                rightEst = gpNode->gp == rightNode->gp ? cutItem._estimate : _EvalutateNode(light, rightNode->gp);
-                Vec3f rightBound = _ComputeUpperBound(ltNode, rightNode, rHeur) * rightNode->strength;
-                lightcut.push_back(MdLightcutHeapItem(ltNode, rightNode, index, rightBound, rightEst, rHeur, 0));
-                push_heap(lightcut.begin(), lightcut.end());
-                Vec3f rL = ltNode->L * rightEst;
-
-                Vec3f t = totalEstL;
-                totalEstL -= (ltNode->L * cutItem._estimate) * gpNode->strength;
-                totalEstL += lL * leftNode->strength + rL * rightNode->strength;
-                cutSize++;
-            }
-            else if (node->GetNodeType() == DIRECT_NODE)
+            GatherNode *children[2] = { gpNode->left, gpNode->right };
+            totalEstL -= (ltNode.L * cutItem._estimate) * gpNode->strength;
+            for (uint32_t c = 0; c < 2; c++)
             {
-				MdDirectionalLightTreeNode *ltNode = static_cast<MdDirectionalLightTreeNode*>(node);
-				Vec3f leftEst, rightEst;
-				bool lHeur, rHeur;
-				uint32_t seq = cutItem._refineSeq <= 0 ? cutItem._refineSeq - 1 : 0; 
-#ifdef MULTI_REP
-				DirLight* light = ltNode->lights[index];
-#else
-				DirLight* light = ltNode->light;
-#endif
-
-                GatherNode *leftNode = gpNode->left;
-                leftEst = gpNode->gp == leftNode->gp ? cutItem._estimate : _EvalutateNode(light, leftNode->gp);
-                Vec3f leftBound = _ComputeUpperBound(ltNode, leftNode, lHeur) * leftNode->strength;
-                lightcut.push_back(MdLightcutHeapItem(ltNode, leftNode, index, leftBound, leftEst, lHeur, 0));
-                push_heap(lightcut.begin(), lightcut.end());
-                Vec3f lL = ltNode->L * leftEst;
-
-                GatherNode *rightNode = gpNode->right;
-                rightEst = gpNode->gp == rightNode->gp ? cutItem._estimate : _EvalutateNode(light, rightNode->gp);
-                Vec3f rightBound = _ComputeUpperBound(ltNode, rightNode, rHeur) * rightNode->strength;
-                lightcut.push_back(MdLightcutHeapItem(ltNode, rightNode, index, rightBound, rightEst, rHeur, 0));
+                GatherNode *child = children[c];
+                bool heur;
+                Vec3f est = gpNode->gp == child->gp ? cutItem._estimate : _EvalutateNode(tree, ltNode, child->gp);
+                Vec3f childBound = _ComputeUpperBound(tree, ltIdx, child, heur) * child->strength;
+                lightcut.push_back(MdLightcutHeapItem(&tree, ltIdx, child, childBound, est, heur, 0));
                 push_heap(lightcut.begin(), lightcut.end());
-                Vec3f rL = ltNode->L * rightEst;
-
-                Vec3f t = totalEstL;
-                totalEstL -= (ltNode->L * cutItem._estimate) * gpNode->strength;
-                totalEstL += lL * leftNode->strength + rL * rightNode->strength;
-                cutSize++;
+                totalEstL += (ltNode.L * est) * child->strength;
             }
+            cutSize++;
         }
         else
             cout << "leaf error" << endl;
@@ -311,6 +136,14 @@ Vec3f MdLightcutter::_EvaluateLightcut(GatherNode *gpRoot, uint32_t &cutSize)
     return gpRoot->emission + totalEstL;
 }
 
+Vec3f MdLightcutter::_EvalutateNode(const FlatLightHierarchy &tree, const FlatLightNode &node, const GatherPoint* g)
+{
+    if (tree.GetNodeType() == ORIENTED_NODE)
+        return _EvalutateNode(&_lightTree->GetOrientedLight(node.light), g);
+    else
+        return _EvalutateNode(&_lightTree->GetDirLight(node.light), g);
+}
+
 Vec3f MdLightcutter::_EvalutateNode(const OrientedLight* l, const GatherPoint* g )
 {
     if (l == NULL)
@@ -366,9 +199,10 @@ Vec3f MdLightcutter::_EvalutateNode(const DirLight* l, const GatherPoint* g )
     return Vec3f::Zero();
 }
 
-Vec3f MdLightcutter::_ComputeUpperBound( MdOrientedLightTreeNode* ltNode, GatherNode *gpNode, bool &refineLight )
+Vec3f MdLightcutter::_ComputeUpperBound(const FlatLightHierarchy &tree, uint32_t ltIdx, GatherNode *gpNode, bool &refineLight)
 {
-    if (ltNode->IsLeaf() && gpNode->IsLeaf())
+    const FlatLightNode &ltNode = tree.GetNode(ltIdx);
+    if (ltNode.IsLeaf() && gpNode->IsLeaf())
         return Vec3f::Zero();
 
     const GatherPoint& gp = *gpNode->gp;
@@ -377,55 +211,61 @@ Vec3f MdLightcutter::_ComputeUpperBound( MdOrientedLightTreeNode* ltNode, Gather
 		return Vec3f::Zero();
 	}
 
-    const DifferentialGeometry &dp = gp.isect.dp;
-
-    const Range3f &ltBBox = ltNode->bbox;
+    bool oriented = tree.GetNodeType() == ORIENTED_NODE;
+    Range3f ltBBox = tree.GetBBox(ltNode);
     const Range3f &gpBBox = gpNode->bbox;
 
     refineLight = true;
     float lenSqr = Range3f::DistanceSqr(ltBBox, gpBBox);
 
-    float cosBound = 1.0f;
-    float cosHalfAngle = ltNode->cone.GetAngleCos();
-    if (cosHalfAngle <= 0.0f)
-        cosBound = 1.0f;
-    else
+    Vec3f upperBound;
+    if (oriented)
     {
-        Vec3f vv = (Vec3f::Z() ^ ltNode->cone.GetAxis()).GetNormalized();
-        Matrix4f mt = Matrix4f::Rotation(vv, -acosf(Vec3f::Z() % ltNode->cone.GetAxis()));
-
-        Range3f xbox(gpBBox.GetMinRef() - ltBBox.GetMaxRef(), gpBBox.GetMaxRef() - ltBBox.GetMinRef());
-        Range3f tbox = mt.TransformBBox(xbox);
-
-		Vec3f &xm = tbox.GetMinRef();
-		Vec3f &xM = tbox.GetMaxRef();
-
-		float cosTheta;
-		if (xM.z > 0)
-		{
-			float minx2 = (xm.x * xM.x <= 0) ? 0.0f : min(xm.x * xm.x, xM.x * xM.x);
-			float miny2 = (xm.y * xM.y <= 0) ? 0.0f : min(xm.y * xm.y, xM.y * xM.y);
-			float maxz2 = xM.z * xM.z;
-			cosTheta = xM.z / sqrt(minx2 + miny2 + maxz2);
-		}
-		else
-			cosTheta = 0;
-
-		cosTheta = clamp(cosTheta, 0.0f, 1.0f);
-
-		if (cosTheta > cosHalfAngle)
-			cosBound = 1.0f;
-		else
-		{
-			float sinHalfAngle = sqrt(1 - cosHalfAngle * cosHalfAngle);
-			float sinTheta = sqrt(1 - cosTheta * cosTheta);
-			cosBound = clamp(cosTheta * cosHalfAngle + sinTheta * sinHalfAngle, 0.0f, 1.0f);
-			assert(cosBound >= 0.0f && cosBound <= 1.0f);
-		}
-	}
-
-    Vec3f MatBound = _BoundMaterialOrientedLight(ltNode, gpNode);
-    Vec3f upperBound = (MatBound * (cosBound / max(_clamp, lenSqr))).Abs();
+        float cosBound = 1.0f;
+        float cosHalfAngle = ltNode.cosAngle;
+        if (cosHalfAngle <= 0.0f)
+            cosBound = 1.0f;
+        else
+        {
+            Vec3f axis = FlatLightHierarchy::GetAxis(ltNode);
+            Vec3f vv = (Vec3f::Z() ^ axis).GetNormalized();
+            Matrix4f mt = Matrix4f::Rotation(vv, -acosf(Vec3f::Z() % axis));
+
+            Range3f xbox(gpBBox.GetMinRef() - ltBBox.GetMaxRef(), gpBBox.GetMaxRef() - ltBBox.GetMinRef());
+            Range3f tbox = mt.TransformBBox(xbox);
+
+		    Vec3f &xm = tbox.GetMinRef();
+		    Vec3f &xM = tbox.GetMaxRef();
+
+		    float cosTheta;
+		    if (xM.z > 0)
+		    {
+			    float minx2 = (xm.x * xM.x <= 0) ? 0.0f : min(xm.x * xm.x, xM.x * xM.x);
+			    float miny2 = (xm.y * xM.y <= 0) ? 0.0f : min(xm.y * xm.y, xM.y * xM.y);
+			    float maxz2 = xM.z * xM.z;
+			    cosTheta = xM.z / sqrt(minx2 + miny2 + maxz2);
+		    }
+		    else
+			    cosTheta = 0;
+
+		    cosTheta = clamp(cosTheta, 0.0f, 1.0f);
+
+		    if (cosTheta > cosHalfAngle)
+			    cosBound = 1.0f;
+		    else
+		    {
+			    float sinHalfAngle = sqrt(1 - cosHalfAngle * cosHalfAngle);
+			    float sinTheta = sqrt(1 - cosTheta * cosTheta);
+			    cosBound = clamp(cosTheta * cosHalfAngle + sinTheta * sinHalfAngle, 0.0f, 1.0f);
+			    assert(cosBound >= 0.0f && cosBound <= 1.0f);
+		    }
+	    }
+
+        Vec3f MatBound = _BoundMaterialOrientedLight(ltBBox, gpNode);
+        upperBound = (MatBound * (cosBound / max(_clamp, lenSqr))).Abs();
+    }
+    else
+        upperBound = _BoundMaterialDirLight(ltBBox, gpNode).Abs();
 
 	// compute heuristic
 	if (Range3f::Overlap(ltBBox, gpBBox))
@@ -437,92 +277,47 @@ Vec3f MdLightcutter::_ComputeUpperBound( MdOrientedLightTreeNode* ltNode, Gather
 		float ltHeur = 0.0f;
 		float gpHeur = 0.0f;
 		// light heuristic
-		if (!ltNode->IsLeaf())
+		if (!ltNode.IsLeaf())
 		{
-			float lmin = Range3f::DistanceSqr(ltNode->left->bbox, gpBBox);
-			float rmin = Range3f::DistanceSqr(ltNode->right->bbox, gpBBox);
+            if (oriented)
+            {
+			    float lmin = Range3f::DistanceSqr(tree.GetBBox(tree.GetNode(tree.Left(ltIdx))), gpBBox);
+			    float rmin = Range3f::DistanceSqr(tree.GetBBox(tree.GetNode(tree.Right(ltIdx))), gpBBox);
 
-			float redDist = min(lmin, rmin) / lenSqr;
-			float redMat = (1.0f - ltNode->cone.GetAngleCos()) * ltNode->bbox.Diagonal() / sqrt(lenSqr);
-			ltHeur = redDist * redMat;
+			    float redDist = min(lmin, rmin) / lenSqr;
+			    float redMat = (1.0f - ltNode.cosAngle) * ltBBox.Diagonal() / sqrt(lenSqr);
+			    ltHeur = redDist * redMat;
+            }
+            else
+                ltHeur = ltBBox.Diagonal() / sqrt(lenSqr);
 		}
 
 		if (!gpNode->IsLeaf())
 		{
-			float lmin = Range3f::DistanceSqr(ltBBox, gpNode->left->bbox);
-			float rmin = Range3f::DistanceSqr(ltBBox, gpNode->right->bbox);
-
-			float redDist = min(lmin, rmin) / lenSqr;
-			float redMat = (1.0f - gpNode->normalCone.GetAngleCos()) * gpNode->bbox.Diagonal() / sqrt(lenSqr);
-
-			gpHeur = redDist * redMat;
-		}
-		refineLight = gpHeur <= ltHeur;
-	}
-
-    return (ltNode->L * upperBound).Abs();
-}
-
-Vec3f MdLightcutter::_ComputeUpperBound( MdDirectionalLightTreeNode* ltNode, GatherNode *gpNode, bool &refineLight )
-{
-    if (ltNode->IsLeaf() && gpNode->IsLeaf())
-        return Vec3f::Zero();
-
-	const GatherPoint& gp = *gpNode->gp;
-	if (!gp.isect.m) {
-		refineLight = true;
-		return Vec3f::Zero();
-	}
-
-    const DifferentialGeometry &dp = gp.isect.dp;
-    const Range3f &ltBBox = ltNode->bbox;
-    const Range3f &gpBBox = gpNode->bbox;
-
-    refineLight = true;
-    float lenSqr = Range3f::DistanceSqr(ltBBox, gpBBox);
-
-	Vec3f MatBound = _BoundMaterialDirLight(ltNode, gpNode);
-	Vec3f upperBound = MatBound.Abs();
-
-    // compute heuristic
-	if (Range3f::Overlap(ltBBox, gpBBox))
-	{
-		refineLight = ltBBox.Diagonal() > gpBBox.Diagonal();
-	}
-	else
-	{
-		float ltHeur = 0.0f;
-		float gpHeur = 0.0f;
-		// light heuristic
-		if (!ltNode->IsLeaf())
-		{
-			float lmin = Range3f::DistanceSqr(ltNode->left->bbox, gpBBox);
-			float rmin = Range3f::DistanceSqr(ltNode->right->bbox, gpBBox);
-
-			float redMat = ltNode->bbox.Diagonal() / sqrt(lenSqr);
-			ltHeur = redMat;
-		}
+            if (oriented)
+            {
+			    float lmin = Range3f::DistanceSqr(ltBBox, gpNode->left->bbox);
+			    float rmin = Range3f::DistanceSqr(ltBBox, gpNode->right->bbox);
 
-		if (!gpNode->IsLeaf())
-		{
-			float lmin = Range3f::DistanceSqr(ltBBox, gpNode->left->bbox);
-			float rmin = Range3f::DistanceSqr(ltBBox, gpNode->right->bbox);
+			    float redDist = min(lmin, rmin) / lenSqr;
+			    float redMat = (1.0f - gpNode->normalCone.GetAngleCos()) * gpNode->bbox.Diagonal() / sqrt(lenSqr);
 
-			float redMat = gpNode->bbox.Diagonal() / sqrt(lenSqr);
-			gpHeur = redMat;
+			    gpHeur = redDist * redMat;
+            }
+            else
+                gpHeur = gpNode->bbox.Diagonal() / sqrt(lenSqr);
 		}
 		refineLight = gpHeur <= ltHeur;
 	}
 
-    return (ltNode->L * upperBound).Abs();
+    return (ltNode.L * upperBound).Abs();
 }
 
-Vec3f MdLightcutter::_BoundMaterialOrientedLight( MdOrientedLightTreeNode* ltNode, GatherNode *gpNode)
+Vec3f MdLightcutter::_BoundMaterialOrientedLight(const Range3f &ltBBox, GatherNode *gpNode)
 {
 	const GatherPoint& gp = *(gpNode->gp);
     const DifferentialGeometry &dp = gp.isect.dp;
 
-    const Range3f &ltBBox = ltNode->bbox;
     const Range3f &gpBBox = gpNode->bbox;
     const GLPhongApproximation &matApprox = gpNode->mat;
 
@@ -612,13 +407,12 @@ Vec3f MdLightcutter::_BoundMaterialOrientedLight( MdOrientedLightTreeNode* ltNod
     return matApprox.Kd * cosBound;
 }
 
-Vec3f MdLightcutter::_BoundMaterialDirLight( MdDirectionalLightTreeNode* ltNode, GatherNode *gpNode)
+Vec3f MdLightcutter::_BoundMaterialDirLight(const Range3f &ltBBox, GatherNode *gpNode)
 {
     const GatherPoint& gp = *(gpNode->gp);
     const DifferentialGeometry &dp = gp.isect.dp;
     //Material *m = gp.isect.m;
 
-    const Range3f &ltBBox = ltNode->bbox;
     const Range3f &gpBBox = gpNode->bbox;
 
     const GLPhongApproximation &matApprox = gpNode->mat;
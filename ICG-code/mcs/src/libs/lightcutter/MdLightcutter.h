@@ -1,56 +1,62 @@
 #ifndef _MULTIDIMENSIONAL_LIGHTCUTTER_H_
 #define _MULTIDIMENSIONAL_LIGHTCUTTER_H_
 #include <lighttree/GatherTree.h>
-#include <lighttree/LightTree.h>
+#include <lighttree/FlatLightTree.h>
+#include <lighttree/GatherTreeBuilder.h>
 #include <image/image.h>
 #include <sampler/pathSampler.h>
 #include <misc/report.h>
 #include <scene/scene.h>
 #include <ray/rayEngine.h>
 
+struct MdLightcutHeapItem
+{
+    MdLightcutHeapItem(const FlatLightHierarchy *tree, uint32_t ltNode, GatherNode *gpNode, const Vec3f &ub, const Vec3f &est, bool refineLight, uint32_t refineSeq) 
+        : _tree(tree), _ltNode(ltNode), _gpNode(gpNode), _estimate(est), _upperBound(ub), _refineLight(refineLight), _refineSeq(refineSeq) {
+        _bound = _upperBound.Average();
+    }
+
+    bool operator< (const MdLightcutHeapItem &p2) const {
+        return _bound == p2._bound ? (_tree == p2._tree ? _ltNode < p2._ltNode : _tree < p2._tree) : _bound < p2._bound;
+    }
+    const FlatLightHierarchy    *_tree;
+    uint32_t        _ltNode;
+    GatherNode      *_gpNode;
+    Vec3f           _upperBound;
+    float           _bound;
+    Vec3f           _estimate;
+    bool            _refineLight;
+    uint32_t        _refineSeq;
+};
+
+// cut and gather tree storage kept by a thread across the pixels it renders
+struct MdLightcutScratch
+{
+    vector<MdLightcutHeapItem>  heap;
+    GatherTreeArena             gatherTree;
+};
+
 class MdLightcutter
 {
     friend class MTMdLightcutThread;
 public:
-    MdLightcutter(MdLightTree *lightTree, Scene *scene, RayEngine *engine, uint32_t maxCutSize = 1000);
+    MdLightcutter(FlatLightTree *lightTree, Scene *scene, RayEngine *engine, uint32_t maxCutSize = 1000);
     ~MdLightcutter(void);
     void Lightcut(Image<Vec3f> *image, Image<uint32_t> *cutImage, uint32_t samples, ReportHandler *report = 0);
 protected:
-    Vec3f _EvaluateLightcut(GatherNode *node, uint32_t &cutSize);
+    Vec3f _RenderPixel(GatherTreeBuilder *builder, uint32_t i, uint32_t j, uint64_t seed, MdLightcutScratch &scratch, uint32_t &cutSize);
+    Vec3f _EvaluateLightcut(GatherNode *node, uint32_t &cutSize, MdLightcutScratch &scratch);
+    Vec3f _EvalutateNode(const FlatLightHierarchy &tree, const FlatLightNode &node, const GatherPoint* g);
     Vec3f _EvalutateNode(const OrientedLight*l, const GatherPoint* g);
     Vec3f _EvalutateNode(const DirLight* l, const GatherPoint* g);
-    Vec3f _ComputeUpperBound( MdOrientedLightTreeNode* ltNode, GatherNode *gpNode, bool &refineLight);
-    Vec3f _ComputeUpperBound( MdDirectionalLightTreeNode* ltNode, GatherNode *gpNode, bool &refineLight);
-    Vec3f _BoundMaterialOrientedLight( MdOrientedLightTreeNode* ltNode, GatherNode *gpNode );
-    Vec3f _BoundMaterialDirLight( MdDirectionalLightTreeNode* ltNode, GatherNode *gpNode );
-	template<typename LIGHT> uint32_t _SelectRandomLight(LIGHT* lights);
+    Vec3f _ComputeUpperBound(const FlatLightHierarchy &tree, uint32_t ltIdx, GatherNode *gpNode, bool &refineLight);
+    Vec3f _BoundMaterialOrientedLight(const Range3f &ltBBox, GatherNode *gpNode );
+    Vec3f _BoundMaterialDirLight(const Range3f &ltBBox, GatherNode *gpNode );
     Scene                   *_scene;
     RayEngine               *_engine;
     uint32_t                 _maxCutSize;
-    MdLightTree				*_lightTree;
+    FlatLightTree			*_lightTree;
     float                    _clamp;
-	RandomPathSamplerStd	 _sampler;
 };
 
-template<typename LIGHT>
-uint32_t MdLightcutter::_SelectRandomLight(LIGHT* lights)
-{
-	int matchingComps = 0;
-	for (uint32_t i = 0; i < MD_REP_SLOTS; i++)
-	{
-		if (lights[i])
-			matchingComps++;
-	}
-	
-	int which = min<uint32_t>((uint32_t)(_sampler.Next1D() * matchingComps), matchingComps-1);
-	for (uint32_t i = 0; i < MD_REP_SLOTS; ++i)
-	{
-		if (lights[i] && which-- == 0) 
-			return i;
-	}
-	assert(0);
-	return 0;
-}
-
-
 #endif // _MULTIDIMENSIONAL_LIGHTCUTTER_H_
@@ -6,40 +6,57 @@ LightTree* DivisiveLightTreeBuilder::Build(Scene *scene, RayEngine *engine, uint
 {
     LightTree *lightTree = new LightTree();
     _SampleLights(lightTree, engine, scene, indirect, report);
-	lightTree->_orientedRoot = _ConstructSubTree<OrientedLight, OrientedLightTreeNode>(lightTree->_orientedLights, report);
-	lightTree->_directionalRoot = _ConstructSubTree<DirLight, DirectionalLightTreeNode>(lightTree->_dirLights, report);
+    Construct(lightTree, _c, report);
     return lightTree;
 }
 
+void DivisiveLightTreeBuilder::Construct(LightTree* lightTree, float c, ReportHandler *report)
+{
+    _c = c;
+	lightTree->_orientedRoot = _ConstructSubTree<OrientedLight, OrientedLightTreeNode>(lightTree->_orientedLights, lightTree->_orientedNodes, report);
+	lightTree->_directionalRoot = _ConstructSubTree<DirLight, DirectionalLightTreeNode>(lightTree->_dirLights, lightTree->_directionalNodes, report);
+}
+
+FlatLightTree* DivisiveLightTreeBuilder::BuildFlat(Scene *scene, RayEngine *engine, uint32_t indirect, ReportHandler *report )
+{
+    LightTree *lightTree = Build(scene, engine, indirect, report);
+    if (report) report->beginActivity("flatten light tree");
+    FlatLightTree *flatTree = new FlatLightTree();
+    flatTree->Flatten(lightTree);
+    if (report) report->endActivity();
+    delete lightTree;
+    return flatTree;
+}
+
 template<>
-void DivisiveLightTreeBuilder::_UpdateNode(OrientedLightTreeNode *node)
+void DivisiveLightTreeBuilder::_UpdateNode(OrientedLightTreeNode *node, uint32_t slot)
 {
 	OrientedLightTreeNode *l = node->left;
 	OrientedLightTreeNode *r = node->right;
 	node->bbox = Range3f::Union(l->bbox, r->bbox);
 	node->cone = FastConef::Union(l->cone, r->cone);
 	node->L = l->L + r->L;
-	node->light = (sampler.Next1D() < (l->L.Average() / node->L.Average())) ? l->light : r->light;
+	node->light = (SlotRandom(slot) < (l->L.Average() / node->L.Average())) ? l->light : r->light;
 }
 
 template<>
-void DivisiveLightTreeBuilder::_UpdateNode(DirectionalLightTreeNode *node)
+void DivisiveLightTreeBuilder::_UpdateNode(DirectionalLightTreeNode *node, uint32_t slot)
 {
 	DirectionalLightTreeNode *l = node->left;
 	DirectionalLightTreeNode *r = node->right;
 	node->bbox = Range3f::Union(l->bbox, r->bbox);
 	node->L = l->L + r->L;
-	node->light = (sampler.Next1D() < (l->L.Average() / node->L.Average())) ? l->light : r->light;
+	node->light = (SlotRandom(slot) < (l->L.Average() / node->L.Average())) ? l->light : r->light;
 }
 
 template<>
-void DivisiveLightTreeBuilder::_UpdateNode(OmniDirLightTreeNode *node)
+void DivisiveLightTreeBuilder::_UpdateNode(OmniDirLightTreeNode *node, uint32_t slot)
 {
 	OmniDirLightTreeNode *l = node->left;
 	OmniDirLightTreeNode *r = node->right;
 	node->bbox = Range3f::Union(l->bbox, r->bbox);
 	node->L = l->L + r->L;
-	node->light = (sampler.Next1D() < (l->L.Average() / node->L.Average())) ? l->light : r->light;
+	node->light = (SlotRandom(slot) < (l->L.Average() / node->L.Average())) ? l->light : r->light;
 }
 
 
@@ -47,14 +64,14 @@ MdLightTree* DivisiveMdLightTreeBuilder::Build(Scene *scene, RayEngine *engine,
 {
 	MdLightTree *lightTree = new MdLightTree();
 	_SampleLights(lightTree, engine, scene, indirect, report);
-	lightTree->_orientedRoot = _ConstructSubTree<OrientedLight, MdOrientedLightTreeNode>(lightTree->_orientedLights, report);
-	lightTree->_directionalRoot = _ConstructSubTree<DirLight, MdDirectionalLightTreeNode>(lightTree->_dirLights, report);
+	lightTree->_orientedRoot = _ConstructSubTree<OrientedLight, MdOrientedLightTreeNode>(lightTree->_orientedLights, lightTree->_orientedNodes, report);
+	lightTree->_directionalRoot = _ConstructSubTree<DirLight, MdDirectionalLightTreeNode>(lightTree->_dirLights, lightTree->_directionalNodes, report);
 	return lightTree;
 }
 
 
 template<>
-void DivisiveMdLightTreeBuilder::_UpdateNode(MdOrientedLightTreeNode *node)
+void DivisiveMdLightTreeBuilder::_UpdateNode(MdOrientedLightTreeNode *node, uint32_t slot)
 {
 	MdOrientedLightTreeNode *l = node->left;
 	MdOrientedLightTreeNode *r = node->right;
@@ -66,18 +83,18 @@ void DivisiveMdLightTreeBuilder::_UpdateNode(MdOrientedLightTreeNode *node)
 	for (uint32_t i = 0; i < MD_REP_SLOTS; i++)
 	{
 		if(l->lights[i] && r->lights[i])
-			node->lights[i] = (sampler.Next1D() < prob) ? l->lights[i] : r->lights[i];
+			node->lights[i] = (SlotRandom(slot * MD_REP_SLOTS + i) < prob) ? l->lights[i] : r->lights[i];
 		else
 			node->lights[i] = l->lights[i] ? l->lights[i] : r->lights[i];
 	}
 #else
-	node->light = (sampler.Next1D() < (l->L.Average() / node->L.Average())) ? l->light : r->light;
+	node->light = (SlotRandom(slot) < (l->L.Average() / node->L.Average())) ? l->light : r->light;
 #endif // MULTI_REP
 
 }
 
 template<>
-void DivisiveMdLightTreeBuilder::_UpdateNode(MdDirectionalLightTreeNode *node)
+void DivisiveMdLightTreeBuilder::_UpdateNode(MdDirectionalLightTreeNode *node, uint32_t slot)
 {
 	MdDirectionalLightTreeNode *l = node->left;
 	MdDirectionalLightTreeNode *r = node->right;
@@ -88,17 +105,17 @@ void DivisiveMdLightTreeBuilder::_UpdateNode(MdDirectionalLightTreeNode *node)
 	for (uint32_t i = 0; i < MD_REP_SLOTS; i++)
 	{
 		if(l->lights[i] && r->lights[i])
-			node->lights[i] = (sampler.Next1D() < prob) ? l->lights[i] : r->lights[i];
+			node->lights[i] = (SlotRandom(slot * MD_REP_SLOTS + i) < prob) ? l->lights[i] : r->lights[i];
 		else
 			node->lights[i] = l->lights[i] ? l->lights[i] : r->lights[i];
 	}
 #else
-	node->light = (sampler.Next1D() < (l->L.Average() / node->L.Average())) ? l->light : r->light;
+	node->light = (SlotRandom(slot) < (l->L.Average() / node->L.Average())) ? l->light : r->light;
 #endif
 }
 
 template<>
-void DivisiveMdLightTreeBuilder::_UpdateNode(MdOmniDirLightTreeNode *node)
+void DivisiveMdLightTreeBuilder::_UpdateNode(MdOmniDirLightTreeNode *node, uint32_t slot)
 {
 	MdOmniDirLightTreeNode *l = node->left;
 	MdOmniDirLightTreeNode *r = node->right;
@@ -109,11 +126,11 @@ void DivisiveMdLightTreeBuilder::_UpdateNode(MdOmniDirLightTreeNode *node)
 	for (uint32_t i = 0; i < MD_REP_SLOTS; i++)
 	{
 		if(l->lights[i] && r->lights[i])
-			node->lights[i] = (sampler.Next1D() < prob) ? l->lights[i] : r->lights[i];
+			node->lights[i] = (SlotRandom(slot * MD_REP_SLOTS + i) < prob) ? l->lights[i] : r->lights[i];
 		else
 			node->lights[i] = l->lights[i] ? l->lights[i] : r->lights[i];
 	}
 #else
-	node->light = (sampler.Next1D() < (l->L.Average() / node->L.Average())) ? l->light : r->light;
+	node->light = (SlotRandom(slot) < (l->L.Average() / node->L.Average())) ? l->light : r->light;
 #endif
 }
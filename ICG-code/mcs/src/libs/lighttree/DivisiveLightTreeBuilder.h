@@ -1,7 +1,9 @@
 #ifndef _DIVISIVE_LIGHT_TREE_BUILDER_H_
 #define _DIVISIVE_LIGHT_TREE_BUILDER_H_
 #include "LightTreeBuilder.h"
-#include <sampler/pathSampler.h>
+#include "FlatLightTree.h"
+#include <tbbutils/tbbutils.h>
+#include <tbb/parallel_invoke.h>
 
 using namespace LightTreeBuilderUtil;
 
@@ -11,62 +13,76 @@ public:
 	DivisiveLightTreeBuilder(VirtualLightGenerator *gen) : LightTreeBuilder(gen) { };
 	~DivisiveLightTreeBuilder(void) {};
 	LightTree* Build(Scene *scene, RayEngine *engine, uint32_t indirect, ReportHandler *report = 0);
+	// builds the tree and linearises it for the lightcutters
+	FlatLightTree* BuildFlat(Scene *scene, RayEngine *engine, uint32_t indirect, ReportHandler *report = 0);
+	// builds the hierarchies over the lights already stored in lightTree,
+	// c scales the light normals against the positions when splitting
+	void        Construct(LightTree* lightTree, float c, ReportHandler *report = 0);
 private:
-	void        _ConstructTree(LightTree* lightTree, ReportHandler *reportt);
 	template<typename LightType, typename NodeType>
-	NodeType*   _ConstructSubTree(vector<LightType> &lights, ReportHandler *report);
+	NodeType*   _ConstructSubTree(vector<LightType> &lights, vector<NodeType> &nodes, ReportHandler *report);
 	template<typename NodeType>
-	NodeType*   _BuildSubTree(typename vector<LightTreeBuildItem<NodeType> >::iterator start, typename vector<LightTreeBuildItem<NodeType> >::iterator end);
+	NodeType*   _BuildSubTree(LightTreeBuildItem<NodeType> *items, uint32_t start, uint32_t end, NodeType *interior);
 	template<typename NodeType>
-	NodeType*   _MakeLeaf( typename vector<LightTreeBuildItem<NodeType> >::iterator start ) { return start->node; }
-	template<typename NodeType>
-	void		_UpdateNode(NodeType *node);
-	RandomPathSamplerStd	sampler;
+	void		_UpdateNode(NodeType *node, uint32_t slot);
 };
 
-
+// The lights of [start, end) own the interior slots [start, end - 1): the
+// node takes mid - 1 and each half keeps its own range, so the subtrees can
+// be built as independent tasks without sharing an allocator.
 template<typename NodeType>
-NodeType* DivisiveLightTreeBuilder::_BuildSubTree(typename vector<LightTreeBuildItem<NodeType> >::iterator start, typename vector<LightTreeBuildItem<NodeType> >::iterator end)
+NodeType* DivisiveLightTreeBuilder::_BuildSubTree(LightTreeBuildItem<NodeType> *items, uint32_t start, uint32_t end, NodeType *interior)
 {
-    typedef typename vector<LightTreeBuildItem<NodeType> >::iterator DataIter;
     assert(end > start);
     if (end - start == 1)
-        return _MakeLeaf<NodeType>(start);
+        return items[start].node;
 
-    Range6f bbox = Range6f::Empty();
-    for (DataIter it = start; it != end; it++)
-        bbox.Grow(it->point);
+    Range6f bbox = ComputeBounds(items + start, end - start);
 
     uint32_t dim = bbox.GetSize().MaxComponentIndex();
-    DataIter mid = start + (end - start) / 2;
-	std::nth_element(start, mid, end, 
+    uint32_t mid = start + (end - start) / 2;
+	std::nth_element(items + start, items + mid, items + end, 
 		[dim](const LightTreeBuildItem<NodeType> &d1, const LightTreeBuildItem<NodeType> &d2)->bool {
 		return d1.point[dim] == d2.point[dim] ? (d1.node < d2.node) : d1.point[dim] < d2.point[dim]; 
 	});
 
-    NodeType *node = new NodeType();
-    node->left = _BuildSubTree<NodeType>(start, mid);
-    node->right = _BuildSubTree<NodeType>(mid, end);
-    _UpdateNode(node);
+    uint32_t slot = mid - 1;
+    NodeType *node = interior + slot;
+    if (end - start > LIGHTTREE_PARALLEL_CUTOFF)
+    {
+        tbb::parallel_invoke(
+            [&]() { node->left = _BuildSubTree<NodeType>(items, start, mid, interior); },
+            [&]() { node->right = _BuildSubTree<NodeType>(items, mid, end, interior); });
+    }
+    else
+    {
+        node->left = _BuildSubTree<NodeType>(items, start, mid, interior);
+        node->right = _BuildSubTree<NodeType>(items, mid, end, interior);
+    }
+    _UpdateNode(node, slot);
     return node;
 }
 
 template<typename LightType, typename NodeType>
-NodeType* DivisiveLightTreeBuilder::_ConstructSubTree( vector<LightType> &lights, ReportHandler *report )
+NodeType* DivisiveLightTreeBuilder::_ConstructSubTree( vector<LightType> &lights, vector<NodeType> &nodes, ReportHandler *report )
 {
+    nodes.clear();
     if (lights.size() < 1)
         return NULL;
     if (report) report->beginActivity("initialize light input data");
-    vector<LightTreeBuildItem<NodeType> > inputData;
-    for (uint32_t i = 0; i < lights.size(); i++)
-    {
-        NodeType *node = new NodeType(lights[i]);
-        inputData.push_back(LightTreeBuildItem<NodeType> (node, _c));
-    }
+    uint32_t nLights = static_cast<uint32_t>(lights.size());
+    nodes.resize(2 * nLights - 1);
+    vector<LightTreeBuildItem<NodeType> > inputData(nLights);
+    float c = _c;
+    TbbParallelFor(0, nLights, [&](uint32_t i) {
+        nodes[i] = NodeType(lights[i]);
+        inputData[i] = LightTreeBuildItem<NodeType>(&nodes[i], c);
+    }, 0, LIGHTTREE_GRAIN);
     if (report) report->endActivity();
 
     if (report) report->beginActivity("build light tree by division");
-    NodeType *node = _BuildSubTree<NodeType>(inputData.begin(), inputData.end());
+    NodeType *interior = nLights > 1 ? &nodes[nLights] : 0;
+    NodeType *node = _BuildSubTree<NodeType>(&inputData[0], 0, nLights, interior);
     if (report) report->endActivity();
     return node;
 }
@@ -79,67 +95,74 @@ public:
 	~DivisiveMdLightTreeBuilder(void) {};
 	MdLightTree* Build(Scene *scene, RayEngine *engine, uint32_t indirect, ReportHandler *report = 0);
 private:
-	void        _ConstructTree(MdLightTree* lightTree, ReportHandler *reportt);
 	template<typename LightType, typename NodeType>
-	NodeType*   _ConstructSubTree(vector<LightType> &lights, ReportHandler *report);
+	NodeType*   _ConstructSubTree(vector<LightType> &lights, vector<NodeType> &nodes, ReportHandler *report);
 	template<typename NodeType>
-	NodeType*   _BuildSubTree(typename vector<LightTreeBuildItem<NodeType> >::iterator start, typename vector<LightTreeBuildItem<NodeType> >::iterator end);
+	NodeType*   _BuildSubTree(LightTreeBuildItem<NodeType> *items, uint32_t start, uint32_t end, NodeType *interior);
 	template<typename NodeType>
-	NodeType*   _MakeLeaf( typename vector<LightTreeBuildItem<NodeType> >::iterator start ) { return start->node; }
-	template<typename NodeType>
-	void		_UpdateNode(NodeType *node);
-	RandomPathSamplerStd	sampler;
+	void		_UpdateNode(NodeType *node, uint32_t slot);
 };
 
 
 template<typename LightType, typename NodeType>
-NodeType* DivisiveMdLightTreeBuilder::_ConstructSubTree( vector<LightType> &lights, ReportHandler *report )
+NodeType* DivisiveMdLightTreeBuilder::_ConstructSubTree( vector<LightType> &lights, vector<NodeType> &nodes, ReportHandler *report )
 {
+	nodes.clear();
 	if (lights.size() < 1)
 		return NULL;
 	if (report) report->beginActivity("initialize light input data");
-	vector<LightTreeBuildItem<NodeType> > inputData;
-	for (uint32_t i = 0; i < lights.size(); i++)
-	{
+	uint32_t nLights = static_cast<uint32_t>(lights.size());
+	nodes.resize(2 * nLights - 1);
+	vector<LightTreeBuildItem<NodeType> > inputData(nLights);
+	float c = _c;
+	TbbParallelFor(0, nLights, [&](uint32_t i) {
 #ifdef MULTI_REP
-		uint32_t index = static_cast<uint32_t>(MD_REP_SLOTS * sampler.Next1D());
-		NodeType *node = new NodeType(lights[i], index);
+		uint32_t index = min<uint32_t>(static_cast<uint32_t>(MD_REP_SLOTS * SlotRandom(~i)), MD_REP_SLOTS - 1);
+		nodes[i] = NodeType(lights[i], index);
 #else
-		NodeType *node = new NodeType(lights[i]);
+		nodes[i] = NodeType(lights[i]);
 #endif
-		inputData.push_back(LightTreeBuildItem<NodeType> (node, _c));
-	}
+		inputData[i] = LightTreeBuildItem<NodeType>(&nodes[i], c);
+	}, 0, LIGHTTREE_GRAIN);
 	if (report) report->endActivity();
 
 	if (report) report->beginActivity("build light tree by division");
-	NodeType *node = _BuildSubTree<NodeType>(inputData.begin(), inputData.end());
+	NodeType *interior = nLights > 1 ? &nodes[nLights] : 0;
+	NodeType *node = _BuildSubTree<NodeType>(&inputData[0], 0, nLights, interior);
 	if (report) report->endActivity();
 	return node;
 }
 
 template<typename NodeType>
-NodeType* DivisiveMdLightTreeBuilder::_BuildSubTree(typename vector<LightTreeBuildItem<NodeType> >::iterator start, typename vector<LightTreeBuildItem<NodeType> >::iterator end)
+NodeType* DivisiveMdLightTreeBuilder::_BuildSubTree(LightTreeBuildItem<NodeType> *items, uint32_t start, uint32_t end, NodeType *interior)
 {
-	typedef typename vector<LightTreeBuildItem<NodeType> >::iterator DataIter;
 	assert(end > start);
 	if (end - start == 1)
-		return _MakeLeaf<NodeType>(start);
+		return items[start].node;
 
-	Range6f bbox = Range6f::Empty();
-	for (DataIter it = start; it != end; it++)
-		bbox.Grow(it->point);
+	Range6f bbox = ComputeBounds(items + start, end - start);
 
 	uint32_t dim = bbox.GetSize().MaxComponentIndex();
-	DataIter mid = start + (end - start) / 2;
-	std::nth_element(start, mid, end, 
+	uint32_t mid = start + (end - start) / 2;
+	std::nth_element(items + start, items + mid, items + end, 
 		[dim](const LightTreeBuildItem<NodeType> &d1, const LightTreeBuildItem<NodeType> &d2)->bool {
 			return d1.point[dim] == d2.point[dim] ? (d1.node < d2.node) : d1.point[dim] < d2.point[dim]; 
 	});
 
-	NodeType *node = new NodeType();
-	node->left = _BuildSubTree<NodeType>(start, mid);
-	node->right = _BuildSubTree<NodeType>(mid, end);
-	_UpdateNode(node);
+	uint32_t slot = mid - 1;
+	NodeType *node = interior + slot;
+	if (end - start > LIGHTTREE_PARALLEL_CUTOFF)
+	{
+		tbb::parallel_invoke(
+			[&]() { node->left = _BuildSubTree<NodeType>(items, start, mid, interior); },
+			[&]() { node->right = _BuildSubTree<NodeType>(items, mid, end, interior); });
+	}
+	else
+	{
+		node->left = _BuildSubTree<NodeType>(items, start, mid, interior);
+		node->right = _BuildSubTree<NodeType>(items, mid, end, interior);
+	}
+	_UpdateNode(node, slot);
 	return node;
 }
 
@@ -0,0 +1,166 @@
+#include "FlatLightTree.h"
+#include <vmath/consts.h>
+#include <vmath/frame.h>
+
+#define FLAT_NO_PARENT      0xffffffff
+
+static inline float _Dequantize(float origin, float scale, uint16_t q)
+{
+    return origin + q * scale;
+}
+
+static void _EncodeAxis(const Vec3f &v, int16_t *q)
+{
+    float s = fabs(v.x) + fabs(v.y) + fabs(v.z);
+    if (s == 0.0f)
+    {
+        q[0] = q[1] = 0;
+        return;
+    }
+    float x = v.x / s, y = v.y / s;
+    if (v.z < 0.0f)
+    {
+        float ox = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float oy = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = ox;
+        y = oy;
+    }
+    q[0] = static_cast<int16_t>(floor(x * FLAT_AXIS_LEVELS + 0.5f));
+    q[1] = static_cast<int16_t>(floor(y * FLAT_AXIS_LEVELS + 0.5f));
+}
+
+Vec3f FlatLightHierarchy::GetAxis(const FlatLightNode &node)
+{
+    float x = node.axis[0] / static_cast<float>(FLAT_AXIS_LEVELS);
+    float y = node.axis[1] / static_cast<float>(FLAT_AXIS_LEVELS);
+    float z = 1.0f - fabs(x) - fabs(y);
+    if (z < 0.0f)
+    {
+        float ox = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float oy = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = ox;
+        y = oy;
+    }
+    return Vec3f(x, y, z).GetNormalized();
+}
+
+// widens the cone by the angle between its axis and the quantised one, the
+// cosine is lowered a bit more since near 1 a float dot product is not exact
+#define FLAT_COS_EPSILON    1e-5f
+
+static void _SetCone(FlatLightNode &node, const FastConef &cone)
+{
+    float cosAngle = cone.GetAngleCos();
+    if (cosAngle <= 0.0f)
+    {
+        node.axis[0] = node.axis[1] = 0;
+        node.cosAngle = 0.0f;
+        return;
+    }
+    Vec3f axis = cone.GetAxis();
+    _EncodeAxis(axis, node.axis);
+    double err = acos(clamp<double>(axis % FlatLightHierarchy::GetAxis(node), -1.0, 1.0));
+    double angle = acos(min(1.0, static_cast<double>(cosAngle))) + err;
+    node.cosAngle = angle >= PI / 2 ? 0.0f : max(0.0f, static_cast<float>(cos(angle)) - FLAT_COS_EPSILON);
+}
+
+static void _SetCone(FlatLightNode &node, const OrientedLightTreeNode *n) { _SetCone(node, n->cone); }
+static void _SetCone(FlatLightNode &node, const DirectionalLightTreeNode *n)
+{
+    node.axis[0] = node.axis[1] = 0;
+    node.cosAngle = 0.0f;
+}
+
+void FlatLightHierarchy::_SetBBox(FlatLightNode &node, const Range3f &bbox) const
+{
+    for (uint32_t k = 0; k < 3; k++)
+    {
+        if (_scale[k] == 0.0f)
+        {
+            node.bboxMin[k] = node.bboxMax[k] = 0;
+            continue;
+        }
+        float m = bbox.GetMin()[k];
+        float M = bbox.GetMax()[k];
+        uint16_t qm = static_cast<uint16_t>(clamp<float>(floor((m - _origin[k]) / _scale[k]), 0.0f, FLAT_BBOX_LEVELS));
+        while (qm > 0 && _Dequantize(_origin[k], _scale[k], qm) > m)
+            qm--;
+        uint16_t qM = static_cast<uint16_t>(clamp<float>(ceil((M - _origin[k]) / _scale[k]), 0.0f, FLAT_BBOX_LEVELS));
+        while (qM < FLAT_BBOX_LEVELS && _Dequantize(_origin[k], _scale[k], qM) < M)
+            qM++;
+        node.bboxMin[k] = qm;
+        node.bboxMax[k] = qM;
+    }
+}
+
+void FlatLightHierarchy::_SetBound(uint32_t i)
+{
+    const FlatLightNode &node = _nodes[i];
+    FlatLightBound &bound = _bounds[i];
+    Range3f bbox = GetBBox(node);
+    bound.center = bbox.GetCenter();
+    bound.extent = bbox.GetSize() * 0.5f;
+    Frame<float> frame;
+    if (node.cosAngle > 0.0f)
+    {
+        frame.SetZ(GetAxis(node));
+        frame.RenormalizeFromZ();
+    }
+    bound.frame[0] = frame.GetX();
+    bound.frame[1] = frame.GetY();
+    bound.frame[2] = frame.GetZ();
+}
+
+template<typename NodeType, typename LightType>
+void FlatLightHierarchy::_Flatten(const NodeType *root, const LightType *lights)
+{
+    _nodes.clear();
+    _bounds.clear();
+    if (!root)
+        return;
+
+    // one step of headroom, the outward rounding never clamps at the top
+    _origin = root->bbox.GetMin();
+    _scale = root->bbox.GetSize() / static_cast<float>(FLAT_BBOX_LEVELS - 1);
+
+    // depth first, the right child patches its parent when it is reached
+    typedef pair<const NodeType*, uint32_t> StackItem;
+    vector<StackItem> stack;
+    stack.push_back(StackItem(root, FLAT_NO_PARENT));
+    while (!stack.empty())
+    {
+        const NodeType *n = stack.back().first;
+        uint32_t parent = stack.back().second;
+        stack.pop_back();
+
+        uint32_t idx = static_cast<uint32_t>(_nodes.size());
+        if (parent != FLAT_NO_PARENT)
+            _nodes[parent].right = idx;
+        _nodes.push_back(FlatLightNode());
+        FlatLightNode &node = _nodes.back();
+        node.L = n->L;
+        node.right = 0;
+        node.light = static_cast<uint32_t>(n->light - lights);
+        _SetBBox(node, n->bbox);
+        _SetCone(node, n);
+
+        if (!n->IsLeaf())
+        {
+            assert(n->left && n->right);
+            stack.push_back(StackItem(static_cast<const NodeType*>(n->right), idx));
+            stack.push_back(StackItem(static_cast<const NodeType*>(n->left), FLAT_NO_PARENT));
+        }
+    }
+
+    _bounds.resize(_nodes.size());
+    for (uint32_t i = 0; i < _nodes.size(); i++)
+        _SetBound(i);
+}
+
+void FlatLightTree::Flatten(LightTree *tree)
+{
+    _oriented._Flatten(tree->GetOrientedRoot(), tree->OrientedLights().empty() ? 0 : &tree->OrientedLights()[0]);
+    _directional._Flatten(tree->GetDirectionalRoot(), tree->DirectionalLights().empty() ? 0 : &tree->DirectionalLights()[0]);
+    _orientedLights.swap(tree->OrientedLights());
+    _dirLights.swap(tree->DirectionalLights());
+}
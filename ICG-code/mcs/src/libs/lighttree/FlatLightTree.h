@@ -0,0 +1,95 @@
+#ifndef _FLAT_LIGHT_TREE_H_
+#define _FLAT_LIGHT_TREE_H_
+
+#include "LightTree.h"
+
+#define FLAT_BBOX_LEVELS    65535
+#define FLAT_AXIS_LEVELS    32767
+
+// 40 byte node of a linearised light tree. Nodes are stored depth first, so
+// the left child is the next node and only the right one is linked. The bbox
+// is quantised to the grid of the hierarchy and the cone axis is octahedral,
+// both rounded outwards so the lightcut bounds stay conservative.
+struct FlatLightNode
+{
+    Vec3f           L;
+    uint32_t        right;          // 0 for leaves
+    uint32_t        light;          // representative light
+    uint16_t        bboxMin[3];
+    uint16_t        bboxMax[3];
+    int16_t         axis[2];
+    float           cosAngle;       // <= 0 when the cone does not bound anything
+
+    inline bool     IsLeaf() const { return right == 0; }
+};
+
+// Per node data of the lightcut bounds, stored next to the node array: the
+// dequantised bbox as center and half size, and the rows of a frame whose z
+// is the cone axis (identity when the cone does not bound anything).
+struct FlatLightBound
+{
+    Vec3f           center;
+    Vec3f           extent;
+    Vec3f           frame[3];
+};
+
+// One light tree (oriented or directional) as a contiguous node array.
+class FlatLightHierarchy
+{
+    friend class FlatLightTree;
+public:
+    FlatLightHierarchy(LightTreeNodeType type) : _type(type), _origin(Vec3f::Zero()), _scale(Vec3f::Zero()) {}
+
+    inline LightTreeNodeType    GetNodeType() const { return _type; }
+    inline bool                 Empty() const { return _nodes.empty(); }
+    inline uint32_t             NodeNum() const { return static_cast<uint32_t>(_nodes.size()); }
+    inline const FlatLightNode& GetNode(uint32_t i) const { return _nodes[i]; }
+    inline const FlatLightBound& GetBound(uint32_t i) const { return _bounds[i]; }
+    inline uint32_t             Left(uint32_t i) const { return i + 1; }
+    inline uint32_t             Right(uint32_t i) const { return _nodes[i].right; }
+
+    inline Range3f              GetBBox(const FlatLightNode &node) const
+    {
+        return Range3f(Vec3f(_origin.x + node.bboxMin[0] * _scale.x, _origin.y + node.bboxMin[1] * _scale.y, _origin.z + node.bboxMin[2] * _scale.z),
+            Vec3f(_origin.x + node.bboxMax[0] * _scale.x, _origin.y + node.bboxMax[1] * _scale.y, _origin.z + node.bboxMax[2] * _scale.z));
+    }
+    static Vec3f                GetAxis(const FlatLightNode &node);
+
+protected:
+    template<typename NodeType, typename LightType>
+    void                        _Flatten(const NodeType *root, const LightType *lights);
+    void                        _SetBBox(FlatLightNode &node, const Range3f &bbox) const;
+    void                        _SetBound(uint32_t i);
+
+    LightTreeNodeType           _type;
+    vector<FlatLightNode>       _nodes;
+    vector<FlatLightBound>      _bounds;
+    Vec3f                       _origin;
+    Vec3f                       _scale;
+};
+
+// Pointer free light tree read by the lightcutters. The lights are taken over
+// from the LightTree it is flattened from.
+class FlatLightTree
+{
+public:
+    FlatLightTree() : _oriented(ORIENTED_NODE), _directional(DIRECT_NODE) {}
+
+    void                        Flatten(LightTree *tree);
+
+    inline const FlatLightHierarchy&    GetOriented() const { return _oriented; }
+    inline const FlatLightHierarchy&    GetDirectional() const { return _directional; }
+
+    inline uint32_t             OrientedLightNum() const { return static_cast<uint32_t>(_orientedLights.size()); }
+    inline uint32_t             DirectionalLightNum() const { return static_cast<uint32_t>(_dirLights.size()); }
+    inline const OrientedLight& GetOrientedLight(uint32_t i) const { return _orientedLights[i]; }
+    inline const DirLight&      GetDirLight(uint32_t i) const { return _dirLights[i]; }
+
+protected:
+    FlatLightHierarchy          _oriented;
+    FlatLightHierarchy          _directional;
+    vector<OrientedLight>       _orientedLights;
+    vector<DirLight>            _dirLights;
+};
+
+#endif // _FLAT_LIGHT_TREE_H_
@@ -18,9 +18,11 @@ GatherTreeBuilder::~GatherTreeBuilder(void)
 {
 }
 
-GatherNode* GatherTreeBuilder::Build( uint32_t i, uint32_t j, uint64_t seed, vector<GatherPoint> &points, Vec3f *background)
+GatherNode* GatherTreeBuilder::Build( uint32_t i, uint32_t j, uint64_t seed, GatherTreeArena &arena, Vec3f *background)
 { 
     const float time = 0.0f;
+    arena.Reset();
+    arena.points.reserve(_samples);
 	const float invSamples = 1.0f / _samples;
 	StratifiedPathSamplerStd::Engine e(seed);
 	StratifiedPathSamplerStd sampler(e);
@@ -59,7 +61,7 @@ GatherNode* GatherTreeBuilder::Build( uint32_t i, uint32_t j, uint64_t seed, vec
                 gp.pixel = pixel;
                 gp.wo = -ray.D;
                 gp.weight = throughput;
-                points.push_back(gp);
+                arena.points.push_back(gp);
                 hit = true;
             }
             break;
@@ -70,15 +72,17 @@ GatherNode* GatherTreeBuilder::Build( uint32_t i, uint32_t j, uint64_t seed, vec
         sampler.NextPixelSample();
     }
     sampler.EndPixel();
-    return _BuildTree(points, &sampler);
+    return _BuildTree(arena, &sampler);
 }
 
-GatherNode* GatherTreeBuilder::_BuildTree( vector<GatherPoint> &points, PathSampler* sampler)
+GatherNode* GatherTreeBuilder::_BuildTree( GatherTreeArena &arena, PathSampler* sampler)
 {
+    vector<GatherPoint> &points = arena.points;
     if (points.size() == 0)
         return NULL;
 
-    vector<GpKdItem> inputData;
+    vector<GpKdItem> &inputData = arena.items;
+    inputData.reserve(points.size());
     for (uint32_t s = 0; s < points.size(); s++)
     {
         GpKdItem item;
@@ -87,7 +91,9 @@ GatherNode* GatherTreeBuilder::_BuildTree( vector<GatherPoint> &points, PathSamp
         inputData.push_back(item);
     }
 
-    GatherNode *node = _Build(inputData.begin(), inputData.end(), points, sampler);
+    // a full binary tree over n points, reserved so node pointers stay valid
+    arena.nodes.reserve(2 * points.size() - 1);
+    GatherNode *node = _Build(inputData.begin(), inputData.end(), arena, sampler);
     return node;
 }
 
@@ -143,11 +149,11 @@ void GatherTreeBuilder::_UpdateNode(GatherNode* node, PathSampler *sampler)
 }
 
 
-GatherNode* GatherTreeBuilder::_Build( vector<GpKdItem>::iterator start, vector<GpKdItem>::iterator end, vector<GatherPoint> &points, PathSampler* sampler)
+GatherNode* GatherTreeBuilder::_Build( vector<GpKdItem>::iterator start, vector<GpKdItem>::iterator end, GatherTreeArena &arena, PathSampler* sampler)
 {
     assert(end > start);
     if (end - start == 1)
-        return _MakeLeaf(start, points);
+        return _MakeLeaf(start, arena);
 
     Range6f bbox = Range6f::Empty();
     for (vector<GpKdItem>::iterator it = start; it != end; it++)
@@ -159,17 +165,21 @@ GatherNode* GatherTreeBuilder::_Build( vector<GpKdItem>::iterator start, vector<
 		return d1.point[dim] < d2.point[dim];
 	});
 
-    GatherNode* node = new GatherNode();
-    node->left = _Build(start, mid, points, sampler);
-    node->right = _Build(mid, end, points, sampler);
+    assert(arena.nodes.size() < arena.nodes.capacity());
+    arena.nodes.push_back(GatherNode());
+    GatherNode* node = &arena.nodes.back();
+    node->left = _Build(start, mid, arena, sampler);
+    node->right = _Build(mid, end, arena, sampler);
 	_UpdateNode(node, sampler);
     return node;
 }
 
-GatherNode* GatherTreeBuilder::_MakeLeaf( vector<GpKdItem>::iterator it, vector<GatherPoint> &points)
+GatherNode* GatherTreeBuilder::_MakeLeaf( vector<GpKdItem>::iterator it, GatherTreeArena &arena)
 {
-    GatherNode *node = new GatherNode();
-    GatherPoint &gp = points[it->idx];
+    assert(arena.nodes.size() < arena.nodes.capacity());
+    arena.nodes.push_back(GatherNode());
+    GatherNode *node = &arena.nodes.back();
+    GatherPoint &gp = arena.points[it->idx];
     GLPhongApproximation m = gp.isect.m->ApprtoximateAsGLPhong(gp.isect.dp);
     node->gp = &gp;
     node->strength = 1.0f / _samples;
@@ -14,6 +14,18 @@ struct GpKdItem
     Vec6f       point;
 };
 
+// Storage of the gather tree of one pixel, kept by a thread and reused from
+// pixel to pixel. Build resets it and writes the nodes depth first into the
+// reserved node array, so a tree is valid until the arena is built into again.
+struct GatherTreeArena
+{
+    void                    Reset() { points.clear(); items.clear(); nodes.clear(); }
+
+    vector<GatherPoint>     points;
+    vector<GpKdItem>        items;
+    vector<GatherNode>      nodes;
+};
+
 
 class GatherTreeBuilder
 {
@@ -21,11 +33,11 @@ public:
     GatherTreeBuilder(Scene *scene, RayEngine *engine, uint32_t width, uint32_t height, uint32_t samples, float c);
     ~GatherTreeBuilder(void);
 
-    GatherNode*				Build(uint32_t i, uint32_t j, uint64_t seed, vector<GatherPoint> &points, Vec3f *background); 
+    GatherNode*				Build(uint32_t i, uint32_t j, uint64_t seed, GatherTreeArena &arena, Vec3f *background); 
 protected:
-    GatherNode*             _BuildTree( vector<GatherPoint> &points, PathSampler* sampler);
-    GatherNode*             _Build( vector<GpKdItem>::iterator start, vector<GpKdItem>::iterator end, vector<GatherPoint> &points, PathSampler* sampler);
-    GatherNode*             _MakeLeaf( vector<GpKdItem>::iterator it, vector<GatherPoint> &points );
+    GatherNode*             _BuildTree( GatherTreeArena &arena, PathSampler* sampler);
+    GatherNode*             _Build( vector<GpKdItem>::iterator start, vector<GpKdItem>::iterator end, GatherTreeArena &arena, PathSampler* sampler);
+    GatherNode*             _MakeLeaf( vector<GpKdItem>::iterator it, GatherTreeArena &arena );
     float                   _BoundGlossyCos( const Range3f &gbox );
 
 private:
@@ -26,20 +26,14 @@ OmniDirLightTreeNode::OmniDirLightTreeNode(OmniDirLight &l) : left(0), right(0)
 
 OrientedLightTreeNode::~OrientedLightTreeNode()
 {
-	if(left) delete left;
-	if(right) delete right;
 }
 
 DirectionalLightTreeNode::~DirectionalLightTreeNode()
 {
-	if(left) delete left;
-	if(right) delete right;
 }
 
 OmniDirLightTreeNode::~OmniDirLightTreeNode()
 {
-	if(left) delete left;
-	if(right) delete right;
 }
 
 #ifdef MULTI_REP
@@ -70,19 +64,13 @@ MdOmniDirLightTreeNode::MdOmniDirLightTreeNode(OmniDirLight &l, uint32_t idx) :
 
 MdOrientedLightTreeNode::~MdOrientedLightTreeNode()
 {
-	if(left) delete left;
-	if(right) delete right;
 }
 
 MdDirectionalLightTreeNode::~MdDirectionalLightTreeNode()
 {
-	if(left) delete left;
-	if(right) delete right;
 }
 
 MdOmniDirLightTreeNode::~MdOmniDirLightTreeNode()
 {
-	if(left) delete left;
-	if(right) delete right;
 }
 #endif
\ No newline at end of file
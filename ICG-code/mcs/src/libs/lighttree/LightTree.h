@@ -126,7 +126,7 @@ class GenericLightTree
     friend class DivisiveMdLightTreeBuilder;
     friend class DivisiveLightTreeBuilder;
 public:
-    GenericLightTree(void) {}
+    GenericLightTree(void) : _orientedRoot(0), _directionalRoot(0), _pointRoot(0) {}
 	~GenericLightTree(void) { Clear(); }
 	inline OT				*GetOrientedRoot() const { return _orientedRoot; }
 	inline DT				*GetDirectionalRoot() const { return _directionalRoot; }
@@ -139,13 +139,24 @@ public:
     vector<DirLight>&       DirectionalLights() { return _dirLights; }
     vector<OrientedLight>&  OrientedLights() { return _orientedLights; }
 
-    void                    Clear() { if (_orientedRoot) delete _orientedRoot; if (_directionalRoot) delete _directionalRoot;}
+    void                    Clear() 
+    {
+        _orientedNodes.clear(); 
+        _directionalNodes.clear(); 
+        _orientedRoot = 0; 
+        _directionalRoot = 0; 
+        _pointRoot = 0;
+    }
 
 protected:
     vector<OmniDirLight>            _omniDirLights;
     vector<DirLight>                _dirLights;
     vector<OrientedLight>           _orientedLights;
 
+    // the nodes are pooled per type, leaves first, and the roots point into the pools
+    vector<OT>                      _orientedNodes;
+    vector<DT>                      _directionalNodes;
+
     OT								*_orientedRoot;
     DT								*_directionalRoot;
 	PT								*_pointRoot;
@@ -5,6 +5,12 @@
 #include <vmath/range3.h>
 #include <vmath/range6.h>
 #include "LightTree.h"
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+
+// subtrees above this many lights are built as parallel tasks
+#define LIGHTTREE_PARALLEL_CUTOFF   4096
+#define LIGHTTREE_GRAIN             1024
 
 namespace LightTreeBuilderUtil
 {
@@ -52,6 +58,38 @@ namespace LightTreeBuilderUtil
 		Vec6f									point;
 	};
 
+	template<typename NodeType>
+	Range6f ComputeBounds(const LightTreeBuildItem<NodeType> *items, uint32_t n)
+	{
+		if (n <= LIGHTTREE_PARALLEL_CUTOFF)
+		{
+			Range6f bbox = Range6f::Empty();
+			for (uint32_t i = 0; i < n; i++)
+				bbox.Grow(items[i].point);
+			return bbox;
+		}
+		return tbb::parallel_reduce(tbb::blocked_range<uint32_t>(0, n, LIGHTTREE_GRAIN), Range6f::Empty(),
+			[items](const tbb::blocked_range<uint32_t> &r, Range6f bbox) -> Range6f {
+				for (uint32_t i = r.begin(); i != r.end(); i++)
+					bbox.Grow(items[i].point);
+				return bbox;
+			},
+			[](const Range6f &a, const Range6f &b) -> Range6f { return Range6f::Union(a, b); });
+	}
+
+	// uniform number in [0,1) hashed from a node slot, so the representative
+	// lights do not depend on the order the tasks run in
+	inline float SlotRandom(uint32_t slot)
+	{
+		uint32_t h = slot + 0x9e3779b9u;
+		h ^= h >> 16;
+		h *= 0x7feb352du;
+		h ^= h >> 15;
+		h *= 0x846ca68bu;
+		h ^= h >> 16;
+		return (h >> 8) * (1.0f / 16777216.0f);
+	}
+
 
     inline float Distance(const OrientedLightTreeNode *o1, const OrientedLightTreeNode *o2, float c)
     {
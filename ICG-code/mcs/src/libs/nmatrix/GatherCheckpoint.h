@@ -0,0 +1,38 @@
+#ifndef _GATHER_CHECKPOINT_H_
+#define _GATHER_CHECKPOINT_H_
+
+#include "GatherGroups.h"
+#include <gpshoot/GatherPointShooter.h>
+#include <lightgen/LightData.h>
+
+// The scene dependent part of a reduced matrix render every renderer
+// checkpoints: the lights, the gather points with the background pixels and
+// the gather groups. The renderers append their matrix data after it.
+inline void SaveGatherState(CheckpointWriter &writer, Scene *scene, const LightList &lights,
+    const GatherPointStore &points, const vector<BackgroundPixel> &bkPixels, const GatherGroupList &groups)
+{
+    vector<Material*> materials;
+    GatherPointStore::SceneMaterials(scene, materials);
+    lights.Save(writer);
+    points.Save(writer, materials);
+    writer.Write(bkPixels);
+    groups.Save(writer);
+}
+
+inline bool LoadGatherState(CheckpointReader &reader, Scene *scene, LightList &lights,
+    GatherPointStore &points, vector<BackgroundPixel> &bkPixels, GatherGroupList &groups)
+{
+    vector<Material*> materials;
+    GatherPointStore::SceneMaterials(scene, materials);
+    bool good = lights.Load(reader) && points.Load(reader, materials) && reader.Read(bkPixels) && groups.Load(reader);
+    if (!good)
+    {
+        lights.Clear();
+        points.Clear();
+        bkPixels.clear();
+        groups.Clear();
+    }
+    return good;
+}
+
+#endif // _GATHER_CHECKPOINT_H_
@@ -0,0 +1,242 @@
+#ifndef _GATHER_GROUPS_H_
+#define _GATHER_GROUPS_H_
+
+#include "kdtree.h"
+#include <vmath/range3.h>
+#include <misc/checkpoint.h>
+#include <tbb/parallel_reduce.h>
+
+// ranges larger than this are bounded and split in parallel
+#define GATHER_GROUP_PARALLEL_CUTOFF    4096
+
+struct GatherKdItem
+{
+    GatherKdItem() : idx(0) {}
+    GatherKdItem(uint32_t i, const Vec6f& point) : idx(i), p(point) {}
+    uint32_t    idx;
+    Vec6f       p;
+};
+
+struct GatherGroup
+{
+    GatherGroup() : seed(0), bbox(Range3f::Empty()) {}
+    uint32_t            seed;
+    Range3f				bbox;
+    Vec3f               normal;
+};
+
+struct GatherKdItemBounds
+{
+    GatherKdItemBounds(const GatherKdItem *items) : items(items), bbox(Range6f::Empty()) {}
+    GatherKdItemBounds(GatherKdItemBounds &b, split) : items(b.items), bbox(Range6f::Empty()) {}
+    void operator()(const blocked_range<uint32_t> &r) {
+        for (uint32_t i = r.begin(); i != r.end(); i++)
+            bbox.Grow(items[i].p);
+    }
+    void join(const GatherKdItemBounds &b) { bbox.Grow(b.bbox); }
+    const GatherKdItem  *items;
+    Range6f             bbox;
+};
+
+// Groups of gather points (or lights) with their members and neighbors in
+// two flat index arrays addressed by offsets, so the members of consecutive
+// groups are consecutive in memory.
+class GatherGroupList
+{
+public:
+    GatherGroupList() { Clear(); }
+
+    inline uint32_t             Size() const { return static_cast<uint32_t>(_groups.size()); }
+    inline bool                 Empty() const { return _groups.empty(); }
+    inline const GatherGroup&   operator[](uint32_t g) const { return _groups[g]; }
+    inline uint32_t             MemberNum(uint32_t g) const { return _offsets[g + 1] - _offsets[g]; }
+    inline const uint32_t*      Members(uint32_t g) const { return &_indices[0] + _offsets[g]; }
+    inline uint32_t             NeighborNum(uint32_t g) const { return _neighborOffsets[g + 1] - _neighborOffsets[g]; }
+    inline const uint32_t*      Neighbors(uint32_t g) const { return _neighbors.empty() ? 0 : &_neighbors[0] + _neighborOffsets[g]; }
+
+    void                        Clear();
+    // Kd partition of the items, reordered in place, into groups of less than
+    // maxSize points split at the center of the widest dimension. Points gives
+    // Position(idx) and Normal(idx) of the item indices. Seeds are drawn from
+    // the sampler group after group in kd order.
+    template<typename Points, typename Sampler>
+    void                        Build(vector<GatherKdItem> &items, uint32_t maxSize, const Points &points, Sampler &sampler);
+    // appends a group without neighbors, seeded by its first member
+    template<typename Points>
+    void                        AddGroup(const vector<uint32_t> &members, const Points &points);
+    // the k closest groups by bbox center and scaled normal, itself included
+    void                        FindNeighbors(float normScale, uint32_t k);
+    void                        Save(CheckpointWriter &writer) const;
+    bool                        Load(CheckpointReader &reader);
+
+protected:
+    void                        _Partition(GatherKdItem *items, uint32_t start, uint32_t end, uint32_t maxSize, uint8_t *leaves);
+    template<typename Points>
+    void                        _SetGroup(uint32_t g, const Points &points);
+
+    vector<GatherGroup>         _groups;
+    vector<uint32_t>            _offsets;           // Size() + 1
+    vector<uint32_t>            _indices;
+    vector<uint32_t>            _neighborOffsets;   // Size() + 1
+    vector<uint32_t>            _neighbors;
+};
+
+inline void GatherGroupList::Clear()
+{
+    _groups.clear();
+    _indices.clear();
+    _neighbors.clear();
+    _offsets.assign(1, 0);
+    _neighborOffsets.assign(1, 0);
+}
+
+inline void GatherGroupList::_Partition(GatherKdItem *items, uint32_t start, uint32_t end, uint32_t maxSize, uint8_t *leaves)
+{
+    if (end - start < maxSize)
+    {
+        leaves[start] = 1;
+        return;
+    }
+
+    bool parallel = end - start > GATHER_GROUP_PARALLEL_CUTOFF;
+    GatherKdItemBounds bounds(items);
+    if (parallel)
+        parallel_reduce(blocked_range<uint32_t>(start, end), bounds);
+    else
+        bounds(blocked_range<uint32_t>(start, end));
+
+    uint32_t dim = bounds.bbox.GetSize().MaxComponentIndex();
+    float pmid = bounds.bbox.GetCenter()[dim];
+    uint32_t mid = static_cast<uint32_t>(
+        std::partition(items + start, items + end, [dim, pmid](const GatherKdItem &a) { return a.p[dim] < pmid; }) - items);
+    // only coincident points stay on one side
+    if (mid == start || mid == end)
+    {
+        leaves[start] = 1;
+        return;
+    }
+
+    if (parallel)
+    {
+        GatherGroupList *list = this;
+        parallel_invoke([=]() { list->_Partition(items, start, mid, maxSize, leaves); },
+            [=]() { list->_Partition(items, mid, end, maxSize, leaves); });
+    }
+    else
+    {
+        _Partition(items, start, mid, maxSize, leaves);
+        _Partition(items, mid, end, maxSize, leaves);
+    }
+}
+
+template<typename Points>
+void GatherGroupList::_SetGroup(uint32_t g, const Points &points)
+{
+    GatherGroup &group = _groups[g];
+    const uint32_t *members = Members(g);
+    for (uint32_t i = 0; i < MemberNum(g); i++)
+    {
+        group.bbox.Grow(points.Position(members[i]));
+        group.normal += points.Normal(members[i]);
+    }
+    group.normal.Normalize();
+}
+
+template<typename Points, typename Sampler>
+void GatherGroupList::Build(vector<GatherKdItem> &items, uint32_t maxSize, const Points &points, Sampler &sampler)
+{
+    Clear();
+    uint32_t n = static_cast<uint32_t>(items.size());
+    if (n == 0)
+        return;
+
+    // the partition marks where the groups start, its leaves are in kd order
+    vector<uint8_t> leaves(n, 0);
+    _Partition(&items[0], 0, n, maxSize, &leaves[0]);
+    _offsets.clear();
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (leaves[i])
+            _offsets.push_back(i);
+    }
+    _offsets.push_back(n);
+    _groups.resize(_offsets.size() - 1);
+    _neighborOffsets.assign(_offsets.size(), 0);
+
+    _indices.resize(n);
+    GatherGroupList *list = this;
+    TbbParallelFor(0, n, [list, &items](uint32_t i) { list->_indices[i] = items[i].idx; }, 0, 1024);
+    TbbParallelFor(0, Size(), [list, &points](uint32_t g) {
+        list->_SetGroup(g, points);
+        assert(!list->_groups[g].normal.IsZero());
+    }, 0, 16);
+
+    for (uint32_t g = 0; g < Size(); g++)
+    {
+        uint32_t size = MemberNum(g);
+        uint32_t sidx = min(static_cast<uint32_t>(sampler.Next1D() * size), size - 1);
+        _groups[g].seed = Members(g)[sidx];
+    }
+}
+
+template<typename Points>
+void GatherGroupList::AddGroup(const vector<uint32_t> &members, const Points &points)
+{
+    if (members.empty())
+        return;
+    _indices.insert(_indices.end(), members.begin(), members.end());
+    _offsets.push_back(static_cast<uint32_t>(_indices.size()));
+    _neighborOffsets.push_back(_neighborOffsets.back());
+    _groups.push_back(GatherGroup());
+    _SetGroup(Size() - 1, points);
+    _groups.back().seed = members[0];
+}
+
+inline void GatherGroupList::FindNeighbors(float normScale, uint32_t k)
+{
+    _neighbors.clear();
+    _neighborOffsets.assign(1, 0);
+    if (_groups.empty())
+        return;
+
+    vector<GatherKdItem> data(Size());
+    vector<Vec6f> queries(Size());
+    for (uint32_t g = 0; g < Size(); g++)
+    {
+        data[g] = GatherKdItem(g, Vec6f(_groups[g].bbox.GetCenter(), _groups[g].normal * normScale));
+        queries[g] = data[g].p;
+    }
+
+    KdTree<GatherKdItem> kdTree(data);
+    vector<uint32_t> nearest(Size() * k);
+    kdTree.KnnQuery(&queries[0], Size(), k, &nearest[0]);
+    _neighbors.reserve(nearest.size());
+    for (uint32_t g = 0; g < Size(); g++)
+    {
+        for (uint32_t i = 0; i < k && nearest[g * k + i] != KDTREE_NO_NEIGHBOR; i++)
+            _neighbors.push_back(kdTree.GetNodeDataPtr()[nearest[g * k + i]].idx);
+        _neighborOffsets.push_back(static_cast<uint32_t>(_neighbors.size()));
+    }
+}
+
+inline void GatherGroupList::Save(CheckpointWriter &writer) const
+{
+    writer.Write(_groups);
+    writer.Write(_offsets);
+    writer.Write(_indices);
+    writer.Write(_neighborOffsets);
+    writer.Write(_neighbors);
+}
+
+inline bool GatherGroupList::Load(CheckpointReader &reader)
+{
+    bool good = reader.Read(_groups) && reader.Read(_offsets) && reader.Read(_indices) &&
+        reader.Read(_neighborOffsets) && reader.Read(_neighbors);
+    good = good && _offsets.size() == _groups.size() + 1 && _offsets.back() == _indices.size() &&
+        _neighborOffsets.size() == _offsets.size() && _neighborOffsets.back() == _neighbors.size();
+    if (!good)
+        Clear();
+    return good;
+}
+
+#endif // _GATHER_GROUPS_H_
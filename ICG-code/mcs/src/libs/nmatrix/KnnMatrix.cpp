@@ -12,6 +12,7 @@
 #include "vmath/range1.h"
 #include "scene/material.h"
 #include "misc/arrays.h"
+#include "GatherCheckpoint.h"
 #include <queue>
 
 KnnMatrix::KnnMatrix(Scene *scene, RayEngine *engine, VirtualLightGenerator *gen, ReportHandler *report) 
@@ -35,18 +36,19 @@ void KnnMatrix::_SetBackground(Image<Vec3f> *image)
 
 struct ComputeColNorm
 {
-	ComputeColNorm(carray2<Vec3f> &matrix, carray2<Vec3f> &norms, const vector<GatherGroup>	&groups) 
+	ComputeColNorm(carray2<Vec3f> &matrix, carray2<Vec3f> &norms, const GatherGroupList &groups) 
 		: _matrix(matrix), _norms(norms), _groups(groups) { }
 	void operator() (const blocked_range<uint32_t> &r) const {
 		for (uint32_t g = r.begin(); g != r.end(); g++)
 		{
-			const GatherGroup &group = _groups[g];
+			const uint32_t *neighbors = _groups.Neighbors(g);
+			uint32_t neighborNum = _groups.NeighborNum(g);
 			for (uint32_t i = 0; i < _matrix.width(); i++)
 			{
 				Vec3f n = Vec3f::Zero();
-				for (int j= 0; j < group.neighbors.size(); j++)
+				for (uint32_t j = 0; j < neighborNum; j++)
 				{
-					uint32_t gidx = group.neighbors[j];
+					uint32_t gidx = neighbors[j];
 					const Vec3f &v = _matrix.at(i, gidx);
 					n += v * v;
 				}
@@ -56,17 +58,17 @@ struct ComputeColNorm
 	}
 	carray2<Vec3f>                      &_norms;
 	carray2<Vec3f>				        &_matrix;
-	const vector<GatherGroup>			&_groups;
+	const GatherGroupList				&_groups;
 };
 
 struct FinalRenderThread
 {
-	typedef uint32_t argument_type;
-	FinalRenderThread(KnnMatrix *knnMat, const vector<uint32_t> &indices, const vector<ScaleLight> &scaleLights, Image<Vec3f> *image, Image<uint32_t> *sampleImage) 
+	FinalRenderThread(KnnMatrix *knnMat, const uint32_t *indices, const vector<ScaleLight> &scaleLights, Image<Vec3f> *image, Image<uint32_t> *sampleImage) 
 		: _knnMat(knnMat), _indices(indices), _scaleLights(scaleLights), _image(image), _sampleImage(sampleImage) {};
 	void operator()(uint32_t g) const { _RenderGatherPoint(_indices[g]); }
     void _RenderGatherPoint( uint32_t g ) const {
-        GatherPoint &gp = _knnMat->_gatherPoints[g];
+        GatherPoint gp;
+        _knnMat->_gatherPoints.Get(g, gp);
         Vec3f L;
         for (uint32_t c = 0; c < _scaleLights.size(); c++)
         {
@@ -84,7 +86,7 @@ struct FinalRenderThread
 private:
 	KnnMatrix                   *_knnMat;
 	const vector<ScaleLight>    &_scaleLights;
-	const vector<uint32_t>      &_indices;
+	const uint32_t              *_indices;
 	Image<Vec3f>				*_image;
 	Image<uint32_t>				*_sampleImage;
 };
@@ -100,12 +102,13 @@ struct FinalGroupRenderThread
         //FinalRenderThread thread(_knnMat, _groups[g].indices, _lights[g], _image, _sampleImage);
         //parallel_while<FinalRenderThread> w;
         //w.run(counter, thread);
-        GatherGroup &group = _groups[gg];
+        const uint32_t *indices = _groups.Members(gg);
         vector<ScaleLight> &scaleLight = _lights[gg];
-        for (int i = 0; i < group.indices.size(); i++)
+        for (uint32_t i = 0; i < _groups.MemberNum(gg); i++)
         {
-            int g = group.indices[i];
-            GatherPoint &gp = _knnMat->_gatherPoints[g];
+            uint32_t g = indices[i];
+            GatherPoint gp;
+            _knnMat->_gatherPoints.Get(g, gp);
             Vec3f L;
             for (uint32_t c = 0; c < scaleLight.size(); c++)
             {
@@ -122,7 +125,7 @@ struct FinalGroupRenderThread
         }
 	}
 	KnnMatrix					*_knnMat;
-	vector<GatherGroup>			&_groups;
+	const GatherGroupList		&_groups;
 	vector<vector<ScaleLight> > &_lights;
 	Image<Vec3f>				*_image;
 	Image<uint32_t>				*_sampleImage;
@@ -131,13 +134,21 @@ struct FinalGroupRenderThread
 
 void KnnMatrix::Render(Image<Vec3f> *image, Image<uint32_t> *sampleImage, uint32_t samples, uint32_t indirect, uint32_t seedNum, uint32_t budget)
 {
- 	_GenerateLights(indirect);
-	_ShootGatherPoints(image->Width(), image->Height(), samples);
-	_GroupGatherPoints(seedNum);
-	_FindGatherGroupNeighbors();
-
-	carray2<Vec3f> matrix(_lightList.GetSize(), (uint32_t)(_gpGroups.size()));
-	_RenderReducedMatrix(matrix);
+	carray2<Vec3f> matrix;
+	_scaledLights.clear();
+	if (!_LoadCheckpoint(matrix))
+	{
+		// the lights of an earlier frame are kept, only the view changes
+		if (_lightList.GetSize() == 0)
+ 			_GenerateLights(indirect);
+		_ShootGatherPoints(image->Width(), image->Height(), samples);
+		_GroupGatherPoints(seedNum);
+		_FindGatherGroupNeighbors();
+
+		matrix.resize(_lightList.GetSize(), (uint32_t)(_gpGroups.Size()));
+		_RenderReducedMatrix(matrix);
+		_SaveCheckpoint(matrix);
+	}
 
 	//vector<Range1i>			clusters;
 	//carray<uint32_t>		lights(matrix.width());
@@ -152,7 +163,7 @@ void KnnMatrix::Render(Image<Vec3f> *image, Image<uint32_t> *sampleImage, uint32
 
     if (_report) _report->beginActivity("rendering final image");
 
-    //TbbReportCounter counter((uint32_t)_gpGroups.size(), _report);
+    //TbbReportCounter counter((uint32_t)_gpGroups.Size(), _report);
     //FinalGroupRenderThread thread(this, image, sampleImage);
     //parallel_while<FinalGroupRenderThread> w;
     //w.run(counter, thread);
@@ -162,18 +173,16 @@ void KnnMatrix::Render(Image<Vec3f> *image, Image<uint32_t> *sampleImage, uint32
 
 
 struct RefineClusterThread {
-	typedef uint32_t argument_type;
 	RefineClusterThread(KnnMatrix *knnMat, const vector<vector<uint32_t> > &clusters, vector<vector<ScaleLight> > &scaleLights, 
-		carray2<Vec3f> &matrix, carray<Vec3f> &fullNorms, carray2<Vec3f> &colNorms, vector<GatherGroup> &gpGroups, const carray<uint64_t> &randSeeds, uint32_t budget, uint32_t samples, Image<Vec3f> *image, Image<uint32_t> *sampleImage) 
+		carray2<Vec3f> &matrix, carray<Vec3f> &fullNorms, carray2<Vec3f> &colNorms, const GatherGroupList &gpGroups, const carray<uint64_t> &randSeeds, uint32_t budget, uint32_t samples, Image<Vec3f> *image, Image<uint32_t> *sampleImage) 
 		: _knnMat(knnMat), _clusters(clusters), _scaleLights(scaleLights), _matrix(matrix), _norms(colNorms), _fullNorms(fullNorms), _gpGroups(gpGroups), _budget(budget), _samples(samples), _seeds(randSeeds), _image(image), _sampleImage(sampleImage) { } 
 	void operator() (uint32_t g) const {
 
-		const GatherGroup &gpGroup = _gpGroups[g];
-		
 		const Vec3f *norms = _norms.row(g);
-        const vector<uint32_t> &samples = gpGroup.neighbors;
+        const uint32_t *samples = _gpGroups.Neighbors(g);
+        uint32_t sampleNum = _gpGroups.NeighborNum(g);
 		carray<pair<uint32_t, float> > projection(_matrix.width());
-        carray<Vec3f> line((uint32_t)samples.size());
+        carray<Vec3f> line(sampleNum);
 
 		std::vector<pair<Range1i, float> > cluster_queue;
 		cluster_queue.reserve(_budget);
@@ -190,7 +199,7 @@ struct RefineClusterThread {
 				projection.at(off++).first = cluster[i];
             range.SetMax(off);
 
-			float cst = cost(projection, range, samples, norms);
+			float cst = cost(projection, range, samples, sampleNum, norms);
 			cluster_queue.push_back(make_pair(range, cst));
 
 			push_heap(cluster_queue.begin(), cluster_queue.end(), [](pair<Range1i, float> &d1, pair<Range1i, float> &d2)->bool { return d1.second < d2.second;});
@@ -234,8 +243,8 @@ struct RefineClusterThread {
 			assert(largestIdx != -1 && secondIdx != -1);
 
 			
-			for (uint32_t i = 0; i < samples.size(); i++) {
-				uint32_t j = samples.at(i);
+			for (uint32_t i = 0; i < sampleNum; i++) {
+				uint32_t j = samples[i];
 				line.at(i) = _matrix.at(largestIdx, j) - _matrix.at(secondIdx, j);
 			}
 
@@ -245,8 +254,8 @@ struct RefineClusterThread {
 			{
 				Vec3f dot; 
 				uint32_t col = projection[i].first;
-				for (uint32_t j = 0; j < samples.size(); j++)
-					dot += _matrix.at(col, samples.at(j)) * line[j];
+				for (uint32_t j = 0; j < sampleNum; j++)
+					dot += _matrix.at(col, samples[j]) * line[j];
 				float d = dot.Average();
 				r.Grow(d);
 				projection[i].second = d;
@@ -282,8 +291,8 @@ struct RefineClusterThread {
 			int rangMid = (int)(middle - start) + range.GetMin();
 			Range1i range1(range.GetMin(), rangMid);
 			Range1i range2(rangMid, range.GetMax());
-			float cost1 = cost(projection, range1, samples, norms);
-			float cost2 = cost(projection, range2, samples, norms);
+			float cost1 = cost(projection, range1, samples, sampleNum, norms);
+			float cost2 = cost(projection, range2, samples, sampleNum, norms);
 
 			cluster_queue.push_back(make_pair(range1, cost1));
 			push_heap(cluster_queue.begin(), cluster_queue.end(), [](pair<Range1i, float> &d1, pair<Range1i, float> &d2)->bool {
@@ -363,13 +372,11 @@ struct RefineClusterThread {
 			//	scaleLight.push_back(light);
 			//}
 		}
-        TbbCounter counter((uint32_t)gpGroup.indices.size());
-        FinalRenderThread thread(_knnMat, gpGroup.indices, scaleLight, _image, _sampleImage);
-        parallel_while<FinalRenderThread> w;
-        w.run(counter, thread);
+        FinalRenderThread thread(_knnMat, _gpGroups.Members(g), scaleLight, _image, _sampleImage);
+        TbbParallelFor(0, _gpGroups.MemberNum(g), thread, NULL, 16);
 	}
 
-	float cost(const carray<pair<uint32_t, float> > &projection, const Range1i &range, const vector<uint32_t> &nsamples, const Vec3f *norms) const {
+	float cost(const carray<pair<uint32_t, float> > &projection, const Range1i &range, const uint32_t *nsamples, uint32_t nsampleNum, const Vec3f *norms) const {
 		if (range.GetSize() <= 1)
 		    return 0.0f;
 
@@ -381,7 +388,7 @@ struct RefineClusterThread {
 			const Vec3f &n = norms[col];
 			nsum += n;
 		}
-		for (uint32_t j = 0; j < nsamples.size(); j++)
+		for (uint32_t j = 0; j < nsampleNum; j++)
 		{
 			Vec3f sum;
 			for (int32_t i = range.GetMin(); i < range.GetMax(); i++)
@@ -402,7 +409,7 @@ struct RefineClusterThread {
 	const carray2<Vec3f>			&_matrix;
 	const carray2<Vec3f>			&_norms;
 	const carray<Vec3f>				&_fullNorms;
-	const vector<GatherGroup>		&_gpGroups;
+	const GatherGroupList			&_gpGroups;
 	const vector<vector<uint32_t> > &_clusters;
     Image<Vec3f> *_image;
     Image<uint32_t> *_sampleImage;
@@ -415,15 +422,15 @@ void KnnMatrix::_RefineClusters(vector<vector<uint32_t> > &clusters, carray2<Vec
 	ComputeFullColNorm computeFullNormThread(matrix, fullNorms);
 	parallel_for(blocked_range<uint32_t>(0, fullNorms.size()), computeFullNormThread);
 
-	carray2<Vec3f> colNorms(matrix.width(), _gpGroups.size());
+	carray2<Vec3f> colNorms(matrix.width(), _gpGroups.Size());
 	ComputeColNorm computeColNormThread(matrix, colNorms, _gpGroups);
-	parallel_for(blocked_range<uint32_t>(0, (uint32_t)_gpGroups.size()), computeColNormThread);
+	parallel_for(blocked_range<uint32_t>(0, (uint32_t)_gpGroups.Size()), computeColNormThread);
 	_report->endActivity();
 
 	_report->beginActivity("refine clusters");
-	_scaledLights.resize(_gpGroups.size());
+	_scaledLights.resize(_gpGroups.Size());
 	
-	carray<uint64_t> randSeeds((uint32_t)_gpGroups.size());
+	carray<uint64_t> randSeeds((uint32_t)_gpGroups.Size());
 	//for (uint32_t i = 0; i < randSeeds.size(); i++)
 	//{
 	//	static minstd_rand0 seeder;
@@ -433,10 +440,8 @@ void KnnMatrix::_RefineClusters(vector<vector<uint32_t> > &clusters, carray2<Vec
 	//}
 
 	RefineClusterThread thread(this, clusters, _scaledLights, matrix, fullNorms, colNorms, _gpGroups, randSeeds, budget, samples, image, sampleImage);
-	TbbReportCounter counter((uint32_t)_gpGroups.size() ,_report);
-	parallel_while<RefineClusterThread> w;
-	w.run(counter, thread);
-	//for (uint32_t g = 0; g < _gpGroups.size(); g++)
+	TbbParallelFor(0, (uint32_t)_gpGroups.Size(), thread, _report);
+	//for (uint32_t g = 0; g < _gpGroups.Size(); g++)
 	//{
 	//	thread(g);
 	//}
@@ -444,6 +449,51 @@ void KnnMatrix::_RefineClusters(vector<vector<uint32_t> > &clusters, carray2<Vec
 }
 
 
+bool KnnMatrix::_LoadCheckpoint(carray2<Vec3f> &matrix)
+{
+	CheckpointReader reader;
+	if (_checkpointFile.empty() || !reader.Open(_checkpointFile, _checkpointKey))
+		return false;
+	if (_report) _report->beginActivity("loading checkpoint");
+	uint32_t width = 0, height = 0;
+	bool good = LoadGatherState(reader, _scene, _lightList, _gatherPoints, _bkPixels, _gpGroups) &&
+		reader.ReadValue(width) && reader.ReadValue(height) &&
+		width == _lightList.GetSize() && height == _gpGroups.Size();
+	if (good)
+	{
+		// the elements go straight into the matrix, sized from the stored dimensions
+		matrix.resize(width, height);
+		good = reader.Read(matrix.data(), matrix.size(), sizeof(Vec3f));
+	}
+	if (!good)
+	{
+		matrix.clear();
+		_lightList.Clear();
+		_gatherPoints.Clear();
+		_bkPixels.clear();
+		_gpGroups.Clear();
+	}
+	if (_report) _report->endActivity();
+	return good;
+}
+
+void KnnMatrix::_SaveCheckpoint(const carray2<Vec3f> &matrix)
+{
+	if (_checkpointFile.empty())
+		return;
+	CheckpointWriter writer;
+	bool good = writer.Open(_checkpointFile, _checkpointKey);
+	if (good)
+	{
+		SaveGatherState(writer, _scene, _lightList, _gatherPoints, _bkPixels, _gpGroups);
+		writer.WriteValue(matrix.width());
+		writer.WriteValue(matrix.height());
+		writer.Write(matrix.data(), matrix.size(), sizeof(Vec3f));
+		good = writer.Close();
+	}
+	if (!good && _report) _report->message("could not write checkpoint " + _checkpointFile);
+}
+
 void KnnMatrix::_ShootGatherPoints(uint32_t width, uint32_t height, uint32_t samples)
 {
     if (_report) _report->beginActivity("sampling eye points");
@@ -453,6 +503,12 @@ void KnnMatrix::_ShootGatherPoints(uint32_t width, uint32_t height, uint32_t sam
 
 void KnnMatrix::_GenerateLights( uint32_t indirect )
 {
+    if (_generator->ViewLights(_lightList))
+    {
+        cout << "total VPL:\t " << _lightList.GetSize() << endl;
+        return;
+    }
+
     if (_report) _report->beginActivity("generate virtual lights");
     ListVirtualLightCache cache(_lightList);
     _generator->Generate(indirect, &cache);
@@ -467,125 +523,59 @@ void KnnMatrix::RenderGatherGroup( Image<Vec3f> *gpImage )
 {
 	RandomPathSamplerStd sampler;
 	if (_report) _report->beginActivity("rendering gather point cluster");
-	for (uint32_t i = 0; i < _gpGroups.size(); i++)
+	for (uint32_t i = 0; i < _gpGroups.Size(); i++)
 	{
-		const GatherGroup &gpGroup = _gpGroups[i];
+		const uint32_t *indices = _gpGroups.Members(i);
 		Vec3f color(sampler.Next1D(),sampler.Next1D(),sampler.Next1D());
 
-		for (uint32_t j = 0; j < gpGroup.indices.size(); j++)
+		for (uint32_t j = 0; j < _gpGroups.MemberNum(i); j++)
 		{
-			GatherPoint& gp = _gatherPoints[gpGroup.indices[j]];
-			gpImage->ElementAt(gp.pixel.x, gpImage->Height()- gp.pixel.y - 1) = color;
+			Vec2i pixel = _gatherPoints.Pixel(indices[j]);
+			gpImage->ElementAt(pixel.x, gpImage->Height()- pixel.y - 1) = color;
 		}
-		if (_report) _report->progress(i / (float)_gpGroups.size(), 1);
+		if (_report) _report->progress(i / (float)_gpGroups.Size(), 1);
 	}
 	if (_report) _report->endActivity();
 }
 
-void KnnMatrix::_KdGatherGroup( vector<GatherKdItem>::iterator start, vector<GatherKdItem>::iterator end)
-{
-    Range6f bbox = Range6f::Empty();
-    for (vector<GatherKdItem>::iterator it = start; it != end; it++)
-        bbox.Grow(it->p);
-    if(end - start < _maxGatherGroupSize)
-    {
-        _gpGroups.push_back(GatherGroup());
-        GatherGroup &group = _gpGroups.back();
-        for (vector<GatherKdItem>::iterator it = start; it != end; it++)
-        {
-            group.indices.push_back(it->idx);
-            GatherPoint &gp = _gatherPoints[it->idx];
-            group.bbox.Grow(gp.isect.dp.P);
-            group.normal += gp.isect.dp.N;
-        }
-        group.normal.Normalize();
-        assert(!group.normal.IsZero());
-		uint32_t sidx = min((uint32_t)(_sampler.Next1D() * group.indices.size()), (uint32_t)(group.indices.size() - 1));
-        group.seed = group.indices[sidx];
-    }
-    else
-    {
-        uint32_t dim = bbox.GetSize().MaxComponentIndex();
-        //vector<GatherKdItem>::iterator mid = start + (end - start) / 2;
-        //std::nth_element(start, mid, end, [dim](const GatherKdItem &d1, const GatherKdItem &d2) { return d1.p[dim] < d2.p[dim]; });
-
-        float pmid = bbox.GetCenter()[dim];
-        vector<GatherKdItem>::iterator mid = 
-            std::partition(start, end, [dim, pmid](const GatherKdItem &a) { return a.p[dim] < pmid; });
-
-        _KdGatherGroup(start, mid);
-        _KdGatherGroup(mid, end);
-    }
-}
-
 void KnnMatrix::_GroupGatherPoints( uint32_t seedNum )
 {
-    _maxGatherGroupSize = max<uint32_t>(1, (uint32_t)(_gatherPoints.size() / seedNum));
+    _maxGatherGroupSize = max<uint32_t>(1, (uint32_t)(_gatherPoints.Size() / seedNum));
     // Compute Gather Point Bounding Box
     Range3f	gpBBox = Range3f::Empty();
-    for (uint32_t i = 0; i < _gatherPoints.size(); i++)
+    for (uint32_t i = 0; i < _gatherPoints.Size(); i++)
     {
-        GatherPoint &gp = _gatherPoints[i];
-        Vec3f &P = gp.isect.dp.P;
-        gpBBox.Grow(P);
+        gpBBox.Grow(_gatherPoints.Position(i));
     }
     _normScale = gpBBox.GetSize().Average() / 8.0f;
 	_diagonal = gpBBox.Diagonal() / 32.0f;
 
-	vector<GatherKdItem> items(_gatherPoints.size());
-	for (uint32_t i = 0; i < _gatherPoints.size(); i++)
+	vector<GatherKdItem> items(_gatherPoints.Size());
+	for (uint32_t i = 0; i < _gatherPoints.Size(); i++)
 	{
-		GatherPoint &gp = _gatherPoints[i];
 		GatherKdItem &item = items[i];
 		item.idx = i;
-		item.p = Vec6f(gp.isect.dp.P, gp.isect.dp.N * _normScale);
+		item.p = Vec6f(_gatherPoints.Position(i), _gatherPoints.Normal(i) * _normScale);
     }
 
     //_KmeanGatherGroup(items, seedNum);
-    _KdGatherGroup(items.begin(), items.end());
+    _gpGroups.Build(items, _maxGatherGroupSize, _gatherPoints, _sampler);
 
     stringstream sout;
-    sout << "Gather group numbers: " << _gpGroups.size();
+    sout << "Gather group numbers: " << _gpGroups.Size();
     if(_report) _report->message(sout.str());
 }
 
 void KnnMatrix::_FindGatherGroupNeighbors()
 {
-	vector<GatherKdItem> data;
-	for (uint32_t i = 0; i < _gpGroups.size(); i++)
-	{
-		GatherGroup &gpGroup = _gpGroups[i];
-		Vec3f P = gpGroup.bbox.GetCenter();
-		Vec3f &N = gpGroup.normal;
-		data.push_back(GatherKdItem(i, Vec6f(P, N * _normScale)));
-	}
-
-    KdTree<GatherKdItem> *kdTree = new KdTree<GatherKdItem>(data);
-    for (uint32_t g = 0; g < _gpGroups.size(); g++)
-    {
-        GatherGroup &gpGroup = _gpGroups[g];
-        Vec6f P(gpGroup.bbox.GetCenter(), gpGroup.normal * _normScale);
-
-        // find mini matrix
-        SeedProcess proc(8);
-        float r2 = FLT_MAX;
-        kdTree->Lookup(P, proc, r2);
-
-        for (uint32_t i = 0; i < proc.foundSeeds; i++)
-        {
-			CloseSeed &cSeed = proc.closeSeeds[i];
-			uint32_t index = cSeed.seedKdItem->idx;
-			gpGroup.neighbors.push_back(index);
-        }
-    }
-	delete kdTree;
+	// find mini matrix
+	_gpGroups.FindNeighbors(_normScale, 8);
 }
 
 
 class RenderReducedMatrixThread
 {
 public:
-    typedef uint32_t argument_type;
     RenderReducedMatrixThread(carray2<Vec3f> &matrix, KnnMatrix *knnMat) : _matrix(matrix), _knnMat(knnMat) { };
     void operator()(const uint32_t &g) const;
 private:
@@ -595,20 +585,22 @@ private:
 
 void RenderReducedMatrixThread::operator()(const uint32_t &g) const
 {
-	const GatherGroup &gpGroup = _knnMat->_gpGroups[g];
-	uint32_t gpIdx = gpGroup.seed;
-	const GatherPoint &gp = _knnMat->_gatherPoints[gpIdx];
+	uint32_t gpIdx = _knnMat->_gpGroups[g].seed;
+	GatherPoint gp;
+	_knnMat->_gatherPoints.Get(gpIdx, gp);
+	vector<Vec3f> row(_matrix.width());
+	LightEvalUtil::EvalL eval(_knnMat->_clamp);
+	eval(_knnMat->_lightList, 0u, _matrix.width(), gp.isect.dp, gp.wo, gp.isect.m, 
+		_knnMat->_engine, gp.isect.rayEpsilon, &row[0]);
 	for (uint32_t i = 0; i < _matrix.width(); i++)
-		_matrix.at(i, g) = _knnMat->RenderCell(LightEvalUtil::EvalL(_knnMat->_clamp), i, gp);
+		_matrix.at(i, g) = row[i];
 }
 
 void KnnMatrix::_RenderReducedMatrix(carray2<Vec3f> &matrix)
 {
 	if (_report) _report->beginActivity("render reduced column");
-	TbbReportCounter counter((uint32_t)_gpGroups.size(), _report);
 	RenderReducedMatrixThread thread(matrix, this);
-	parallel_while<RenderReducedMatrixThread> w;
-	w.run(counter, thread);
+	TbbParallelFor(0, (uint32_t)_gpGroups.Size(), thread, _report);
 	if (_report) _report->endActivity();
 }
 
@@ -882,20 +874,14 @@ void KnnMatrix::_KmeanGatherGroup( vector<GatherKdItem> items, uint32_t seedNum
         parallel_for(blocked_range<uint32_t>(0, (uint32_t)seeds.size()), update);
     }
 
+    _gpGroups.Clear();
+    vector<uint32_t> members;
     for (uint32_t i = 0; i < clusters.size(); i++)
     {
-        if (clusters[i].size() == 0)
-            continue;
-        _gpGroups.push_back(GatherGroup());
-        GatherGroup &group = _gpGroups.back();
+        members.clear();
         for (concurrent_vector<uint32_t>::iterator it = clusters[i].begin(); it != clusters[i].end(); it++)
-        {
-            group.indices.push_back(items[*it].idx);
-            GatherPoint &gp = _gatherPoints[items[*it].idx];
-            group.bbox.Grow(gp.isect.dp.P);
-            group.normal += (gp.isect.dp.N);
-        }
-        group.normal.Normalize();
+            members.push_back(items[*it].idx);
+        _gpGroups.AddGroup(members, _gatherPoints);
     }
 }
 
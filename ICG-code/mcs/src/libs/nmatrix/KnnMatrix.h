@@ -7,7 +7,7 @@
 #include <sampler/Distribution1D.h>
 #include <lightgen/LightGenerator.h>
 #include <vmath/random.h>
-#include "kdtree.h"
+#include "GatherGroups.h"
 #include <gpshoot/GatherPointShooter.h>
 #include "vmath/vec6.h"
 #include "gsl/gsl_matrix_double.h"
@@ -15,30 +15,12 @@
 #include "vmath/fastcone.h"
 #include "tbb/spin_mutex.h"
 
-struct GatherKdItem
-{
-    GatherKdItem() : idx(0) {}
-    GatherKdItem(uint32_t i, const Vec6f& point) : idx(i), p(point) {} 
-    uint32_t    idx;
-    Vec6f       p;
-};
-
 struct ScaleLight
 {
     vector<uint32_t>    indices;
     vector<Vec3f>       weights;
 };
 
-struct GatherGroup
-{
-    GatherGroup() : bbox(Range3f::Empty()) {}
-    vector<uint32_t>	indices;
-    uint32_t            seed;
-    vector<uint32_t>    neighbors;
-    Range3f				bbox;
-    Vec3f               normal;
-};
-
 struct LightGroup
 {
     Vec3f               L;
@@ -106,12 +88,15 @@ public:
 	~KnnMatrix(void) {};
 
 	void									RenderGatherGroup(Image<Vec3f> *image);
+	// rendering again after moving the camera reuses the lights of the first frame
 	void                                    Render(Image<Vec3f> *image, Image<uint32_t> *sampleImage, uint32_t samples, uint32_t indirect, uint32_t seedNum, uint32_t budget = 400);
+	// Resumes from the lights, gather points, groups and reduced matrix stored
+	// in filename when it was written for key, and writes them there otherwise
+	void                                    SetCheckpoint(const string &filename, const string &key) { _checkpointFile = filename; _checkpointKey = key; }
 
 protected:
 	template<typename T> Vec3f              RenderCell(const T &t, uint32_t col, uint32_t row );
 	template<typename T> Vec3f              RenderCell(const T &t, uint32_t col, const GatherPoint &gp );
-	void                                    _KdGatherGroup( vector<GatherKdItem>::iterator start, vector<GatherKdItem>::iterator end);
 	void                                    _KmeanGatherGroup( vector<GatherKdItem> items, uint32_t seedNum );
 	void                                    _SetBackground(Image<Vec3f> *image);
 	void                                    _GroupGatherPoints(uint32_t seedNum);
@@ -120,6 +105,8 @@ protected:
     void                                    _BuildGatherGroupKdTree();
     void                                    _RenderReducedMatrix(carray2<Vec3f> &matrix);
     void                                    _FindGatherGroupNeighbors();
+    bool                                    _LoadCheckpoint(carray2<Vec3f> &matrix);
+    void                                    _SaveCheckpoint(const carray2<Vec3f> &matrix);
 
 	void									_NewInitialClusters(vector<vector<uint32_t> > &clusters, carray2<Vec3f> &matrix, uint32_t budget);
 	void									_InitialClusters(vector<vector<uint32_t> > &clusters, carray2<Vec3f> &matrix, uint32_t budget, bool randProj);
@@ -141,15 +128,19 @@ protected:
     LightList                               _lightList;
 
 	vector<vector<ScaleLight> >				_scaledLights;
-	vector<GatherPoint>                     _gatherPoints;
-	vector<GatherGroup>                     _gpGroups;
+	GatherPointStore                        _gatherPoints;
+	GatherGroupList                         _gpGroups;
+
+	string                                  _checkpointFile;
+	string                                  _checkpointKey;
 };
 
 
 template<typename T>
 Vec3f KnnMatrix::RenderCell(const T &t, uint32_t col, uint32_t row )
 {
-    GatherPoint &gp = _gatherPoints[row];
+    GatherPoint gp;
+    _gatherPoints.Get(row, gp);
     return RenderCell(t, col, gp);
 }
 
@@ -164,11 +155,11 @@ Vec3f KnnMatrix::RenderCell(const T &t, uint32_t col, const GatherPoint &gp )
         L = Vec3f::Zero();
         break;
     case DIRECTIONAL_LIGHT:
-        L = t(*reinterpret_cast<DirLight*>(_lightList.GetLight(col)), 
+        L = t(_lightList.GetDirLight(col), 
             gp.isect.dp, gp.wo, gp.isect.m, _engine, gp.isect.rayEpsilon);
         break;
     case ORIENTED_LIGHT:
-        L = t(*reinterpret_cast<OrientedLight*>(_lightList.GetLight(col)), 
+        L = t(_lightList.GetOrientedLight(col), 
             gp.isect.dp, gp.wo, gp.isect.m, _engine, gp.isect.rayEpsilon);
         break;
     }
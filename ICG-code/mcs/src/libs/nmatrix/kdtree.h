@@ -3,9 +3,17 @@
 
 #include <vmath/vec6.h>
 #include "vmath/range6.h"
+#include <tbbutils/tbbutils.h>
+#include <tbb/parallel_invoke.h>
+#include <algorithm>
 
 typedef uint32_t u_int;
 
+// subtrees larger than this are built in parallel
+#define KDTREE_PARALLEL_CUTOFF  4096
+#define KDTREE_MAX_K            64
+#define KDTREE_NO_NEIGHBOR      0xffffffff
+
 // compressed kdtree from pbrt
 struct KdNode {
 	void init(float p, u_int a) {
@@ -41,6 +49,10 @@ public:
     template<typename LookupProc>
 	void Lookup(const Vec6f &p, const LookupProc &process,
 			float &maxDistSquared) const;
+	// k nearest items of every query in parallel, written to neighbors[q * k + i]
+	// as node data indices sorted by distance, KDTREE_NO_NEIGHBOR past the end
+	void KnnQuery(const Vec6f *queries, u_int nQueries, u_int k, 
+			u_int *neighbors, float *dist2 = 0) const;
 	inline const NodeData* GetNodeDataPtr() const { return nodeData; }
 	inline uint32_t NodeDataSize() const { return nNodes; }
     inline Range3f GetBoundingBox() const { return cacheBBox; }
@@ -52,7 +64,7 @@ private:
 	// KdTree Private Data
 	KdNode *nodes;
 	NodeData *nodeData;
-	u_int nNodes, nextFreeNode;
+	u_int nNodes;
     Range6f cacheBBox;
 };
 
@@ -67,11 +79,61 @@ struct CompareNode {
 	}
 };
 
+template<class NodeData> 
+struct KdBoundsReduce {
+	KdBoundsReduce(const NodeData * const *d) : data(d), bbox(Range6f::Empty()) {}
+	KdBoundsReduce(KdBoundsReduce &r, split) : data(r.data), bbox(Range6f::Empty()) {}
+	void operator()(const blocked_range<u_int> &r) {
+		for (u_int i = r.begin(); i != r.end(); ++i)
+			bbox.Grow(data[i]->p);
+	}
+	void join(const KdBoundsReduce &r) { bbox.Grow(r.bbox); }
+	const NodeData * const *data;
+	Range6f bbox;
+};
+
+// value neighbor of a knn query, ordered by distance then index
+struct KdNeighbor {
+	bool operator<(const KdNeighbor &n) const {
+		return dist2 == n.dist2 ? idx < n.idx : dist2 < n.dist2;
+	}
+	float dist2;
+	u_int idx;
+};
+
+// keeps the k closest items in a fixed max heap
+template<class NodeData> 
+struct KdKnnProcess {
+	KdKnnProcess(const NodeData *base, KdNeighbor *heap, u_int k) 
+		: base(base), heap(heap), k(k), found(0) {}
+	void operator()(const NodeData &item, float dist2, float &maxDistSquared) const {
+		KdNeighbor n;
+		n.dist2 = dist2;
+		n.idx = (u_int)(&item - base);
+		if (found < k) {
+			heap[found++] = n;
+			if (found == k) {
+				std::make_heap(heap, heap + k);
+				maxDistSquared = heap[0].dist2;
+			}
+		}
+		else {
+			std::pop_heap(heap, heap + k);
+			heap[k - 1] = n;
+			std::push_heap(heap, heap + k);
+			maxDistSquared = heap[0].dist2;
+		}
+	}
+	const NodeData *base;
+	KdNeighbor *heap;
+	u_int k;
+	mutable u_int found;
+};
+
 // KdTree Method Definitions
 template <typename NodeData>
 KdTree<NodeData>::KdTree(const vector<NodeData> &d) {
 	nNodes = (uint32_t)d.size();
-	nextFreeNode = 1;
 	nodes = new KdNode[nNodes];
 	nodeData = new NodeData[nNodes];
 	vector<const NodeData *> buildNodes;
@@ -82,7 +144,8 @@ KdTree<NodeData>::KdTree(const vector<NodeData> &d) {
         cacheBBox.Grow(d[i].p);
     }
 	// Begin the KdTree building process
-	recursiveBuild(0, buildNodes.begin(), buildNodes.end());
+	if (nNodes)
+		recursiveBuild(0, buildNodes.begin(), buildNodes.end());
 }
 
 template <class NodeData> 
@@ -98,27 +161,44 @@ void KdTree<NodeData>::recursiveBuild(u_int nodeNum,
 	}
 	// Choose split direction and partition data
 	// Compute bounds of data from _start_ to _end_
-	Range6f bbox;
-    for (typename vector<const NodeData *>::iterator i = start; i < end; ++i) 
-		bbox.Grow((*i)->p);
+	Range6f bbox = Range6f::Empty();
+	if (end - start > KDTREE_PARALLEL_CUTOFF) {
+		KdBoundsReduce<NodeData> reduce(&*start);
+		parallel_reduce(blocked_range<u_int>(0, (u_int)(end - start), KDTREE_PARALLEL_CUTOFF), reduce);
+		bbox = reduce.bbox;
+	}
+	else {
+		for (typename vector<const NodeData *>::iterator i = start; i < end; ++i) 
+			bbox.Grow((*i)->p);
+	}
 
     int splitAxis = bbox.GetSize().MaxComponentIndex();
 	typename vector<const NodeData *>::iterator splitPos = start + (end - start)/2;
 	std::nth_element(start, splitPos,
 		end, CompareNode<NodeData>(splitAxis));
-	// Allocate kd-tree node and continue recursively
+	// Allocate kd-tree node and continue recursively. The left subtree takes
+	// the slots right after the node, so the layout does not depend on the
+	// order the subtrees are built in.
 	nodes[nodeNum].init((*splitPos)->p[splitAxis],
 		splitAxis);
 	nodeData[nodeNum] = *(*splitPos);
-	if (start < splitPos) {
+	if (start < splitPos)
 		nodes[nodeNum].hasLeftChild = 1;
-		u_int childNum = nextFreeNode++;
-		recursiveBuild(childNum, start, splitPos);
-	}
-	if (splitPos+1 < end) {
-		nodes[nodeNum].rightChild = nextFreeNode++;
-		recursiveBuild(nodes[nodeNum].rightChild, splitPos+1, end);
+	if (splitPos+1 < end)
+		nodes[nodeNum].rightChild = nodeNum + 1 + (u_int)(splitPos - start);
+
+	KdTree<NodeData> *tree = this;
+	u_int rightNum = nodes[nodeNum].rightChild;
+	if (end - start > KDTREE_PARALLEL_CUTOFF && start < splitPos && splitPos+1 < end) {
+		parallel_invoke(
+			[=]() { tree->recursiveBuild(nodeNum + 1, start, splitPos); },
+			[=]() { tree->recursiveBuild(rightNum, splitPos + 1, end); });
+		return;
 	}
+	if (start < splitPos)
+		recursiveBuild(nodeNum + 1, start, splitPos);
+	if (splitPos+1 < end)
+		recursiveBuild(rightNum, splitPos+1, end);
 }
 
 template <typename NodeData>
@@ -129,6 +209,25 @@ void KdTree<NodeData>::Lookup(const Vec6f &p,
 	privateLookup(0, p, proc, maxDistSquared);
 }
 
+template <typename NodeData>
+void KdTree<NodeData>::KnnQuery(const Vec6f *queries, u_int nQueries, u_int k, 
+		u_int *neighbors, float *dist2) const {
+	assert(k <= KDTREE_MAX_K);
+	const KdTree<NodeData> *tree = this;
+	TbbParallelFor(0, nQueries, [=](u_int q) {
+		KdNeighbor heap[KDTREE_MAX_K];
+		KdKnnProcess<NodeData> proc(tree->nodeData, heap, k);
+		float r2 = FLT_MAX;
+		if (tree->nNodes)
+			tree->Lookup(queries[q], proc, r2);
+		std::sort(heap, heap + proc.found);
+		for (u_int i = 0; i < k; i++) {
+			neighbors[q * k + i] = i < proc.found ? heap[i].idx : KDTREE_NO_NEIGHBOR;
+			if (dist2) dist2[q * k + i] = i < proc.found ? heap[i].dist2 : FLT_MAX;
+		}
+	}, 0, 64);
+}
+
 template <typename NodeData>
 template <typename LookupProc>
 void KdTree<NodeData>::privateLookup(u_int nodeNum,
@@ -1,4 +1,5 @@
 #include "LightEval.h"
+#include <xmmintrin.h>
 
 namespace LightEvalUtil
 {
@@ -36,6 +37,180 @@ namespace LightEvalUtil
     }
 
 
+    // collects the shadow rays of a row, an occluded ray zeroes its slot
+    class ShadowRayBatch
+    {
+    public:
+        ShadowRayBatch(RayEngine *engine, Vec3f *row) : _engine(engine), _row(row), _nRays(0) {}
+        void Add(const Ray &ray, uint32_t slot)
+        {
+            _rays[_nRays] = ray;
+            _slots[_nRays++] = slot;
+            if (_nRays == EVAL_BATCH_SIZE)
+                Flush();
+        }
+        void Flush()
+        {
+            if (!_nRays)
+                return;
+            uint32_t occluded[RAY_BATCH_MASK_WORDS(EVAL_BATCH_SIZE)];
+            _engine->IntersectAnyBatch(_rays, _nRays, occluded);
+            for (uint32_t r = 0; r < _nRays; r++)
+            {
+                if (occluded[r >> 5] & (1u << (r & 31)))
+                    _row[_slots[r]] = Vec3f::Zero();
+            }
+            _nRays = 0;
+        }
+    private:
+        RayEngine       *_engine;
+        Vec3f           *_row;
+        Ray             _rays[EVAL_BATCH_SIZE];
+        uint32_t        _slots[EVAL_BATCH_SIZE];
+        uint32_t        _nRays;
+    };
+
+    static void _EvalDirLights(const DirLightArray &lights, uint32_t begin, uint32_t end, const DifferentialGeometry& dp, 
+        float rayEpsilon, Vec3f *row, uint32_t slot, ShadowRayBatch &shadows)
+    {
+        for (uint32_t i = begin; i < end; i++, slot++)
+        {
+            Vec3f wi = -lights.Get(DIR_NORMAL, i);
+            float cosIn = ReflectanceUtils::PosCos(wi, dp);
+            row[slot] = cosIn > 0.0f ? lights.Get(DIR_LE, i) * cosIn : Vec3f::Zero();
+            if (!row[slot].IsZero())
+                shadows.Add(Ray(dp.P, wi, rayEpsilon, RAY_INFINITY, 0.0f), slot);
+        }
+    }
+
+    // same terms as EvalL on an OrientedLight, evaluated for four lights at once
+    static void _EvalOrientedLights(const OrientedLightArray &lights, uint32_t begin, uint32_t end, float minGeoTerm, 
+        const DifferentialGeometry& dp, float rayEpsilon, Vec3f *row, uint32_t slot, ShadowRayBatch &shadows)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 minGeo = _mm_set1_ps(minGeoTerm);
+        const __m128 Px = _mm_set1_ps(dp.P.x), Py = _mm_set1_ps(dp.P.y), Pz = _mm_set1_ps(dp.P.z);
+        const __m128 Nx = _mm_set1_ps(dp.N.x), Ny = _mm_set1_ps(dp.N.y), Nz = _mm_set1_ps(dp.N.z);
+        const float *ch[ORIENTED_CHANNELS];
+        for (uint32_t c = 0; c < ORIENTED_CHANNELS; c++)
+            ch[c] = lights.Channel(c);
+
+        for (uint32_t i = begin; i < end; i += 4, slot += 4)
+        {
+            uint32_t n = min(4u, end - i);
+            __m128 v[ORIENTED_CHANNELS];
+            for (uint32_t c = 0; c < ORIENTED_CHANNELS; c++)
+            {
+                if (n == 4)
+                    v[c] = _mm_loadu_ps(ch[c] + i);
+                else
+                {
+                    float t[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                    for (uint32_t k = 0; k < n; k++)
+                        t[k] = ch[c][i + k];
+                    v[c] = _mm_loadu_ps(t);
+                }
+            }
+
+            __m128 dx = _mm_sub_ps(v[ORIENTED_POSITION], Px);
+            __m128 dy = _mm_sub_ps(v[ORIENTED_POSITION + 1], Py);
+            __m128 dz = _mm_sub_ps(v[ORIENTED_POSITION + 2], Pz);
+            __m128 lenSqr = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            __m128 len = _mm_sqrt_ps(lenSqr);
+            __m128 wx = _mm_div_ps(dx, len), wy = _mm_div_ps(dy, len), wz = _mm_div_ps(dz, len);
+            __m128 cosIn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wx, Nx), _mm_mul_ps(wy, Ny)), _mm_mul_ps(wz, Nz));
+            __m128 cosAngle = _mm_max_ps(zero, _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(v[ORIENTED_NORMAL], wx), _mm_mul_ps(v[ORIENTED_NORMAL + 1], wy)), _mm_mul_ps(v[ORIENTED_NORMAL + 2], wz))));
+            __m128 lenSqrEst = _mm_max_ps(minGeo, lenSqr);
+            // also drops the lights at the shading point, their direction is NaN
+            __m128 front = _mm_cmpgt_ps(cosIn, zero);
+
+            float L[3][4], w[3][4], dist[4];
+            for (uint32_t c = 0; c < 3; c++)
+                _mm_storeu_ps(L[c], _mm_and_ps(front, _mm_div_ps(_mm_mul_ps(_mm_mul_ps(v[ORIENTED_LE + c], cosIn), cosAngle), lenSqrEst)));
+            _mm_storeu_ps(w[0], wx);
+            _mm_storeu_ps(w[1], wy);
+            _mm_storeu_ps(w[2], wz);
+            _mm_storeu_ps(dist, len);
+
+            for (uint32_t k = 0; k < n; k++)
+            {
+                row[slot + k] = Vec3f(L[0][k], L[1][k], L[2][k]);
+                if (!row[slot + k].IsZero())
+                    shadows.Add(Ray(dp.P, Vec3f(w[0][k], w[1][k], w[2][k]), rayEpsilon, dist[k], 0.0f), slot + k);
+            }
+        }
+    }
+
+    void EvalL::operator()(const LightList &lights, uint32_t begin, uint32_t end, const DifferentialGeometry& dp, const Vec3f &wo, Material *ms, RayEngine *engine, float rayEpsilon, Vec3f *row) const
+    {
+        ShadowRayBatch shadows(engine, row);
+        Range1u range = lights.GetRange(OMNIDIR_LIGHT);
+        for (uint32_t i = max(begin, range.GetMin()); i < min(end, range.GetMax()); i++)
+        {
+            assert(false);
+            row[i - begin] = Vec3f::Zero();
+        }
+
+        range = lights.GetRange(DIRECTIONAL_LIGHT);
+        uint32_t b = max(begin, range.GetMin()), e = min(end, range.GetMax());
+        if (b < e)
+            _EvalDirLights(lights.DirLights(), b - range.GetMin(), e - range.GetMin(), dp, rayEpsilon, row, b - begin, shadows);
+
+        range = lights.GetRange(ORIENTED_LIGHT);
+        b = max(begin, range.GetMin());
+        e = min(end, range.GetMax());
+        if (b < e)
+            _EvalOrientedLights(lights.OrientedLights(), b - range.GetMin(), e - range.GetMin(), _minGeoTerm, dp, rayEpsilon, row, b - begin, shadows);
+        shadows.Flush();
+    }
+
+    void EvalL::operator()(const LightList &lights, const uint32_t *cols, uint32_t nCols, const DifferentialGeometry& dp, const Vec3f &wo, Material *ms, RayEngine *engine, float rayEpsilon, Vec3f *row) const
+    {
+        ShadowRayBatch shadows(engine, row);
+        Range1u dirRange = lights.GetRange(DIRECTIONAL_LIGHT);
+        const DirLightArray &dirLights = lights.DirLights();
+        const OrientedLightArray &otrLights = lights.OrientedLights();
+        for (uint32_t i = 0; i < nCols; i++)
+        {
+            uint32_t col = cols[i];
+            Vec3f L = Vec3f::Zero();
+            Vec3f wi;
+            float maxDist = RAY_INFINITY;
+            if (col >= dirRange.GetMax())
+            {
+                col -= dirRange.GetMax();
+                Vec3f d = otrLights.Get(ORIENTED_POSITION, col) - dp.P;
+                wi = d.GetNormalized();
+                if(ReflectanceUtils::PosCos(wi, dp) > 0.0f)
+                {
+                    maxDist = d.GetLength();
+                    float cosAngle = max(0.0f, otrLights.Get(ORIENTED_NORMAL, col) % (-wi));
+                    float lenSqrEst = max(_minGeoTerm, d.GetLengthSqr());
+                    L = otrLights.Get(ORIENTED_LE, col) * ReflectanceUtils::PosCos(wi, dp) * cosAngle / lenSqrEst;
+                }
+            }
+            else if (col >= dirRange.GetMin())
+            {
+                col -= dirRange.GetMin();
+                wi = -dirLights.Get(DIR_NORMAL, col);
+                if(ReflectanceUtils::PosCos(wi, dp) > 0.0f)
+                    L = dirLights.Get(DIR_LE, col) * ReflectanceUtils::PosCos(wi, dp);
+            }
+            // omni lights are not evaluated, as in the range overload
+            else
+            {
+                row[i] = Vec3f::Zero();
+                continue;
+            }
+
+            row[i] = L;
+            if (!L.IsZero())
+                shadows.Add(Ray(dp.P, wi, rayEpsilon, maxDist, 0.0f), i);
+        }
+        shadows.Flush();
+    }
+
     Vec3f EvalIrrad::operator()(const OrientedLight& light, const DifferentialGeometry& dp, const Vec3f &wo, Material *ms, RayEngine *engine, float rayEpsilon) const
     {
         Vec3f wi = (light.position - dp.P).GetNormalized();
@@ -6,6 +6,7 @@
 #include <ray/rayEngine.h>
 
 #define DEFAULT_MIN_GEO_TERM 0.8f
+#define EVAL_BATCH_SIZE 64
 
 namespace LightEvalUtil
 {
@@ -30,6 +31,12 @@ namespace LightEvalUtil
         EvalL(float minGeoTerm = DEFAULT_MIN_GEO_TERM) : EvalFunction(minGeoTerm) {}
         Vec3f operator()(const OrientedLight& light, const DifferentialGeometry& dp, const Vec3f &wo, Material *ms, RayEngine *engine, float rayEpsilon) const;
         Vec3f operator()(const DirLight& light, const DifferentialGeometry& dp, const Vec3f &wo, Material *ms, RayEngine *engine, float rayEpsilon) const;
+        // evaluates lights cols[0..nCols) into row, tracing the shadow rays in
+        // batches through RayEngine::IntersectAnyBatch
+        void operator()(const LightList &lights, const uint32_t *cols, uint32_t nCols, const DifferentialGeometry& dp, const Vec3f &wo, Material *ms, RayEngine *engine, float rayEpsilon, Vec3f *row) const;
+        // evaluates lights [begin, end) into row[0..end-begin), one loop per light
+        // type, the oriented lights four at a time from the SoA channels
+        void operator()(const LightList &lights, uint32_t begin, uint32_t end, const DifferentialGeometry& dp, const Vec3f &wo, Material *ms, RayEngine *engine, float rayEpsilon, Vec3f *row) const;
     };
 
     class EvalShading : public EvalFunction
@@ -17,19 +17,19 @@ public:
 	virtual void			Clear() { _nIndirect = 0; _llist.Clear(); }
 	virtual void			AddOmniDirLight(const Vec3f &position, const Vec3f &intensity) 
 	{     
-		_llist._ptLights.push_back(OmniDirLight(position, intensity));
+		_llist.AddOmniDirLight(position, intensity);
 	}
 	virtual void			AddDirLight(const Vec3f &normal, const Vec3f &le)
 	{
-		_llist._dirLights.push_back(DirLight(normal, le));
+		_llist.AddDirLight(normal, le);
 	}
 	virtual void			AddOrientedLight(const Vec3f& position, const Vec3f &normal, const Vec3f &le)
 	{
-		_llist._otrLights.push_back(OrientedLight(position, normal, le));
+		_llist.AddOrientedLight(position, normal, le);
 	}
 	virtual void			AddIndirectLight(const Vec3f& position, const Vec3f &normal, const Vec3f &le)
 	{
-		_llist._otrLights.push_back(OrientedLight(position, normal, le));
+		_llist.AddOrientedLight(position, normal, le);
 		_nIndirect++;
 	}
 	virtual uint32_t      DirectLightNum() const { return static_cast<uint32_t>(_llist.GetSize() - _nIndirect); }